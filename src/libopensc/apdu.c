@@ -198,6 +198,47 @@ int sc_apdu_get_octets(sc_context_t *ctx, const sc_apdu_t *apdu, u8 **buf,
 	return SC_SUCCESS;
 }
 
+/* Smallest reader buffers: a short APDU and its response */
+#define READER_MIN_SEND_SIZE	(4 + 1 + SC_MAX_APDU_DATA_SIZE + 1)
+#define READER_MIN_RECV_SIZE	(SC_MAX_APDU_RESP_SIZE + 2)
+
+int _sc_reader_get_buffers(sc_reader_t *reader, size_t ssize, size_t rsize,
+		u8 **sbuf, u8 **rbuf)
+{
+	u8 *buffers;
+
+	if (reader == NULL || sbuf == NULL || rbuf == NULL)
+		return SC_ERROR_INVALID_ARGUMENTS;
+	if (ssize > SC_READER_SEND_BUFFER_SIZE || rsize > SC_READER_RECV_BUFFER_SIZE)
+		return SC_ERROR_BUFFER_TOO_SMALL;
+
+	if (reader->apdu_buffers == NULL
+			|| ssize > reader->apdu_send_size || rsize > reader->apdu_recv_size) {
+		if (ssize < reader->apdu_send_size)
+			ssize = reader->apdu_send_size;
+		if (ssize < READER_MIN_SEND_SIZE)
+			ssize = READER_MIN_SEND_SIZE;
+		if (rsize < reader->apdu_recv_size)
+			rsize = reader->apdu_recv_size;
+		if (rsize < READER_MIN_RECV_SIZE)
+			rsize = READER_MIN_RECV_SIZE;
+		buffers = sc_mem_secure_alloc(ssize + rsize);
+		if (buffers == NULL)
+			return SC_ERROR_OUT_OF_MEMORY;
+		if (reader->apdu_buffers != NULL) {
+			sc_mem_secure_clear_free(reader->apdu_buffers,
+					reader->apdu_send_size + reader->apdu_recv_size);
+		}
+		reader->apdu_buffers = buffers;
+		reader->apdu_send_size = ssize;
+		reader->apdu_recv_size = rsize;
+	}
+	*sbuf = reader->apdu_buffers;
+	*rbuf = reader->apdu_buffers + reader->apdu_send_size;
+
+	return SC_SUCCESS;
+}
+
 int sc_apdu_set_resp(sc_context_t *ctx, sc_apdu_t *apdu, const u8 *buf,
 	size_t len)
 {
@@ -500,23 +541,20 @@ sc_get_response(struct sc_card *card, struct sc_apdu *apdu, size_t olen)
 }
 
 
-/** Sends a single APDU to the card reader and calls GET RESPONSE to get the return data if necessary.
+/** Completes the response of an APDU which was sent to the reader.
  *  @param  card  sc_card_t object for the smartcard
- *  @param  apdu  APDU to be sent
+ *  @param  apdu  APDU with the response of the reader
+ *  @param  olen  size of the response buffer before the APDU was sent
  *  @return SC_SUCCESS on success and an error value otherwise
  */
 static int
-sc_transmit(sc_card_t *card, sc_apdu_t *apdu)
+sc_transmit_finish(sc_card_t *card, sc_apdu_t *apdu, size_t olen)
 {
 	struct sc_context *ctx  = card->ctx;
-	size_t       olen  = apdu->resplen;
 	int          r;
 
 	LOG_FUNC_CALLED(ctx);
 
-	r = sc_single_transmit(card, apdu);
-	LOG_TEST_RET(ctx, r, "transmit APDU failed");
-
 	/* ok, the APDU was successfully transmitted. Now we have two special cases:
 	 * 1. the card returned 0x6Cxx: in this case APDU will be re-transmitted with Le set to SW2
 	 * (possible only if response buffer size is larger than new Le = SW2)
@@ -540,28 +578,40 @@ sc_transmit(sc_card_t *card, sc_apdu_t *apdu)
 }
 
 
-int sc_transmit_apdu(sc_card_t *card, sc_apdu_t *apdu)
+/** Sends a single APDU to the card reader and calls GET RESPONSE to get the return data if necessary.
+ *  @param  card  sc_card_t object for the smartcard
+ *  @param  apdu  APDU to be sent
+ *  @return SC_SUCCESS on success and an error value otherwise
+ */
+static int
+sc_transmit(sc_card_t *card, sc_apdu_t *apdu)
 {
-	int r = SC_SUCCESS;
+	struct sc_context *ctx  = card->ctx;
+	size_t       olen  = apdu->resplen;
+	int          r;
 
-	if (card == NULL || apdu == NULL)
-		return SC_ERROR_INVALID_ARGUMENTS;
+	LOG_FUNC_CALLED(ctx);
 
-	LOG_FUNC_CALLED(card->ctx);
+	r = sc_single_transmit(card, apdu);
+	LOG_TEST_RET(ctx, r, "transmit APDU failed");
 
-	/* determine the APDU type if necessary, i.e. to use
-	 * short or extended APDUs  */
-	sc_detect_apdu_cse(card, apdu);
-	/* basic APDU consistency check */
-	r = sc_check_apdu(card, apdu);
-	if (r != SC_SUCCESS)
-		return SC_ERROR_INVALID_ARGUMENTS;
+	r = sc_transmit_finish(card, apdu, olen);
+	LOG_FUNC_RETURN(ctx, r);
+}
 
-	r = sc_lock(card);	/* acquire card lock*/
-	if (r != SC_SUCCESS) {
-		sc_log(card->ctx, "unable to acquire lock");
-		return r;
-	}
+
+/** Sends an APDU to the card, using command chaining if requested.
+ *  The card has to be locked.
+ *  @param  card  sc_card_t object for the smartcard
+ *  @param  apdu  APDU to be sent
+ *  @return SC_SUCCESS on success and an error value otherwise
+ */
+static int
+sc_transmit_locked(sc_card_t *card, sc_apdu_t *apdu)
+{
+	int r = SC_SUCCESS;
+
+	sc_read_cache_apdu(card, apdu);
 
 	if ((apdu->flags & SC_APDU_FLAGS_CHAINING) != 0) {
 		/* divide et impera: transmit APDU in chunks with Lc <= max_send_size
@@ -628,6 +678,35 @@ int sc_transmit_apdu(sc_card_t *card, sc_apdu_t *apdu)
 		r = sc_transmit(card, apdu);
 	}
 
+	return r;
+}
+
+
+int sc_transmit_apdu(sc_card_t *card, sc_apdu_t *apdu)
+{
+	int r = SC_SUCCESS;
+
+	if (card == NULL || apdu == NULL)
+		return SC_ERROR_INVALID_ARGUMENTS;
+
+	LOG_FUNC_CALLED(card->ctx);
+
+	/* determine the APDU type if necessary, i.e. to use
+	 * short or extended APDUs  */
+	sc_detect_apdu_cse(card, apdu);
+	/* basic APDU consistency check */
+	r = sc_check_apdu(card, apdu);
+	if (r != SC_SUCCESS)
+		return SC_ERROR_INVALID_ARGUMENTS;
+
+	r = sc_lock(card);	/* acquire card lock*/
+	if (r != SC_SUCCESS) {
+		sc_log(card->ctx, "unable to acquire lock");
+		return r;
+	}
+
+	r = sc_transmit_locked(card, apdu);
+
 	if (r == SC_ERROR_CARD_RESET || r == SC_ERROR_READER_REATTACHED) {
 		sc_invalidate_cache(card);
 		/* give card driver a chance to react on resets */
@@ -643,6 +722,101 @@ int sc_transmit_apdu(sc_card_t *card, sc_apdu_t *apdu)
 }
 
 
+/* APDUs handed to the reader driver at once, see sc_transmit_apdu_batch() */
+#define SC_APDU_BATCH_WINDOW	16
+
+/** Tells whether the reader driver may send the APDU as part of a batch:
+ *  chained APDUs and APDUs wrapped by secure messaging go one by one.
+ */
+static int
+sc_apdu_batchable(sc_card_t *card, const sc_apdu_t *apdu)
+{
+	if (card->reader->ops->transmit_batch == NULL
+			|| (apdu->flags & SC_APDU_FLAGS_CHAINING) != 0)
+		return 0;
+#ifdef ENABLE_SM
+	if (card->sm_ctx.sm_mode == SM_MODE_TRANSMIT
+			&& (apdu->flags & SC_APDU_FLAGS_NO_SM) == 0)
+		return 0;
+#endif
+	return 1;
+}
+
+int sc_transmit_apdu_batch(sc_card_t *card, sc_apdu_t *apdus, size_t count,
+		size_t *done)
+{
+	size_t olen[SC_APDU_BATCH_WINDOW];
+	size_t i, n, sent;
+	sc_apdu_t *apdu;
+	int r = SC_SUCCESS;
+
+	if (done != NULL)
+		*done = 0;
+	if (card == NULL || (apdus == NULL && count != 0))
+		return SC_ERROR_INVALID_ARGUMENTS;
+
+	LOG_FUNC_CALLED(card->ctx);
+
+	/* check all APDUs before the first one is sent */
+	for (i = 0; i < count; i++) {
+		sc_detect_apdu_cse(card, &apdus[i]);
+		if (sc_check_apdu(card, &apdus[i]) != SC_SUCCESS)
+			return SC_ERROR_INVALID_ARGUMENTS;
+	}
+
+	r = sc_lock(card);
+	if (r != SC_SUCCESS) {
+		sc_log(card->ctx, "unable to acquire lock");
+		return r;
+	}
+
+	i = 0;
+	while (i < count) {
+		apdu = &apdus[i];
+		if (sc_apdu_batchable(card, apdu)) {
+			for (n = 0; i + n < count && n < SC_APDU_BATCH_WINDOW
+					&& sc_apdu_batchable(card, &apdus[i + n]); n++) {
+				sc_read_cache_apdu(card, &apdus[i + n]);
+				olen[n] = apdus[i + n].resplen;
+			}
+			/* the reader stops after the first response which is not
+			 * 90 00, so only the last one needs further handling */
+			sent = 0;
+			r = card->reader->ops->transmit_batch(card->reader, apdu, n, &sent);
+			if (r == SC_SUCCESS && (sent == 0 || sent > n))
+				r = SC_ERROR_INTERNAL;
+			if (r != SC_SUCCESS)
+				break;
+			i += sent;
+			apdu = &apdus[i - 1];
+			r = sc_transmit_finish(card, apdu, olen[sent - 1]);
+		} else {
+			r = sc_transmit_locked(card, apdu);
+			if (r == SC_SUCCESS)
+				i++;
+		}
+		if (r != SC_SUCCESS)
+			break;
+		r = sc_check_sw(card, apdu->sw1, apdu->sw2);
+		if (r != SC_SUCCESS)
+			break;
+	}
+	if (done != NULL)
+		*done = i;
+
+	if (r == SC_ERROR_CARD_RESET || r == SC_ERROR_READER_REATTACHED) {
+		sc_invalidate_cache(card);
+		if (card->ops->card_reader_lock_obtained)
+			card->ops->card_reader_lock_obtained(card, 1);
+	}
+
+	if (sc_unlock(card) != SC_SUCCESS)
+		sc_log(card->ctx, "sc_unlock failed");
+
+	LOG_FUNC_RETURN(card->ctx, r);
+}
+
+
 int
 sc_bytes2apdu(sc_context_t *ctx, const u8 *buf, size_t len, sc_apdu_t *apdu)
 {
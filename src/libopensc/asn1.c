@@ -1575,6 +1575,12 @@ static int asn1_decode_entry(sc_context_t *ctx,struct sc_asn1_entry *entry,
 			/* Allocate buffer if needed */
 			if (entry->flags & SC_ASN1_ALLOC) {
 				u8 **buf = (u8 **) parm;
+				if (entry->flags & SC_ASN1_BORROW) {
+					if (objlen > 0)
+						*buf = (u8 *) obj;
+					*len = objlen;
+					break;
+				}
 				if (objlen > 0) {
 					*buf = malloc(objlen);
 					if (*buf == NULL) {
@@ -1699,7 +1705,8 @@ static void sc_free_entry(struct sc_asn1_entry *asn1) {
 		case SC_ASN1_GENERALIZEDTIME:
 		case SC_ASN1_PRINTABLESTRING:
 		case SC_ASN1_UTF8STRING:
-			if ((entry->flags & SC_ASN1_ALLOC) && (entry->flags & SC_ASN1_PRESENT)) {
+			if ((entry->flags & SC_ASN1_ALLOC) && (entry->flags & SC_ASN1_PRESENT)
+					&& !(entry->flags & SC_ASN1_BORROW)) {
 				u8 **buf = (u8 **)entry->parm;
 				free(*buf);
 				*buf = NULL;
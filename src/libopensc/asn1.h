@@ -149,6 +149,9 @@ int sc_asn1_decode_ecdsa_signature(sc_context_t *ctx, const u8 *data, size_t dat
 #define SC_ASN1_ALLOC			0x00000004
 #define SC_ASN1_UNSIGNED		0x00000008
 #define SC_ASN1_EMPTY_ALLOWED           0x00000010
+/* With SC_ASN1_ALLOC, an OCTET STRING points into the decoded buffer
+ * instead of a copy; the caller has to keep the buffer around */
+#define SC_ASN1_BORROW			0x00000020
 
 #define SC_ASN1_BOOLEAN                 1
 #define SC_ASN1_INTEGER                 2
@@ -432,7 +432,7 @@ aes128_encrypt_cmac(struct sc_card *card, const unsigned char *key, int keysize,
 err:
 	CMAC_CTX_free(ctx);
 #else
-	EVP_MAC *mac = EVP_MAC_fetch(card->ctx->ossl3ctx->libctx, "cmac", NULL);
+	EVP_MAC *mac = sc_evp_mac(card->ctx, "cmac");
 	if(mac == NULL){    
 		return r;
 	}
@@ -443,7 +443,7 @@ err:
 
 	EVP_MAC_CTX *ctx = EVP_MAC_CTX_new(mac);
 	if(ctx == NULL){
-		EVP_MAC_CTX_free(ctx);
+		sc_evp_mac_free(mac);
 		return r;
 	}    
 	if(!EVP_MAC_init(ctx, (const unsigned char *)key, keysize/8,params)){
@@ -458,7 +458,7 @@ err:
 	r = SC_SUCCESS;
 err:
 	EVP_MAC_CTX_free(ctx);
-	EVP_MAC_free(mac);
+	sc_evp_mac_free(mac);
 #endif
 	return r;
 }
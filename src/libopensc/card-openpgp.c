@@ -2230,47 +2230,27 @@ pgp_set_security_env(sc_card_t *card,
 
 
 /**
- * set MANAGE SECURITY ENVIRONMENT as documented in 7.2.18 since OpenPGP Card v3.3
+ * format MANAGE SECURITY ENVIRONMENT as documented in 7.2.18 since OpenPGP Card v3.3
  *
  * "This optional command (announced in Extended Capabilities) assigns a specific key to a
  * command. The DEC-key (Key-Ref 2) can be assigned to the command INTERNAL AUTHENTICATE
  * and the AUT-Key (Key.Ref 3) can be linked to the command PSO:DECIPHER also."
  *
+ * apdu: APDU to format, sent by the caller
+ * data: 3 byte buffer for the APDU data
  * key: Key-Ref to change (2 for DEC-Key or 3 for AUT-Key)
  * p2: Usage to set (0xb8 for PSO:DECIPHER or 0xa4 for INTERNAL AUTHENTICATE)
  **/
-static int
-pgp_set_MSE(sc_card_t *card, int key, u8 p2)
+static void
+pgp_format_MSE(sc_card_t *card, sc_apdu_t *apdu, u8 *data, int key, u8 p2)
 {
-	struct pgp_priv_data	*priv = DRVDATA(card);
-	sc_apdu_t	apdu;
-	u8	apdu_case = SC_APDU_CASE_3;
-	u8	apdu_data[3];
-	int	r;
-
-	LOG_FUNC_CALLED(card->ctx);
-
-	// check if MSE is supported
-	if (!(priv->ext_caps & EXT_CAP_MSE))
-		LOG_FUNC_RETURN(card->ctx, SC_ERROR_NOT_SUPPORTED);
-
-	// create apdu
-	sc_format_apdu(card, &apdu, apdu_case, 0x22, 0x41, p2);
-	apdu.lc = 3;
-	apdu_data[0] = 0x83;
-	apdu_data[1] = 0x01;
-	apdu_data[2] = key;
-	apdu.data = apdu_data;
-	apdu.datalen = 3;
-
-	// transmit apdu
-	r = sc_transmit_apdu(card, &apdu);
-	LOG_TEST_RET(card->ctx, r, "APDU transmit failed");
-
-	r = sc_check_sw(card, apdu.sw1, apdu.sw2);
-	LOG_TEST_RET(card->ctx, r, "Card returned error");
-
-	LOG_FUNC_RETURN(card->ctx, SC_SUCCESS);
+	sc_format_apdu(card, apdu, SC_APDU_CASE_3, 0x22, 0x41, p2);
+	apdu->lc = 3;
+	data[0] = 0x83;
+	data[1] = 0x01;
+	data[2] = key;
+	apdu->data = data;
+	apdu->datalen = 3;
 }
 
 
@@ -2460,9 +2440,39 @@ pgp_decipher(sc_card_t *card, const u8 *in, size_t inlen,
 
 	/* For OpenPGP Card >=v3.3, key slot 3 instead of 2 can be used for deciphering,
 	 * but this has to be set via MSE beforehand on every usage (slot 2 is used by default)
-	 * see section 7.2.18 of the specification of OpenPGP Card v3.3 */
-	if (priv->bcd_version >= OPENPGP_CARD_3_3 && env->key_ref[0] == 0x02){
-		pgp_set_MSE(card, 3, 0xb8);
+	 * see section 7.2.18 of the specification of OpenPGP Card v3.3.
+	 * MSE, PSO:DECIPHER and the MSE back to slot 2 are sent as one sequence. */
+	if (priv->bcd_version >= OPENPGP_CARD_3_3 && env->key_ref[0] == 0x02
+			&& (priv->ext_caps & EXT_CAP_MSE)) {
+		sc_apdu_t batch[3];
+		u8 mse_aut[3], mse_dec[3];
+		size_t done;
+		int dec_r;
+
+		pgp_format_MSE(card, &batch[0], mse_aut, 3, 0xb8);
+		batch[1] = apdu;
+		pgp_format_MSE(card, &batch[2], mse_dec, 2, 0xb8);
+		r = sc_transmit_apdu_batch(card, batch, 3, &done);
+		free(temp);
+		/* done also counts a command which got an error response */
+		if (done >= 2)
+			dec_r = sc_check_sw(card, batch[1].sw1, batch[1].sw2);
+		else
+			dec_r = r;
+		/* unless the card rejected the first MSE, key slot 3 may still be
+		 * selected: set slot 2 again, failing that does not spoil the result */
+		if (r != SC_SUCCESS && done != 1) {
+			sc_log(card->ctx, "Sequence stopped (%d), setting key slot 2 again", r);
+			pgp_format_MSE(card, &batch[2], mse_dec, 2, 0xb8);
+			r = sc_transmit_apdu(card, &batch[2]);
+			if (r == SC_SUCCESS)
+				r = sc_check_sw(card, batch[2].sw1, batch[2].sw2);
+			if (r != SC_SUCCESS)
+				sc_log(card->ctx, "Setting key slot 2 for PSO:DECIPHER failed: %s",
+						sc_strerror(r));
+		}
+		LOG_TEST_RET(card->ctx, dec_r, "Deciphering with key slot 3 failed");
+		LOG_FUNC_RETURN(card->ctx, (int)batch[1].resplen);
 	}
 
 	r = sc_transmit_apdu(card, &apdu);
@@ -2472,11 +2482,6 @@ pgp_decipher(sc_card_t *card, const u8 *in, size_t inlen,
 	r = sc_check_sw(card, apdu.sw1, apdu.sw2);
 	LOG_TEST_RET(card->ctx, r, "Card returned error");
 
-	/* For OpenPGP Card >=v3.3, use key slot 2 for deciphering again (set to default) */
-	if (priv->bcd_version >= OPENPGP_CARD_3_3 && env->key_ref[0] == 0x02){
-		pgp_set_MSE(card, 2, 0xb8);
-	}
-
 	LOG_FUNC_RETURN(card->ctx, (int)apdu.resplen);
 }
 
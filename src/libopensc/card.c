@@ -23,12 +23,14 @@
 #endif
 
 #include <assert.h>
+#include <stdio.h>
 #include <stdlib.h>
 #ifdef HAVE_UNISTD_H
 #include <unistd.h>
 #endif
 #include <string.h>
 #include <limits.h>
+#include <stdint.h>
 
 #include "reader-tr03119.h"
 #include "internal.h"
@@ -178,6 +180,7 @@ static void sc_card_free(sc_card_t *card)
 
 	sc_file_free(card->cache.current_ef);
 	sc_file_free(card->cache.current_df);
+	sc_invalidate_read_cache(card);
 
 	if (card->mutex != NULL) {
 		int r = sc_mutex_destroy(card->ctx, card->mutex);
@@ -241,6 +244,178 @@ size_t sc_get_max_send_size(const sc_card_t *card)
 	return max_send_size;
 }
 
+/*
+ * Driver probe cache: a text file in the cache directory remembering
+ * which driver and card type were found for an ATR in a given reader,
+ * most recently used entries first. One entry per line:
+ *
+ *   ATR (hex) TAB driver short name TAB card type TAB reader name
+ */
+#define PROBE_CACHE_FILE	"driver-probe"
+#define PROBE_CACHE_MAX_ENTRIES	32
+#define PROBE_CACHE_LINE_SIZE	512
+
+struct probe_cache_entry {
+	char atr[SC_MAX_ATR_SIZE * 2 + 1];
+	char driver[32];
+	int type;
+	char reader[PROBE_CACHE_LINE_SIZE];
+};
+
+static int probe_cache_filename(sc_context_t *ctx, char *buf, size_t bufsize)
+{
+	char dir[PATH_MAX];
+	int r;
+
+	r = sc_get_cache_dir(ctx, dir, sizeof(dir));
+	if (r != SC_SUCCESS)
+		return r;
+	r = snprintf(buf, bufsize, "%s/%s", dir, PROBE_CACHE_FILE);
+	if (r < 0 || (size_t)r >= bufsize)
+		return SC_ERROR_BUFFER_TOO_SMALL;
+	return SC_SUCCESS;
+}
+
+static int probe_cache_parse(char *line, struct probe_cache_entry *entry)
+{
+	char *atr, *driver, *type, *reader, *end;
+	long val;
+
+	line[strcspn(line, "\r\n")] = '\0';
+	atr = line;
+	if ((driver = strchr(atr, '\t')) == NULL)
+		return 0;
+	*driver++ = '\0';
+	if ((type = strchr(driver, '\t')) == NULL)
+		return 0;
+	*type++ = '\0';
+	if ((reader = strchr(type, '\t')) == NULL)
+		return 0;
+	*reader++ = '\0';
+
+	val = strtol(type, &end, 10);
+	if (*type == '\0' || *end != '\0' || val < 0 || val > INT_MAX)
+		return 0;
+	if (strlcpy(entry->atr, atr, sizeof(entry->atr)) >= sizeof(entry->atr)
+			|| strlcpy(entry->driver, driver, sizeof(entry->driver)) >= sizeof(entry->driver)
+			|| strlcpy(entry->reader, reader, sizeof(entry->reader)) >= sizeof(entry->reader))
+		return 0;
+	entry->type = (int)val;
+	return 1;
+}
+
+/* The reader name is stored verbatim, so it must fit on one line */
+static int probe_cache_key(sc_card_t *card, char *atr, size_t atrsize)
+{
+	const char *name = card->reader->name;
+
+	if (card->atr.len == 0 || name == NULL || name[0] == '\0'
+			|| strpbrk(name, "\t\r\n") != NULL
+			|| strlen(name) >= PROBE_CACHE_LINE_SIZE)
+		return 0;
+	return sc_bin_to_hex(card->atr.value, card->atr.len, atr, atrsize, 0) == SC_SUCCESS;
+}
+
+/* Find the driver that matched this card in this reader last time and
+ * the position of its entry, 0 for the most recently used one */
+static struct sc_card_driver *probe_cache_lookup(sc_card_t *card, int *type, int *pos)
+{
+	sc_context_t *ctx = card->ctx;
+	struct probe_cache_entry entry;
+	struct sc_card_driver *drv = NULL;
+	char fname[PATH_MAX], atr[SC_MAX_ATR_SIZE * 2 + 1];
+	char line[PROBE_CACHE_LINE_SIZE + 64];
+	FILE *f;
+	int i, n = 0;
+
+	if (!probe_cache_key(card, atr, sizeof(atr))
+			|| probe_cache_filename(ctx, fname, sizeof(fname)) != SC_SUCCESS)
+		return NULL;
+	f = fopen(fname, "r");
+	if (f == NULL)
+		return NULL;
+	for (; fgets(line, sizeof(line), f) != NULL; n++) {
+		if (!probe_cache_parse(line, &entry)
+				|| strcmp(entry.atr, atr) != 0
+				|| strcmp(entry.reader, card->reader->name) != 0)
+			continue;
+		/* the driver may have been removed from the configuration */
+		for (i = 0; ctx->card_drivers[i] != NULL; i++) {
+			if (!strcmp(ctx->card_drivers[i]->short_name, entry.driver)) {
+				drv = ctx->card_drivers[i];
+				break;
+			}
+		}
+		break;
+	}
+	fclose(f);
+
+	if (drv == NULL || drv->ops == NULL || drv->ops->match_card == NULL)
+		return NULL;
+	if (!(ctx->flags & SC_CTX_FLAG_ENABLE_DEFAULT_DRIVER)
+			&& !strcmp("default", drv->short_name))
+		return NULL;
+	*type = entry.type;
+	*pos = n;
+	return drv;
+}
+
+/* Move the result of the probe for this card to the top of the cache */
+static void probe_cache_store(sc_card_t *card)
+{
+	sc_context_t *ctx = card->ctx;
+	struct probe_cache_entry entry;
+	char fname[PATH_MAX], atr[SC_MAX_ATR_SIZE * 2 + 1];
+	char line[PROBE_CACHE_LINE_SIZE + 64];
+	char *image = NULL, *tmp;
+	size_t len, size = 0, count = 1;
+	FILE *f;
+	int r;
+
+	if (!probe_cache_key(card, atr, sizeof(atr))
+			|| probe_cache_filename(ctx, fname, sizeof(fname)) != SC_SUCCESS)
+		return;
+
+	r = snprintf(line, sizeof(line), "%s\t%s\t%d\t%s\n", atr,
+			card->driver->short_name, card->type, card->reader->name);
+	if (r < 0 || (size_t)r >= sizeof(line))
+		return;
+	len = r;
+	image = malloc(len);
+	if (image == NULL)
+		return;
+	memcpy(image, line, len);
+	size = len;
+
+	f = fopen(fname, "r");
+	while (f != NULL && count < PROBE_CACHE_MAX_ENTRIES
+			&& fgets(line, sizeof(line), f) != NULL) {
+		if (!probe_cache_parse(line, &entry)
+				|| (!strcmp(entry.atr, atr)
+					&& !strcmp(entry.reader, card->reader->name)))
+			continue;
+		r = snprintf(line, sizeof(line), "%s\t%s\t%d\t%s\n", entry.atr,
+				entry.driver, entry.type, entry.reader);
+		if (r < 0 || (size_t)r >= sizeof(line))
+			continue;
+		len = r;
+		tmp = realloc(image, size + len);
+		if (tmp == NULL)
+			break;
+		image = tmp;
+		memcpy(image + size, line, len);
+		size += len;
+		count++;
+	}
+	if (f != NULL)
+		fclose(f);
+
+	r = sc_write_cache_file(ctx, fname, (const u8 *)image, size);
+	if (r != SC_SUCCESS)
+		sc_log(ctx, "unable to update the driver probe cache: %s", sc_strerror(r));
+	free(image);
+}
+
 int sc_connect_card(sc_reader_t *reader, sc_card_t **card_out)
 {
 	sc_card_t *card;
@@ -320,8 +495,36 @@ int sc_connect_card(sc_reader_t *reader, sc_card_t **card_out)
 	}
 	else {
 		sc_card_t uninitialized = *card;
-		sc_log(ctx, "matching built-in ATRs");
-		for (i = 0; ctx->card_drivers[i] != NULL; i++) {
+		struct sc_card_driver *cached = NULL;
+		int cached_type = 0, cached_pos = 0;
+
+		if (ctx->flags & SC_CTX_FLAG_ENABLE_PROBE_CACHE)
+			cached = probe_cache_lookup(card, &cached_type, &cached_pos);
+		if (cached != NULL) {
+			/* Try the driver which matched last time before probing
+			 * all of them, which may cost a few SELECTs per driver */
+			sc_log(ctx, "trying cached driver '%s'", cached->short_name);
+			*card->ops = *cached->ops;
+			if (cached->ops->match_card(card) == 1) {
+				card->driver = cached;
+				r = cached->ops->init(card);
+				if (r) {
+					sc_log(ctx, "driver '%s' init() failed: %s", cached->name, sc_strerror(r));
+					if (r != SC_ERROR_INVALID_CARD)
+						goto err;
+					card->driver = NULL;
+				}
+			}
+			if (card->driver == NULL)
+				sc_log(ctx, "cached driver '%s' did not match", cached->short_name);
+			else if (card->type != cached_type || cached_pos > 0)
+				/* keep the entries in the order of their last use */
+				probe_cache_store(card);
+		}
+
+		if (card->driver == NULL)
+			sc_log(ctx, "matching built-in ATRs");
+		for (i = 0; card->driver == NULL && ctx->card_drivers[i] != NULL; i++) {
 			/* FIXME If we had a clean API description, we'd probably get a
 			 * cleaner implementation of the driver's match_card and init,
 			 * which should normally *not* modify the card object if
@@ -339,7 +542,7 @@ int sc_connect_card(sc_reader_t *reader, sc_card_t **card_out)
 			const struct sc_card_operations *ops = drv->ops;
 
 			sc_log(ctx, "trying driver '%s'", drv->short_name);
-			if (ops == NULL || ops->match_card == NULL)   {
+			if (ops == NULL || ops->match_card == NULL || drv == cached)   {
 				continue;
 			}
 			else if (!(ctx->flags & SC_CTX_FLAG_ENABLE_DEFAULT_DRIVER)
@@ -364,6 +567,8 @@ int sc_connect_card(sc_reader_t *reader, sc_card_t **card_out)
 				}
 				goto err;
 			}
+			if (ctx->flags & SC_CTX_FLAG_ENABLE_PROBE_CACHE)
+				probe_cache_store(card);
 			break;
 		}
 	}
@@ -616,11 +821,159 @@ int sc_delete_file(sc_card_t *card, const sc_path_t *path)
 	LOG_FUNC_RETURN(card->ctx, r);
 }
 
+/* Upper limit of EF contents kept in memory with SC_CARD_FLAG_READ_CACHE */
+#define SC_READ_CACHE_MAX_SIZE	(256 * 1024)
+
+struct sc_cached_ef {
+	struct sc_path path;
+	u8 *data;
+	size_t len;		/* number of bytes known from offset 0 */
+	struct sc_cached_ef *next;
+};
+
+static int sc_read_cache_path_equal(const sc_path_t *a, const sc_path_t *b)
+{
+	return a->type == b->type && a->len == b->len
+		&& !memcmp(a->value, b->value, a->len)
+		&& a->aid.len == b->aid.len
+		&& !memcmp(a->aid.value, b->aid.value, a->aid.len);
+}
+
+static void sc_read_cache_free_ef(struct sc_cached_ef *ef)
+{
+	sc_mem_clear(ef->data, ef->len);
+	free(ef->data);
+	free(ef);
+}
+
+void sc_invalidate_read_cache(struct sc_card *card)
+{
+	struct sc_cached_ef *ef, *next;
+
+	if (card == NULL)
+		return;
+	for (ef = card->cache.ef_list; ef != NULL; ef = next) {
+		next = ef->next;
+		sc_read_cache_free_ef(ef);
+	}
+	card->cache.ef_list = NULL;
+	card->cache.ef_size = 0;
+}
+
+void sc_read_cache_apdu(struct sc_card *card, const sc_apdu_t *apdu)
+{
+	if (card == NULL || apdu == NULL || !(card->flags & SC_CARD_FLAG_READ_CACHE))
+		return;
+
+	switch (apdu->ins) {
+	case 0xA4: /* SELECT */
+	case 0x70: /* MANAGE CHANNEL */
+		card->cache.selected_path.len = 0;
+		break;
+	case 0x04: /* DEACTIVATE FILE */
+	case 0x0E: /* ERASE BINARY */
+	case 0x0F:
+	case 0x44: /* ACTIVATE FILE */
+	case 0x46: /* GENERATE KEY PAIR */
+	case 0x47:
+	case 0xD0: /* WRITE BINARY */
+	case 0xD1:
+	case 0xD2: /* WRITE RECORD */
+	case 0xD6: /* UPDATE BINARY */
+	case 0xD7:
+	case 0xDA: /* PUT DATA */
+	case 0xDB:
+	case 0xDC: /* UPDATE RECORD */
+	case 0xDD:
+	case 0xE0: /* CREATE FILE */
+	case 0xE2: /* APPEND RECORD */
+	case 0xE4: /* DELETE FILE */
+	case 0xE6: /* TERMINATE DF */
+	case 0xE8: /* TERMINATE EF */
+		sc_invalidate_read_cache(card);
+		break;
+	}
+}
+
+/* Returns the cached contents of the selected EF, if any */
+static struct sc_cached_ef *sc_read_cache_find(struct sc_card *card)
+{
+	struct sc_cached_ef *ef, **prev;
+
+	if (card->cache.selected_path.len == 0)
+		return NULL;
+
+	for (prev = &card->cache.ef_list; (ef = *prev) != NULL; prev = &ef->next) {
+		if (sc_read_cache_path_equal(&ef->path, &card->cache.selected_path)) {
+			/* move to front, the list tail is evicted first */
+			*prev = ef->next;
+			ef->next = card->cache.ef_list;
+			card->cache.ef_list = ef;
+			return ef;
+		}
+	}
+	return NULL;
+}
+
+/* Adds the data read at idx from the selected EF to the cache, as long as
+ * it extends the contents known from offset 0 */
+static void sc_read_cache_store(struct sc_card *card, unsigned int idx,
+		const u8 *buf, size_t count)
+{
+	struct sc_cached_ef *ef, **prev;
+	u8 *data;
+
+	if (count == 0 || card->cache.selected_path.len == 0)
+		return;
+
+	ef = sc_read_cache_find(card);
+	if (ef == NULL) {
+		if (idx != 0)
+			return;
+		ef = calloc(1, sizeof(struct sc_cached_ef));
+		if (ef == NULL)
+			return;
+		ef->path = card->cache.selected_path;
+		ef->next = card->cache.ef_list;
+		card->cache.ef_list = ef;
+	}
+	if (idx > ef->len || idx + count <= ef->len
+			|| idx + count > SC_READ_CACHE_MAX_SIZE)
+		return;
+
+	data = malloc(idx + count);
+	if (data == NULL)
+		return;
+	if (ef->data != NULL) {
+		memcpy(data, ef->data, idx);
+		sc_mem_clear(ef->data, ef->len);
+		free(ef->data);
+	}
+	memcpy(data + idx, buf, count);
+	card->cache.ef_size += idx + count - ef->len;
+	ef->data = data;
+	ef->len = idx + count;
+
+	/* evict the least recently used entries */
+	while (card->cache.ef_size > SC_READ_CACHE_MAX_SIZE) {
+		for (prev = &card->cache.ef_list; (*prev)->next != NULL; prev = &(*prev)->next)
+			;
+		if (*prev == ef)
+			break;
+		card->cache.ef_size -= (*prev)->len;
+		sc_read_cache_free_ef(*prev);
+		*prev = NULL;
+	}
+}
+
 int sc_read_binary(sc_card_t *card, unsigned int idx,
 		   unsigned char *buf, size_t count, unsigned long flags)
 {
 	size_t max_le = sc_get_max_recv_size(card);
 	size_t todo = count;
+	unsigned int read_idx;
+	unsigned char *read_buf;
+	int use_cache;
 	int r;
 
 	if (card == NULL || card->ops == NULL || buf == NULL) {
@@ -632,6 +985,9 @@ int sc_read_binary(sc_card_t *card, unsigned int idx,
 		LOG_FUNC_RETURN(card->ctx, SC_SUCCESS);
 
 #ifdef ENABLE_SM
+	/* Not cached: the external SM module selects and reads the file over
+	 * its own secure channel, so the selected path known here does not
+	 * tell which EF the data came from. */
 	if (card->sm_ctx.ops.read_binary)   {
 		r = card->sm_ctx.ops.read_binary(card, idx, buf, count);
 		if (r)
@@ -646,6 +1002,24 @@ int sc_read_binary(sc_card_t *card, unsigned int idx,
 	r = sc_lock(card);
 	LOG_TEST_RET(card->ctx, r, "sc_lock() failed");
 
+	use_cache = (card->flags & SC_CARD_FLAG_READ_CACHE) && flags == 0
+		&& card->cache.selected_path.len != 0;
+	if (use_cache) {
+		struct sc_cached_ef *ef = sc_read_cache_find(card);
+
+		if (ef != NULL && idx < ef->len) {
+			size_t cached = MIN(todo, ef->len - idx);
+
+			sc_log(card->ctx, "%"SC_FORMAT_LEN_SIZE_T"u bytes read from cache", cached);
+			memcpy(buf, ef->data + idx, cached);
+			todo -= cached;
+			buf  += cached;
+			idx  += (unsigned int) cached;
+		}
+	}
+	read_idx = idx;
+	read_buf = buf;
+
 	while (todo > 0) {
 		size_t chunk = MIN(todo, max_le);
 
@@ -673,6 +1047,9 @@ int sc_read_binary(sc_card_t *card, unsigned int idx,
 		idx  += (size_t) r;
 	}
 
+	if (use_cache)
+		sc_read_cache_store(card, read_idx, read_buf, buf - read_buf);
+
 	sc_unlock(card);
 
 	LOG_FUNC_RETURN(card->ctx, count - todo);
@@ -693,6 +1070,8 @@ int sc_write_binary(sc_card_t *card, unsigned int idx,
 	if (count == 0)
 		LOG_FUNC_RETURN(card->ctx, SC_SUCCESS);
 
+	sc_invalidate_read_cache(card);
+
 	if (card->ops->write_binary == NULL)
 		LOG_FUNC_RETURN(card->ctx, SC_ERROR_NOT_SUPPORTED);
 
@@ -741,6 +1120,8 @@ int sc_update_binary(sc_card_t *card, unsigned int idx,
 	if (count == 0)
 		LOG_FUNC_RETURN(card->ctx, SC_SUCCESS);
 
+	sc_invalidate_read_cache(card);
+
 #ifdef ENABLE_SM
 	if (card->sm_ctx.ops.update_binary)   {
 		r = card->sm_ctx.ops.update_binary(card, idx, buf, count);
@@ -797,6 +1178,8 @@ int sc_erase_binary(struct sc_card *card, unsigned int idx, size_t count,  unsig
 	if (count == 0)
 		LOG_FUNC_RETURN(card->ctx, SC_SUCCESS);
 
+	sc_invalidate_read_cache(card);
+
 	if (card->ops->erase_binary == NULL)
 		LOG_FUNC_RETURN(card->ctx, SC_ERROR_NOT_SUPPORTED);
 
@@ -868,9 +1251,15 @@ int sc_select_file(sc_card_t *card, const sc_path_t *in_path,  sc_file_t **file)
 	}
 	if (card->ops->select_file == NULL)
 		LOG_FUNC_RETURN(card->ctx, SC_ERROR_NOT_SUPPORTED);
+	card->cache.selected_path.len = 0;
 	r = card->ops->select_file(card, in_path, file);
 	LOG_TEST_RET(card->ctx, r, "'SELECT' error");
 
+	/* Only remember paths identifying the file regardless of the current DF */
+	if (in_path->type == SC_PATH_TYPE_PATH
+			|| (in_path->type == SC_PATH_TYPE_FILE_ID && in_path->aid.len > 0))
+		card->cache.selected_path = *in_path;
+
 	if (file) {
 		if (*file)
 			/* Remember file path */
@@ -1273,67 +1662,235 @@ sc_algorithm_info_t * sc_card_find_gostr3410_alg(sc_card_t *card,
 	return sc_card_find_alg(card, SC_ALGORITHM_GOSTR3410, key_length, NULL);
 }
 
-static int match_atr_table(sc_context_t *ctx, const struct sc_atr_table *table, struct sc_atr *atr)
+/*
+ * ATR tables are matched in a binary form that is built the first time a
+ * table is used and kept in the context, keyed by the table's address.
+ * Entries are grouped by ATR length, keeping the table order within a
+ * group, so that only entries of the right length are looked at and the
+ * first matching entry of the table still wins.
+ */
+#define ATR_CACHE_BUCKETS	64
+
+struct sc_compiled_atr {
+	u8 value[SC_MAX_ATR_SIZE];	/* already reduced with the mask */
+	u8 mask[SC_MAX_ATR_SIZE];
+	unsigned int index;		/* entry in the source table */
+};
+
+struct sc_compiled_atr_table {
+	const struct sc_atr_table *table;
+	struct sc_compiled_atr_table *next;
+	/* entries[start[len] .. start[len + 1]] are the ATRs of length len */
+	unsigned int start[SC_MAX_ATR_SIZE + 2];
+	struct sc_compiled_atr *entries;
+};
+
+struct sc_atr_cache {
+	struct sc_compiled_atr_table *buckets[ATR_CACHE_BUCKETS];
+};
+
+static unsigned int atr_cache_bucket(const struct sc_atr_table *table)
 {
-	u8 *card_atr_bin;
-	size_t card_atr_bin_len;
-	char card_atr_hex[3 * SC_MAX_ATR_SIZE];
-	size_t card_atr_hex_len;
-	unsigned int i = 0;
+	return (unsigned int) (((uintptr_t) table >> 4) % ATR_CACHE_BUCKETS);
+}
 
-	if (ctx == NULL || table == NULL || atr == NULL)
-		return -1;
-	card_atr_bin = atr->value;
-	card_atr_bin_len = atr->len;
-	sc_bin_to_hex(card_atr_bin, card_atr_bin_len, card_atr_hex, sizeof(card_atr_hex), ':');
-	card_atr_hex_len = strlen(card_atr_hex);
-
-	sc_debug(ctx, SC_LOG_DEBUG_MATCH, "ATR     : %s", card_atr_hex);
-
-	for (i = 0; table[i].atr != NULL; i++) {
-		const char *tatr = table[i].atr;
-		const char *matr = table[i].atrmask;
-		size_t tatr_len = strlen(tatr);
-		u8 mbin[SC_MAX_ATR_SIZE], tbin[SC_MAX_ATR_SIZE];
-		size_t mbin_len, tbin_len, s, matr_len;
-		size_t fix_hex_len = card_atr_hex_len;
-		size_t fix_bin_len = card_atr_bin_len;
-
-		sc_debug(ctx, SC_LOG_DEBUG_MATCH, "ATR try : %s", tatr);
-
-		if (tatr_len != fix_hex_len) {
-			sc_debug(ctx, SC_LOG_DEBUG_MATCH, "ignored - wrong length");
-			continue;
+/* Returns the ATR length, 0 if the entry can never match */
+static size_t compile_atr(sc_context_t *ctx, const struct sc_atr_table *entry,
+		struct sc_compiled_atr *out)
+{
+	size_t len = sizeof(out->value), mask_len = sizeof(out->mask);
+	size_t hex_len = strlen(entry->atr), s;
+
+	/* the ATR is matched against the card's ATR in "3b:02:.." form */
+	if (sc_hex_to_bin(entry->atr, out->value, &len) != SC_SUCCESS
+			|| len == 0 || hex_len != 3 * len - 1)
+		return 0;
+	if (entry->atrmask != NULL) {
+		if (strlen(entry->atrmask) != hex_len
+				|| sc_hex_to_bin(entry->atrmask, out->mask, &mask_len) != SC_SUCCESS
+				|| mask_len != len) {
+			sc_debug(ctx, SC_LOG_DEBUG_MATCH, "length of atr and atr mask do not match - ignored: %s - %s",
+					entry->atr, entry->atrmask);
+			return 0;
 		}
-		if (matr != NULL) {
-			sc_debug(ctx, SC_LOG_DEBUG_MATCH, "ATR mask: %s", matr);
+		for (s = 0; s < len; s++)
+			out->value[s] &= out->mask[s];
+	} else {
+		memset(out->mask, 0xFF, len);
+	}
+	return len;
+}
 
-			matr_len = strlen(matr);
-			if (tatr_len != matr_len)
-				continue;
-			tbin_len = sizeof(tbin);
-			sc_hex_to_bin(tatr, tbin, &tbin_len);
-			mbin_len = sizeof(mbin);
-			sc_hex_to_bin(matr, mbin, &mbin_len);
-			if (mbin_len != fix_bin_len) {
-				sc_debug(ctx, SC_LOG_DEBUG_MATCH, "length of atr and atr mask do not match - ignored: %s - %s", tatr, matr);
-				continue;
+static void free_compiled_atr_table(struct sc_compiled_atr_table *ct)
+{
+	if (ct) {
+		free(ct->entries);
+		free(ct);
+	}
+}
+
+static struct sc_compiled_atr_table *compile_atr_table(sc_context_t *ctx,
+		const struct sc_atr_table *table)
+{
+	struct sc_compiled_atr_table *ct;
+	struct sc_compiled_atr *tmp = NULL;
+	unsigned char *lens = NULL;
+	unsigned int n, i, len;
+
+	for (n = 0; table[n].atr != NULL; n++)
+		;
+	ct = calloc(1, sizeof(struct sc_compiled_atr_table));
+	if (ct == NULL)
+		return NULL;
+	ct->table = table;
+	if (n == 0)
+		return ct;
+
+	tmp = calloc(n, sizeof(struct sc_compiled_atr));
+	lens = calloc(n, 1);
+	ct->entries = malloc(n * sizeof(struct sc_compiled_atr));
+	if (tmp == NULL || lens == NULL || ct->entries == NULL) {
+		free_compiled_atr_table(ct);
+		ct = NULL;
+		goto out;
+	}
+
+	/* count the entries of each length, then place them in order */
+	for (i = 0; i < n; i++) {
+		lens[i] = (unsigned char) compile_atr(ctx, &table[i], &tmp[i]);
+		tmp[i].index = i;
+		if (lens[i])
+			ct->start[lens[i] + 1]++;
+	}
+	for (len = 1; len < SC_MAX_ATR_SIZE + 2; len++)
+		ct->start[len] += ct->start[len - 1];
+	for (i = 0; i < n; i++) {
+		if (lens[i])
+			ct->entries[ct->start[lens[i]]++] = tmp[i];
+	}
+	/* placing advanced each start to the end of its group */
+	for (len = SC_MAX_ATR_SIZE + 1; len > 0; len--)
+		ct->start[len] = ct->start[len - 1];
+	ct->start[0] = 0;
+
+out:
+	free(tmp);
+	free(lens);
+	return ct;
+}
+
+/* Called with ctx->mutex held, which also keeps the result alive */
+static struct sc_compiled_atr_table *get_compiled_atr_table(sc_context_t *ctx,
+		const struct sc_atr_table *table)
+{
+	struct sc_compiled_atr_table *ct = NULL;
+	unsigned int bucket = atr_cache_bucket(table);
+
+	if (ctx->atr_cache == NULL)
+		ctx->atr_cache = calloc(1, sizeof(struct sc_atr_cache));
+	if (ctx->atr_cache != NULL) {
+		for (ct = ctx->atr_cache->buckets[bucket]; ct != NULL; ct = ct->next)
+			if (ct->table == table)
+				break;
+		if (ct == NULL) {
+			ct = compile_atr_table(ctx, table);
+			if (ct != NULL) {
+				ct->next = ctx->atr_cache->buckets[bucket];
+				ctx->atr_cache->buckets[bucket] = ct;
 			}
-			for (s = 0; s < tbin_len; s++) {
-				/* reduce tatr with mask */
-				tbin[s] = (tbin[s] & mbin[s]);
-				/* create copy of card_atr_bin masked) */
-				mbin[s] = (card_atr_bin[s] & mbin[s]);
+		}
+	}
+	return ct;
+}
+
+/* Drop the compiled form of a table that is about to change or go away */
+static void invalidate_atr_table(sc_context_t *ctx, const struct sc_atr_table *table)
+{
+	struct sc_compiled_atr_table **pct;
+
+	if (ctx == NULL || table == NULL)
+		return;
+	sc_mutex_lock(ctx, ctx->mutex);
+	if (ctx->atr_cache != NULL) {
+		for (pct = &ctx->atr_cache->buckets[atr_cache_bucket(table)]; *pct; pct = &(*pct)->next) {
+			if ((*pct)->table == table) {
+				struct sc_compiled_atr_table *ct = *pct;
+				*pct = ct->next;
+				free_compiled_atr_table(ct);
+				break;
 			}
-			if (memcmp(tbin, mbin, tbin_len) != 0)
-				continue;
-		} else {
-			if (strncasecmp(tatr, card_atr_hex, tatr_len) != 0)
-				continue;
 		}
-		return i;
 	}
-	return -1;
+	sc_mutex_unlock(ctx, ctx->mutex);
+}
+
+void _sc_compile_atr_tables(sc_context_t *ctx)
+{
+	unsigned int i;
+
+	sc_mutex_lock(ctx, ctx->mutex);
+	for (i = 0; ctx->card_drivers[i] != NULL; i++)
+		if (ctx->card_drivers[i]->atr_map != NULL)
+			get_compiled_atr_table(ctx, ctx->card_drivers[i]->atr_map);
+	sc_mutex_unlock(ctx, ctx->mutex);
+}
+
+void _sc_free_atr_cache(sc_context_t *ctx)
+{
+	unsigned int i;
+
+	if (ctx == NULL || ctx->atr_cache == NULL)
+		return;
+	for (i = 0; i < ATR_CACHE_BUCKETS; i++) {
+		while (ctx->atr_cache->buckets[i] != NULL) {
+			struct sc_compiled_atr_table *ct = ctx->atr_cache->buckets[i];
+			ctx->atr_cache->buckets[i] = ct->next;
+			free_compiled_atr_table(ct);
+		}
+	}
+	free(ctx->atr_cache);
+	ctx->atr_cache = NULL;
+}
+
+static int match_atr_table(sc_context_t *ctx, const struct sc_atr_table *table, struct sc_atr *atr)
+{
+	struct sc_compiled_atr_table *ct;
+	unsigned int i;
+	size_t s;
+	int res = -1;
+
+	if (ctx == NULL || table == NULL || atr == NULL || atr->len > SC_MAX_ATR_SIZE)
+		return -1;
+
+	if (ctx->debug >= SC_LOG_DEBUG_MATCH) {
+		char card_atr_hex[3 * SC_MAX_ATR_SIZE];
+
+		sc_bin_to_hex(atr->value, atr->len, card_atr_hex, sizeof(card_atr_hex), ':');
+		sc_debug(ctx, SC_LOG_DEBUG_MATCH, "ATR     : %s", card_atr_hex);
+	}
+
+	/* the compiled table is freed by invalidate_atr_table() under the
+	 * same lock */
+	sc_mutex_lock(ctx, ctx->mutex);
+	ct = get_compiled_atr_table(ctx, table);
+	if (ct != NULL) {
+		for (i = ct->start[atr->len]; i < ct->start[atr->len + 1]; i++) {
+			const struct sc_compiled_atr *entry = &ct->entries[i];
+
+			for (s = 0; s < atr->len; s++)
+				if ((atr->value[s] & entry->mask[s]) != entry->value[s])
+					break;
+			if (s == atr->len) {
+				res = (int) entry->index;
+				break;
+			}
+		}
+	}
+	sc_mutex_unlock(ctx, ctx->mutex);
+
+	if (res >= 0)
+		sc_debug(ctx, SC_LOG_DEBUG_MATCH, "ATR match: %s", table[res].atr);
+	return res;
 }
 
 int _sc_match_atr(sc_card_t *card, const struct sc_atr_table *table, int *type_out)
@@ -1384,6 +1941,7 @@ int _sc_add_atr(sc_context_t *ctx, struct sc_card_driver *driver, struct sc_atr_
 {
 	struct sc_atr_table *map, *dst;
 
+	invalidate_atr_table(ctx, driver->atr_map);
 	map = (struct sc_atr_table *) realloc(driver->atr_map,
 			(driver->natrs + 2) * sizeof(struct sc_atr_table));
 	if (!map)
@@ -1427,6 +1985,7 @@ int _sc_free_atr(sc_context_t *ctx, struct sc_card_driver *driver)
 {
 	unsigned int i;
 
+	invalidate_atr_table(ctx, driver->atr_map);
 	for (i = 0; i < driver->natrs; i++) {
 		struct sc_atr_table *src = &driver->atr_map[i];
 
@@ -1472,6 +2031,7 @@ void sc_invalidate_cache(struct sc_card *card)
 	if (card) {
 		sc_file_free(card->cache.current_ef);
 		sc_file_free(card->cache.current_df);
+		sc_invalidate_read_cache(card);
 		memset(&card->cache, 0, sizeof(card->cache));
 		card->cache.valid = 0;
 	}
@@ -29,6 +29,10 @@
 #include <errno.h>
 #include <sys/stat.h>
 #include <limits.h>
+#include <fcntl.h>
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
 
 #ifdef _WIN32
 #include <windows.h>
@@ -42,8 +46,8 @@
 #include "internal.h"
 #ifdef ENABLE_OPENSSL
 #include <openssl/crypto.h>
-#include "sc-ossl-compat.h"
 #endif
+#include "sc-ossl-compat.h"
 
 
 static int ignored_reader(sc_context_t *ctx, sc_reader_t *reader)
@@ -87,6 +91,9 @@ int _sc_delete_reader(sc_context_t *ctx, sc_reader_t *reader)
 			reader->ops->release(reader);
 	free(reader->name);
 	free(reader->vendor);
+	if (reader->apdu_buffers != NULL)
+		sc_mem_secure_clear_free(reader->apdu_buffers,
+				reader->apdu_send_size + reader->apdu_recv_size);
 	list_delete(&ctx->readers, reader);
 	free(reader);
 	return SC_SUCCESS;
@@ -330,7 +337,7 @@ static void set_defaults(sc_context_t *ctx, struct _sc_ctx_options *opts)
  * each DLL has a separate file handle table. Thus tools and utilities
  * can not set the file handle themselves when -v is specified on command line.
  */
-int sc_ctx_log_to_file(sc_context_t *ctx, const char* filename)
+static int ctx_log_to_file(sc_context_t *ctx, const char* filename)
 {
 	/* Close any existing handles */
 	if (ctx->debug_file && (ctx->debug_file != stderr && ctx->debug_file != stdout))   {
@@ -360,6 +367,18 @@ int sc_ctx_log_to_file(sc_context_t *ctx, const char* filename)
 	return SC_SUCCESS;
 }
 
+int sc_ctx_log_to_file(sc_context_t *ctx, const char* filename)
+{
+	int r;
+
+	/* Messages queued so far belong to the old file, which must not be
+	 * closed while the log writer still uses it */
+	_sc_log_async_pause(ctx);
+	r = ctx_log_to_file(ctx, filename);
+	_sc_log_async_resume(ctx);
+	return r;
+}
+
 static void
 set_drivers(struct _sc_ctx_options *opts, const scconf_list *list)
 {
@@ -407,6 +426,10 @@ load_parameters(sc_context_t *ctx, scconf_block *block, struct _sc_ctx_options *
 		sc_ctx_log_to_file(ctx, NULL);
 	}
 
+	if (scconf_get_bool(block, "debug_async", 0)
+			&& _sc_log_async_start(ctx) != SC_SUCCESS)
+		sc_log(ctx, "asynchronous logging is not available");
+
 	if (scconf_get_bool (block, "disable_popups",
 				ctx->flags & SC_CTX_FLAG_DISABLE_POPUPS))
 		ctx->flags |= SC_CTX_FLAG_DISABLE_POPUPS;
@@ -419,6 +442,14 @@ load_parameters(sc_context_t *ctx, scconf_block *block, struct _sc_ctx_options *
 				ctx->flags & SC_CTX_FLAG_ENABLE_DEFAULT_DRIVER))
 		ctx->flags |= SC_CTX_FLAG_ENABLE_DEFAULT_DRIVER;
 
+	if (scconf_get_bool (block, "enable_probe_cache",
+				ctx->flags & SC_CTX_FLAG_ENABLE_PROBE_CACHE))
+		ctx->flags |= SC_CTX_FLAG_ENABLE_PROBE_CACHE;
+
+	if (scconf_get_bool (block, "enable_config_cache",
+				ctx->flags & SC_CTX_FLAG_ENABLE_CONFIG_CACHE))
+		ctx->flags |= SC_CTX_FLAG_ENABLE_CONFIG_CACHE;
+
 	list = scconf_find_list(block, "card_drivers");
 	set_drivers(opts, list);
 
@@ -663,6 +694,8 @@ static int load_card_atrs(sc_context_t *ctx)
 					flags = SC_CARD_FLAG_RNG;
 				else if (!strcmp(list->data, "keep_alive"))
 					flags = SC_CARD_FLAG_KEEP_ALIVE;
+				else if (!strcmp(list->data, "read_cache"))
+					flags = SC_CARD_FLAG_READ_CACHE;
 				else if (sscanf(list->data, "%x", &flags) != 1)
 					flags = 0;
 
@@ -677,12 +710,150 @@ static int load_card_atrs(sc_context_t *ctx)
 	return SC_SUCCESS;
 }
 
+/*
+ * Configuration cache: with enable_config_cache, the parsed configuration
+ * is stored as a scconf image in the cache directory, preceded by a key
+ * identifying the configuration file and this version of OpenSC. Later
+ * contexts load the image instead of parsing the file again; any change
+ * of the file changes the key. The image is looked up in the default
+ * cache directory, because file_cache_dir is only known after parsing.
+ * The key can be reproduced by anybody able to stat the configuration
+ * file, so the image is only trusted from a file and directory owned by
+ * the effective user and not writable by others, never in a setuid or
+ * setgid process, and only if the configuration it holds enables the
+ * cache.
+ */
+#define CONFIG_CACHE_FILE	"config-cache"
+/* the key is padded to keep the image aligned */
+#define CONFIG_CACHE_KEYLEN(key)	((strlen(key) + 1 + 15) & ~(size_t)15)
+
+static int config_cache_prepare(sc_context_t *ctx, const char *conf_path,
+		char *fname, size_t fnamelen, char *key, size_t keylen)
+{
+	char dir[PATH_MAX];
+	struct stat st;
+	int r;
+
+#ifndef _WIN32
+	if (getuid() != geteuid() || getgid() != getegid())
+		return 0;
+#endif
+	if (stat(conf_path, &st) != 0
+			|| sc_get_cache_dir(ctx, dir, sizeof(dir)) != SC_SUCCESS)
+		return 0;
+	r = snprintf(fname, fnamelen, "%s/%s", dir, CONFIG_CACHE_FILE);
+	if (r < 0 || (size_t)r >= fnamelen)
+		return 0;
+	memset(key, 0, keylen);
+	r = snprintf(key, keylen, "OpenSC %s\n%s\n%llu %lld %lld %llu\n",
+			sc_get_version(), conf_path,
+			(unsigned long long)st.st_size, (long long)st.st_mtime,
+			(long long)st.st_ctime, (unsigned long long)st.st_ino);
+	if (r < 0 || CONFIG_CACHE_KEYLEN(key) > keylen)
+		return 0;
+	return 1;
+}
+
+#ifndef _WIN32
+static int config_cache_owned(const struct stat *st)
+{
+	return st->st_uid == geteuid() && (st->st_mode & (S_IWGRP | S_IWOTH)) == 0;
+}
+#endif
+
+/* Tells whether the loaded configuration enables the cache */
+static int config_cache_enabled(sc_context_t *ctx)
+{
+	const char *apps[2] = { ctx->app_name, "default" };
+	scconf_block **blocks;
+	int i, enabled = 0;
+
+	for (i = 0; i < 2 && !enabled; i++) {
+		blocks = scconf_find_blocks(ctx->conf, NULL, "app", apps[i]);
+		if (blocks && blocks[0])
+			enabled = scconf_get_bool(blocks[0], "enable_config_cache", 0);
+		free(blocks);
+	}
+	return enabled;
+}
+
+/* Returns 1 if the configuration was loaded, -1 for an outdated, damaged
+ * or untrusted cache file and 0 if there is none */
+static int config_cache_load(sc_context_t *ctx, const char *fname, const char *key)
+{
+	char head[PATH_MAX + 128];
+	size_t keylen = CONFIG_CACHE_KEYLEN(key), len;
+	unsigned char *image = NULL;
+	long size;
+	FILE *f;
+	int r = -1;
+#ifndef _WIN32
+	char dir[PATH_MAX], *p;
+	struct stat st;
+#endif
+
+	f = fopen(fname, "rb");
+	if (f == NULL)
+		return 0;
+#ifndef _WIN32
+	strlcpy(dir, fname, sizeof(dir));
+	if ((p = strrchr(dir, '/')) != NULL)
+		*p = '\0';
+	if (p == NULL || stat(dir, &st) != 0 || !config_cache_owned(&st)
+			|| fstat(fileno(f), &st) != 0 || !S_ISREG(st.st_mode)
+			|| !config_cache_owned(&st)) {
+		sc_log(ctx, "Ignoring the configuration cache not owned by the user");
+		goto out;
+	}
+#endif
+	if (keylen > sizeof(head)
+			|| fread(head, 1, keylen, f) != keylen
+			|| memcmp(head, key, keylen) != 0
+			|| fseek(f, 0, SEEK_END) != 0
+			|| (size = ftell(f)) < 0 || (size_t)size <= keylen
+			|| fseek(f, (long)keylen, SEEK_SET) != 0)
+		goto out;
+	len = (size_t)size - keylen;
+	image = malloc(len);
+	if (image == NULL || fread(image, 1, len, f) != len)
+		goto out;
+	if (scconf_image_load(ctx->conf, image, len)) {
+		image = NULL;
+		r = 1;
+	}
+out:
+	fclose(f);
+	free(image);
+	return r;
+}
+
+static void config_cache_store(sc_context_t *ctx, const char *fname, const char *key)
+{
+	size_t keylen = CONFIG_CACHE_KEYLEN(key), len;
+	unsigned char *image, *buf;
+
+	image = scconf_image_create(ctx->conf, &len);
+	if (image == NULL)
+		return;
+	buf = calloc(1, keylen + len);
+	if (buf != NULL) {
+		strcpy((char *)buf, key);
+		memcpy(buf + keylen, image, len);
+		if (sc_write_cache_file(ctx, fname, buf, keylen + len) != SC_SUCCESS)
+			sc_log(ctx, "Unable to write the configuration cache");
+		free(buf);
+	}
+	free(image);
+}
+
 static void process_config_file(sc_context_t *ctx, struct _sc_ctx_options *opts)
 {
-	int i, r, count = 0;
+	int i, r, count = 0, cache = 0, cacheable;
 	scconf_block **blocks;
 	const char *conf_path = NULL;
 	const char *debug = NULL;
+	char cache_file[PATH_MAX];
+	char cache_key[PATH_MAX + 128];
 #ifdef _WIN32
 	char temp_path[PATH_MAX];
 	size_t temp_len;
@@ -712,7 +883,23 @@ static void process_config_file(sc_context_t *ctx, struct _sc_ctx_options *opts)
 	ctx->conf = scconf_new(conf_path);
 	if (ctx->conf == NULL)
 		return;
-	r = scconf_parse(ctx->conf);
+	/* before parsing, the default cache directory is used */
+	cacheable = config_cache_prepare(ctx, conf_path, cache_file, sizeof(cache_file),
+			cache_key, sizeof(cache_key));
+	if (cacheable)
+		cache = config_cache_load(ctx, cache_file, cache_key);
+	if (cache == 1 && !config_cache_enabled(ctx)) {
+		/* start over, the cache is only used when it is enabled */
+		scconf_free(ctx->conf);
+		ctx->conf = scconf_new(conf_path);
+		if (ctx->conf == NULL)
+			return;
+		cache = -1;
+	}
+	if (cache == 1)
+		r = 1;
+	else
+		r = scconf_parse(ctx->conf);
 #ifdef OPENSC_CONFIG_STRING
 	/* Parse the string if config file didn't exist */
 	if (r < 0)
@@ -746,6 +933,16 @@ static void process_config_file(sc_context_t *ctx, struct _sc_ctx_options *opts)
 	 * so at least one is NULL */
 	for (i = 0; ctx->conf_blocks[i]; i++)
 		load_parameters(ctx, ctx->conf_blocks[i], opts);
+
+	if (cache == 1) {
+		sc_log(ctx, "Configuration loaded from the cache");
+	} else if (ctx->flags & SC_CTX_FLAG_ENABLE_CONFIG_CACHE) {
+		if (cacheable)
+			config_cache_store(ctx, cache_file, cache_key);
+	} else if (cache == -1) {
+		/* the cache was switched off */
+		unlink(cache_file);
+	}
 }
 
 int sc_ctx_detect_readers(sc_context_t *ctx)
@@ -834,13 +1031,168 @@ static int sc_openssl3_init(sc_context_t *ctx)
 	if (ctx->ossl3ctx->legacyprov == NULL) {
 		sc_log(ctx, "Failed to load OpenSSL Legacy provider");
 	}
+	/* without the lock, algorithms are just fetched every time */
+	ctx->ossl3ctx->cache_lock = CRYPTO_THREAD_lock_new();
 	return SC_SUCCESS;
 }
 
+/*
+ * Fetched algorithm cache. Fetching looks up the providers under a lock
+ * of the library context, which is a point of contention when many
+ * threads sign at once. The cache holds a reference to every algorithm
+ * it returned; a name is only fetched again when the cache is full.
+ */
+#define OSSL3_CACHE_MD		0
+#define OSSL3_CACHE_CIPHER	1
+#define OSSL3_CACHE_MAC		2
+
+static struct ossl3ctx_cache *ossl3ctx_cache(ossl3ctx_t *ctx, int kind)
+{
+	switch (kind) {
+	case OSSL3_CACHE_MD:
+		return &ctx->md_cache;
+	case OSSL3_CACHE_CIPHER:
+		return &ctx->cipher_cache;
+	default:
+		return &ctx->mac_cache;
+	}
+}
+
+static void *ossl3ctx_fetch(ossl3ctx_t *ctx, int kind, const char *algorithm)
+{
+	switch (kind) {
+	case OSSL3_CACHE_MD:
+		return EVP_MD_fetch(ctx->libctx, algorithm, NULL);
+	case OSSL3_CACHE_CIPHER:
+		return EVP_CIPHER_fetch(ctx->libctx, algorithm, NULL);
+	default:
+		return EVP_MAC_fetch(ctx->libctx, algorithm, NULL);
+	}
+}
+
+static int ossl3ctx_up_ref(int kind, void *alg)
+{
+	switch (kind) {
+	case OSSL3_CACHE_MD:
+		return EVP_MD_up_ref(alg);
+	case OSSL3_CACHE_CIPHER:
+		return EVP_CIPHER_up_ref(alg);
+	default:
+		return EVP_MAC_up_ref(alg);
+	}
+}
+
+static void ossl3ctx_free(int kind, void *alg)
+{
+	switch (kind) {
+	case OSSL3_CACHE_MD:
+		EVP_MD_free(alg);
+		break;
+	case OSSL3_CACHE_CIPHER:
+		EVP_CIPHER_free(alg);
+		break;
+	default:
+		EVP_MAC_free(alg);
+		break;
+	}
+}
+
+/* Returns a new reference to the cached algorithm or NULL.
+ * Must be called with the cache lock held. */
+static void *ossl3ctx_cache_find(struct ossl3ctx_cache *cache, int kind, const char *algorithm)
+{
+	int i;
+
+	for (i = 0; i < SC_OSSL3_CACHE_SIZE && cache->name[i] != NULL; i++) {
+		if (strcmp(cache->name[i], algorithm) == 0)
+			return ossl3ctx_up_ref(kind, cache->alg[i]) ? cache->alg[i] : NULL;
+	}
+	return NULL;
+}
+
+static void *ossl3ctx_cache_fetch(ossl3ctx_t *ctx, int kind, const char *algorithm)
+{
+	struct ossl3ctx_cache *cache;
+	void *alg, *found = NULL;
+	int i;
+
+	if (ctx == NULL || algorithm == NULL)
+		return NULL;
+	if (ctx->cache_lock == NULL)
+		return ossl3ctx_fetch(ctx, kind, algorithm);
+
+	cache = ossl3ctx_cache(ctx, kind);
+	if (CRYPTO_THREAD_read_lock(ctx->cache_lock)) {
+		found = ossl3ctx_cache_find(cache, kind, algorithm);
+		CRYPTO_THREAD_unlock(ctx->cache_lock);
+		if (found != NULL)
+			return found;
+	}
+
+	/* not cached yet, fetch without holding the lock */
+	alg = ossl3ctx_fetch(ctx, kind, algorithm);
+	if (alg == NULL || !CRYPTO_THREAD_write_lock(ctx->cache_lock))
+		return alg;
+	/* another thread may have been faster */
+	found = ossl3ctx_cache_find(cache, kind, algorithm);
+	if (found == NULL) {
+		for (i = 0; i < SC_OSSL3_CACHE_SIZE && cache->name[i] != NULL; i++)
+			;
+		if (i < SC_OSSL3_CACHE_SIZE && (cache->name[i] = strdup(algorithm)) != NULL) {
+			if (ossl3ctx_up_ref(kind, alg)) {
+				cache->alg[i] = alg;
+			} else {
+				free(cache->name[i]);
+				cache->name[i] = NULL;
+			}
+		}
+	}
+	CRYPTO_THREAD_unlock(ctx->cache_lock);
+	if (found != NULL) {
+		ossl3ctx_free(kind, alg);
+		return found;
+	}
+	return alg;
+}
+
+EVP_MD *sc_ossl3ctx_fetch_md(ossl3ctx_t *ctx, const char *algorithm)
+{
+	return ossl3ctx_cache_fetch(ctx, OSSL3_CACHE_MD, algorithm);
+}
+
+EVP_CIPHER *sc_ossl3ctx_fetch_cipher(ossl3ctx_t *ctx, const char *algorithm)
+{
+	return ossl3ctx_cache_fetch(ctx, OSSL3_CACHE_CIPHER, algorithm);
+}
+
+EVP_MAC *sc_ossl3ctx_fetch_mac(ossl3ctx_t *ctx, const char *algorithm)
+{
+	return ossl3ctx_cache_fetch(ctx, OSSL3_CACHE_MAC, algorithm);
+}
+
+static void ossl3ctx_cache_clear(ossl3ctx_t *ctx)
+{
+	int kind, i;
+
+	for (kind = OSSL3_CACHE_MD; kind <= OSSL3_CACHE_MAC; kind++) {
+		struct ossl3ctx_cache *cache = ossl3ctx_cache(ctx, kind);
+
+		for (i = 0; i < SC_OSSL3_CACHE_SIZE && cache->name[i] != NULL; i++) {
+			ossl3ctx_free(kind, cache->alg[i]);
+			free(cache->name[i]);
+		}
+		memset(cache, 0, sizeof(*cache));
+	}
+	CRYPTO_THREAD_lock_free(ctx->cache_lock);
+	ctx->cache_lock = NULL;
+}
+
 static void sc_openssl3_deinit(sc_context_t *ctx)
 {
 	if (ctx->ossl3ctx == NULL)
 		return;
+	/* the algorithms have to go before their providers */
+	ossl3ctx_cache_clear(ctx->ossl3ctx);
 	if (ctx->ossl3ctx->legacyprov)
 		OSSL_PROVIDER_unload(ctx->ossl3ctx->legacyprov);
 	if (ctx->ossl3ctx->defprov)
@@ -850,6 +1202,22 @@ static void sc_openssl3_deinit(sc_context_t *ctx)
 	free(ctx->ossl3ctx);
 	ctx->ossl3ctx = NULL;
 }
+#else
+
+void *sc_ossl3ctx_fetch_md(ossl3ctx_t *ctx, const char *algorithm)
+{
+	return NULL;
+}
+
+void *sc_ossl3ctx_fetch_cipher(ossl3ctx_t *ctx, const char *algorithm)
+{
+	return NULL;
+}
+
+void *sc_ossl3ctx_fetch_mac(ossl3ctx_t *ctx, const char *algorithm)
+{
+	return NULL;
+}
 #endif
 
 int sc_context_create(sc_context_t **ctx_out, const sc_context_param_t *parm)
@@ -924,6 +1292,9 @@ int sc_context_create(sc_context_t **ctx_out, const sc_context_param_t *parm)
 #elif defined(ENABLE_OPENCT)
 	ctx->reader_driver = sc_get_openct_driver();
 #endif
+	/* A recorded session replaces the real readers */
+	if (_sc_replay_file(ctx) != NULL)
+		ctx->reader_driver = sc_get_replay_driver();
 
 	r = ctx->reader_driver->ops->init(ctx);
 	if (r != SC_SUCCESS)   {
@@ -942,6 +1313,7 @@ int sc_context_create(sc_context_t **ctx_out, const sc_context_param_t *parm)
 
 	load_card_drivers(ctx, &opts);
 	load_card_atrs(ctx);
+	_sc_compile_atr_tables(ctx);
 
 	del_drvs(&opts);
 	sc_ctx_detect_readers(ctx);
@@ -996,6 +1368,10 @@ int sc_release_context(sc_context_t *ctx)
 	if (ctx->reader_driver->ops->finish != NULL)
 		ctx->reader_driver->ops->finish(ctx);
 
+	/* Queued messages point to strings in the drivers, write them out
+	 * before any driver module is unloaded */
+	_sc_log_async_stop(ctx);
+
 	for (i = 0; ctx->card_drivers[i]; i++) {
 		struct sc_card_driver *drv = ctx->card_drivers[i];
 
@@ -1004,6 +1380,7 @@ int sc_release_context(sc_context_t *ctx)
 		if (drv->dll)
 			sc_dlclose(drv->dll);
 	}
+	_sc_free_atr_cache(ctx);
 #ifdef USE_OPENSSL3_LIBCTX
 	sc_openssl3_deinit(ctx);
 #endif
@@ -1145,3 +1522,83 @@ failed:
 	sc_log(ctx, "failed to create cache directory");
 	return SC_ERROR_INTERNAL;
 }
+
+/*
+ * Create a new temporary file next to the cache file. Not mkstemp(), which
+ * creates the file with mode 0600: the mode of the cache files follows
+ * the umask, as for the cache files written in place before.
+ */
+static int cache_open_temp(const char *fname, char *tmpname, size_t tmpsize)
+{
+	static unsigned int counter = 0;
+#ifdef _WIN32
+	unsigned long pid = GetCurrentProcessId();
+#else
+	unsigned long pid = (unsigned long)getpid();
+#endif
+	unsigned int i;
+	int fd, r;
+
+	for (i = 0; i < 100; i++) {
+		r = snprintf(tmpname, tmpsize, "%s.%lu.%u", fname, pid, counter++);
+		if (r < 0 || (size_t)r >= tmpsize)
+			return -1;
+#ifdef _WIN32
+		fd = _open(tmpname, _O_CREAT | _O_EXCL | _O_WRONLY | _O_BINARY, _S_IREAD | _S_IWRITE);
+#else
+		fd = open(tmpname, O_CREAT | O_EXCL | O_WRONLY, 0666);
+#endif
+		/* a name left over by a process with the same pid */
+		if (fd >= 0 || errno != EEXIST)
+			return fd;
+	}
+	return -1;
+}
+
+int sc_write_cache_file(sc_context_t *ctx, const char *fname,
+		const u8 *data, size_t len)
+{
+	char tmpname[PATH_MAX];
+	size_t done = 0;
+	int fd, r;
+
+	fd = cache_open_temp(fname, tmpname, sizeof(tmpname));
+	/* If the open failed because the cache directory does
+	 * not exist, create it and re-try.
+	 */
+	if (fd < 0 && errno == ENOENT) {
+		if ((r = sc_make_cache_dir(ctx)) < 0)
+			return r;
+		fd = cache_open_temp(fname, tmpname, sizeof(tmpname));
+	}
+	if (fd < 0) {
+		r = errno == ENOENT ? SC_ERROR_FILE_NOT_FOUND : SC_ERROR_INTERNAL;
+		sc_log(ctx, "failed to create a temporary file for %s", fname);
+		return r;
+	}
+
+	while (done < len) {
+		r = write(fd, data + done, (unsigned int)(len - done));
+		if (r <= 0)
+			break;
+		done += r;
+	}
+	if (close(fd) != 0 || done != len) {
+		sc_log(ctx,
+			 "write() wrote only %"SC_FORMAT_LEN_SIZE_T"u bytes",
+			 done);
+		unlink(tmpname);
+		return SC_ERROR_INTERNAL;
+	}
+
+	/* Readers in other processes see either the old or the new file */
+#ifdef _WIN32
+	if (!MoveFileExA(tmpname, fname, MOVEFILE_REPLACE_EXISTING)) {
+#else
+	if (rename(tmpname, fname) != 0) {
+#endif
+		unlink(tmpname);
+		return SC_ERROR_INTERNAL;
+	}
+	return SC_SUCCESS;
+}
@@ -84,6 +84,18 @@ int _sc_parse_atr(struct sc_reader *reader);
 /* Add an ATR to the card driver's struct sc_atr_table */
 int _sc_add_atr(struct sc_context *ctx, struct sc_card_driver *driver, struct sc_atr_table *src);
 int _sc_free_atr(struct sc_context *ctx, struct sc_card_driver *driver);
+/* Build the binary form of the configured ATR tables, free all of them */
+void _sc_compile_atr_tables(struct sc_context *ctx);
+void _sc_free_atr_cache(struct sc_context *ctx);
+/* Hand debug messages to a writer thread, wait for it, stop it */
+int _sc_log_async_start(struct sc_context *ctx);
+void _sc_log_async_flush(struct sc_context *ctx);
+void _sc_log_async_pause(struct sc_context *ctx);
+void _sc_log_async_resume(struct sc_context *ctx);
+void _sc_log_async_stop(struct sc_context *ctx);
+/* Atomically replace a file in the cache directory */
+int sc_write_cache_file(struct sc_context *ctx, const char *fname,
+		const u8 *data, size_t len);
 
 /**
  * Convert an unsigned long into 4 bytes in big endian order
@@ -251,6 +263,29 @@ unsigned long sc_thread_id(const sc_context_t *ctx);
 /*             internal APDU handling functions                     */
 /********************************************************************/
 
+/* Largest reader buffers: the longest extended APDU, and a response
+ * buffer of the largest APDU buffer size plus the status word */
+#define SC_READER_SEND_BUFFER_SIZE	(4 + 3 + SC_MAX_EXT_APDU_DATA_SIZE + 2)
+#define SC_READER_RECV_BUFFER_SIZE	(SC_MAX_EXT_APDU_BUFFER_SIZE + 2)
+
+/**
+ * Returns the send and receive buffers of a reader, which are locked in
+ * memory and reused for every APDU, so that the transmit path of a reader
+ * driver does not allocate. They are allocated for the first APDU and
+ * grow only when a longer APDU or response is exchanged. The buffers are
+ * cleared and freed when the reader is deleted; a reader driver should
+ * clear the used parts after each exchange.
+ * @param  reader  sc_reader_t object
+ * @param  ssize   needed size of the send buffer
+ * @param  rsize   needed size of the receive buffer
+ * @param  sbuf    pointer to the send buffer of at least ssize bytes
+ * @param  rbuf    pointer to the receive buffer of at least rsize bytes
+ * @return SC_SUCCESS on success, SC_ERROR_BUFFER_TOO_SMALL if a size is
+ *         above SC_READER_SEND_BUFFER_SIZE or SC_READER_RECV_BUFFER_SIZE
+ *         and an error code otherwise
+ */
+int _sc_reader_get_buffers(sc_reader_t *reader, size_t ssize, size_t rsize,
+		u8 **sbuf, u8 **rbuf);
 /**
  * Returns the encoded APDU in newly created buffer.
  * @param  ctx     sc_context_t object
@@ -272,6 +307,19 @@ int sc_apdu_get_octets(sc_context_t *ctx, const sc_apdu_t *apdu, u8 **buf,
  */
 int sc_apdu_set_resp(sc_context_t *ctx, sc_apdu_t *apdu, const u8 *buf,
 		size_t len);
+/**
+ * Keeps the EF cache of SC_CARD_FLAG_READ_CACHE coherent with the APDU
+ * about to be sent: forgets the selected path on SELECT and drops the
+ * cached contents on commands modifying the card.
+ * @param  card    sc_card_t object
+ * @param  apdu    the apdu to be sent
+ */
+void sc_read_cache_apdu(struct sc_card *card, const sc_apdu_t *apdu);
+/**
+ * Drops all EF contents cached by sc_read_binary()
+ * @param  card    sc_card_t object
+ */
+void sc_invalidate_read_cache(struct sc_card *card);
 /**
  * Logs APDU
  * @param  ctx          sc_context_t object
@@ -286,6 +334,15 @@ extern struct sc_reader_driver *sc_get_pcsc_driver(void);
 extern struct sc_reader_driver *sc_get_ctapi_driver(void);
 extern struct sc_reader_driver *sc_get_openct_driver(void);
 extern struct sc_reader_driver *sc_get_cryptotokenkit_driver(void);
+extern struct sc_reader_driver *sc_get_replay_driver(void);
+
+/* Recording of APDU sessions for the replay reader driver */
+const char *_sc_replay_file(struct sc_context *ctx);
+unsigned long long _sc_replay_time(void);
+FILE *_sc_record_open(struct sc_context *ctx, const char *file);
+void _sc_record_connect(FILE *f, struct sc_reader *reader);
+void _sc_record_apdu(FILE *f, struct sc_reader *reader, const u8 *cmd, size_t cmdlen,
+		const u8 *resp, size_t resplen, unsigned long usec);
 
 #ifdef __cplusplus
 }
@@ -27,6 +27,7 @@
 #include <stdlib.h>
 #include <assert.h>
 #include <ctype.h>
+#include <stdio.h>
 #include <string.h>
 #include <time.h>
 #ifdef HAVE_UNISTD_H
@@ -47,6 +48,19 @@
 
 #include "internal.h"
 
+/* sc_dump_hex() and sc_dump_oid() return a buffer per thread */
+#if defined(_MSC_VER)
+#define SC_THREAD_LOCAL __declspec(thread)
+#elif defined(__STDC_VERSION__) && __STDC_VERSION__ >= 201112L
+#define SC_THREAD_LOCAL _Thread_local
+#elif defined(__GNUC__)
+#define SC_THREAD_LOCAL __thread
+#else
+#define SC_THREAD_LOCAL
+#endif
+
+static const char sc_hex_upper[] = "0123456789ABCDEF";
+
 static void sc_do_log_va(sc_context_t *ctx, int level, const char *file, int line, const char *func, int color, const char *format, va_list args);
 static int sc_color_fprintf_va(int colors, struct sc_context *ctx, FILE * stream, const char *format, va_list args);
 
@@ -73,14 +87,370 @@ void sc_do_log_noframe(sc_context_t *ctx, int level, const char *format, va_list
 	sc_do_log_va(ctx, level, NULL, 0, NULL, 0, format, args);
 }
 
+#if defined(HAVE_PTHREAD) && !defined(_WIN32)
+#define SC_LOG_ASYNC
+#endif
+
+#ifndef _WIN32
+static void log_prefix(sc_context_t *ctx, unsigned long pid, unsigned long thread,
+		const struct timeval *tv)
+{
+	struct tm *tm, tm_buf;
+	char time_string[40];
+	time_t sec = tv->tv_sec;
+
+	sc_color_fprintf(SC_COLOR_FG_GREEN|SC_COLOR_BOLD,
+			ctx, ctx->debug_file,
+			"P:%lu; T:0x%lu",
+			pid, thread);
+	tm = localtime_r(&sec, &tm_buf);
+	if (tm == NULL || strftime(time_string, sizeof(time_string), "%H:%M:%S", tm) == 0)
+		time_string[0] = '\0';
+	sc_color_fprintf(SC_COLOR_FG_GREEN,
+			ctx, ctx->debug_file,
+			" %s.%03ld",
+			time_string,
+			(long)tv->tv_usec / 1000);
+}
+#endif
+
+static void log_location(sc_context_t *ctx, const char *file, int line, const char *func)
+{
+	sc_color_fprintf(SC_COLOR_FG_YELLOW,
+			ctx, ctx->debug_file,
+			" [");
+	sc_color_fprintf(SC_COLOR_FG_YELLOW|SC_COLOR_BOLD,
+			ctx, ctx->debug_file,
+			"%s",
+			ctx->app_name);
+	sc_color_fprintf(SC_COLOR_FG_YELLOW,
+			ctx, ctx->debug_file,
+			"] ");
+
+	if (file != NULL) {
+		sc_color_fprintf(SC_COLOR_FG_YELLOW,
+				ctx, ctx->debug_file,
+				"%s:%d:%s: ",
+				file, line, func ? func : "");
+	}
+}
+
+#ifdef SC_LOG_ASYNC
+/*
+ * Asynchronous logging: the calling thread only formats the message into
+ * a slot of a bounded ring and a writer thread adds the prefix and writes
+ * it to the debug file. The ring is a multi-producer, single-consumer
+ * queue in which every slot carries a sequence number telling whether it
+ * is free for the producer at a position or filled for the consumer, so
+ * producers never block. If the ring is full, the message is dropped and
+ * counted, and the writer reports the number of dropped messages.
+ */
+#define LOG_QUEUE_SLOTS		256	/* power of two */
+#define LOG_RECORD_SIZE		2048
+
+struct log_record {
+	size_t seq;
+	unsigned long thread;
+	struct timeval tv;
+	const char *file;
+	int line;
+	const char *func;
+	int color;
+	char msg[LOG_RECORD_SIZE];
+};
+
+struct sc_log_queue {
+	struct log_record *records;
+	size_t enqueue_pos;
+	size_t dequeue_pos;
+	unsigned long dropped;
+	pid_t pid;
+	int stop;
+	int sleeping;
+	pthread_t writer;
+	pthread_mutex_t lock;
+	/* held by the writer while it uses the debug file */
+	pthread_mutex_t file_lock;
+	pthread_cond_t wake;
+	pthread_cond_t drained;
+};
+
+static int log_queue_push(struct sc_log_queue *q, const char *file, int line, const char *func, int color,
+		const char *format, va_list args)
+{
+	struct log_record *rec;
+	size_t pos, seq;
+	int len;
+
+	/* the writer thread does not exist in a forked child */
+	if (q->pid != getpid())
+		return 0;
+
+	pos = __atomic_load_n(&q->enqueue_pos, __ATOMIC_RELAXED);
+	for (;;) {
+		rec = &q->records[pos & (LOG_QUEUE_SLOTS - 1)];
+		seq = __atomic_load_n(&rec->seq, __ATOMIC_ACQUIRE);
+		if (seq == pos) {
+			if (__atomic_compare_exchange_n(&q->enqueue_pos, &pos, pos + 1,
+					0, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+				break;
+		} else if ((long)(seq - pos) < 0) {
+			__atomic_add_fetch(&q->dropped, 1, __ATOMIC_RELAXED);
+			return 1;
+		} else {
+			pos = __atomic_load_n(&q->enqueue_pos, __ATOMIC_RELAXED);
+		}
+	}
+
+	rec->thread = (unsigned long)pthread_self();
+	gettimeofday(&rec->tv, NULL);
+	rec->file = file;
+	rec->line = line;
+	rec->func = func;
+	rec->color = color;
+	len = vsnprintf(rec->msg, sizeof(rec->msg), format, args);
+	if (len < 0) {
+		rec->msg[0] = '\0';
+	} else if ((size_t)len >= sizeof(rec->msg)) {
+		/* mark the truncation */
+		memcpy(rec->msg + sizeof(rec->msg) - 5, "...\n", 5);
+	}
+	__atomic_store_n(&rec->seq, pos + 1, __ATOMIC_RELEASE);
+
+	/* pairs with the check in log_writer() before it goes to sleep */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&q->sleeping, __ATOMIC_RELAXED)) {
+		pthread_mutex_lock(&q->lock);
+		pthread_cond_signal(&q->wake);
+		pthread_mutex_unlock(&q->lock);
+	}
+	return 1;
+}
+
+static int log_queue_ready(struct sc_log_queue *q)
+{
+	size_t pos = __atomic_load_n(&q->dequeue_pos, __ATOMIC_RELAXED);
+	struct log_record *rec = &q->records[pos & (LOG_QUEUE_SLOTS - 1)];
+
+	return __atomic_load_n(&rec->seq, __ATOMIC_ACQUIRE) == pos + 1;
+}
+
+/* Write all queued records, returns the number of records written */
+static size_t log_queue_drain(sc_context_t *ctx, struct sc_log_queue *q,
+		unsigned long *reported)
+{
+	size_t pos, n = 0, len;
+	struct log_record *rec;
+	unsigned long dropped;
+
+	while (log_queue_ready(q)) {
+		pos = __atomic_load_n(&q->dequeue_pos, __ATOMIC_RELAXED);
+		rec = &q->records[pos & (LOG_QUEUE_SLOTS - 1)];
+
+		if (ctx->debug_file != NULL) {
+			dropped = __atomic_load_n(&q->dropped, __ATOMIC_RELAXED);
+			if (dropped != *reported) {
+				fprintf(ctx->debug_file, "[%lu log messages dropped]\n",
+						dropped - *reported);
+				*reported = dropped;
+			}
+			log_prefix(ctx, (unsigned long)q->pid, rec->thread, &rec->tv);
+			log_location(ctx, rec->file, rec->line, rec->func);
+			sc_color_fprintf(rec->color, ctx, ctx->debug_file, "%s", rec->msg);
+			len = strlen(rec->msg);
+			if (len == 0 || rec->msg[len - 1] != '\n')
+				sc_color_fprintf(rec->color, ctx, ctx->debug_file, "\n");
+		}
+
+		__atomic_store_n(&rec->seq, pos + LOG_QUEUE_SLOTS, __ATOMIC_RELEASE);
+		__atomic_store_n(&q->dequeue_pos, pos + 1, __ATOMIC_RELEASE);
+		n++;
+	}
+	if (n > 0 && ctx->debug_file != NULL)
+		fflush(ctx->debug_file);
+	return n;
+}
+
+static void *log_writer(void *arg)
+{
+	sc_context_t *ctx = arg;
+	struct sc_log_queue *q = ctx->log_queue;
+	unsigned long reported = 0;
+	struct timespec ts;
+	struct timeval now;
+
+	for (;;) {
+		size_t n;
+
+		pthread_mutex_lock(&q->file_lock);
+		n = log_queue_drain(ctx, q, &reported);
+		pthread_mutex_unlock(&q->file_lock);
+
+		pthread_mutex_lock(&q->lock);
+		if (n > 0)
+			pthread_cond_broadcast(&q->drained);
+		if (q->stop && !log_queue_ready(q)) {
+			pthread_mutex_unlock(&q->lock);
+			break;
+		}
+		if (n == 0) {
+			__atomic_store_n(&q->sleeping, 1, __ATOMIC_RELAXED);
+			__atomic_thread_fence(__ATOMIC_SEQ_CST);
+			if (!q->stop && !log_queue_ready(q)) {
+				/* the timeout only covers a missed wakeup */
+				gettimeofday(&now, NULL);
+				ts.tv_sec = now.tv_sec + 1;
+				ts.tv_nsec = now.tv_usec * 1000;
+				pthread_cond_timedwait(&q->wake, &q->lock, &ts);
+			}
+			__atomic_store_n(&q->sleeping, 0, __ATOMIC_RELAXED);
+		}
+		pthread_mutex_unlock(&q->lock);
+	}
+
+	pthread_mutex_lock(&q->file_lock);
+	if (ctx->debug_file != NULL && q->dropped != reported) {
+		fprintf(ctx->debug_file, "[%lu log messages dropped]\n", q->dropped - reported);
+		fflush(ctx->debug_file);
+	}
+	pthread_mutex_unlock(&q->file_lock);
+	return NULL;
+}
+
+int _sc_log_async_start(sc_context_t *ctx)
+{
+	struct sc_log_queue *q;
+	size_t i;
+
+	if (ctx == NULL)
+		return SC_ERROR_INVALID_ARGUMENTS;
+	if (ctx->log_queue != NULL)
+		return SC_SUCCESS;
+
+	q = calloc(1, sizeof(struct sc_log_queue));
+	if (q == NULL)
+		return SC_ERROR_OUT_OF_MEMORY;
+	q->records = calloc(LOG_QUEUE_SLOTS, sizeof(struct log_record));
+	if (q->records == NULL) {
+		free(q);
+		return SC_ERROR_OUT_OF_MEMORY;
+	}
+	for (i = 0; i < LOG_QUEUE_SLOTS; i++)
+		q->records[i].seq = i;
+	q->pid = getpid();
+	pthread_mutex_init(&q->lock, NULL);
+	pthread_mutex_init(&q->file_lock, NULL);
+	pthread_cond_init(&q->wake, NULL);
+	pthread_cond_init(&q->drained, NULL);
+
+	ctx->log_queue = q;
+	if (pthread_create(&q->writer, NULL, log_writer, ctx) != 0) {
+		ctx->log_queue = NULL;
+		pthread_cond_destroy(&q->drained);
+		pthread_cond_destroy(&q->wake);
+		pthread_mutex_destroy(&q->file_lock);
+		pthread_mutex_destroy(&q->lock);
+		free(q->records);
+		free(q);
+		return SC_ERROR_INTERNAL;
+	}
+	return SC_SUCCESS;
+}
+
+void _sc_log_async_flush(sc_context_t *ctx)
+{
+	struct sc_log_queue *q;
+	size_t target;
+
+	if (ctx == NULL || (q = ctx->log_queue) == NULL || q->pid != getpid())
+		return;
+
+	target = __atomic_load_n(&q->enqueue_pos, __ATOMIC_ACQUIRE);
+	pthread_mutex_lock(&q->lock);
+	while ((long)(__atomic_load_n(&q->dequeue_pos, __ATOMIC_ACQUIRE) - target) < 0) {
+		pthread_cond_signal(&q->wake);
+		pthread_cond_wait(&q->drained, &q->lock);
+	}
+	pthread_mutex_unlock(&q->lock);
+}
+
+/*
+ * Write out the queued messages and keep the writer away from the debug
+ * file until _sc_log_async_resume(), so that the file can be replaced.
+ */
+void _sc_log_async_pause(sc_context_t *ctx)
+{
+	struct sc_log_queue *q;
+
+	if (ctx == NULL || (q = ctx->log_queue) == NULL || q->pid != getpid())
+		return;
+
+	_sc_log_async_flush(ctx);
+	pthread_mutex_lock(&q->file_lock);
+}
+
+void _sc_log_async_resume(sc_context_t *ctx)
+{
+	struct sc_log_queue *q;
+
+	if (ctx == NULL || (q = ctx->log_queue) == NULL || q->pid != getpid())
+		return;
+
+	pthread_mutex_unlock(&q->file_lock);
+}
+
+void _sc_log_async_stop(sc_context_t *ctx)
+{
+	struct sc_log_queue *q;
+
+	if (ctx == NULL || (q = ctx->log_queue) == NULL)
+		return;
+
+	if (q->pid == getpid()) {
+		/* the writer drains the ring before it exits */
+		pthread_mutex_lock(&q->lock);
+		q->stop = 1;
+		pthread_cond_signal(&q->wake);
+		pthread_mutex_unlock(&q->lock);
+		pthread_join(q->writer, NULL);
+	}
+	ctx->log_queue = NULL;
+	pthread_cond_destroy(&q->drained);
+	pthread_cond_destroy(&q->wake);
+	pthread_mutex_destroy(&q->file_lock);
+	pthread_mutex_destroy(&q->lock);
+	free(q->records);
+	free(q);
+}
+#else
+int _sc_log_async_start(sc_context_t *ctx)
+{
+	return SC_ERROR_NOT_SUPPORTED;
+}
+
+void _sc_log_async_flush(sc_context_t *ctx)
+{
+}
+
+void _sc_log_async_pause(sc_context_t *ctx)
+{
+}
+
+void _sc_log_async_resume(sc_context_t *ctx)
+{
+}
+
+void _sc_log_async_stop(sc_context_t *ctx)
+{
+}
+#endif
+
 static void sc_do_log_va(sc_context_t *ctx, int level, const char *file, int line, const char *func, int color, const char *format, va_list args)
 {
 #ifdef _WIN32
 	SYSTEMTIME st;
 #else
-	struct tm *tm;
 	struct timeval tv;
-	char time_string[40];
 #endif
 
 	if (!ctx || ctx->debug < level)
@@ -96,6 +466,12 @@ static void sc_do_log_va(sc_context_t *ctx, int level, const char *file, int lin
 	if (ctx->debug_file == NULL)
 		return;
 
+#ifdef SC_LOG_ASYNC
+	if (ctx->log_queue != NULL
+			&& log_queue_push(ctx->log_queue, file, line, func, color, format, args))
+		return;
+#endif
+
 #ifdef _WIN32
 	GetLocalTime(&st);
 	sc_color_fprintf(SC_COLOR_FG_GREEN|SC_COLOR_BOLD,
@@ -109,38 +485,11 @@ static void sc_do_log_va(sc_context_t *ctx, int level, const char *file, int lin
 			st.wYear, st.wMonth, st.wDay,
 			st.wHour, st.wMinute, st.wSecond, st.wMilliseconds);
 #else
-	sc_color_fprintf(SC_COLOR_FG_GREEN|SC_COLOR_BOLD,
-			ctx, ctx->debug_file,
-			"P:%lu; T:0x%lu",
-			(unsigned long)getpid(),
-			(unsigned long)pthread_self());
 	gettimeofday (&tv, NULL);
-	tm = localtime (&tv.tv_sec);
-	strftime (time_string, sizeof(time_string), "%H:%M:%S", tm);
-	sc_color_fprintf(SC_COLOR_FG_GREEN,
-			ctx, ctx->debug_file,
-			" %s.%03ld",
-			time_string,
-			(long)tv.tv_usec / 1000);
+	log_prefix(ctx, (unsigned long)getpid(), (unsigned long)pthread_self(), &tv);
 #endif
 
-	sc_color_fprintf(SC_COLOR_FG_YELLOW,
-			ctx, ctx->debug_file,
-			" [");
-	sc_color_fprintf(SC_COLOR_FG_YELLOW|SC_COLOR_BOLD,
-			ctx, ctx->debug_file,
-			"%s",
-			ctx->app_name);
-	sc_color_fprintf(SC_COLOR_FG_YELLOW,
-			ctx, ctx->debug_file,
-			"] ");
-
-	if (file != NULL) {
-		sc_color_fprintf(SC_COLOR_FG_YELLOW,
-				ctx, ctx->debug_file,
-				"%s:%d:%s: ",
-				file, line, func ? func : "");
-	}
+	log_location(ctx, file, line, func);
 
 	sc_color_fprintf_va(color, ctx, ctx->debug_file, format, args);
 	if (strlen(format) == 0 || format[strlen(format) - 1] != '\n')
@@ -317,64 +666,58 @@ void sc_hex_dump(const u8 * in, size_t count, char *buf, size_t len)
 		return;
 	}
 	buf[0] = 0;
-	if ((count * 5) > len)
+	/* 65 characters per line, but the first one is not padded */
+	if ((count <= 16 ? count * 4 + 1 : (count + 15) / 16 * 65) >= len)
 		return;
 	while (count) {
-		char ascbuf[17];
-		size_t i;
-
-		for (i = 0; i < count && i < 16; i++) {
-			sprintf(p, "%02X ", *in);
-			if (isprint(*in))
-				ascbuf[i] = *in;
-			else
-				ascbuf[i] = '.';
-			p += 3;
-			in++;
+		char ascbuf[16];
+		size_t i, n = count < 16 ? count : 16;
+
+		for (i = 0; i < n; i++) {
+			*p++ = sc_hex_upper[in[i] >> 4];
+			*p++ = sc_hex_upper[in[i] & 0xF];
+			*p++ = ' ';
+			ascbuf[i] = isprint(in[i]) ? in[i] : '.';
 		}
-		count -= i;
-		ascbuf[i] = 0;
+		in += n;
+		count -= n;
+		/* the first line is never padded */
 		for (; i < 16 && lines; i++) {
-			strcat(p, "   ");
+			memcpy(p, "   ", 3);
 			p += 3;
 		}
-		strcat(p, ascbuf);
-		p += strlen(p);
-		sprintf(p, "\n");
-		p++;
+		memcpy(p, ascbuf, n);
+		p += n;
+		*p++ = '\n';
 		lines++;
 	}
+	*p = '\0';
 }
 
 const char *
 sc_dump_hex(const u8 * in, size_t count)
 {
-	static char dump_buf[0x1000];
+	static SC_THREAD_LOCAL char dump_buf[0x1000];
 	size_t ii, size = sizeof(dump_buf) - 0x10;
-	size_t offs = 0;
+	char *p = dump_buf;
 
-	memset(dump_buf, 0, sizeof(dump_buf));
+	dump_buf[0] = '\0';
 	if (in == NULL)
 		return dump_buf;
 
 	for (ii=0; ii<count; ii++) {
-		if (ii && !(ii%16))   {
-			if (!(ii%48))
-				snprintf(dump_buf + offs, size - offs, "\n");
-			else
-				snprintf(dump_buf + offs, size - offs, " ");
-			offs = strlen(dump_buf);
-		}
-
-		snprintf(dump_buf + offs, size - offs, "%02X", *(in + ii));
-		offs += 2;
-
-		if (offs > size)
+		/* a separator and the byte must fit, "....\n" goes into the rest */
+		if ((size_t)(p - dump_buf) + 3 > size)
 			break;
+		if (ii && !(ii%16))
+			*p++ = (ii%48) ? ' ' : '\n';
+		*p++ = sc_hex_upper[in[ii] >> 4];
+		*p++ = sc_hex_upper[in[ii] & 0xF];
 	}
+	*p = '\0';
 
 	if (ii<count)
-		snprintf(dump_buf + offs, sizeof(dump_buf) - offs, "....\n");
+		strcpy(p, "....\n");
 
 	return dump_buf;
 }
@@ -382,7 +725,7 @@ sc_dump_hex(const u8 * in, size_t count)
 const char *
 sc_dump_oid(const struct sc_object_id *oid)
 {
-	static char dump_buf[SC_MAX_OBJECT_ID_OCTETS * 20];
+	static SC_THREAD_LOCAL char dump_buf[SC_MAX_OBJECT_ID_OCTETS * 20];
         size_t ii;
 
 	memset(dump_buf, 0, sizeof(dump_buf));
@@ -344,6 +344,8 @@ struct sc_ef_atr {
 	unsigned status;
 };
 
+struct sc_cached_ef;
+
 struct sc_card_cache {
 	struct sc_path current_path;
 
@@ -351,6 +353,12 @@ struct sc_card_cache {
         struct sc_file *current_df;
 
 	int valid;
+
+	/* Path last selected by sc_select_file() and EF contents read by
+	 * sc_read_binary(), used with SC_CARD_FLAG_READ_CACHE */
+	struct sc_path selected_path;
+	struct sc_cached_ef *ef_list;
+	size_t ef_size;
 };
 
 #define SC_PROTO_T0		0x00000001
@@ -410,6 +418,11 @@ typedef struct sc_reader {
 		int Fi, f, Di, N;
 		u8 FI, DI;
 	} atr_info;
+
+	/* send and receive buffers of the reader driver and their sizes,
+	 * see _sc_reader_get_buffers() */
+	u8 *apdu_buffers;
+	size_t apdu_send_size, apdu_recv_size;
 } sc_reader_t;
 
 /* This will be the new interface for handling PIN commands.
@@ -518,6 +531,11 @@ struct sc_reader_operations {
 	int (*reset)(struct sc_reader *, int);
 	/* Used to pass in PC/SC handles to minidriver */
 	int (*use_reader)(struct sc_context *ctx, void *pcsc_context_handle, void *pcsc_card_handle);
+	/* Send count APDUs in order, if possible in one exchange with the
+	 * reader, stopping after the first response other than 90 00.
+	 * done is set to the number of APDUs with a response. */
+	int (*transmit_batch)(struct sc_reader *reader, sc_apdu_t *apdus,
+			size_t count, size_t *done);
 };
 
 /*
@@ -538,6 +556,10 @@ struct sc_reader_operations {
 /* Hint SC_CARD_CAP_RNG */
 #define SC_CARD_FLAG_RNG		0x00000002
 #define SC_CARD_FLAG_KEEP_ALIVE	0x00000004
+/* Keep the EF contents read with sc_read_binary() in memory until the
+ * card cache is invalidated or anything is written to the card. Only for
+ * cards selecting files exclusively through sc_select_file() */
+#define SC_CARD_FLAG_READ_CACHE	0x00000008
 
 /*
  * Card capabilities
@@ -866,9 +888,14 @@ typedef struct {
 #define SC_CTX_FLAG_ENABLE_DEFAULT_DRIVER	0x00000008
 #define SC_CTX_FLAG_DISABLE_POPUPS			0x00000010
 #define SC_CTX_FLAG_DISABLE_COLORS			0x00000020
+#define SC_CTX_FLAG_ENABLE_PROBE_CACHE		0x00000040
+#define SC_CTX_FLAG_ENABLE_CONFIG_CACHE		0x00000080
 
 typedef struct ossl3ctx ossl3ctx_t;
 
+struct sc_atr_cache;
+struct sc_log_queue;
+
 typedef struct sc_context {
 	scconf_context *conf;
 	scconf_block *conf_blocks[3];
@@ -896,6 +923,10 @@ typedef struct sc_context {
 #endif
 
 	unsigned int magic;
+
+	/* binary form of the ATR tables used for matching, see card.c */
+	struct sc_atr_cache *atr_cache;
+	struct sc_log_queue *log_queue;
 } sc_context_t;
 
 /* APDU handling functions */
@@ -907,6 +938,20 @@ typedef struct sc_context {
  */
 int sc_transmit_apdu(struct sc_card *card, struct sc_apdu *apdu);
 
+/** Sends a sequence of APDUs to the card while holding the card lock once.
+ *  All APDUs are checked before the first one is sent and the sequence
+ *  stops at the first APDU which fails or whose status words are an
+ *  error according to sc_check_sw().
+ *  @param  card   struct sc_card object to which the APDUs should be send
+ *  @param  apdus  array of count APDUs
+ *  @param  count  number of APDUs
+ *  @param  done   if not NULL, receives the number of APDUs with a response,
+ *                 including a last one with error status words
+ *  @return SC_SUCCESS on success and an error code otherwise
+ */
+int sc_transmit_apdu_batch(struct sc_card *card, struct sc_apdu *apdus,
+		size_t count, size_t *done);
+
 void sc_format_apdu(struct sc_card *card, struct sc_apdu *apdu,
 		int cse, int ins, int p1, int p2);
 
@@ -1576,8 +1621,32 @@ int sc_base64_decode(const char *in, u8 *out, size_t outlen);
  * @param  len  length of the memory buffer
  */
 void sc_mem_clear(void *ptr, size_t len);
+/**
+ * Allocates zeroed memory for secrets that is kept out of swap. Small
+ * buffers come from a pool of locked pages, larger ones are locked on
+ * their own.
+ * @param  len  length of the memory buffer
+ */
 void *sc_mem_secure_alloc(size_t len);
+/**
+ * Frees memory from sc_mem_secure_alloc(). Pool buffers are zeroized.
+ * @param  ptr  pointer to the memory buffer
+ * @param  len  length of the memory buffer as allocated
+ */
 void sc_mem_secure_free(void *ptr, size_t len);
+
+struct sc_mem_secure_stats {
+	size_t slabs;		/* slabs of the pool */
+	size_t locked;		/* bytes of the pool locked in memory */
+	size_t in_use;		/* buffers currently allocated from the pool */
+	size_t allocations;	/* buffers ever allocated from the pool */
+	size_t lock_failures;	/* slabs that could not be locked */
+};
+/**
+ * Returns statistics of the pool behind sc_mem_secure_alloc()
+ * @param  stats  receives the statistics
+ */
+void sc_mem_secure_get_stats(struct sc_mem_secure_stats *stats);
 #define sc_mem_secure_clear_free(ptr, len) do { \
 	sc_mem_clear(ptr, len); \
 	sc_mem_secure_free(ptr, len); \
@@ -28,89 +28,695 @@
 #ifdef HAVE_UNISTD_H
 #include <unistd.h>
 #endif
+#include <sys/types.h>
 #include <sys/stat.h>
+#include <fcntl.h>
 #include <limits.h>
 #include <errno.h>
 #include <assert.h>
+#include <ctype.h>
+#ifdef _WIN32
+#include <windows.h>
+#include <io.h>
+#else
+#include <dirent.h>
+#include <sys/file.h>
+#endif
+#ifdef HAVE_SYS_MMAN_H
+#include <sys/mman.h>
+#endif
 
 #include "internal.h"
 #include "pkcs15.h"
 #include "common/compat_strlcpy.h"
 
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
+
+/*
+ * All files cached for one token are kept in a single cache file named
+ * after the token serial number and the lastUpdate field of TokenInfo.
+ * The file starts with a header and a table of entries sorted by key,
+ * followed by the file contents:
+ *
+ *   magic[8] | u32 entry count | u32 file size
+ *   entry: key[CACHE_KEY_SIZE] | u32 offset | u32 length
+ *
+ * Integers are big-endian. The cache file is mapped read-only into memory
+ * and shared between the processes using the token. Updates write a new
+ * cache file and atomically rename it over the old one, so a mapped file
+ * is never modified.
+ *
+ * Files cached while binding the card are collected in memory and
+ * written with a single update by sc_pkcs15_cache_flush(). The update
+ * holds a lock on a file in the cache directory while it merges the
+ * entries into the cache file, so concurrent updates do not lose entries.
+ */
+#define CACHE_MAGIC		"OSCP15C1"
+#define CACHE_MAGIC_SIZE	8
+#define CACHE_HEADER_SIZE	(CACHE_MAGIC_SIZE + 8)
+#define CACHE_KEY_SIZE		88
+#define CACHE_ENTRY_SIZE	(CACHE_KEY_SIZE + 8)
+#define CACHE_MAX_ENTRIES	4096
+
+struct sc_pkcs15_cache_entry {
+	char key[CACHE_KEY_SIZE];
+	u8 *data;
+	size_t len;
+};
+
+struct sc_pkcs15_file_cache {
+	char fname[PATH_MAX];
+	u8 *data;
+	size_t len;
+	int mapped;
+	/* identity of the loaded file, to notice its replacement */
+	struct stat st;
+
+	/* entries not yet written to the cache file pending_fname */
+	char pending_fname[PATH_MAX];
+	struct sc_pkcs15_cache_entry *pending;
+	size_t pending_count;
+	/* files of older versions imported into the pending entries */
+	char **migrated;
+	size_t migrated_count;
+	int migration_done;
+};
+
 #define RANDOM_UID_INDICATOR 0x08
 static int generate_cache_filename(struct sc_pkcs15_card *p15card,
-				   const sc_path_t *path,
 				   char *buf, size_t bufsize)
 {
 	char dir[PATH_MAX];
 	char *last_update = NULL;
 	int  r;
-	unsigned u;
 
 	if (p15card->tokeninfo->serial_number == NULL
 			&& (p15card->card->uid.len == 0
 				|| p15card->card->uid.value[0] == RANDOM_UID_INDICATOR))
 		return SC_ERROR_INVALID_ARGUMENTS;
 
-	assert(path->len <= SC_MAX_PATH_SIZE);
 	r = sc_get_cache_dir(p15card->card->ctx, dir, sizeof(dir));
 	if (r)
 		return r;
-	snprintf(dir + strlen(dir), sizeof(dir) - strlen(dir), "/");
 
 	last_update = sc_pkcs15_get_lastupdate(p15card);
 	if (!last_update)
 		last_update = "NODATE";
 
-	if (p15card->tokeninfo->serial_number) {
-		snprintf(dir + strlen(dir), sizeof(dir) - strlen(dir),
-				"%s_%s", p15card->tokeninfo->serial_number,
+	if (p15card->tokeninfo->serial_number)
+		r = snprintf(buf, bufsize, "%s/%s_%s", dir,
+				p15card->tokeninfo->serial_number, last_update);
+	else
+		r = snprintf(buf, bufsize, "%s/uid-%s_%s", dir,
+				sc_dump_hex(p15card->card->uid.value, p15card->card->uid.len),
 				last_update);
-	} else {
-		snprintf(dir + strlen(dir), sizeof(dir) - strlen(dir),
-				"uid-%s_%s", sc_dump_hex(
-					p15card->card->uid.value,
-					p15card->card->uid.len), last_update);
-	}
+	if (r < 0 || (size_t)r >= bufsize)
+		return SC_ERROR_BUFFER_TOO_SMALL;
+
+	return SC_SUCCESS;
+}
 
+static int generate_cache_key(const sc_path_t *path, char *key)
+{
+	size_t offs = 0, n = 0;
+
+	assert(path->len <= SC_MAX_PATH_SIZE);
+
+	memset(key, 0, CACHE_KEY_SIZE);
 	if (path->aid.len &&
 		(path->type == SC_PATH_TYPE_FILE_ID || path->type == SC_PATH_TYPE_PATH))   {
-		snprintf(dir + strlen(dir), sizeof(dir) - strlen(dir), "_");
-		for (u = 0; u < path->aid.len; u++)
-			snprintf(dir + strlen(dir), sizeof(dir) - strlen(dir),
-					"%02X",  path->aid.value[u]);
+		sc_bin_to_hex(path->aid.value, path->aid.len, key, CACHE_KEY_SIZE, 0);
+		n = strlen(key);
 	}
 	else if (path->type != SC_PATH_TYPE_PATH)  {
 		return SC_ERROR_INVALID_ARGUMENTS;
 	}
 
-	if (path->len)   {
-		size_t offs = 0;
+	key[n++] = '_';
+	if (path->len > 2 && memcmp(path->value, "\x3F\x00", 2) == 0)
+		offs = 2;
+	if (path->len > offs)
+		sc_bin_to_hex(path->value + offs, path->len - offs, key + n, CACHE_KEY_SIZE - n, 0);
+
+	return SC_SUCCESS;
+}
+
+static unsigned int cache_get_u32(const u8 *p)
+{
+	return ((unsigned int)p[0] << 24) | ((unsigned int)p[1] << 16)
+		| ((unsigned int)p[2] << 8) | p[3];
+}
+
+static void cache_put_u32(u8 *p, size_t v)
+{
+	p[0] = (v >> 24) & 0xFF;
+	p[1] = (v >> 16) & 0xFF;
+	p[2] = (v >> 8) & 0xFF;
+	p[3] = v & 0xFF;
+}
+
+static void cache_unload(struct sc_pkcs15_file_cache *cache)
+{
+	if (cache->data == NULL)
+		return;
+#ifdef HAVE_SYS_MMAN_H
+	if (cache->mapped)
+		munmap(cache->data, cache->len);
+	else
+#endif
+		free(cache->data);
+	cache->data = NULL;
+	cache->len = 0;
+	cache->mapped = 0;
+}
+
+static int cache_is_valid(const u8 *data, size_t len)
+{
+	size_t count, ii;
+
+	if (len < CACHE_HEADER_SIZE || memcmp(data, CACHE_MAGIC, CACHE_MAGIC_SIZE) != 0)
+		return 0;
+	count = cache_get_u32(data + CACHE_MAGIC_SIZE);
+	if (cache_get_u32(data + CACHE_MAGIC_SIZE + 4) != len
+			|| count > CACHE_MAX_ENTRIES
+			|| CACHE_HEADER_SIZE + count * CACHE_ENTRY_SIZE > len)
+		return 0;
+	for (ii = 0; ii < count; ii++) {
+		const u8 *e = data + CACHE_HEADER_SIZE + ii * CACHE_ENTRY_SIZE;
+		size_t offset = cache_get_u32(e + CACHE_KEY_SIZE);
+		size_t length = cache_get_u32(e + CACHE_KEY_SIZE + 4);
 
-		if (path->len > 2 && memcmp(path->value, "\x3F\x00", 2) == 0)
-			offs = 2;
-		snprintf(dir + strlen(dir), sizeof(dir) - strlen(dir), "_");
-		for (u = 0; u < path->len - offs; u++)
-			snprintf(dir + strlen(dir), sizeof(dir) - strlen(dir),
-					"%02X",  path->value[u + offs]);
+		if (e[CACHE_KEY_SIZE - 1] != '\0' || offset > len || length > len - offset)
+			return 0;
 	}
+	return 1;
+}
 
-	if (!buf)
-		return SC_ERROR_BUFFER_TOO_SMALL;
-	strlcpy(buf, dir, bufsize);
+static struct sc_pkcs15_file_cache *cache_get(struct sc_pkcs15_card *p15card)
+{
+	if (p15card->file_cache == NULL)
+		p15card->file_cache = calloc(1, sizeof(struct sc_pkcs15_file_cache));
+	return p15card->file_cache;
+}
 
+/*
+ * Make sure the current cache file of the token is loaded.
+ * The file is reloaded when it was replaced since it was loaded.
+ */
+static struct sc_pkcs15_file_cache *
+cache_load(struct sc_pkcs15_card *p15card, const char *fname)
+{
+	struct sc_pkcs15_file_cache *cache = p15card->file_cache;
+	struct stat st;
+	u8 *data = NULL;
+	int fd, mapped = 0;
+
+	if (stat(fname, &st) != 0 || st.st_size < CACHE_HEADER_SIZE || st.st_size > UINT_MAX) {
+		if (cache)
+			cache_unload(cache);
+		return NULL;
+	}
+
+	if (cache == NULL) {
+		cache = cache_get(p15card);
+		if (cache == NULL)
+			return NULL;
+	}
+	else if (cache->data != NULL && strcmp(cache->fname, fname) == 0
+			&& cache->st.st_dev == st.st_dev && cache->st.st_ino == st.st_ino
+			&& cache->st.st_size == st.st_size && cache->st.st_mtime == st.st_mtime) {
+		return cache;
+	}
+	cache_unload(cache);
+
+	fd = open(fname, O_RDONLY | O_BINARY);
+	if (fd < 0)
+		return NULL;
+	if (fstat(fd, &st) != 0 || st.st_size < CACHE_HEADER_SIZE || st.st_size > UINT_MAX) {
+		close(fd);
+		return NULL;
+	}
+
+#ifdef HAVE_SYS_MMAN_H
+	data = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	if (data == MAP_FAILED)
+		data = NULL;
+	else
+		mapped = 1;
+#endif
+	if (data == NULL) {
+		size_t done = 0;
+
+		data = malloc((size_t)st.st_size);
+		while (data != NULL && done < (size_t)st.st_size) {
+			int r = read(fd, data + done, (unsigned int)((size_t)st.st_size - done));
+			if (r <= 0) {
+				free(data);
+				data = NULL;
+				break;
+			}
+			done += r;
+		}
+	}
+	close(fd);
+	if (data == NULL)
+		return NULL;
+
+	cache->data = data;
+	cache->len = (size_t)st.st_size;
+	cache->mapped = mapped;
+	cache->st = st;
+	strlcpy(cache->fname, fname, sizeof(cache->fname));
+
+	if (!cache_is_valid(cache->data, cache->len)) {
+		sc_log(p15card->card->ctx, "ignoring invalid cache file %s", fname);
+		cache_unload(cache);
+		return NULL;
+	}
+	return cache;
+}
+
+/* Returns the entry with the given key, or NULL */
+static const u8 *
+cache_find_entry(const struct sc_pkcs15_file_cache *cache, const char *key)
+{
+	size_t lo = 0, hi = cache_get_u32(cache->data + CACHE_MAGIC_SIZE);
+
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		const u8 *e = cache->data + CACHE_HEADER_SIZE + mid * CACHE_ENTRY_SIZE;
+		int cmp = strncmp(key, (const char *)e, CACHE_KEY_SIZE);
+
+		if (cmp == 0)
+			return e;
+		if (cmp < 0)
+			hi = mid;
+		else
+			lo = mid + 1;
+	}
+	return NULL;
+}
+
+/* Returns the pending entry with the given key, or NULL */
+static struct sc_pkcs15_cache_entry *
+cache_find_pending(struct sc_pkcs15_file_cache *cache, const char *fname, const char *key)
+{
+	size_t ii;
+
+	if (strcmp(cache->pending_fname, fname) != 0)
+		return NULL;
+	for (ii = 0; ii < cache->pending_count; ii++)
+		if (strncmp(cache->pending[ii].key, key, CACHE_KEY_SIZE) == 0)
+			return &cache->pending[ii];
+	return NULL;
+}
+
+static void cache_pending_clear(struct sc_pkcs15_file_cache *cache)
+{
+	size_t ii;
+
+	for (ii = 0; ii < cache->pending_count; ii++)
+		free(cache->pending[ii].data);
+	free(cache->pending);
+	cache->pending = NULL;
+	cache->pending_count = 0;
+	for (ii = 0; ii < cache->migrated_count; ii++)
+		free(cache->migrated[ii]);
+	free(cache->migrated);
+	cache->migrated = NULL;
+	cache->migrated_count = 0;
+}
+
+/* Make the pending entries refer to the given cache file */
+static void cache_use_file(struct sc_pkcs15_card *p15card,
+		struct sc_pkcs15_file_cache *cache, const char *fname)
+{
+	if (strcmp(cache->pending_fname, fname) == 0)
+		return;
+	if (cache->pending_count)
+		sc_pkcs15_cache_flush(p15card);
+	cache_pending_clear(cache);
+	strlcpy(cache->pending_fname, fname, sizeof(cache->pending_fname));
+	cache->migration_done = 0;
+}
+
+static int cache_add_pending(struct sc_pkcs15_file_cache *cache, const char *key,
+		const u8 *buf, size_t bufsize, int replace)
+{
+	struct sc_pkcs15_cache_entry *entry, *tmp;
+	u8 *data;
+
+	entry = cache_find_pending(cache, cache->pending_fname, key);
+	if (entry != NULL && !replace)
+		return SC_SUCCESS;
+	if (entry == NULL && cache->pending_count >= CACHE_MAX_ENTRIES)
+		return SC_ERROR_NOT_ENOUGH_MEMORY;
+
+	data = malloc(bufsize ? bufsize : 1);
+	if (data == NULL)
+		return SC_ERROR_OUT_OF_MEMORY;
+	if (bufsize)
+		memcpy(data, buf, bufsize);
+
+	if (entry == NULL) {
+		tmp = realloc(cache->pending, (cache->pending_count + 1) * sizeof(*tmp));
+		if (tmp == NULL) {
+			free(data);
+			return SC_ERROR_OUT_OF_MEMORY;
+		}
+		cache->pending = tmp;
+		entry = &cache->pending[cache->pending_count++];
+		memcpy(entry->key, key, CACHE_KEY_SIZE);
+	}
+	else {
+		free(entry->data);
+	}
+	entry->data = data;
+	entry->len = bufsize;
 	return SC_SUCCESS;
 }
 
+/*
+ * Older versions kept every cached file in a file of its own, named
+ * <cache file>_[<AID>_]<path> with upper case hex digits. Returns the key
+ * of the entry such a file corresponds to.
+ */
+static int cache_old_name_to_key(const char *suffix, char *key)
+{
+	size_t ii, n = strlen(suffix), off = 0, seps = 0;
+
+	if (n == 0 || n + 1 >= CACHE_KEY_SIZE || suffix[0] == '_' || suffix[n - 1] == '_')
+		return 0;
+	for (ii = 0; ii < n; ii++) {
+		if (suffix[ii] == '_')
+			seps++;
+		else if (!isdigit((unsigned char)suffix[ii])
+				&& (suffix[ii] < 'A' || suffix[ii] > 'F'))
+			return 0;
+	}
+	if (seps > 1)
+		return 0;
+
+	memset(key, 0, CACHE_KEY_SIZE);
+	if (seps == 0)
+		key[off++] = '_';
+	for (ii = 0; ii < n; ii++)
+		key[off + ii] = (char)tolower((unsigned char)suffix[ii]);
+	return 1;
+}
+
+static void cache_migrate_file(struct sc_pkcs15_card *p15card,
+		struct sc_pkcs15_file_cache *cache, const char *fname, const char *name)
+{
+	const char *base = strrchr(fname, '/');
+	char path[PATH_MAX], key[CACHE_KEY_SIZE];
+	char **tmp;
+	size_t blen, len;
+	struct stat st;
+	u8 *data = NULL;
+	FILE *f;
+	int r;
+
+	base = base ? base + 1 : fname;
+	blen = strlen(base);
+	if (strncmp(name, base, blen) != 0 || name[blen] != '_'
+			|| !cache_old_name_to_key(name + blen + 1, key))
+		return;
+	r = snprintf(path, sizeof(path), "%.*s%s", (int)(base - fname), fname, name);
+	if (r < 0 || (size_t)r >= sizeof(path))
+		return;
+
+	f = fopen(path, "rb");
+	if (f == NULL)
+		return;
+	if (fstat(fileno(f), &st) == 0 && st.st_size >= 0 && st.st_size <= UINT_MAX) {
+		len = (size_t)st.st_size;
+		data = malloc(len ? len : 1);
+		if (data != NULL && fread(data, 1, len, f) != len) {
+			free(data);
+			data = NULL;
+		}
+	}
+	fclose(f);
+	if (data == NULL)
+		return;
+
+	tmp = realloc(cache->migrated, (cache->migrated_count + 1) * sizeof(*tmp));
+	if (tmp != NULL) {
+		cache->migrated = tmp;
+		if (cache_add_pending(cache, key, data, len, 0) == SC_SUCCESS
+				&& (tmp[cache->migrated_count] = strdup(path)) != NULL) {
+			cache->migrated_count++;
+			sc_log(p15card->card->ctx, "migrating cached file %s", path);
+		}
+	}
+	free(data);
+}
+
+/*
+ * Import the files of older versions into the pending entries. They are
+ * removed once the entries were written to the cache file.
+ */
+static void cache_migrate(struct sc_pkcs15_card *p15card,
+		struct sc_pkcs15_file_cache *cache, const char *fname)
+{
+#ifdef _WIN32
+	WIN32_FIND_DATAA fd;
+	HANDLE h;
+	char pattern[PATH_MAX];
+#else
+	const char *base = strrchr(fname, '/');
+	char dir[PATH_MAX];
+	struct dirent *de;
+	DIR *d;
+#endif
+
+	cache_use_file(p15card, cache, fname);
+	if (cache->migration_done)
+		return;
+	cache->migration_done = 1;
+
+#ifdef _WIN32
+	if (snprintf(pattern, sizeof(pattern), "%s_*", fname) >= (int)sizeof(pattern))
+		return;
+	h = FindFirstFileA(pattern, &fd);
+	if (h == INVALID_HANDLE_VALUE)
+		return;
+	do {
+		cache_migrate_file(p15card, cache, fname, fd.cFileName);
+	} while (FindNextFileA(h, &fd));
+	FindClose(h);
+#else
+	if (base == NULL || (size_t)(base - fname) >= sizeof(dir))
+		return;
+	memcpy(dir, fname, base - fname);
+	dir[base - fname] = '\0';
+	d = opendir(dir);
+	if (d == NULL)
+		return;
+	while ((de = readdir(d)) != NULL)
+		cache_migrate_file(p15card, cache, fname, de->d_name);
+	closedir(d);
+#endif
+}
+
+/*
+ * Serialize the updates of the cache files with a lock on a file in the
+ * cache directory. The lock is taken with flock() on a descriptor opened
+ * for each update, so it excludes the other threads of this process as
+ * well as other processes, and the context mutex is not held while
+ * waiting for it. Returns the descriptor of the lock file, or -1.
+ */
+static int cache_lock(sc_context_t *ctx)
+{
+	int fd = -1;
+#ifndef _WIN32
+	char lockname[PATH_MAX];
+	char dir[PATH_MAX];
+	int r;
+
+	if (sc_get_cache_dir(ctx, dir, sizeof(dir)) != SC_SUCCESS)
+		return -1;
+	r = snprintf(lockname, sizeof(lockname), "%s/pkcs15.lock", dir);
+	if (r < 0 || (size_t)r >= sizeof(lockname))
+		return -1;
+	fd = open(lockname, O_RDWR | O_CREAT, 0666);
+	if (fd < 0 && errno == ENOENT && sc_make_cache_dir(ctx) == SC_SUCCESS)
+		fd = open(lockname, O_RDWR | O_CREAT, 0666);
+	if (fd < 0)
+		return -1;
+
+	while (flock(fd, LOCK_EX) != 0) {
+		if (errno != EINTR) {
+			sc_log(ctx, "failed to lock %s", lockname);
+			close(fd);
+			return -1;
+		}
+	}
+#else
+	sc_mutex_lock(ctx, ctx->mutex);
+#endif
+	return fd;
+}
+
+static void cache_unlock(sc_context_t *ctx, int fd)
+{
+#ifndef _WIN32
+	/* closing the file releases the lock */
+	if (fd >= 0)
+		close(fd);
+#else
+	sc_mutex_unlock(ctx, ctx->mutex);
+#endif
+}
+
+static int cache_compare_pending(const void *a, const void *b)
+{
+	return strncmp(((const struct sc_pkcs15_cache_entry *)a)->key,
+			((const struct sc_pkcs15_cache_entry *)b)->key, CACHE_KEY_SIZE);
+}
+
+/* Merge the pending entries into the current cache file of the token */
+static int cache_write(struct sc_pkcs15_card *p15card, struct sc_pkcs15_file_cache *cache)
+{
+	const char *fname = cache->pending_fname;
+	struct sc_pkcs15_cache_entry *pending = cache->pending;
+	size_t npending = cache->pending_count;
+	size_t count = 0, new_count, data_len = 0, len, offset, ii, jj, kk;
+	const u8 *old_data = NULL;
+	u8 *image;
+	int r;
+
+	qsort(pending, npending, sizeof(*pending), cache_compare_pending);
+
+	/* reload it, another process may have replaced it since */
+	if (cache_load(p15card, fname) != NULL) {
+		old_data = cache->data;
+		count = cache_get_u32(old_data + CACHE_MAGIC_SIZE);
+	}
+	else if (!cache->migration_done) {
+		cache_migrate(p15card, cache, fname);
+		pending = cache->pending;
+		npending = cache->pending_count;
+		qsort(pending, npending, sizeof(*pending), cache_compare_pending);
+	}
+
+	new_count = npending;
+	for (ii = 0; ii < npending; ii++)
+		data_len += pending[ii].len;
+	for (ii = 0, kk = 0; ii < count; ii++) {
+		const u8 *e = old_data + CACHE_HEADER_SIZE + ii * CACHE_ENTRY_SIZE;
+		int cmp = -1;
+
+		while (kk < npending && (cmp = strncmp((const char *)e, pending[kk].key, CACHE_KEY_SIZE)) > 0)
+			kk++;
+		if (kk >= npending || cmp != 0) {
+			/* kept from the old file */
+			new_count++;
+			data_len += cache_get_u32(e + CACHE_KEY_SIZE + 4);
+		}
+	}
+	if (new_count > CACHE_MAX_ENTRIES)
+		return SC_ERROR_NOT_ENOUGH_MEMORY;
+
+	len = CACHE_HEADER_SIZE + new_count * CACHE_ENTRY_SIZE + data_len;
+	if (len > UINT_MAX)
+		return SC_ERROR_NOT_ENOUGH_MEMORY;
+	image = calloc(1, len);
+	if (image == NULL)
+		return SC_ERROR_OUT_OF_MEMORY;
+
+	memcpy(image, CACHE_MAGIC, CACHE_MAGIC_SIZE);
+	cache_put_u32(image + CACHE_MAGIC_SIZE, new_count);
+	cache_put_u32(image + CACHE_MAGIC_SIZE + 4, len);
+
+	offset = CACHE_HEADER_SIZE + new_count * CACHE_ENTRY_SIZE;
+	for (ii = 0, kk = 0, jj = 0; jj < new_count; jj++) {
+		u8 *e = image + CACHE_HEADER_SIZE + jj * CACHE_ENTRY_SIZE;
+		const u8 *old = ii < count ? old_data + CACHE_HEADER_SIZE + ii * CACHE_ENTRY_SIZE : NULL;
+		int cmp = old == NULL ? -1 : kk >= npending ? 1
+			: strncmp(pending[kk].key, (const char *)old, CACHE_KEY_SIZE);
+		const u8 *src;
+		size_t src_len;
+
+		if (cmp <= 0) {
+			/* a new or replaced entry */
+			memcpy(e, pending[kk].key, CACHE_KEY_SIZE);
+			src = pending[kk].data;
+			src_len = pending[kk].len;
+			kk++;
+			if (cmp == 0)
+				ii++;
+		}
+		else {
+			memcpy(e, old, CACHE_KEY_SIZE);
+			src = old_data + cache_get_u32(old + CACHE_KEY_SIZE);
+			src_len = cache_get_u32(old + CACHE_KEY_SIZE + 4);
+			ii++;
+		}
+		cache_put_u32(e + CACHE_KEY_SIZE, offset);
+		cache_put_u32(e + CACHE_KEY_SIZE + 4, src_len);
+		if (src_len)
+			memcpy(image + offset, src, src_len);
+		offset += src_len;
+	}
+
+	r = sc_write_cache_file(p15card->card->ctx, fname, image, len);
+	free(image);
+	return r;
+}
+
+void sc_pkcs15_cache_release(struct sc_pkcs15_card *p15card)
+{
+	if (p15card == NULL || p15card->file_cache == NULL)
+		return;
+	sc_pkcs15_cache_flush(p15card);
+	cache_pending_clear(p15card->file_cache);
+	cache_unload(p15card->file_cache);
+	free(p15card->file_cache);
+	p15card->file_cache = NULL;
+}
+
+int sc_pkcs15_cache_flush(struct sc_pkcs15_card *p15card)
+{
+	struct sc_pkcs15_file_cache *cache;
+	sc_context_t *ctx;
+	size_t ii;
+	int fd, r;
+
+	if (p15card == NULL || p15card->file_cache == NULL
+			|| p15card->file_cache->pending_count == 0)
+		return SC_SUCCESS;
+	cache = p15card->file_cache;
+	ctx = p15card->card->ctx;
+
+	fd = cache_lock(ctx);
+	r = cache_write(p15card, cache);
+	if (r == SC_SUCCESS) {
+		for (ii = 0; ii < cache->migrated_count; ii++)
+			unlink(cache->migrated[ii]);
+	}
+	else {
+		sc_log(ctx, "failed to write cache file %s: %s", cache->pending_fname, sc_strerror(r));
+	}
+	cache_pending_clear(cache);
+	cache_unlock(ctx, fd);
+	return r;
+}
+
 int sc_pkcs15_read_cached_file(struct sc_pkcs15_card *p15card,
 				const sc_path_t *path,
 				u8 **buf, size_t *bufsize)
 {
 	char fname[PATH_MAX];
+	char key[CACHE_KEY_SIZE];
+	struct sc_pkcs15_file_cache *cache;
+	struct sc_pkcs15_cache_entry *pending;
+	const u8 *entry, *src;
+	size_t length, count;
 	int rv;
-	FILE *f;
-	size_t count;
-	struct stat stbuf;
 	u8 *data = NULL;
 
 	if (path->len < 2)
@@ -121,68 +727,61 @@ int sc_pkcs15_read_cached_file(struct sc_pkcs15_card *p15card,
 		return SC_ERROR_INVALID_ARGUMENTS;
 
 	sc_log(p15card->card->ctx, "try to read cache for %s", sc_print_path(path));
-	rv = generate_cache_filename(p15card, path, fname, sizeof(fname));
+	rv = generate_cache_filename(p15card, fname, sizeof(fname));
 	if (rv != SC_SUCCESS)
 		return rv;
-	sc_log(p15card->card->ctx, "read cached file %s", fname);
+	rv = generate_cache_key(path, key);
+	if (rv != SC_SUCCESS)
+		return rv;
+	sc_log(p15card->card->ctx, "read cached file %s, entry %s", fname, key);
 
-	f = fopen(fname, "rb");
-	if (!f)
-		return SC_ERROR_FILE_NOT_FOUND;
-	if (fstat(fileno(f), &stbuf))   {
-		fclose(f);
-		return  SC_ERROR_FILE_NOT_FOUND;
+	cache = cache_get(p15card);
+	if (cache == NULL)
+		return SC_ERROR_OUT_OF_MEMORY;
+	/* files cached since the last flush are not in the cache file yet */
+	pending = cache_find_pending(cache, fname, key);
+	if (pending == NULL && cache_load(p15card, fname) == NULL) {
+		cache_migrate(p15card, cache, fname);
+		pending = cache_find_pending(cache, fname, key);
+	}
+	if (pending != NULL) {
+		src = pending->data;
+		length = pending->len;
+	}
+	else {
+		entry = cache->data != NULL ? cache_find_entry(cache, key) : NULL;
+		if (entry == NULL)
+			return SC_ERROR_FILE_NOT_FOUND;
+		src = cache->data + cache_get_u32(entry + CACHE_KEY_SIZE);
+		length = cache_get_u32(entry + CACHE_KEY_SIZE + 4);
 	}
 
 	if (path->count < 0) {
-		count = stbuf.st_size;
+		count = length;
 	}
 	else {
 		count = path->count;
-		if (path->index + count > (size_t)stbuf.st_size)   {
-			rv = SC_ERROR_FILE_NOT_FOUND; /* cache file bad? */
-			goto err;
-		}
-
-		if (0 != fseek(f, (long)path->index, SEEK_SET)) {
-			rv = SC_ERROR_FILE_NOT_FOUND;
-			goto err;
-		}
+		if (path->index + count > length)
+			return SC_ERROR_FILE_NOT_FOUND; /* cache file bad? */
+		src += path->index;
 	}
 
 	if (*buf == NULL) {
-		data = malloc((size_t)stbuf.st_size);
-		if (data == NULL)   {
-			rv = SC_ERROR_OUT_OF_MEMORY;
-			goto err;
-		}
+		data = malloc(count ? count : 1);
+		if (data == NULL)
+			return SC_ERROR_OUT_OF_MEMORY;
 	}
 	else {
-		if (count > *bufsize) {
-			rv =  SC_ERROR_BUFFER_TOO_SMALL;
-			goto err;
-		}
+		if (count > *bufsize)
+			return SC_ERROR_BUFFER_TOO_SMALL;
 		data = *buf;
 	}
 
-	if (count != fread(data, 1, count, f)) {
-		rv = SC_ERROR_BUFFER_TOO_SMALL;
-		goto err;
-	}
+	memcpy(data, src, count);
 	*buf = data;
 	*bufsize = count;
 
-	rv = SC_SUCCESS;
-
-err:
-	if (rv != SC_SUCCESS) {
-		if (data != *buf) {
-			free(data);
-		}
-	}
-
-	fclose(f);
-	return rv;
+	return SC_SUCCESS;
 }
 
 int sc_pkcs15_cache_file(struct sc_pkcs15_card *p15card,
@@ -190,34 +789,21 @@ int sc_pkcs15_cache_file(struct sc_pkcs15_card *p15card,
 			 const u8 *buf, size_t bufsize)
 {
 	char fname[PATH_MAX];
+	char key[CACHE_KEY_SIZE];
+	struct sc_pkcs15_file_cache *cache;
 	int r;
-	FILE *f;
-	size_t c;
 
-	r = generate_cache_filename(p15card, path, fname, sizeof(fname));
+	r = generate_cache_filename(p15card, fname, sizeof(fname));
+	if (r != 0)
+		return r;
+	r = generate_cache_key(path, key);
 	if (r != 0)
 		return r;
 
-	f = fopen(fname, "wb");
-	/* If the open failed because the cache directory does
-	 * not exist, create it and a re-try the fopen() call.
-	 */
-	if (f == NULL && errno == ENOENT) {
-		if ((r = sc_make_cache_dir(p15card->card->ctx)) < 0)
-			return r;
-		f = fopen(fname, "wb");
-	}
-	if (f == NULL)
-		return 0;
-
-	c = fwrite(buf, 1, bufsize, f);
-	fclose(f);
-	if (c != bufsize) {
-		sc_log(p15card->card->ctx, 
-			 "fwrite() wrote only %"SC_FORMAT_LEN_SIZE_T"u bytes",
-			 c);
-		unlink(fname);
-		return SC_ERROR_INTERNAL;
-	}
-	return 0;
+	/* Written to the cache file by sc_pkcs15_cache_flush() */
+	cache = cache_get(p15card);
+	if (cache == NULL)
+		return SC_ERROR_OUT_OF_MEMORY;
+	cache_use_file(p15card, cache, fname);
+	return cache_add_pending(cache, key, buf, bufsize, 1);
 }
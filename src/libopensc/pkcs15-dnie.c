@@ -243,6 +243,7 @@ static int sc_pkcs15emu_dnie_init(sc_pkcs15_card_t * p15card)
 		    && (p15_obj->auth_id.len == 0)) {
 			p15_obj->auth_id.value[0] = 0x01;
 			p15_obj->auth_id.len = 1;
+			sc_pkcs15_reindex_object(p15card, p15_obj);
 		};
 		/* Set path count to -1 for public certificates, as they
 		   will need to be decompressed and read_binary()'d, so
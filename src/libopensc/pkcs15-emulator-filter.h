@@ -19,6 +19,9 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#ifndef PKCS15_EMULATOR_FILTER_H
+#define PKCS15_EMULATOR_FILTER_H
+
 struct _sc_pkcs15_emulators {
 	struct sc_pkcs15_emulator_handler *list_of_handlers[SC_MAX_PKCS15_EMULATORS + 1];
 	int ccount;
@@ -26,3 +29,5 @@ struct _sc_pkcs15_emulators {
 
 int set_emulators(sc_context_t *ctx, struct _sc_pkcs15_emulators* filtered_emulators, const scconf_list *list,
 					struct sc_pkcs15_emulator_handler* builtin, struct sc_pkcs15_emulator_handler* old);
+
+#endif
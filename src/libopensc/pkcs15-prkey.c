@@ -223,6 +223,7 @@ int sc_pkcs15_decode_prkdf_entry(struct sc_pkcs15_card *p15card,
 	sc_format_asn1_entry(asn1_com_key_attr + 5, asn1_supported_algorithms, NULL, 0);
 
 	sc_format_asn1_entry(asn1_com_prkey_attr + 0, &info.subject.value, &info.subject.len, 0);
+	asn1_com_prkey_attr[0].flags |= sc_pkcs15_borrow_flag(p15card);
 
 	/* Fill in defaults */
 	memset(&info, 0, sizeof(info));
@@ -356,7 +357,8 @@ int sc_pkcs15_decode_prkdf_entry(struct sc_pkcs15_card *p15card,
 err:
 	if (r < 0) {
 		/* This might have allocated something. If so, clear it now */
-		free(info.subject.value);
+		if (!sc_pkcs15_is_borrowed(p15card, info.subject.value))
+			free(info.subject.value);
 		sc_pkcs15_free_key_params(&info.params);
 	}
 
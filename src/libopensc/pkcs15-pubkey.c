@@ -247,6 +247,7 @@ int sc_pkcs15_decode_pukdf_entry(struct sc_pkcs15_card *p15card,
 	sc_copy_asn1_entry(c_asn1_com_key_attr, asn1_com_key_attr);
 
 	sc_format_asn1_entry(asn1_com_pubkey_attr + 0, &info->subject.value, &info->subject.len, 0);
+	asn1_com_pubkey_attr[0].flags |= sc_pkcs15_borrow_flag(p15card);
 
 	sc_format_asn1_entry(asn1_pubkey_choice + 0, &rsakey_obj, NULL, 0);
 	sc_format_asn1_entry(asn1_pubkey_choice + 1, &gostr3410key_obj, NULL, 0);
@@ -350,6 +351,8 @@ int sc_pkcs15_decode_pukdf_entry(struct sc_pkcs15_card *p15card,
 
 err:
 	if (r < 0) {
+		if (info && sc_pkcs15_is_borrowed(p15card, info->subject.value))
+			info->subject.value = NULL;
 		sc_pkcs15_free_pubkey_info(info);
 	}
 
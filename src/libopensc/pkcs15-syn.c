@@ -73,6 +73,42 @@ struct sc_pkcs15_emulator_handler old_emulators[] = {
 	{ NULL, NULL }
 };	
 
+/*
+ * Card types recognized by the built-in emulators. An emulator listed here
+ * for the type of the card is tried before all others; the remaining
+ * emulators, including those which look for files or applets on any card,
+ * are only tried if it fails. The ranges of types are half-open: a family
+ * of cards owns the 1000 types from its SC_CARD_TYPE_*_BASE.
+ */
+static const struct sc_pkcs15_emulator_card_types {
+	const char *name;
+	int min_type, end_type;
+} emulator_card_types[] = {
+	{ "openpgp",	SC_CARD_TYPE_OPENPGP_BASE,	SC_CARD_TYPE_OPENPGP_GNUK + 1 },
+	{ "tcos",	SC_CARD_TYPE_TCOS_V2,		SC_CARD_TYPE_TCOS_V3 + 1 },
+	{ "esteid",	SC_CARD_TYPE_MCRD_ESTEID_V30,	SC_CARD_TYPE_MCRD_ESTEID_V30 + 1 },
+	{ "itacns",	SC_CARD_TYPE_ITACNS_BASE + 1,	SC_CARD_TYPE_ITACNS_BASE + 1000 },
+	{ "itacns",	SC_CARD_TYPE_CARDOS_CIE_V1,	SC_CARD_TYPE_CARDOS_CIE_V1 + 1 },
+	{ "PIV-II",	SC_CARD_TYPE_PIV_II_GENERIC,	SC_CARD_TYPE_PIV_II_BASE + 1000 },
+	{ "cac",	SC_CARD_TYPE_CAC_GENERIC,	SC_CARD_TYPE_CAC_BASE + 1000 },
+	{ "idprime",	SC_CARD_TYPE_IDPRIME_BASE,	SC_CARD_TYPE_IDPRIME_BASE + 1000 },
+	{ "pteid",	SC_CARD_TYPE_GEMSAFEV1_PTEID,	SC_CARD_TYPE_GEMSAFEV1_PTEID + 1 },
+	{ "oberthur",	SC_CARD_TYPE_OBERTHUR_64K,	SC_CARD_TYPE_OBERTHUR_64K + 1 },
+	{ "sc-hsm",	SC_CARD_TYPE_SC_HSM,		SC_CARD_TYPE_SC_HSM_GOID + 1 },
+	{ "dnie",	SC_CARD_TYPE_DNIE_BASE,		SC_CARD_TYPE_DNIE_TERMINATED + 1 },
+	{ "gids",	SC_CARD_TYPE_GIDS_GENERIC,	SC_CARD_TYPE_GIDS_V2 + 1 },
+	{ "iasecc",	SC_CARD_TYPE_IASECC_BASE,	SC_CARD_TYPE_IASECC_BASE + 1000 },
+	{ "jpki",	SC_CARD_TYPE_JPKI_BASE,		SC_CARD_TYPE_JPKI_BASE + 1 },
+	{ "coolkey",	SC_CARD_TYPE_COOLKEY_GENERIC,	SC_CARD_TYPE_COOLKEY_BASE + 1000 },
+	{ "esteid2018",	SC_CARD_TYPE_ESTEID_2018,	SC_CARD_TYPE_ESTEID_2018 + 1 },
+	{ "skeid",	SC_CARD_TYPE_SKEID_V3,		SC_CARD_TYPE_SKEID_V3 + 1 },
+	{ "cardos",	SC_CARD_TYPE_CARDOS_BASE,	SC_CARD_TYPE_CARDOS_BASE + 1000 },
+	{ "nqapplet",	SC_CARD_TYPE_NQ_APPLET,		SC_CARD_TYPE_NQ_APPLET + 1 },
+	{ "esign",	SC_CARD_TYPE_STARCOS_V3_4_ESIGN, SC_CARD_TYPE_STARCOS_V3_5_ESIGN + 1 },
+	{ "eOI",	SC_CARD_TYPE_EOI,		SC_CARD_TYPE_EOI_CONTACTLESS + 1 },
+	{ NULL, 0, 0 }
+};
+
 static int parse_emu_block(sc_pkcs15_card_t *, struct sc_aid *, scconf_block *);
 static sc_pkcs15_df_t * sc_pkcs15emu_get_df(sc_pkcs15_card_t *p15card,
 	unsigned int type);
@@ -121,6 +157,63 @@ int sc_pkcs15_is_emulation_only(sc_card_t *card)
 	}
 }
 
+static int emulator_handles_type(const char *name, int type)
+{
+	int i;
+
+	for (i = 0; emulator_card_types[i].name; i++) {
+		if (type >= emulator_card_types[i].min_type
+				&& type < emulator_card_types[i].end_type
+				&& !strcmp(emulator_card_types[i].name, name))
+			return 1;
+	}
+	return 0;
+}
+
+/* The emulators come either from a table or from a filtered list */
+static struct sc_pkcs15_emulator_handler *
+emulator_at(struct sc_pkcs15_emulator_handler *table,
+		struct sc_pkcs15_emulator_handler **list, int i)
+{
+	if (list != NULL)
+		return list[i];
+	return table[i].name ? &table[i] : NULL;
+}
+
+static int try_emulators(sc_pkcs15_card_t *p15card, struct sc_aid *aid,
+		struct sc_pkcs15_emulator_handler *table,
+		struct sc_pkcs15_emulator_handler **list)
+{
+	sc_context_t *ctx = p15card->card->ctx;
+	struct sc_pkcs15_emulator_handler *emu, *typed = NULL;
+	int i, r = SC_ERROR_WRONG_CARD;
+
+	/* the first enabled emulator for this card type */
+	for (i = 0; (emu = emulator_at(table, list, i)) != NULL; i++) {
+		if (emulator_handles_type(emu->name, p15card->card->type)) {
+			typed = emu;
+			break;
+		}
+	}
+	if (typed != NULL) {
+		sc_log(ctx, "trying %s for card type %d", typed->name, p15card->card->type);
+		r = typed->handler(p15card, aid);
+		if (r == SC_SUCCESS)
+			return r;
+	}
+
+	for (i = 0; (emu = emulator_at(table, list, i)) != NULL; i++) {
+		if (emu == typed)
+			continue;
+		sc_log(ctx, "trying %s", emu->name);
+		r = emu->handler(p15card, aid);
+		if (r == SC_SUCCESS)
+			/* we got a hit */
+			break;
+	}
+	return r;
+}
+
 int
 sc_pkcs15_bind_synthetic(sc_pkcs15_card_t *p15card, struct sc_aid *aid)
 {
@@ -136,13 +229,9 @@ sc_pkcs15_bind_synthetic(sc_pkcs15_card_t *p15card, struct sc_aid *aid)
 	if (!conf_block) {
 		/* no conf file found => try builtin drivers  */
 		sc_log(ctx, "no conf file (or section), trying all builtin emulators");
-		for (i = 0; builtin_emulators[i].name; i++) {
-			sc_log(ctx, "trying %s", builtin_emulators[i].name);
-			r = builtin_emulators[i].handler(p15card, aid);
-			if (r == SC_SUCCESS)
-				/* we got a hit */
-				goto out;
-		}
+		r = try_emulators(p15card, aid, builtin_emulators, NULL);
+		if (r == SC_SUCCESS)
+			goto out;
 	} else {
 		/* we have a conf file => let's use it */
 		int builtin_enabled;
@@ -165,26 +254,18 @@ sc_pkcs15_bind_synthetic(sc_pkcs15_card_t *p15card, struct sc_aid *aid)
 				if (ret == SC_ERROR_TOO_MANY_OBJECTS)
 					sc_log(ctx, "trying first %d emulators from conf file", SC_MAX_PKCS15_EMULATORS);
 
-				for (i = 0; lst[i]; i++) {
-					sc_log(ctx, "trying %s", lst[i]->name);
-					r = lst[i]->handler(p15card, aid);
-					if (r == SC_SUCCESS)
-						/* we got a hit */
-						goto out;
-				}
+				r = try_emulators(p15card, aid, NULL, lst);
+				if (r == SC_SUCCESS)
+					goto out;
 			} else {
 				sc_log(ctx, "failed to filter enabled card emulators: %s", sc_strerror(ret));
 			}
 		}
 		else if (builtin_enabled) {
 			sc_log(ctx, "no emulator list in config file, trying all builtin emulators");
-			for (i = 0; builtin_emulators[i].name; i++) {
-				sc_log(ctx, "trying %s", builtin_emulators[i].name);
-				r = builtin_emulators[i].handler(p15card, aid);
-				if (r == SC_SUCCESS)
-					/* we got a hit */
-					goto out;
-			}
+			r = try_emulators(p15card, aid, builtin_emulators, NULL);
+			if (r == SC_SUCCESS)
+				goto out;
 		}
 
 		/* search for 'emulate foo { ... }' entries in the conf file */
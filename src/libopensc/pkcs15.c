@@ -128,6 +128,7 @@ static const struct sc_asn1_entry c_asn1_tokeninfo[] = {
 static void sc_pkcs15_free_unusedspace(struct sc_pkcs15_card *);
 static void sc_pkcs15_remove_dfs(struct sc_pkcs15_card *);
 static void sc_pkcs15_remove_objects(struct sc_pkcs15_card *);
+static int compare_obj_key(struct sc_pkcs15_object *, void *);
 static int sc_pkcs15_aux_get_md_guid(struct sc_pkcs15_card *, const struct sc_pkcs15_object *,
 		unsigned, unsigned char *, size_t *);
 static void sc_pkcs15_clear_tokeninfo(struct sc_pkcs15_tokeninfo *tokeninfo);
@@ -799,6 +800,7 @@ sc_pkcs15_card_free(struct sc_pkcs15_card *p15card)
 	sc_pkcs15_remove_objects(p15card);
 	sc_pkcs15_remove_dfs(p15card);
 	sc_pkcs15_free_unusedspace(p15card);
+	sc_pkcs15_cache_release(p15card);
 	p15card->unusedspace_read = 0;
 
 	sc_file_free(p15card->file_app);
@@ -828,6 +830,7 @@ sc_pkcs15_card_clear(struct sc_pkcs15_card *p15card)
 
 	sc_pkcs15_remove_objects(p15card);
 	sc_pkcs15_remove_dfs(p15card);
+	sc_pkcs15_cache_release(p15card);
 
 	p15card->df_list = NULL;
 	sc_file_free(p15card->file_app);
@@ -1353,6 +1356,8 @@ sc_pkcs15_bind(struct sc_card *card, struct sc_aid *aid,
 done:
 	*p15card_out = p15card;
 	sc_unlock(card);
+	/* write the files cached while binding */
+	sc_pkcs15_cache_flush(p15card);
 	LOG_FUNC_RETURN(ctx, SC_SUCCESS);
 error:
 	sc_unlock(card);
@@ -1377,6 +1382,239 @@ sc_pkcs15_unbind(struct sc_pkcs15_card *p15card)
 }
 
 
+/*
+ * Object index
+ *
+ * The objects of obj_list are additionally chained into hash buckets keyed
+ * by the object ID (auth ID for the authentication objects), by the auth ID
+ * of the protecting PIN and by the object path. Every bucket chain is kept
+ * in obj_list order, so that an indexed search returns the same objects
+ * in the same order as a walk over the whole list.
+ * The index is built on the first search that can use it and is kept in
+ * sync by sc_pkcs15_add_object() and sc_pkcs15_remove_object().
+ */
+#define OBJ_INDEX_ID		0
+#define OBJ_INDEX_AUTH_ID	1
+#define OBJ_INDEX_PATH		2
+
+#define OBJ_INDEX_MIN_SIZE	64
+
+struct sc_pkcs15_object_index {
+	size_t size;		/* number of buckets, power of two */
+	size_t count;		/* number of indexed objects */
+	struct sc_pkcs15_object **buckets[SC_PKCS15_OBJECT_INDEXES];
+};
+
+
+static unsigned int
+obj_index_hash(const unsigned char *data, size_t len)
+{
+	/* FNV-1a */
+	unsigned int hash = 2166136261U;
+	size_t ii;
+
+	for (ii = 0; ii < len; ii++) {
+		hash ^= data[ii];
+		hash *= 16777619U;
+	}
+	return hash;
+}
+
+
+static const struct sc_pkcs15_id *
+obj_index_get_id(const struct sc_pkcs15_object *obj)
+{
+	const void *data = obj->data;
+
+	if (data == NULL)
+		return NULL;
+	switch (obj->type & SC_PKCS15_TYPE_CLASS_MASK) {
+	case SC_PKCS15_TYPE_CERT:
+		return &((const struct sc_pkcs15_cert_info *) data)->id;
+	case SC_PKCS15_TYPE_PRKEY:
+		return &((const struct sc_pkcs15_prkey_info *) data)->id;
+	case SC_PKCS15_TYPE_PUBKEY:
+		return &((const struct sc_pkcs15_pubkey_info *) data)->id;
+	case SC_PKCS15_TYPE_SKEY:
+		return &((const struct sc_pkcs15_skey_info *) data)->id;
+	case SC_PKCS15_TYPE_AUTH:
+		return &((const struct sc_pkcs15_auth_info *) data)->auth_id;
+	case SC_PKCS15_TYPE_DATA_OBJECT:
+		return &((const struct sc_pkcs15_data_info *) data)->id;
+	}
+	return NULL;
+}
+
+
+static const struct sc_path *
+obj_index_get_path(const struct sc_pkcs15_object *obj)
+{
+	const void *data = obj->data;
+
+	if (data == NULL)
+		return NULL;
+	switch (obj->type & SC_PKCS15_TYPE_CLASS_MASK) {
+	case SC_PKCS15_TYPE_PRKEY:
+		return &((const struct sc_pkcs15_prkey_info *) data)->path;
+	case SC_PKCS15_TYPE_PUBKEY:
+		return &((const struct sc_pkcs15_pubkey_info *) data)->path;
+	case SC_PKCS15_TYPE_SKEY:
+		return &((const struct sc_pkcs15_skey_info *) data)->path;
+	case SC_PKCS15_TYPE_CERT:
+		return &((const struct sc_pkcs15_cert_info *) data)->path;
+	case SC_PKCS15_TYPE_AUTH:
+		return &((const struct sc_pkcs15_auth_info *) data)->path;
+	case SC_PKCS15_TYPE_DATA_OBJECT:
+		return &((const struct sc_pkcs15_data_info *) data)->path;
+	}
+	return NULL;
+}
+
+
+static unsigned int
+obj_index_id_hash(const struct sc_pkcs15_id *id)
+{
+	if (id == NULL || id->len > sizeof(id->value))
+		return obj_index_hash(NULL, 0);
+	return obj_index_hash(id->value, id->len);
+}
+
+
+static unsigned int
+obj_index_path_hash(const struct sc_path *path)
+{
+	if (path == NULL || path->len > sizeof(path->value))
+		return obj_index_hash(NULL, 0);
+	return obj_index_hash(path->value, path->len);
+}
+
+
+static void
+obj_index_link(struct sc_pkcs15_object_index *idx, struct sc_pkcs15_object *obj, int which)
+{
+	struct sc_pkcs15_object **pp = &idx->buckets[which][obj->index_hash[which] & (idx->size - 1)];
+
+	while (*pp != NULL && (*pp)->index_seq < obj->index_seq)
+		pp = &(*pp)->index_next[which];
+	obj->index_next[which] = *pp;
+	*pp = obj;
+}
+
+
+static int
+obj_index_unlink(struct sc_pkcs15_object_index *idx, struct sc_pkcs15_object *obj, int which)
+{
+	struct sc_pkcs15_object **pp = &idx->buckets[which][obj->index_hash[which] & (idx->size - 1)];
+
+	while (*pp != NULL && *pp != obj)
+		pp = &(*pp)->index_next[which];
+	if (*pp == NULL)
+		return 0;
+	*pp = obj->index_next[which];
+	obj->index_next[which] = NULL;
+	return 1;
+}
+
+
+static void
+obj_index_insert(struct sc_pkcs15_object_index *idx, struct sc_pkcs15_object *obj)
+{
+	int ii;
+
+	obj->index_hash[OBJ_INDEX_ID] = obj_index_id_hash(obj_index_get_id(obj));
+	obj->index_hash[OBJ_INDEX_AUTH_ID] = obj_index_id_hash(&obj->auth_id);
+	obj->index_hash[OBJ_INDEX_PATH] = obj_index_path_hash(obj_index_get_path(obj));
+	for (ii = 0; ii < SC_PKCS15_OBJECT_INDEXES; ii++)
+		obj_index_link(idx, obj, ii);
+	idx->count++;
+}
+
+
+static void
+obj_index_free(struct sc_pkcs15_card *p15card)
+{
+	struct sc_pkcs15_object_index *idx = p15card->obj_index;
+	int ii;
+
+	if (idx == NULL)
+		return;
+	for (ii = 0; ii < SC_PKCS15_OBJECT_INDEXES; ii++)
+		free(idx->buckets[ii]);
+	free(idx);
+	p15card->obj_index = NULL;
+}
+
+
+static int
+obj_index_build(struct sc_pkcs15_card *p15card, size_t size)
+{
+	struct sc_pkcs15_object_index *idx;
+	struct sc_pkcs15_object *obj;
+	int ii;
+
+	obj_index_free(p15card);
+
+	idx = calloc(1, sizeof(struct sc_pkcs15_object_index));
+	if (idx == NULL)
+		return SC_ERROR_OUT_OF_MEMORY;
+	idx->size = OBJ_INDEX_MIN_SIZE;
+	while (idx->size < size)
+		idx->size <<= 1;
+	for (ii = 0; ii < SC_PKCS15_OBJECT_INDEXES; ii++) {
+		idx->buckets[ii] = calloc(idx->size, sizeof(struct sc_pkcs15_object *));
+		if (idx->buckets[ii] == NULL) {
+			p15card->obj_index = idx;
+			obj_index_free(p15card);
+			return SC_ERROR_OUT_OF_MEMORY;
+		}
+	}
+
+	for (obj = p15card->obj_list; obj != NULL; obj = obj->next)
+		obj_index_insert(idx, obj);
+
+	p15card->obj_index = idx;
+	return SC_SUCCESS;
+}
+
+
+/*
+ * Select the index chain to be walked for the search key.
+ * Returns the index number, or -1 if the whole list has to be searched.
+ */
+static int
+obj_index_select(struct sc_pkcs15_card *p15card, const struct sc_pkcs15_search_key *sk,
+		struct sc_pkcs15_object **first)
+{
+	struct sc_pkcs15_object_index *idx;
+	unsigned int hash;
+	int which;
+
+	if (sk->id != NULL) {
+		which = OBJ_INDEX_ID;
+		hash = obj_index_id_hash(sk->id);
+	}
+	else if (sk->auth_id != NULL) {
+		which = OBJ_INDEX_AUTH_ID;
+		hash = obj_index_id_hash(sk->auth_id);
+	}
+	else if (sk->path != NULL) {
+		which = OBJ_INDEX_PATH;
+		hash = obj_index_path_hash(sk->path);
+	}
+	else {
+		return -1;
+	}
+
+	if (p15card->obj_index == NULL
+			&& obj_index_build(p15card, p15card->obj_seq) != SC_SUCCESS)
+		return -1;
+
+	idx = p15card->obj_index;
+	*first = idx->buckets[which][hash & (idx->size - 1)];
+	return which;
+}
+
+
 static int
 __sc_pkcs15_search_objects(struct sc_pkcs15_card *p15card, unsigned int class_mask, unsigned int type,
 			int (*func)(sc_pkcs15_object_t *, void *), void *func_arg,
@@ -1386,6 +1624,7 @@ __sc_pkcs15_search_objects(struct sc_pkcs15_card *p15card, unsigned int class_ma
 	struct sc_pkcs15_df	*df = NULL;
 	unsigned int	df_mask = 0;
 	size_t		match_count = 0;
+	int which = -1;
 	int r;
 
 	if (type)
@@ -1433,8 +1672,12 @@ __sc_pkcs15_search_objects(struct sc_pkcs15_card *p15card, unsigned int class_ma
 			continue;
 	}
 
-	/* And now loop over all objects */
-	for (obj = p15card->obj_list; obj != NULL; obj = obj->next) {
+	/* And now loop over all objects, or only over the candidates
+	 * sharing the hash of the searched key */
+	obj = p15card->obj_list;
+	if (func == compare_obj_key && func_arg != NULL)
+		which = obj_index_select(p15card, (struct sc_pkcs15_search_key *) func_arg, &obj);
+	for (; obj != NULL; obj = which < 0 ? obj->next : obj->index_next[which]) {
 		/* Check object type */
 		if (!(class_mask & SC_PKCS15_TYPE_TO_CLASS(obj->type)))
 			continue;
@@ -1606,6 +1849,8 @@ compare_obj_key(struct sc_pkcs15_object *obj, void *arg)
 
 	if (sk->id && !compare_obj_id(obj, sk->id))
 		return 0;
+	if (sk->auth_id && !sc_pkcs15_compare_id(&obj->auth_id, sk->auth_id))
+		return 0;
 	if (sk->app_oid && !sc_obj_app_oid(obj, sk->app_oid))
 		return 0;
 	if (sk->usage_mask && !compare_obj_usage(obj, sk->usage_mask, sk->usage_value))
@@ -1910,19 +2155,31 @@ sc_pkcs15_find_prkey_by_reference(struct sc_pkcs15_card *p15card, const struct s
 int
 sc_pkcs15_add_object(struct sc_pkcs15_card *p15card, struct sc_pkcs15_object *obj)
 {
-	struct sc_pkcs15_object *p = p15card->obj_list;
+	struct sc_pkcs15_object_index *idx = p15card->obj_index;
 
 	if (!obj)
 		return 0;
 	obj->next = obj->prev = NULL;
+	memset(obj->index_next, 0, sizeof(obj->index_next));
+	obj->index_seq = p15card->obj_seq++;
+
 	if (p15card->obj_list == NULL) {
 		p15card->obj_list = obj;
-		return 0;
 	}
-	while (p->next != NULL)
-		p = p->next;
-	p->next = obj;
-	obj->prev = p;
+	else {
+		p15card->obj_tail->next = obj;
+		obj->prev = p15card->obj_tail;
+	}
+	p15card->obj_tail = obj;
+
+	if (idx != NULL) {
+		/* Keep the load factor below one; if the rehash fails,
+		 * the index is dropped and rebuilt on the next search */
+		if (idx->count >= idx->size)
+			obj_index_build(p15card, idx->size << 1);
+		else
+			obj_index_insert(idx, obj);
+	}
 
 	return 0;
 }
@@ -1931,6 +2188,9 @@ sc_pkcs15_add_object(struct sc_pkcs15_card *p15card, struct sc_pkcs15_object *ob
 void
 sc_pkcs15_remove_object(struct sc_pkcs15_card *p15card, struct sc_pkcs15_object *obj)
 {
+	struct sc_pkcs15_object_index *idx = p15card->obj_index;
+	int ii, unlinked = 0;
+
 	if (!obj)
 		return;
 	else if (obj->prev == NULL)
@@ -1939,6 +2199,34 @@ sc_pkcs15_remove_object(struct sc_pkcs15_card *p15card, struct sc_pkcs15_object
 		obj->prev->next = obj->next;
 	if (obj->next != NULL)
 		obj->next->prev = obj->prev;
+	else if (p15card->obj_tail == obj)
+		p15card->obj_tail = obj->prev;
+
+	if (idx != NULL) {
+		for (ii = 0; ii < SC_PKCS15_OBJECT_INDEXES; ii++)
+			unlinked |= obj_index_unlink(idx, obj, ii);
+		if (unlinked)
+			idx->count--;
+	}
+}
+
+
+void
+sc_pkcs15_reindex_object(struct sc_pkcs15_card *p15card, struct sc_pkcs15_object *obj)
+{
+	struct sc_pkcs15_object_index *idx;
+	int ii, unlinked = 0;
+
+	if (p15card == NULL || obj == NULL || p15card->obj_index == NULL)
+		return;
+
+	idx = p15card->obj_index;
+	for (ii = 0; ii < SC_PKCS15_OBJECT_INDEXES; ii++)
+		unlinked |= obj_index_unlink(idx, obj, ii);
+	if (unlinked) {
+		idx->count--;
+		obj_index_insert(idx, obj);
+	}
 }
 
 
@@ -1947,22 +2235,90 @@ sc_pkcs15_remove_objects(struct sc_pkcs15_card *p15card)
 {
 	struct sc_pkcs15_object *cur = NULL, *next = NULL;
 
-	if (!p15card || !p15card->obj_list)
+	if (!p15card)
 		return;
+	obj_index_free(p15card);
 	for (cur = p15card->obj_list; cur; cur = next)   {
 		next = cur->next;
 		sc_pkcs15_free_object(cur);
 	}
 
 	p15card->obj_list = NULL;
+	p15card->obj_tail = NULL;
+}
+
+
+/*
+ * DF entries are decoded with values pointing into the DF contents rather
+ * than into copies of them. The contents stay around as long as objects
+ * with such values exist.
+ */
+struct sc_pkcs15_df_buffer {
+	unsigned int refs;
+	u8 *data;
+	size_t len;
+};
+
+static int
+df_buffer_contains(const struct sc_pkcs15_df_buffer *dfb, const void *value)
+{
+	const u8 *p = value;
+
+	return dfb != NULL && p != NULL && p >= dfb->data && p < dfb->data + dfb->len;
+}
+
+static void
+df_buffer_release(struct sc_pkcs15_df_buffer *dfb)
+{
+	if (dfb != NULL && --dfb->refs == 0) {
+		free(dfb->data);
+		free(dfb);
+	}
+}
+
+/* The value of an object that may be decoded with SC_ASN1_BORROW */
+static u8 **
+object_borrowed_value(struct sc_pkcs15_object *obj)
+{
+	if (obj->data == NULL)
+		return NULL;
+	switch (obj->type & SC_PKCS15_TYPE_CLASS_MASK) {
+	case SC_PKCS15_TYPE_CERT:
+		return &((sc_pkcs15_cert_info_t *)obj->data)->value.value;
+	case SC_PKCS15_TYPE_PRKEY:
+		return &((sc_pkcs15_prkey_info_t *)obj->data)->subject.value;
+	case SC_PKCS15_TYPE_PUBKEY:
+		return &((sc_pkcs15_pubkey_info_t *)obj->data)->subject.value;
+	}
+	return NULL;
 }
 
+unsigned int
+sc_pkcs15_borrow_flag(const struct sc_pkcs15_card *p15card)
+{
+	return p15card != NULL && p15card->df_buffer != NULL ? SC_ASN1_BORROW : 0;
+}
+
+int
+sc_pkcs15_is_borrowed(const struct sc_pkcs15_card *p15card, const void *value)
+{
+	return p15card != NULL && df_buffer_contains(p15card->df_buffer, value);
+}
 
 void
 sc_pkcs15_free_object(struct sc_pkcs15_object *obj)
 {
 	if (!obj)
 		return;
+	if (obj->df_buffer) {
+		u8 **value = object_borrowed_value(obj);
+
+		/* the value may have been replaced in the meantime */
+		if (value != NULL && df_buffer_contains(obj->df_buffer, *value))
+			*value = NULL;
+		df_buffer_release(obj->df_buffer);
+		obj->df_buffer = NULL;
+	}
 	switch (obj->type & SC_PKCS15_TYPE_CLASS_MASK) {
 	case SC_PKCS15_TYPE_PRKEY:
 		sc_pkcs15_free_prkey_info((sc_pkcs15_prkey_info_t *)obj->data);
@@ -2114,6 +2470,7 @@ int
 sc_pkcs15_parse_df(struct sc_pkcs15_card *p15card, struct sc_pkcs15_df *df)
 {
 	struct sc_context *ctx = p15card->card->ctx;
+	struct sc_pkcs15_df_buffer *dfb;
 	unsigned char *buf;
 	const unsigned char *p;
 	size_t bufsize;
@@ -2156,6 +2513,15 @@ sc_pkcs15_parse_df(struct sc_pkcs15_card *p15card, struct sc_pkcs15_df *df)
 	r = sc_pkcs15_read_file(p15card, &df->path, &buf, &bufsize, 0);
 	LOG_TEST_RET(ctx, r, "pkcs15 read file failed");
 
+	/* if this fails, the entries are just copied */
+	dfb = calloc(1, sizeof(struct sc_pkcs15_df_buffer));
+	if (dfb != NULL) {
+		dfb->refs = 1;
+		dfb->data = buf;
+		dfb->len = bufsize;
+		p15card->df_buffer = dfb;
+	}
+
 	p = buf;
 	while (bufsize && *p != 0x00) {
 
@@ -2184,6 +2550,14 @@ sc_pkcs15_parse_df(struct sc_pkcs15_card *p15card, struct sc_pkcs15_df *df)
 			sc_log(ctx, "%s: Error adding object", sc_strerror(r));
 			goto ret;
 		}
+		if (dfb != NULL) {
+			u8 **value = object_borrowed_value(obj);
+
+			if (value != NULL && df_buffer_contains(dfb, *value)) {
+				obj->df_buffer = dfb;
+				dfb->refs++;
+			}
+		}
 		while (bufsize > 0 && *p == 00) {
 			bufsize--;
 			p++;
@@ -2194,7 +2568,11 @@ sc_pkcs15_parse_df(struct sc_pkcs15_card *p15card, struct sc_pkcs15_df *df)
 		r = 0;
 ret:
 	df->enumerated = 1;
-	free(buf);
+	p15card->df_buffer = NULL;
+	if (dfb != NULL)
+		df_buffer_release(dfb);
+	else
+		free(buf);
 	LOG_FUNC_RETURN(ctx, r);
 }
 
@@ -465,6 +465,9 @@ typedef struct sc_pkcs15_skey_info sc_pkcs15_skey_info_t;
 #define SC_PKCS15_SEARCH_CLASS_DATA		0x0020U
 #define SC_PKCS15_SEARCH_CLASS_AUTH		0x0040U
 
+/* Number of hash indexes kept over the object list: (type, ID), auth ID and path */
+#define SC_PKCS15_OBJECT_INDEXES	3
+
 struct sc_pkcs15_object {
 	unsigned int type;
 	/* CommonObjectAttributes */
@@ -485,9 +488,17 @@ struct sc_pkcs15_object {
 	struct sc_pkcs15_df *df; /* can be NULL, if object is 'floating' */
 	struct sc_pkcs15_object *next, *prev; /* used only internally */
 
+	/* used only internally by the object index, see sc_pkcs15_reindex_object() */
+	struct sc_pkcs15_object *index_next[SC_PKCS15_OBJECT_INDEXES];
+	unsigned int index_hash[SC_PKCS15_OBJECT_INDEXES];
+	unsigned int index_seq;
+
 	struct sc_pkcs15_der content;
 
 	int session_object;	/* used internally. if nonzero, object is a session object. */
+
+	/* used internally: DF contents the object data points into */
+	struct sc_pkcs15_df_buffer *df_buffer;
 };
 typedef struct sc_pkcs15_object sc_pkcs15_object_t;
 
@@ -566,6 +577,12 @@ struct sc_pkcs15_operations   {
 			unsigned char *, size_t *);
 };
 
+/* Hash index over sc_pkcs15_card.obj_list, private to pkcs15.c */
+struct sc_pkcs15_object_index;
+/* Contents of a DF that decoded objects point into, private to pkcs15.c */
+struct sc_pkcs15_df_buffer;
+struct sc_pkcs15_file_cache;
+
 typedef struct sc_pkcs15_card {
 	sc_card_t *card;
 	unsigned int flags;
@@ -596,6 +613,14 @@ typedef struct sc_pkcs15_card {
 
 	struct sc_pkcs15_operations ops;
 
+	struct sc_pkcs15_object *obj_tail;	/* last object of obj_list */
+	struct sc_pkcs15_object_index *obj_index; /* built on demand */
+	unsigned int obj_seq;
+
+	struct sc_pkcs15_file_cache *file_cache; /* loaded cache file, see pkcs15-cache.c */
+	/* DF being parsed by sc_pkcs15_parse_df(), entries may point into it */
+	struct sc_pkcs15_df_buffer *df_buffer;
+
 } sc_pkcs15_card_t;
 
 /* flags suitable for sc_pkcs15_tokeninfo_t */
@@ -877,6 +902,11 @@ int sc_pkcs15_encode_aodf_entry(struct sc_context *ctx,
 
 int sc_pkcs15_parse_df(struct sc_pkcs15_card *p15card,
 		       struct sc_pkcs15_df *df);
+/* While sc_pkcs15_parse_df() runs, DF entry decoders decode large values
+ * with the returned SC_ASN1_BORROW flag and must not free values that
+ * sc_pkcs15_is_borrowed() reports to point into the DF */
+unsigned int sc_pkcs15_borrow_flag(const struct sc_pkcs15_card *p15card);
+int sc_pkcs15_is_borrowed(const struct sc_pkcs15_card *p15card, const void *value);
 int sc_pkcs15_read_df(struct sc_pkcs15_card *p15card,
 		      struct sc_pkcs15_df *df);
 int sc_pkcs15_decode_cdf_entry(struct sc_pkcs15_card *p15card,
@@ -902,6 +932,10 @@ int sc_pkcs15_add_object(struct sc_pkcs15_card *p15card,
 			 struct sc_pkcs15_object *obj);
 void sc_pkcs15_remove_object(struct sc_pkcs15_card *p15card,
 			     struct sc_pkcs15_object *obj);
+/* Has to be called when the ID, auth ID or path of an object
+ * already added to the card is changed in place */
+void sc_pkcs15_reindex_object(struct sc_pkcs15_card *p15card,
+			     struct sc_pkcs15_object *obj);
 int sc_pkcs15_add_df(struct sc_pkcs15_card *, unsigned int, const sc_path_t *);
 
 int sc_pkcs15_add_unusedspace(struct sc_pkcs15_card *p15card,
@@ -935,6 +969,8 @@ int sc_pkcs15_read_cached_file(struct sc_pkcs15_card *p15card,
 int sc_pkcs15_cache_file(struct sc_pkcs15_card *p15card,
 			 const struct sc_path *path,
 			 const u8 *buf, size_t bufsize);
+int sc_pkcs15_cache_flush(struct sc_pkcs15_card *p15card);
+void sc_pkcs15_cache_release(struct sc_pkcs15_card *p15card);
 
 /* PKCS #15 ID handling functions */
 int sc_pkcs15_compare_id(const struct sc_pkcs15_id *id1,
@@ -1003,6 +1039,7 @@ typedef struct sc_pkcs15_search_key {
 	int			reference;
 	const char *		app_label;
 	const char *		label;
+	const sc_pkcs15_id_t *	auth_id;
 } sc_pkcs15_search_key_t;
 
 int sc_pkcs15_search_objects(struct sc_pkcs15_card *, sc_pkcs15_search_key_t *,
@@ -36,6 +36,13 @@
 #include <arpa/inet.h>
 #endif
 
+#if defined(HAVE_PTHREAD) && !defined(_WIN32)
+#define PCSC_LINGER
+#include <pthread.h>
+#include <sys/time.h>
+#include <unistd.h>
+#endif
+
 #include "common/libscdl.h"
 #include "internal.h"
 #include "internal-winscard.h"
@@ -130,6 +137,24 @@ struct pcsc_global_private_data {
 
 	sc_reader_t *attached_reader;
 	sc_reader_t *removed_reader;
+
+	/* APDU recording for the replay reader driver */
+	FILE *record;
+
+	/* milliseconds to keep a transaction after unlock, see pcsc_unlock() */
+	int transaction_linger;
+#ifdef PCSC_LINGER
+	struct pcsc_private_data *lingering;
+	pthread_t linger_thread;
+	pthread_mutex_t linger_lock;
+	pthread_cond_t linger_wake;
+	/* linger_lock and linger_wake are set up, see linger_init() */
+	int linger_ready;
+	int linger_started;
+	int linger_stop;
+	/* the process owning the linger state */
+	pid_t linger_pid;
+#endif
 };
 
 struct pcsc_private_data {
@@ -151,12 +176,212 @@ struct pcsc_private_data {
 	DWORD get_tlv_properties;
 
 	int locked;
+#ifdef PCSC_LINGER
+	/* the transaction is kept until linger_until, protected by linger_lock */
+	int lingering;
+	struct timespec linger_until;
+	struct pcsc_private_data *linger_next;
+#endif
 };
 
 static int pcsc_detect_card_presence(sc_reader_t *reader);
 static int pcsc_reconnect(sc_reader_t * reader, DWORD action);
 static int pcsc_connect(sc_reader_t *reader);
 
+#ifdef PCSC_LINGER
+/*
+ * Transaction lingering: instead of ending the transaction in pcsc_unlock(),
+ * the reader keeps it for transaction_linger milliseconds. A pcsc_lock()
+ * within that time reuses the transaction, which saves the two round trips
+ * to the resource manager for back-to-back operations. A helper thread ends
+ * the transactions which were not taken up again in time, so an idle
+ * process blocks other processes at most for the configured interval.
+ */
+static int linger_before(const struct timespec *a, const struct timespec *b)
+{
+	return a->tv_sec < b->tv_sec
+		|| (a->tv_sec == b->tv_sec && a->tv_nsec < b->tv_nsec);
+}
+
+/* Must be called with linger_lock held */
+static void linger_unlink(struct pcsc_private_data *priv)
+{
+	struct pcsc_private_data **p;
+
+	for (p = &priv->gpriv->lingering; *p != NULL; p = &(*p)->linger_next) {
+		if (*p == priv) {
+			*p = priv->linger_next;
+			break;
+		}
+	}
+	priv->linger_next = NULL;
+	priv->lingering = 0;
+}
+
+/* Called once from pcsc_init(), the thread is started on first use */
+static int linger_init(struct pcsc_global_private_data *gpriv)
+{
+	if (pthread_mutex_init(&gpriv->linger_lock, NULL) != 0)
+		return -1;
+	if (pthread_cond_init(&gpriv->linger_wake, NULL) != 0) {
+		pthread_mutex_destroy(&gpriv->linger_lock);
+		return -1;
+	}
+	gpriv->linger_pid = getpid();
+	gpriv->linger_ready = 1;
+	return 0;
+}
+
+/*
+ * A child process inherits the linger state of its parent, but not the
+ * linger thread, and the lingering transactions are the parent's to end.
+ * Forget them and start over with a thread of its own when needed. The
+ * lock and the condition variable are set up again: the parent's thread
+ * may have held the lock or waited on the condition when it forked.
+ */
+static void linger_check_fork(struct pcsc_global_private_data *gpriv)
+{
+	struct pcsc_private_data *priv;
+
+	if (gpriv->linger_pid == getpid())
+		return;
+	gpriv->linger_pid = getpid();
+	pthread_mutex_init(&gpriv->linger_lock, NULL);
+	pthread_cond_init(&gpriv->linger_wake, NULL);
+	while ((priv = gpriv->lingering) != NULL) {
+		gpriv->lingering = priv->linger_next;
+		priv->linger_next = NULL;
+		priv->lingering = 0;
+	}
+	gpriv->linger_started = 0;
+	gpriv->linger_stop = 0;
+}
+
+static void *linger_thread(void *arg)
+{
+	struct pcsc_global_private_data *gpriv = arg;
+	struct pcsc_private_data *priv, *next;
+	struct timespec now, deadline;
+	struct timeval tv;
+	int have_deadline;
+
+	pthread_mutex_lock(&gpriv->linger_lock);
+	while (!gpriv->linger_stop) {
+		gettimeofday(&tv, NULL);
+		now.tv_sec = tv.tv_sec;
+		now.tv_nsec = tv.tv_usec * 1000;
+		have_deadline = 0;
+		for (priv = gpriv->lingering; priv != NULL; priv = next) {
+			next = priv->linger_next;
+			if (!linger_before(&now, &priv->linger_until)) {
+				gpriv->SCardEndTransaction(priv->pcsc_card,
+						gpriv->transaction_end_action);
+				linger_unlink(priv);
+			} else if (!have_deadline || linger_before(&priv->linger_until, &deadline)) {
+				deadline = priv->linger_until;
+				have_deadline = 1;
+			}
+		}
+		if (have_deadline)
+			pthread_cond_timedwait(&gpriv->linger_wake, &gpriv->linger_lock, &deadline);
+		else
+			pthread_cond_wait(&gpriv->linger_wake, &gpriv->linger_lock);
+	}
+	pthread_mutex_unlock(&gpriv->linger_lock);
+	return NULL;
+}
+
+/* Keep the transaction of the reader instead of ending it. Returns 0 if
+ * lingering is disabled or not possible. */
+static int linger_start(sc_reader_t *reader)
+{
+	struct pcsc_private_data *priv = reader->drv_data;
+	struct pcsc_global_private_data *gpriv = priv->gpriv;
+	struct timeval tv;
+	long usec;
+
+	if (!gpriv->linger_ready || gpriv->transaction_linger <= 0)
+		return 0;
+
+	linger_check_fork(gpriv);
+	pthread_mutex_lock(&gpriv->linger_lock);
+	/* readers may be unlocked concurrently, the first one starts the thread */
+	if (!gpriv->linger_started) {
+		if (pthread_create(&gpriv->linger_thread, NULL, linger_thread, gpriv) != 0) {
+			pthread_mutex_unlock(&gpriv->linger_lock);
+			sc_log(reader->ctx, "Unable to start the transaction linger thread");
+			return 0;
+		}
+		gpriv->linger_started = 1;
+	}
+
+	gettimeofday(&tv, NULL);
+	usec = tv.tv_usec + (long)(gpriv->transaction_linger % 1000) * 1000;
+	priv->linger_until.tv_sec = tv.tv_sec + gpriv->transaction_linger / 1000 + usec / 1000000;
+	priv->linger_until.tv_nsec = (usec % 1000000) * 1000;
+	if (!priv->lingering) {
+		priv->lingering = 1;
+		priv->linger_next = gpriv->lingering;
+		gpriv->lingering = priv;
+	}
+	pthread_cond_signal(&gpriv->linger_wake);
+	pthread_mutex_unlock(&gpriv->linger_lock);
+	return 1;
+}
+
+/* Take up a lingering transaction again. Returns 0 if there is none. */
+static int linger_resume(struct pcsc_private_data *priv)
+{
+	int lingering;
+
+	if (!priv->gpriv->linger_ready)
+		return 0;
+	linger_check_fork(priv->gpriv);
+	pthread_mutex_lock(&priv->gpriv->linger_lock);
+	lingering = priv->lingering;
+	if (lingering)
+		linger_unlink(priv);
+	pthread_mutex_unlock(&priv->gpriv->linger_lock);
+	return lingering;
+}
+
+/* Forget a lingering transaction, ending it first if end_transaction is set */
+static void linger_cancel(struct pcsc_private_data *priv, int end_transaction)
+{
+	if (linger_resume(priv) && end_transaction)
+		priv->gpriv->SCardEndTransaction(priv->pcsc_card,
+				priv->gpriv->transaction_end_action);
+}
+
+static void linger_stop(struct pcsc_global_private_data *gpriv, int end_transactions)
+{
+	struct pcsc_private_data *priv;
+	int started;
+
+	if (!gpriv->linger_ready)
+		return;
+	linger_check_fork(gpriv);
+	pthread_mutex_lock(&gpriv->linger_lock);
+	started = gpriv->linger_started;
+	gpriv->linger_stop = 1;
+	pthread_cond_signal(&gpriv->linger_wake);
+	pthread_mutex_unlock(&gpriv->linger_lock);
+	if (started)
+		pthread_join(gpriv->linger_thread, NULL);
+
+	while ((priv = gpriv->lingering) != NULL) {
+		if (end_transactions)
+			gpriv->SCardEndTransaction(priv->pcsc_card, gpriv->transaction_end_action);
+		linger_unlink(priv);
+	}
+	pthread_cond_destroy(&gpriv->linger_wake);
+	pthread_mutex_destroy(&gpriv->linger_lock);
+	gpriv->linger_started = 0;
+	gpriv->linger_stop = 0;
+	gpriv->linger_ready = 0;
+}
+#endif
+
 static DWORD pcsc_reset_action(const char *str)
 {
 	if (!strcmp(str, "reset"))
@@ -301,8 +526,10 @@ static int pcsc_internal_transmit(sc_reader_t *reader,
 
 static int pcsc_transmit(sc_reader_t *reader, sc_apdu_t *apdu)
 {
-	size_t ssize, rsize, rbuflen = 0;
+	struct pcsc_private_data *priv = reader->drv_data;
+	size_t ssize = 0, rsize, rbuflen = 0;
 	u8 *sbuf = NULL, *rbuf = NULL;
+	unsigned long long start = 0;
 	int r;
 
 	/* we always use a at least 258 byte size big return buffer
@@ -311,20 +538,28 @@ static int pcsc_transmit(sc_reader_t *reader, sc_apdu_t *apdu)
 	 * The buffer for the returned data needs to be at least 2 bytes
 	 * larger than the expected data length to store SW1 and SW2. */
 	rsize = rbuflen = apdu->resplen <= 256 ? 258 : apdu->resplen + 2;
-	rbuf = malloc(rbuflen);
-	if (rbuf == NULL) {
-		r = SC_ERROR_OUT_OF_MEMORY;
-		goto out;
+
+	ssize = sc_apdu_get_length(apdu, reader->active_protocol);
+	if (ssize == 0)
+		return SC_ERROR_INTERNAL;
+	r = _sc_reader_get_buffers(reader, ssize, rbuflen, &sbuf, &rbuf);
+	if (r != SC_SUCCESS) {
+		sc_log(reader->ctx, "no reader buffers for the APDU: %s", sc_strerror(r));
+		return r;
 	}
 
 	/* encode and log the APDU */
-	r = sc_apdu_get_octets(reader->ctx, apdu, &sbuf, &ssize, reader->active_protocol);
-	if (r != SC_SUCCESS)
+	r = sc_apdu2bytes(reader->ctx, apdu, reader->active_protocol, sbuf, ssize);
+	if (r != SC_SUCCESS) {
+		r = SC_ERROR_INTERNAL;
 		goto out;
+	}
 	if (reader->name)
 		sc_log(reader->ctx, "reader '%s'", reader->name);
 	sc_apdu_log(reader->ctx, sbuf, ssize, 1);
 
+	if (priv->gpriv->record != NULL)
+		start = _sc_replay_time();
 	r = pcsc_internal_transmit(reader, sbuf, ssize,
 				rbuf, &rsize, apdu->control);
 	if (r < 0) {
@@ -334,18 +569,16 @@ static int pcsc_transmit(sc_reader_t *reader, sc_apdu_t *apdu)
 	}
 	sc_apdu_log(reader->ctx, rbuf, rsize, 0);
 	APDU_LOG(rbuf, (uint16_t)rsize);
+	if (priv->gpriv->record != NULL && !apdu->control)
+		_sc_record_apdu(priv->gpriv->record, reader, sbuf, ssize, rbuf, rsize,
+				(unsigned long)(_sc_replay_time() - start));
 	/* set response */
 	r = sc_apdu_set_resp(reader->ctx, apdu, rbuf, rsize);
 
 out:
-	if (sbuf != NULL) {
-		sc_mem_clear(sbuf, ssize);
-		free(sbuf);
-	}
-	if (rbuf != NULL) {
-		sc_mem_clear(rbuf, rbuflen);
-		free(rbuf);
-	}
+	/* the buffers are reused, clear what this exchange left in them */
+	sc_mem_clear(sbuf, ssize);
+	sc_mem_clear(rbuf, rbuflen);
 
 	return r;
 }
@@ -636,6 +869,7 @@ static int pcsc_connect(sc_reader_t *reader)
 		reader->active_protocol = pcsc_proto_to_opensc(active_proto);
 		priv->pcsc_card = card_handle;
 
+		_sc_record_connect(priv->gpriv->record, reader);
 		initialize_uid(reader);
 
 		sc_log(reader->ctx, "Initial protocol: %s", reader->active_protocol == SC_PROTO_T1 ? "T=1" : "T=0");
@@ -660,6 +894,9 @@ static int pcsc_connect(sc_reader_t *reader)
 
 	/* After connect reader is not locked yet */
 	priv->locked = 0;
+#ifdef PCSC_LINGER
+	linger_cancel(priv, 0);
+#endif
 
 	return SC_SUCCESS;
 }
@@ -668,6 +905,10 @@ static int pcsc_disconnect(sc_reader_t * reader)
 {
 	struct pcsc_private_data *priv = reader->drv_data;
 
+#ifdef PCSC_LINGER
+	/* disconnecting ends the transaction */
+	linger_cancel(priv, 0);
+#endif
 	if (!priv->gpriv->cardmod && !(reader->ctx->flags & SC_CTX_FLAG_TERMINATE)) {
 		LONG rv = priv->gpriv->SCardDisconnect(priv->pcsc_card, priv->gpriv->disconnect_action);
 		PCSC_TRACE(reader, "SCardDisconnect returned", rv);
@@ -690,6 +931,13 @@ static int pcsc_lock(sc_reader_t *reader)
 	if (reader->ctx->flags & SC_CTX_FLAG_TERMINATE)
 		return SC_ERROR_NOT_ALLOWED;
 
+#ifdef PCSC_LINGER
+	if (linger_resume(priv)) {
+		priv->locked = 1;
+		return SC_SUCCESS;
+	}
+#endif
+
 	rv = priv->gpriv->SCardBeginTransaction(priv->pcsc_card);
 
 
@@ -742,6 +990,13 @@ static int pcsc_unlock(sc_reader_t *reader)
 	if (reader->ctx->flags & SC_CTX_FLAG_TERMINATE)
 		return SC_ERROR_NOT_ALLOWED;
 
+#ifdef PCSC_LINGER
+	if (linger_start(reader)) {
+		priv->locked = 0;
+		return SC_SUCCESS;
+	}
+#endif
+
 	rv = priv->gpriv->SCardEndTransaction(priv->pcsc_card, priv->gpriv->transaction_end_action);
 
 	priv->locked = 0;
@@ -756,6 +1011,9 @@ static int pcsc_release(sc_reader_t *reader)
 {
 	struct pcsc_private_data *priv = reader->drv_data;
 
+#ifdef PCSC_LINGER
+	linger_cancel(priv, !(reader->ctx->flags & SC_CTX_FLAG_TERMINATE));
+#endif
 	free(priv);
 	return SC_SUCCESS;
 }
@@ -824,6 +1082,7 @@ static int pcsc_init(sc_context_t *ctx)
 {
 	struct pcsc_global_private_data *gpriv;
 	scconf_block *conf_block = NULL;
+	const char *record_file = NULL;
 	int ret = SC_ERROR_INTERNAL;
 
 
@@ -875,7 +1134,12 @@ static int pcsc_init(sc_context_t *ctx)
 				"max_send_size", gpriv->force_max_send_size);
 		gpriv->force_max_recv_size = scconf_get_int(conf_block,
 				"max_recv_size", gpriv->force_max_recv_size);
+		record_file = scconf_get_str(conf_block, "record_file", NULL);
+		gpriv->transaction_linger = scconf_get_int(conf_block,
+				"transaction_linger", gpriv->transaction_linger);
 	}
+	if (getenv("OPENSC_RECORD") != NULL)
+		record_file = getenv("OPENSC_RECORD");
 
 	if (gpriv->cardmod) {
 		/* for cardmod, don't manipulate winscard.dll or the OS's builtin
@@ -885,15 +1149,26 @@ static int pcsc_init(sc_context_t *ctx)
 		gpriv->disconnect_action = SCARD_LEAVE_CARD;
 		gpriv->transaction_end_action = SCARD_LEAVE_CARD;
 		gpriv->reconnect_action = SCARD_LEAVE_CARD;
+		gpriv->transaction_linger = 0;
+	}
+	if (gpriv->transaction_end_action != SCARD_LEAVE_CARD) {
+		/* the card has to be reset at the end of every transaction */
+		gpriv->transaction_linger = 0;
+	}
+#ifndef PCSC_LINGER
+	if (gpriv->transaction_linger > 0) {
+		sc_log(ctx, "transaction_linger is not supported on this platform");
+		gpriv->transaction_linger = 0;
 	}
+#endif
 	sc_log(ctx,
 			"PC/SC options: connect_exclusive=%d disconnect_action=%u transaction_end_action=%u"
-			" reconnect_action=%u enable_pinpad=%d enable_pace=%d",
+			" reconnect_action=%u enable_pinpad=%d enable_pace=%d transaction_linger=%d",
 			gpriv->connect_exclusive,
 			(unsigned int)gpriv->disconnect_action,
 			(unsigned int)gpriv->transaction_end_action,
 			(unsigned int)gpriv->reconnect_action, gpriv->enable_pinpad,
-			gpriv->enable_pace);
+			gpriv->enable_pace, gpriv->transaction_linger);
 
 	gpriv->dlhandle = sc_dlopen(gpriv->provider_library);
 	if (gpriv->dlhandle == NULL) {
@@ -955,6 +1230,15 @@ static int pcsc_init(sc_context_t *ctx)
 		goto out;
 	}
 
+	if (record_file != NULL && !gpriv->cardmod)
+		gpriv->record = _sc_record_open(ctx, record_file);
+
+#ifdef PCSC_LINGER
+	if (gpriv->transaction_linger > 0 && linger_init(gpriv) != 0) {
+		sc_log(ctx, "Unable to set up transaction lingering");
+		gpriv->transaction_linger = 0;
+	}
+#endif
 	ctx->reader_drv_data = gpriv;
 	gpriv = NULL;
 	ret = SC_SUCCESS;
@@ -977,11 +1261,16 @@ static int pcsc_finish(sc_context_t *ctx)
 	LOG_FUNC_CALLED(ctx);
 
 	if (gpriv) {
+#ifdef PCSC_LINGER
+		linger_stop(gpriv, !(ctx->flags & SC_CTX_FLAG_TERMINATE));
+#endif
 		if (!gpriv->cardmod && gpriv->pcsc_ctx != (SCARDCONTEXT)-1 &&
 				!(ctx->flags & SC_CTX_FLAG_TERMINATE))
 			gpriv->SCardReleaseContext(gpriv->pcsc_ctx);
 		if (gpriv->dlhandle != NULL)
 			sc_dlclose(gpriv->dlhandle);
+		if (gpriv->record != NULL)
+			fclose(gpriv->record);
 		free(gpriv);
 	}
 
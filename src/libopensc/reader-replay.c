@@ -0,0 +1,558 @@
+/*
+ * reader-replay.c: Reader driver replaying a recorded APDU session
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * A recording is a text file written by the PC/SC driver when the option
+ * record_file is set. Every connect to a card starts with the reader name,
+ * the protocol and the ATR, followed by one line per transmitted APDU with
+ * the time it took in microseconds, the command, the response and the
+ * name of the reader:
+ *
+ *   reader <name>
+ *   protocol <SC_PROTO_*>
+ *   atr <hex>
+ *   apdu <usec> <command hex> <response hex> <name>
+ *
+ * The APDUs of several readers used at the same time are interleaved in
+ * the file; the reader name tells them apart. In recordings without it, an
+ * APDU belongs to the reader of the last connect.
+ *
+ * The replay driver offers one reader with a card for each reader name in
+ * the recording. A transmitted command is answered with the response of
+ * the next matching command in the recording of that reader, wrapping
+ * around at the end, so a session can be replayed repeatedly. Commands
+ * with random content, e.g. in secure messaging, can not be replayed.
+ */
+
+#if HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#ifdef HAVE_SYS_TIME_H
+#include <sys/time.h>
+#endif
+#ifdef _WIN32
+#include <windows.h>
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+
+#include "internal.h"
+
+#define REPLAY_LINE_SIZE	(2 * (SC_MAX_EXT_APDU_BUFFER_SIZE + SC_MAX_EXT_APDU_RESP_SIZE) + 64)
+
+struct replay_apdu {
+	u8 *cmd;
+	size_t cmdlen;
+	u8 *resp;
+	size_t resplen;
+	unsigned long usec;
+};
+
+struct replay_card {
+	char *name;
+	unsigned int protocol;
+	u8 atr[SC_MAX_ATR_SIZE];
+	size_t atrlen;
+	struct replay_apdu *apdus;
+	size_t count;
+	size_t next;
+};
+
+struct replay_global_private_data {
+	struct replay_card *cards;
+	size_t count;
+	int timing;
+	unsigned long transmitted;
+	unsigned long missed;
+	unsigned long long usec;
+};
+
+static struct sc_reader_operations replay_ops;
+
+static struct sc_reader_driver replay_reader_driver = {
+	"APDU replay reader",
+	"replay",
+	&replay_ops,
+	NULL
+};
+
+unsigned long long _sc_replay_time(void)
+{
+#ifdef _WIN32
+	return (unsigned long long)GetTickCount64() * 1000;
+#elif defined(HAVE_GETTIMEOFDAY)
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return (unsigned long long)tv.tv_sec * 1000000 + tv.tv_usec;
+#else
+	return (unsigned long long)time(NULL) * 1000000;
+#endif
+}
+
+const char *_sc_replay_file(sc_context_t *ctx)
+{
+	const char *file = getenv("OPENSC_REPLAY");
+
+	if (file == NULL || file[0] == '\0')
+		file = scconf_get_str(sc_get_conf_block(ctx, "reader_driver", "replay", 1),
+				"file", NULL);
+	return file;
+}
+
+/* The recording contains PINs and keys: it is only readable by the user */
+FILE *_sc_record_open(sc_context_t *ctx, const char *file)
+{
+	FILE *f = NULL;
+	int fd;
+
+#ifdef _WIN32
+	fd = _open(file, _O_WRONLY | _O_CREAT | _O_APPEND, _S_IREAD | _S_IWRITE);
+	if (fd >= 0 && (f = _fdopen(fd, "a")) == NULL)
+		_close(fd);
+#else
+	fd = open(file, O_WRONLY | O_CREAT | O_APPEND, 0600);
+	if (fd >= 0 && (f = fdopen(fd, "a")) == NULL)
+		close(fd);
+#endif
+	if (f == NULL)
+		sc_log(ctx, "unable to open the APDU recording '%s'", file);
+	else
+		fprintf(f, "# OpenSC %s APDU recording\n", sc_get_version());
+	return f;
+}
+
+void _sc_record_connect(FILE *f, sc_reader_t *reader)
+{
+	char atr[SC_MAX_ATR_SIZE * 2 + 1];
+
+	if (f == NULL || reader->name == NULL
+			|| sc_bin_to_hex(reader->atr.value, reader->atr.len, atr, sizeof(atr), 0) != SC_SUCCESS)
+		return;
+	fprintf(f, "reader %s\nprotocol %u\natr %s\n",
+			reader->name, reader->active_protocol, atr);
+	fflush(f);
+}
+
+/* Writes data in hex through a small buffer on the stack */
+static void record_hex(FILE *f, const u8 *data, size_t len)
+{
+	char hex[2 * 64 + 1];
+	size_t n;
+
+	while (len > 0) {
+		n = len < 64 ? len : 64;
+		if (sc_bin_to_hex(data, n, hex, sizeof(hex), 0) != SC_SUCCESS)
+			return;
+		fputs(hex, f);
+		data += n;
+		len -= n;
+	}
+}
+
+void _sc_record_apdu(FILE *f, sc_reader_t *reader, const u8 *cmd, size_t cmdlen,
+		const u8 *resp, size_t resplen, unsigned long usec)
+{
+	if (f == NULL || reader->name == NULL)
+		return;
+	/* hold the stream for the whole line, so threads do not interleave */
+#ifdef _WIN32
+	_lock_file(f);
+#else
+	flockfile(f);
+#endif
+	fprintf(f, "apdu %lu ", usec);
+	record_hex(f, cmd, cmdlen);
+	fputc(' ', f);
+	record_hex(f, resp, resplen);
+	fprintf(f, " %s\n", reader->name);
+	fflush(f);
+#ifdef _WIN32
+	_unlock_file(f);
+#else
+	funlockfile(f);
+#endif
+}
+
+static int replay_hex(const char *hex, u8 **out, size_t *outlen)
+{
+	size_t len = strlen(hex) / 2;
+	u8 *buf;
+
+	buf = malloc(len ? len : 1);
+	if (buf == NULL)
+		return SC_ERROR_OUT_OF_MEMORY;
+	if (sc_hex_to_bin(hex, buf, &len) != SC_SUCCESS) {
+		free(buf);
+		return SC_ERROR_INVALID_DATA;
+	}
+	*out = buf;
+	*outlen = len;
+	return SC_SUCCESS;
+}
+
+static struct replay_card *replay_get_card(struct replay_global_private_data *gpriv,
+		const char *name)
+{
+	struct replay_card *cards;
+	size_t i;
+
+	for (i = 0; i < gpriv->count; i++)
+		if (!strcmp(gpriv->cards[i].name, name))
+			return &gpriv->cards[i];
+
+	cards = realloc(gpriv->cards, (gpriv->count + 1) * sizeof(struct replay_card));
+	if (cards == NULL)
+		return NULL;
+	gpriv->cards = cards;
+	memset(&cards[gpriv->count], 0, sizeof(struct replay_card));
+	cards[gpriv->count].name = strdup(name);
+	if (cards[gpriv->count].name == NULL)
+		return NULL;
+	return &cards[gpriv->count++];
+}
+
+static int replay_add_apdu(struct replay_global_private_data *gpriv,
+		struct replay_card *card, char *args)
+{
+	struct replay_apdu *apdus, *apdu;
+	char *cmd, *resp, *name, *end;
+	int r;
+
+	cmd = strchr(args, ' ');
+	if (cmd == NULL)
+		return SC_ERROR_INVALID_DATA;
+	*cmd++ = '\0';
+	resp = strchr(cmd, ' ');
+	if (resp == NULL)
+		return SC_ERROR_INVALID_DATA;
+	*resp++ = '\0';
+	/* the reader of the APDU, in the recordings of newer versions */
+	name = strchr(resp, ' ');
+	if (name != NULL) {
+		*name++ = '\0';
+		card = replay_get_card(gpriv, name);
+		if (card == NULL)
+			return SC_ERROR_OUT_OF_MEMORY;
+	}
+	if (card == NULL)
+		return SC_ERROR_INVALID_DATA;
+
+	apdus = realloc(card->apdus, (card->count + 1) * sizeof(struct replay_apdu));
+	if (apdus == NULL)
+		return SC_ERROR_OUT_OF_MEMORY;
+	card->apdus = apdus;
+	apdu = &apdus[card->count];
+	memset(apdu, 0, sizeof(*apdu));
+
+	apdu->usec = strtoul(args, &end, 10);
+	if (*args == '\0' || *end != '\0')
+		return SC_ERROR_INVALID_DATA;
+	r = replay_hex(cmd, &apdu->cmd, &apdu->cmdlen);
+	if (r != SC_SUCCESS)
+		return r;
+	r = replay_hex(resp, &apdu->resp, &apdu->resplen);
+	if (r != SC_SUCCESS || apdu->resplen < 2) {
+		free(apdu->cmd);
+		free(apdu->resp);
+		return r != SC_SUCCESS ? r : SC_ERROR_INVALID_DATA;
+	}
+	card->count++;
+	return SC_SUCCESS;
+}
+
+static int replay_load(sc_context_t *ctx, struct replay_global_private_data *gpriv,
+		const char *file)
+{
+	struct replay_card *card = NULL;
+	char *line, *args;
+	size_t len, lineno = 0, current = 0;
+	FILE *f;
+	int r = SC_SUCCESS;
+
+	line = malloc(REPLAY_LINE_SIZE);
+	if (line == NULL)
+		return SC_ERROR_OUT_OF_MEMORY;
+	f = fopen(file, "r");
+	if (f == NULL) {
+		sc_log(ctx, "unable to open the APDU recording '%s'", file);
+		free(line);
+		return SC_ERROR_FILE_NOT_FOUND;
+	}
+
+	while (r == SC_SUCCESS && fgets(line, REPLAY_LINE_SIZE, f) != NULL) {
+		lineno++;
+		line[strcspn(line, "\r\n")] = '\0';
+		if (line[0] == '\0' || line[0] == '#')
+			continue;
+		args = strchr(line, ' ');
+		if (args == NULL) {
+			r = SC_ERROR_INVALID_DATA;
+			break;
+		}
+		*args++ = '\0';
+		/* by index, the cards move when an APDU line adds one */
+		card = current > 0 ? &gpriv->cards[current - 1] : NULL;
+
+		if (!strcmp(line, "reader")) {
+			card = replay_get_card(gpriv, args);
+			if (card == NULL)
+				r = SC_ERROR_OUT_OF_MEMORY;
+			else
+				current = card - gpriv->cards + 1;
+		} else if (!strcmp(line, "apdu")) {
+			r = replay_add_apdu(gpriv, card, args);
+		} else if (card == NULL) {
+			r = SC_ERROR_INVALID_DATA;
+		} else if (!strcmp(line, "protocol")) {
+			card->protocol = (unsigned int)strtoul(args, NULL, 10);
+		} else if (!strcmp(line, "atr")) {
+			len = sizeof(card->atr);
+			r = sc_hex_to_bin(args, card->atr, &len);
+			card->atrlen = len;
+		}
+		/* unknown lines are ignored for future extensions */
+	}
+	if (r != SC_SUCCESS)
+		sc_log(ctx, "invalid APDU recording '%s' in line %"SC_FORMAT_LEN_SIZE_T"u",
+				file, lineno);
+
+	fclose(f);
+	free(line);
+	return r;
+}
+
+static void replay_free(struct replay_global_private_data *gpriv)
+{
+	size_t i, j;
+
+	for (i = 0; i < gpriv->count; i++) {
+		for (j = 0; j < gpriv->cards[i].count; j++) {
+			free(gpriv->cards[i].apdus[j].cmd);
+			free(gpriv->cards[i].apdus[j].resp);
+		}
+		free(gpriv->cards[i].apdus);
+		free(gpriv->cards[i].name);
+	}
+	free(gpriv->cards);
+	free(gpriv);
+}
+
+static int replay_init(sc_context_t *ctx)
+{
+	struct replay_global_private_data *gpriv;
+	scconf_block *conf_block;
+	const char *file;
+	sc_reader_t *reader;
+	size_t i;
+	int r;
+
+	SC_FUNC_CALLED(ctx, SC_LOG_DEBUG_VERBOSE);
+
+	file = _sc_replay_file(ctx);
+	if (file == NULL)
+		LOG_FUNC_RETURN(ctx, SC_ERROR_INVALID_ARGUMENTS);
+
+	gpriv = calloc(1, sizeof(struct replay_global_private_data));
+	if (gpriv == NULL)
+		LOG_FUNC_RETURN(ctx, SC_ERROR_OUT_OF_MEMORY);
+	conf_block = sc_get_conf_block(ctx, "reader_driver", "replay", 1);
+	gpriv->timing = scconf_get_bool(conf_block, "timing", 0);
+
+	r = replay_load(ctx, gpriv, file);
+	if (r != SC_SUCCESS) {
+		replay_free(gpriv);
+		LOG_FUNC_RETURN(ctx, r);
+	}
+	ctx->reader_drv_data = gpriv;
+
+	for (i = 0; i < gpriv->count; i++) {
+		reader = calloc(1, sizeof(*reader));
+		if (reader == NULL)
+			LOG_FUNC_RETURN(ctx, SC_ERROR_OUT_OF_MEMORY);
+		reader->driver = &replay_reader_driver;
+		reader->ops = &replay_ops;
+		reader->drv_data = &gpriv->cards[i];
+		reader->name = strdup(gpriv->cards[i].name);
+		r = reader->name != NULL ? _sc_add_reader(ctx, reader) : SC_ERROR_OUT_OF_MEMORY;
+		if (r < 0) {
+			free(reader->name);
+			free(reader);
+			LOG_FUNC_RETURN(ctx, r);
+		}
+		sc_log(ctx, "replaying %"SC_FORMAT_LEN_SIZE_T"u APDUs in reader '%s'",
+				gpriv->cards[i].count, reader->name);
+	}
+
+	LOG_FUNC_RETURN(ctx, SC_SUCCESS);
+}
+
+static int replay_finish(sc_context_t *ctx)
+{
+	struct replay_global_private_data *gpriv = ctx->reader_drv_data;
+
+	SC_FUNC_CALLED(ctx, SC_LOG_DEBUG_VERBOSE);
+	if (gpriv != NULL) {
+		sc_log(ctx, "replayed %lu APDUs (%lu not recorded), %llu us on the recorded card",
+				gpriv->transmitted, gpriv->missed, gpriv->usec);
+		replay_free(gpriv);
+		ctx->reader_drv_data = NULL;
+	}
+	return SC_SUCCESS;
+}
+
+static int replay_release(sc_reader_t *reader)
+{
+	/* the cards belong to the driver */
+	reader->drv_data = NULL;
+	return SC_SUCCESS;
+}
+
+static int replay_detect_card_presence(sc_reader_t *reader)
+{
+	reader->flags |= SC_READER_CARD_PRESENT;
+	return reader->flags;
+}
+
+static int replay_connect(sc_reader_t *reader)
+{
+	struct replay_card *card = reader->drv_data;
+
+	memcpy(reader->atr.value, card->atr, card->atrlen);
+	reader->atr.len = card->atrlen;
+	reader->active_protocol = card->protocol;
+	return SC_SUCCESS;
+}
+
+static int replay_disconnect(sc_reader_t *reader)
+{
+	return SC_SUCCESS;
+}
+
+static void replay_sleep(unsigned long usec)
+{
+#ifdef _WIN32
+	Sleep(usec / 1000);
+#else
+	struct timespec ts;
+
+	ts.tv_sec = usec / 1000000;
+	ts.tv_nsec = (usec % 1000000) * 1000;
+	nanosleep(&ts, NULL);
+#endif
+}
+
+static int replay_transmit(sc_reader_t *reader, sc_apdu_t *apdu)
+{
+	struct replay_global_private_data *gpriv = reader->ctx->reader_drv_data;
+	struct replay_card *card = reader->drv_data;
+	struct replay_apdu *rec = NULL;
+	size_t ssize, i, idx;
+	u8 *sbuf = NULL, *rbuf = NULL;
+	int r;
+
+	ssize = sc_apdu_get_length(apdu, reader->active_protocol);
+	if (ssize == 0)
+		return SC_ERROR_INTERNAL;
+	r = _sc_reader_get_buffers(reader, ssize, 0, &sbuf, &rbuf);
+	if (r != SC_SUCCESS)
+		return r;
+	if (sc_apdu2bytes(reader->ctx, apdu, reader->active_protocol,
+				sbuf, ssize) != SC_SUCCESS)
+		return SC_ERROR_INTERNAL;
+	sc_apdu_log(reader->ctx, sbuf, ssize, 1);
+
+	/* the next matching command, starting after the last one */
+	for (i = 0; i < card->count; i++) {
+		idx = (card->next + i) % card->count;
+		if (card->apdus[idx].cmdlen == ssize
+				&& !memcmp(card->apdus[idx].cmd, sbuf, ssize)) {
+			rec = &card->apdus[idx];
+			card->next = idx + 1;
+			break;
+		}
+	}
+	sc_mem_clear(sbuf, ssize);
+
+	gpriv->transmitted++;
+	if (rec == NULL) {
+		gpriv->missed++;
+		sc_log(reader->ctx, "command not found in the recording");
+		return SC_ERROR_TRANSMIT_FAILED;
+	}
+	gpriv->usec += rec->usec;
+	if (gpriv->timing)
+		replay_sleep(rec->usec);
+
+	sc_apdu_log(reader->ctx, rec->resp, rec->resplen, 0);
+	return sc_apdu_set_resp(reader->ctx, apdu, rec->resp, rec->resplen);
+}
+
+/* Answers the APDUs one after the other from the recording and stops
+ * like a reader after the first status other than 90 00 */
+static int replay_transmit_batch(sc_reader_t *reader, sc_apdu_t *apdus,
+		size_t count, size_t *done)
+{
+	size_t i;
+	int r;
+
+	*done = 0;
+	for (i = 0; i < count; i++) {
+		r = replay_transmit(reader, &apdus[i]);
+		if (r != SC_SUCCESS)
+			return r;
+		*done = i + 1;
+		if (apdus[i].sw1 != 0x90 || apdus[i].sw2 != 0x00)
+			break;
+	}
+	return SC_SUCCESS;
+}
+
+static int replay_lock(sc_reader_t *reader)
+{
+	return SC_SUCCESS;
+}
+
+static int replay_unlock(sc_reader_t *reader)
+{
+	return SC_SUCCESS;
+}
+
+struct sc_reader_driver *sc_get_replay_driver(void)
+{
+	replay_ops.init = replay_init;
+	replay_ops.finish = replay_finish;
+	replay_ops.release = replay_release;
+	replay_ops.detect_card_presence = replay_detect_card_presence;
+	replay_ops.connect = replay_connect;
+	replay_ops.disconnect = replay_disconnect;
+	replay_ops.transmit = replay_transmit;
+	replay_ops.transmit_batch = replay_transmit_batch;
+	replay_ops.lock = replay_lock;
+	replay_ops.unlock = replay_unlock;
+
+	return &replay_reader_driver;
+}
@@ -73,15 +73,37 @@ extern "C" {
 #include <openssl/crypto.h>
 #include <openssl/evp.h>
 
+/* Number of algorithms of each kind kept fetched in the library context */
+#define SC_OSSL3_CACHE_SIZE	16
+
+struct ossl3ctx_cache {
+	char *name[SC_OSSL3_CACHE_SIZE];
+	void *alg[SC_OSSL3_CACHE_SIZE];
+};
+
 typedef struct ossl3ctx {
 	OSSL_LIB_CTX *libctx;
 	OSSL_PROVIDER *defprov;
 	OSSL_PROVIDER *legacyprov;
+	/* Fetched algorithms, reused instead of fetching them again */
+	CRYPTO_RWLOCK *cache_lock;
+	struct ossl3ctx_cache md_cache;
+	struct ossl3ctx_cache cipher_cache;
+	struct ossl3ctx_cache mac_cache;
 } ossl3ctx_t;
 
+/*
+ * Fetch an algorithm from the library context. Algorithms are fetched once
+ * and kept; every call returns a new reference, which the caller releases
+ * with the matching free function as before.
+ */
+EVP_MD *sc_ossl3ctx_fetch_md(ossl3ctx_t *ctx, const char *algorithm);
+EVP_CIPHER *sc_ossl3ctx_fetch_cipher(ossl3ctx_t *ctx, const char *algorithm);
+EVP_MAC *sc_ossl3ctx_fetch_mac(ossl3ctx_t *ctx, const char *algorithm);
+
 static inline EVP_MD *_sc_evp_md(ossl3ctx_t *ctx, const char *algorithm)
 {
-	return EVP_MD_fetch(ctx->libctx, algorithm, NULL);
+	return sc_ossl3ctx_fetch_md(ctx, algorithm);
 }
 #define sc_evp_md(ctx, alg) _sc_evp_md((ctx)->ossl3ctx, alg)
 
@@ -100,7 +122,7 @@ static inline EVP_PKEY_CTX *_sc_evp_pkey_ctx_new(ossl3ctx_t *ctx,
 
 static inline EVP_CIPHER *_sc_evp_cipher(ossl3ctx_t *ctx, const char *algorithm)
 {
-	return EVP_CIPHER_fetch(ctx->libctx, algorithm, NULL);
+	return sc_ossl3ctx_fetch_cipher(ctx, algorithm);
 }
 #define sc_evp_cipher(ctx, alg) _sc_evp_cipher((ctx)->ossl3ctx, alg)
 
@@ -109,6 +131,13 @@ static inline void sc_evp_cipher_free(EVP_CIPHER *cipher)
 	EVP_CIPHER_free(cipher);
 }
 
+#define sc_evp_mac(ctx, alg) sc_ossl3ctx_fetch_mac((ctx)->ossl3ctx, alg)
+
+static inline void sc_evp_mac_free(EVP_MAC *mac)
+{
+	EVP_MAC_free(mac);
+}
+
 #else /* OPENSSL < 3 */
 
 #include <openssl/evp.h>
@@ -146,4 +175,13 @@ static inline void sc_evp_cipher_free(EVP_CIPHER *cipher)
 #endif /* __cplusplus */
 
 #endif /* ENABLE_OPENSSL */
+
+#ifndef USE_OPENSSL3_LIBCTX
+/* Exported in every build, without OpenSSL 3 there is nothing to fetch */
+struct ossl3ctx;
+void *sc_ossl3ctx_fetch_md(struct ossl3ctx *ctx, const char *algorithm);
+void *sc_ossl3ctx_fetch_cipher(struct ossl3ctx *ctx, const char *algorithm);
+void *sc_ossl3ctx_fetch_mac(struct ossl3ctx *ctx, const char *algorithm);
+#endif
+
 #endif /* _SC_OSSL_COMPAT_H */
@@ -36,6 +36,9 @@
 
 
 #include "internal.h"
+#ifndef __ARM_FEATURE_CRC32
+#include "crc32-tables.h"
+#endif
 
 #ifdef PACKAGE_VERSION
 static const char *sc_version = PACKAGE_VERSION;
@@ -56,14 +59,56 @@ static const char *sc_version = "(undef)";
 #endif
 static size_t page_size = PAGESIZE;
 
+#if defined(HAVE_PTHREAD) && !defined(_WIN32)
+#include <pthread.h>
+#define SECURE_POOL
+#endif
+
 const char *sc_get_version(void)
 {
     return sc_version;
 }
 
+/* Values of hex digits, the separators " :" and invalid characters */
+#define HEX_SEP	0x10
+#define HEX_BAD	0xFF
+static const u8 hex_values[256] = {
+	HEX_BAD, HEX_BAD, HEX_BAD, HEX_BAD, HEX_BAD, HEX_BAD, HEX_BAD, HEX_BAD,
+	HEX_BAD, HEX_BAD, HEX_BAD, HEX_BAD, HEX_BAD, HEX_BAD, HEX_BAD, HEX_BAD,
+	HEX_BAD, HEX_BAD, HEX_BAD, HEX_BAD, HEX_BAD, HEX_BAD, HEX_BAD, HEX_BAD,
+	HEX_BAD, HEX_BAD, HEX_BAD, HEX_BAD, HEX_BAD, HEX_BAD, HEX_BAD, HEX_BAD,
+	HEX_SEP, HEX_BAD, HEX_BAD, HEX_BAD, HEX_BAD, HEX_BAD, HEX_BAD, HEX_BAD,
+	HEX_BAD, HEX_BAD, HEX_BAD, HEX_BAD, HEX_BAD, HEX_BAD, HEX_BAD, HEX_BAD,
+	0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07,
+	0x08, 0x09, HEX_SEP, HEX_BAD, HEX_BAD, HEX_BAD, HEX_BAD, HEX_BAD,
+	HEX_BAD, 0x0A, 0x0B, 0x0C, 0x0D, 0x0E, 0x0F, HEX_BAD,
+	HEX_BAD, HEX_BAD, HEX_BAD, HEX_BAD, HEX_BAD, HEX_BAD, HEX_BAD, HEX_BAD,
+	HEX_BAD, HEX_BAD, HEX_BAD, HEX_BAD, HEX_BAD, HEX_BAD, HEX_BAD, HEX_BAD,
+	HEX_BAD, HEX_BAD, HEX_BAD, HEX_BAD, HEX_BAD, HEX_BAD, HEX_BAD, HEX_BAD,
+	HEX_BAD, 0x0A, 0x0B, 0x0C, 0x0D, 0x0E, 0x0F, HEX_BAD,
+	HEX_BAD, HEX_BAD, HEX_BAD, HEX_BAD, HEX_BAD, HEX_BAD, HEX_BAD, HEX_BAD,
+	HEX_BAD, HEX_BAD, HEX_BAD, HEX_BAD, HEX_BAD, HEX_BAD, HEX_BAD, HEX_BAD,
+	HEX_BAD, HEX_BAD, HEX_BAD, HEX_BAD, HEX_BAD, HEX_BAD, HEX_BAD, HEX_BAD,
+	HEX_BAD, HEX_BAD, HEX_BAD, HEX_BAD, HEX_BAD, HEX_BAD, HEX_BAD, HEX_BAD,
+	HEX_BAD, HEX_BAD, HEX_BAD, HEX_BAD, HEX_BAD, HEX_BAD, HEX_BAD, HEX_BAD,
+	HEX_BAD, HEX_BAD, HEX_BAD, HEX_BAD, HEX_BAD, HEX_BAD, HEX_BAD, HEX_BAD,
+	HEX_BAD, HEX_BAD, HEX_BAD, HEX_BAD, HEX_BAD, HEX_BAD, HEX_BAD, HEX_BAD,
+	HEX_BAD, HEX_BAD, HEX_BAD, HEX_BAD, HEX_BAD, HEX_BAD, HEX_BAD, HEX_BAD,
+	HEX_BAD, HEX_BAD, HEX_BAD, HEX_BAD, HEX_BAD, HEX_BAD, HEX_BAD, HEX_BAD,
+	HEX_BAD, HEX_BAD, HEX_BAD, HEX_BAD, HEX_BAD, HEX_BAD, HEX_BAD, HEX_BAD,
+	HEX_BAD, HEX_BAD, HEX_BAD, HEX_BAD, HEX_BAD, HEX_BAD, HEX_BAD, HEX_BAD,
+	HEX_BAD, HEX_BAD, HEX_BAD, HEX_BAD, HEX_BAD, HEX_BAD, HEX_BAD, HEX_BAD,
+	HEX_BAD, HEX_BAD, HEX_BAD, HEX_BAD, HEX_BAD, HEX_BAD, HEX_BAD, HEX_BAD,
+	HEX_BAD, HEX_BAD, HEX_BAD, HEX_BAD, HEX_BAD, HEX_BAD, HEX_BAD, HEX_BAD,
+	HEX_BAD, HEX_BAD, HEX_BAD, HEX_BAD, HEX_BAD, HEX_BAD, HEX_BAD, HEX_BAD,
+	HEX_BAD, HEX_BAD, HEX_BAD, HEX_BAD, HEX_BAD, HEX_BAD, HEX_BAD, HEX_BAD,
+	HEX_BAD, HEX_BAD, HEX_BAD, HEX_BAD, HEX_BAD, HEX_BAD, HEX_BAD, HEX_BAD,
+	HEX_BAD, HEX_BAD, HEX_BAD, HEX_BAD, HEX_BAD, HEX_BAD, HEX_BAD, HEX_BAD,
+	HEX_BAD, HEX_BAD, HEX_BAD, HEX_BAD, HEX_BAD, HEX_BAD, HEX_BAD, HEX_BAD
+};
+
 int sc_hex_to_bin(const char *in, u8 *out, size_t *outlen)
 {
-	const char *sc_hex_to_bin_separators = " :";
 	if (in == NULL || out == NULL || outlen == NULL) {
 		return SC_ERROR_INVALID_ARGUMENTS;
 	}
@@ -73,22 +118,15 @@ int sc_hex_to_bin(const char *in, u8 *out, size_t *outlen)
 	size_t left = *outlen;
 	u8 byte = 0;
 	while (*in != '\0' && 0 != left) {
-		char c = *in++;
-		u8 nibble;
-		if      ('0' <= c && c <= '9')
-			nibble = c - '0';
-		else if ('a' <= c && c <= 'f')
-			nibble = c - 'a' + 10;
-		else if ('A' <= c && c <= 'F')
-			nibble = c - 'A' + 10;
-		else {
-			if (strchr(sc_hex_to_bin_separators, (int) c)) {
-				if (byte_needs_nibble) {
-					r = SC_ERROR_INVALID_ARGUMENTS;
-					goto err;
-				}
-				continue;
+		u8 nibble = hex_values[(unsigned char) *in++];
+		if (nibble == HEX_SEP) {
+			if (byte_needs_nibble) {
+				r = SC_ERROR_INVALID_ARGUMENTS;
+				goto err;
 			}
+			continue;
+		}
+		if (nibble == HEX_BAD) {
 			r = SC_ERROR_INVALID_ARGUMENTS;
 			goto err;
 		}
@@ -119,11 +157,8 @@ int sc_hex_to_bin(const char *in, u8 *out, size_t *outlen)
 	}
 
 	/* skip all trailing separators to see if we missed something */
-	while (*in != '\0') {
-		if (NULL == strchr(sc_hex_to_bin_separators, (int) *in))
-			break;
+	while (*in != '\0' && hex_values[(unsigned char) *in] == HEX_SEP)
 		in++;
-	}
 	if (*in != '\0') {
 		r = SC_ERROR_BUFFER_TOO_SMALL;
 		goto err;
@@ -137,6 +172,9 @@ err:
 int sc_bin_to_hex(const u8 *in, size_t in_len, char *out, size_t out_len,
 				  int in_sep)
 {
+	const char hex[] = "0123456789abcdef";
+	size_t i;
+
 	if (in == NULL || out == NULL) {
 		return SC_ERROR_INVALID_ARGUMENTS;
 	}
@@ -149,14 +187,20 @@ int sc_bin_to_hex(const u8 *in, size_t in_len, char *out, size_t out_len,
 			return SC_ERROR_BUFFER_TOO_SMALL;
 	}
 
-	const char hex[] = "0123456789abcdef";
-	while (in_len) {
-		unsigned char value = *in++;
-		*out++ = hex[(value >> 4) & 0xF];
-		*out++ = hex[ value       & 0xF];
-		in_len--;
-		if (in_len && in_sep > 0)
-			*out++ = (char)in_sep;
+	if (in_sep > 0) {
+		for (i = 0; i < in_len; i++) {
+			if (i)
+				*out++ = (char)in_sep;
+			*out++ = hex[in[i] >> 4];
+			*out++ = hex[in[i] & 0xF];
+		}
+	} else {
+		/* no separators, the compiler can unroll this */
+		for (i = 0; i < in_len; i++) {
+			out[2*i] = hex[in[i] >> 4];
+			out[2*i + 1] = hex[in[i] & 0xF];
+		}
+		out += 2*in_len;
 	}
 	*out = '\0';
 
@@ -913,7 +957,8 @@ static void init_page_size()
 	}
 }
 
-void *sc_mem_secure_alloc(size_t len)
+/* Lock whole pages for buffers the pool does not serve */
+static void *secure_alloc_pages(size_t len)
 {
 	void *p;
 
@@ -936,7 +981,7 @@ void *sc_mem_secure_alloc(size_t len)
 	return p;
 }
 
-void sc_mem_secure_free(void *ptr, size_t len)
+static void secure_free_pages(void *ptr, size_t len)
 {
 #ifdef _WIN32
 	VirtualUnlock(ptr, len);
@@ -946,6 +991,203 @@ void sc_mem_secure_free(void *ptr, size_t len)
 	free(ptr);
 }
 
+#ifdef SECURE_POOL
+/*
+ * Small secrets like PINs and keys are served from a process wide pool
+ * of locked slabs instead of locking (and wasting) a page each. Every
+ * slab holds chunks of one size class between two inaccessible guard
+ * pages and is mapped and locked once, so allocations do not need any
+ * system calls. Chunks are zeroized when they are freed.
+ */
+#define SECURE_POOL_MIN_CHUNK	16
+#define SECURE_POOL_CLASSES	8	/* 16 to 2048 bytes */
+#define SECURE_POOL_SLAB_PAGES	4
+
+struct secure_slab {
+	struct secure_slab *next;
+	unsigned char *map;	/* including the guard pages */
+	size_t map_len;
+	unsigned char *data;
+	size_t data_len;
+	size_t chunk;
+	size_t carved;		/* chunks never handed out start here */
+	size_t used;
+	void *free_list;
+	int locked;
+};
+
+static struct {
+	pthread_mutex_t lock;
+	struct secure_slab *slabs[SECURE_POOL_CLASSES];
+	struct sc_mem_secure_stats stats;
+} secure_pool = { PTHREAD_MUTEX_INITIALIZER, { NULL }, { 0, 0, 0, 0, 0 } };
+
+static int secure_pool_class(size_t len)
+{
+	size_t chunk = SECURE_POOL_MIN_CHUNK;
+	int i;
+
+	for (i = 0; i < SECURE_POOL_CLASSES; i++, chunk <<= 1)
+		if (len <= chunk)
+			return i;
+	return -1;
+}
+
+static struct secure_slab *secure_slab_new(size_t chunk)
+{
+	struct secure_slab *slab;
+
+	init_page_size();
+	if (page_size == 0)
+		return NULL;
+	slab = calloc(1, sizeof(struct secure_slab));
+	if (slab == NULL)
+		return NULL;
+	slab->chunk = chunk;
+	slab->data_len = SECURE_POOL_SLAB_PAGES * page_size;
+	slab->map_len = slab->data_len + 2 * page_size;
+	slab->map = mmap(NULL, slab->map_len, PROT_NONE,
+			MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (slab->map == MAP_FAILED) {
+		free(slab);
+		return NULL;
+	}
+	slab->data = slab->map + page_size;
+	if (mprotect(slab->data, slab->data_len, PROT_READ | PROT_WRITE) != 0) {
+		munmap(slab->map, slab->map_len);
+		free(slab);
+		return NULL;
+	}
+#ifdef MADV_DONTDUMP
+	madvise(slab->data, slab->data_len, MADV_DONTDUMP);
+#endif
+	slab->locked = mlock(slab->data, slab->data_len) == 0;
+	if (slab->locked)
+		secure_pool.stats.locked += slab->data_len;
+	else
+		secure_pool.stats.lock_failures++;
+	secure_pool.stats.slabs++;
+	return slab;
+}
+
+static void secure_slab_free(struct secure_slab *slab)
+{
+	/* unmapping also unlocks the pages */
+	if (slab->locked)
+		secure_pool.stats.locked -= slab->data_len;
+	munmap(slab->map, slab->map_len);
+	secure_pool.stats.slabs--;
+	free(slab);
+}
+
+static void *secure_pool_alloc(int cls)
+{
+	struct secure_slab *slab;
+	unsigned char *p = NULL;
+
+	for (slab = secure_pool.slabs[cls]; slab != NULL; slab = slab->next)
+		if (slab->free_list != NULL
+				|| (slab->carved + 1) * slab->chunk <= slab->data_len)
+			break;
+	if (slab == NULL) {
+		slab = secure_slab_new((size_t)SECURE_POOL_MIN_CHUNK << cls);
+		if (slab == NULL)
+			return NULL;
+		slab->next = secure_pool.slabs[cls];
+		secure_pool.slabs[cls] = slab;
+	}
+
+	if (slab->free_list != NULL) {
+		p = slab->free_list;
+		memcpy(&slab->free_list, p, sizeof(void *));
+		/* everything else was cleared when the chunk was freed */
+		memset(p, 0, sizeof(void *));
+	} else {
+		p = slab->data + slab->carved * slab->chunk;
+		slab->carved++;
+	}
+	slab->used++;
+	secure_pool.stats.in_use++;
+	secure_pool.stats.allocations++;
+	return p;
+}
+
+/* Returns 0 if the pointer does not belong to the pool */
+static int secure_pool_free(void *ptr)
+{
+	struct secure_slab *slab, **prev;
+	unsigned char *p = ptr;
+	int cls;
+
+	for (cls = 0; cls < SECURE_POOL_CLASSES; cls++) {
+		for (prev = &secure_pool.slabs[cls]; (slab = *prev) != NULL; prev = &slab->next) {
+			if (p < slab->data || p >= slab->data + slab->data_len)
+				continue;
+			p = slab->data + (size_t)(p - slab->data) / slab->chunk * slab->chunk;
+			sc_mem_clear(p, slab->chunk);
+			memcpy(p, &slab->free_list, sizeof(void *));
+			slab->free_list = p;
+			slab->used--;
+			secure_pool.stats.in_use--;
+			/* keep the first slab of the class, return the others */
+			if (slab->used == 0 && prev != &secure_pool.slabs[cls]) {
+				*prev = slab->next;
+				secure_slab_free(slab);
+			}
+			return 1;
+		}
+	}
+	return 0;
+}
+#endif
+
+void *sc_mem_secure_alloc(size_t len)
+{
+#ifdef SECURE_POOL
+	int cls = secure_pool_class(len);
+
+	if (cls >= 0) {
+		void *p;
+
+		pthread_mutex_lock(&secure_pool.lock);
+		p = secure_pool_alloc(cls);
+		pthread_mutex_unlock(&secure_pool.lock);
+		if (p != NULL)
+			return p;
+	}
+#endif
+	return secure_alloc_pages(len);
+}
+
+void sc_mem_secure_free(void *ptr, size_t len)
+{
+#ifdef SECURE_POOL
+	int r;
+
+	if (ptr == NULL)
+		return;
+	pthread_mutex_lock(&secure_pool.lock);
+	r = secure_pool_free(ptr);
+	pthread_mutex_unlock(&secure_pool.lock);
+	if (r)
+		return;
+#endif
+	secure_free_pages(ptr, len);
+}
+
+void sc_mem_secure_get_stats(struct sc_mem_secure_stats *stats)
+{
+	if (stats == NULL)
+		return;
+#ifdef SECURE_POOL
+	pthread_mutex_lock(&secure_pool.lock);
+	*stats = secure_pool.stats;
+	pthread_mutex_unlock(&secure_pool.lock);
+#else
+	memset(stats, 0, sizeof(*stats));
+#endif
+}
+
 void sc_mem_clear(void *ptr, size_t len)
 {
 	if (len > 0)   {
@@ -1041,37 +1283,52 @@ void sc_remote_data_init(struct sc_remote_data *rdata)
 	rdata->free = sc_remote_apdu_free;
 }
 
-static unsigned long  sc_CRC_tab32[256];
-static int sc_CRC_tab32_initialized = 0;
-unsigned sc_crc32(const unsigned char *value, size_t len)
+#if defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+
+/* ARMv8 implements the same (IEEE 802.3) polynomial in hardware */
+static uint32_t crc32_update(uint32_t crc, const unsigned char *p, size_t len)
 {
-	size_t ii, jj;
-	unsigned long crc;
-	unsigned long index, long_c;
-
-	if (!sc_CRC_tab32_initialized)   {
-		for (ii=0; ii<256; ii++) {
-			crc = (unsigned long) ii;
-			for (jj=0; jj<8; jj++) {
-				if ( crc & 0x00000001L )
-					crc = ( crc >> 1 ) ^ 0xEDB88320l;
-				else
-					crc =   crc >> 1;
-			}
-			sc_CRC_tab32[ii] = crc;
-		}
-		sc_CRC_tab32_initialized = 1;
-	}
+	uint64_t v;
 
-	crc = 0xffffffffL;
-	for (ii=0; ii<len; ii++)   {
-		long_c = 0x000000ffL & (unsigned long) (*(value + ii));
-		index = crc ^ long_c;
-		crc = (crc >> 8) ^ sc_CRC_tab32[ index & 0xff ];
+	for (; len >= 8; len -= 8, p += 8) {
+		memcpy(&v, p, sizeof(v));
+		crc = __crc32d(crc, v);
+	}
+	for (; len > 0; len--, p++)
+		crc = __crc32b(crc, *p);
+	return crc;
+}
+#else
+/* Slice-by-8: eight input bytes per iteration with table lookups only */
+static uint32_t crc32_update(uint32_t crc, const unsigned char *p, size_t len)
+{
+	const uint32_t (*t)[256] = sc_crc32_table;
+	uint32_t hi;
+
+	for (; len >= 8; len -= 8, p += 8) {
+		crc ^= (uint32_t)p[0] | (uint32_t)p[1] << 8
+			| (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+		hi = (uint32_t)p[4] | (uint32_t)p[5] << 8
+			| (uint32_t)p[6] << 16 | (uint32_t)p[7] << 24;
+		crc = t[7][crc & 0xff] ^ t[6][(crc >> 8) & 0xff]
+			^ t[5][(crc >> 16) & 0xff] ^ t[4][crc >> 24]
+			^ t[3][hi & 0xff] ^ t[2][(hi >> 8) & 0xff]
+			^ t[1][(hi >> 16) & 0xff] ^ t[0][hi >> 24];
 	}
+	for (; len > 0; len--, p++)
+		crc = (crc >> 8) ^ t[0][(crc ^ *p) & 0xff];
+	return crc;
+}
+#endif
+
+unsigned sc_crc32(const unsigned char *value, size_t len)
+{
+	uint32_t crc;
 
-	crc ^= 0xffffffff;
-	return  crc%0xffff;
+	crc = crc32_update(0xffffffff, value, len) ^ 0xffffffff;
+	/* the reduction has always been part of the result */
+	return crc % 0xffff;
 }
 
 const u8 *sc_compacttlv_find_tag(const u8 *buf, size_t len, u8 tag, size_t *outlen)
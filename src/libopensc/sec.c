@@ -143,6 +143,8 @@ int sc_verify(sc_card_t *card, unsigned int type, int ref,
 
 int sc_logout(sc_card_t *card)
 {
+	/* do not keep contents read with the access rights of the session */
+	sc_invalidate_read_cache(card);
 	if (card->ops->logout == NULL)
 		return SC_ERROR_NOT_SUPPORTED;
 	return card->ops->logout(card);
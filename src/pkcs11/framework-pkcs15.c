@@ -62,11 +62,15 @@ struct pkcs15_slot_data {
 	}                                       \
 	attr->ulValueLen = size;
 
-#define MAX_OBJECTS	128
+/* Initial size of the object table, it grows as needed */
+#define MIN_OBJECTS	32
+struct pkcs15_related_index;
 struct pkcs15_fw_data {
 	struct sc_pkcs15_card *		p15_card;
-	struct pkcs15_any_object *	objects[MAX_OBJECTS];
+	struct pkcs15_any_object **	objects;
 	unsigned int			num_objects;
+	unsigned int			max_objects;
+	struct pkcs15_related_index *	related;
 	unsigned int			locked;
 	unsigned char user_puk[64];
 	unsigned int user_puk_len;
@@ -204,6 +208,7 @@ static const struct {
 #endif
 
 static int	__pkcs15_release_object(struct pkcs15_any_object *);
+static void	related_index_drop(struct pkcs15_fw_data *);
 static CK_RV	register_mechanisms(struct sc_pkcs11_card *p11card);
 static CK_RV	get_public_exponent(struct sc_pkcs15_pubkey *,
 					CK_ATTRIBUTE_PTR);
@@ -383,6 +388,9 @@ pkcs15_unbind(struct sc_pkcs11_card *p11card)
 				__pkcs15_release_object(obj);
 		}
 
+		free(fw_data->objects);
+		fw_data->objects = NULL;
+		related_index_drop(fw_data);
 		unlock_card(fw_data);
 
 		if (fw_data->p15_card) {
@@ -485,6 +493,28 @@ set_cka_label(CK_ATTRIBUTE_PTR attr, char *label)
 }
 #endif
 
+/* Append an object to the object table of the framework data */
+static int
+__pkcs15_append_object(struct pkcs15_fw_data *fw_data, struct pkcs15_any_object *obj)
+{
+	related_index_drop(fw_data);
+	if (fw_data->num_objects >= fw_data->max_objects) {
+		struct pkcs15_any_object **objects;
+		unsigned int max_objects = fw_data->max_objects ? fw_data->max_objects * 2 : MIN_OBJECTS;
+
+		if (max_objects <= fw_data->max_objects)
+			return SC_ERROR_TOO_MANY_OBJECTS;
+		objects = realloc(fw_data->objects, max_objects * sizeof(*objects));
+		if (!objects)
+			return SC_ERROR_OUT_OF_MEMORY;
+		fw_data->objects = objects;
+		fw_data->max_objects = max_objects;
+	}
+
+	fw_data->objects[fw_data->num_objects++] = obj;
+	return SC_SUCCESS;
+}
+
 static int
 __pkcs15_create_object(struct pkcs15_fw_data *fw_data,
 		       struct pkcs15_any_object **result,
@@ -493,14 +523,16 @@ __pkcs15_create_object(struct pkcs15_fw_data *fw_data,
 		       size_t size)
 {
 	struct pkcs15_any_object *obj;
-
-	if (fw_data->num_objects >= MAX_OBJECTS)
-		return SC_ERROR_TOO_MANY_OBJECTS;
+	int rv;
 
 	if (!(obj = calloc(1, size)))
 		return SC_ERROR_OUT_OF_MEMORY;
 
-	fw_data->objects[fw_data->num_objects++] = obj;
+	rv = __pkcs15_append_object(fw_data, obj);
+	if (rv != SC_SUCCESS) {
+		free(obj);
+		return rv;
+	}
 
 	obj->base.ops = ops;
 	obj->p15_object = p15_object;
@@ -534,6 +566,7 @@ __pkcs15_delete_object(struct pkcs15_fw_data *fw_data, struct pkcs15_any_object
 
 	for (i = 0; i < fw_data->num_objects; ++i)   {
 		if (fw_data->objects[i] == obj) {
+			related_index_drop(fw_data);
 			fw_data->objects[i] = fw_data->objects[--fw_data->num_objects];
 			if (__pkcs15_release_object(obj) > 0)
 				return SC_ERROR_INTERNAL;
@@ -898,58 +931,231 @@ pkcs15_create_pkcs11_objects(struct pkcs15_fw_data *fw_data, int p15_type, const
 		int (*create)(struct pkcs15_fw_data *, struct sc_pkcs15_object *,
 			struct pkcs15_any_object **any_object))
 {
-	struct sc_pkcs15_object *p15_object[MAX_OBJECTS];
+	struct sc_pkcs15_object **p15_object;
 	int i, count, rv;
 
-	rv = count = sc_pkcs15_get_objects(fw_data->p15_card, p15_type, p15_object, MAX_OBJECTS);
+	/* count the objects first */
+	rv = count = sc_pkcs15_get_objects(fw_data->p15_card, p15_type, NULL, 0);
+	if (count <= 0)
+		return count;
+
+	p15_object = calloc(count, sizeof(*p15_object));
+	if (!p15_object)
+		return SC_ERROR_OUT_OF_MEMORY;
+	rv = count = sc_pkcs15_get_objects(fw_data->p15_card, p15_type, p15_object, count);
 	if (rv >= 0)
 		sc_log(context, "Found %d %s%s", count, name, (count == 1)? "" : "s");
 
 	for (i = 0; rv >= 0 && i < count; i++)
 		rv = create(fw_data, p15_object[i], NULL);
 
+	free(p15_object);
 	return count;
 }
 
 
+/*
+ * Index used for relating objects: hash chains over the object table,
+ * keyed by the class and ID of keys and certificates and by the subject
+ * and issuer of the certificates read so far. Chains are kept in table
+ * order, so the first match found is the same as the first one of a walk
+ * over the whole table.
+ * The index is built by pkcs15_bind_related_objects() and dropped when the
+ * object table or an ID changes.
+ */
+struct pkcs15_related_index {
+	size_t		size;		/* number of buckets, power of two */
+	unsigned int	*id_buckets;	/* position of the first object + 1 */
+	unsigned int	*subject_buckets;
+	unsigned int	*issuer_buckets;
+	unsigned int	*id_next;	/* per object: position of the next one + 1 */
+	unsigned int	*subject_next;
+	unsigned int	*issuer_next;
+};
+
+static unsigned int
+related_index_hash(unsigned int class, const unsigned char *data, size_t len)
+{
+	/* FNV-1a */
+	unsigned int hash = 2166136261U;
+	size_t ii;
+
+	hash = (hash ^ class) * 16777619U;
+	for (ii = 0; ii < len; ii++) {
+		hash ^= data[ii];
+		hash *= 16777619U;
+	}
+	return hash;
+}
+
+static const struct sc_pkcs15_id *
+related_index_id(struct pkcs15_any_object *obj)
+{
+	if (is_privkey(obj))
+		return &((struct pkcs15_prkey_object *) obj)->prv_info->id;
+	if (is_pubkey(obj))
+		return &((struct pkcs15_pubkey_object *) obj)->pub_info->id;
+	if (is_cert(obj))
+		return &((struct pkcs15_cert_object *) obj)->cert_info->id;
+	return NULL;
+}
+
+static unsigned int
+related_index_id_hash(unsigned int class, const struct sc_pkcs15_id *id)
+{
+	return related_index_hash(class, id->value, MIN(id->len, sizeof(id->value)));
+}
+
+/* Insert the position + 1 of an object into a chain, keeping the order */
+static void
+related_index_link(unsigned int *bucket, unsigned int *next, unsigned int pos)
+{
+	while (*bucket && *bucket < pos)
+		bucket = &next[*bucket - 1];
+	if (*bucket == pos)
+		return;
+	next[pos - 1] = *bucket;
+	*bucket = pos;
+}
+
+static void
+related_index_add_cert(struct pkcs15_related_index *idx, unsigned int pos,
+		const struct sc_pkcs15_cert *c)
+{
+	size_t mask = idx->size - 1;
+
+	if (c->subject_len)
+		related_index_link(&idx->subject_buckets[related_index_hash(0, c->subject, c->subject_len) & mask],
+				idx->subject_next, pos);
+	if (c->issuer_len)
+		related_index_link(&idx->issuer_buckets[related_index_hash(0, c->issuer, c->issuer_len) & mask],
+				idx->issuer_next, pos);
+}
+
+static void
+related_index_drop(struct pkcs15_fw_data *fw_data)
+{
+	struct pkcs15_related_index *idx = fw_data->related;
+
+	if (!idx)
+		return;
+	free(idx->id_buckets);
+	free(idx->subject_buckets);
+	free(idx->issuer_buckets);
+	free(idx->id_next);
+	free(idx->subject_next);
+	free(idx->issuer_next);
+	free(idx);
+	fw_data->related = NULL;
+}
+
+static int
+related_index_build(struct pkcs15_fw_data *fw_data)
+{
+	struct pkcs15_related_index *idx;
+	unsigned int i, n = fw_data->num_objects;
+
+	related_index_drop(fw_data);
+	if (!(idx = calloc(1, sizeof(*idx))))
+		return SC_ERROR_OUT_OF_MEMORY;
+	fw_data->related = idx;
+
+	for (idx->size = 16; idx->size < n; idx->size <<= 1)
+		;
+	idx->id_buckets = calloc(idx->size, sizeof(unsigned int));
+	idx->subject_buckets = calloc(idx->size, sizeof(unsigned int));
+	idx->issuer_buckets = calloc(idx->size, sizeof(unsigned int));
+	idx->id_next = calloc(n + 1, sizeof(unsigned int));
+	idx->subject_next = calloc(n + 1, sizeof(unsigned int));
+	idx->issuer_next = calloc(n + 1, sizeof(unsigned int));
+	if (!idx->id_buckets || !idx->subject_buckets || !idx->issuer_buckets
+			|| !idx->id_next || !idx->subject_next || !idx->issuer_next) {
+		related_index_drop(fw_data);
+		return SC_ERROR_OUT_OF_MEMORY;
+	}
+
+	/* insert backwards, so every object goes to the head of its chains */
+	for (i = n; i-- > 0; ) {
+		struct pkcs15_any_object *obj = fw_data->objects[i];
+		const struct sc_pkcs15_id *id = related_index_id(obj);
+
+		if (id == NULL)
+			continue;
+		related_index_link(&idx->id_buckets[related_index_id_hash(__p15_type(obj) & SC_PKCS15_TYPE_CLASS_MASK, id)
+				& (idx->size - 1)], idx->id_next, i + 1);
+		if (is_cert(obj) && ((struct pkcs15_cert_object *) obj)->cert_data)
+			related_index_add_cert(idx, i + 1, ((struct pkcs15_cert_object *) obj)->cert_data);
+	}
+	return SC_SUCCESS;
+}
+
+/* Position + 1 of the first object in the chain of the class and ID, or 0 */
+static unsigned int
+related_index_first_id(struct pkcs15_related_index *idx, unsigned int class, const struct sc_pkcs15_id *id)
+{
+	return idx->id_buckets[related_index_id_hash(class, id) & (idx->size - 1)];
+}
+
+/* Position + 1 of an indexed object in the table, or 0 */
+static unsigned int
+related_index_position(struct pkcs15_fw_data *fw_data, struct pkcs15_any_object *obj)
+{
+	struct pkcs15_related_index *idx = fw_data->related;
+	const struct sc_pkcs15_id *id = related_index_id(obj);
+	unsigned int i;
+
+	if (id == NULL)
+		return 0;
+	for (i = related_index_first_id(idx, __p15_type(obj) & SC_PKCS15_TYPE_CLASS_MASK, id); i; i = idx->id_next[i - 1])
+		if (fw_data->objects[i - 1] == obj)
+			return i;
+	return 0;
+}
+
+
 static void
 __pkcs15_prkey_bind_related(struct pkcs15_fw_data *fw_data, struct pkcs15_prkey_object *pk)
 {
+	struct pkcs15_related_index *idx = fw_data->related;
 	struct sc_pkcs15_id *id = &pk->prv_info->id;
 	unsigned int i;
 
 	sc_log(context, "Object is a private key and has id %s", sc_pkcs15_print_id(id));
 
-	for (i = 0; i < fw_data->num_objects; i++) {
-		struct pkcs15_any_object *obj = fw_data->objects[i];
+	/* merge private keys with the same ID and different usage bits */
+	for (i = related_index_first_id(idx, SC_PKCS15_TYPE_PRKEY, id); i; i = idx->id_next[i - 1]) {
+		struct pkcs15_any_object *obj = fw_data->objects[i - 1];
+		struct pkcs15_prkey_object *other, **pp;
 
 		if (obj->base.flags & SC_PKCS11_OBJECT_HIDDEN)
 			continue;
-		if (is_privkey(obj) && obj != (struct pkcs15_any_object *) pk) {
-			/* merge private keys with the same ID and
-			 * different usage bits */
-			struct pkcs15_prkey_object *other, **pp;
-
-			other = (struct pkcs15_prkey_object *) obj;
-			if (sc_pkcs15_compare_id(&other->prv_info->id, id)) {
-				obj->base.flags |= SC_PKCS11_OBJECT_HIDDEN;
-				for (pp = &pk->prv_next; *pp; pp = &(*pp)->prv_next)
-					;
-				*pp = (struct pkcs15_prkey_object *) obj;
-			}
+		if (!is_privkey(obj) || obj == (struct pkcs15_any_object *) pk)
+			continue;
+		other = (struct pkcs15_prkey_object *) obj;
+		if (sc_pkcs15_compare_id(&other->prv_info->id, id)) {
+			obj->base.flags |= SC_PKCS11_OBJECT_HIDDEN;
+			for (pp = &pk->prv_next; *pp; pp = &(*pp)->prv_next)
+				;
+			*pp = other;
 		}
-		else if (is_pubkey(obj) && !pk->prv_pubkey) {
-			struct pkcs15_pubkey_object *pubkey;
-
-			pubkey = (struct pkcs15_pubkey_object *) obj;
-			if (sc_pkcs15_compare_id(&pubkey->pub_info->id, id)) {
-				sc_log(context, "Associating object %d as public key", i);
-				pk->prv_pubkey = pubkey;
-				if (pubkey->pub_data) {
-					sc_pkcs15_dup_pubkey(context, pubkey->pub_data, &pk->pub_data);
-					if (pk->prv_info->modulus_length == 0)
-						pk->prv_info->modulus_length = pubkey->pub_info->modulus_length;
-				}
+	}
+
+	for (i = related_index_first_id(idx, SC_PKCS15_TYPE_PUBKEY, id); i && !pk->prv_pubkey; i = idx->id_next[i - 1]) {
+		struct pkcs15_any_object *obj = fw_data->objects[i - 1];
+		struct pkcs15_pubkey_object *pubkey;
+
+		if (obj->base.flags & SC_PKCS11_OBJECT_HIDDEN)
+			continue;
+		if (!is_pubkey(obj))
+			continue;
+		pubkey = (struct pkcs15_pubkey_object *) obj;
+		if (sc_pkcs15_compare_id(&pubkey->pub_info->id, id)) {
+			sc_log(context, "Associating object %d as public key", i - 1);
+			pk->prv_pubkey = pubkey;
+			if (pubkey->pub_data) {
+				sc_pkcs15_dup_pubkey(context, pubkey->pub_data, &pk->pub_data);
+				if (pk->prv_info->modulus_length == 0)
+					pk->prv_info->modulus_length = pubkey->pub_info->modulus_length;
 			}
 		}
 	}
@@ -959,44 +1165,48 @@ __pkcs15_prkey_bind_related(struct pkcs15_fw_data *fw_data, struct pkcs15_prkey_
 static void
 __pkcs15_cert_bind_related(struct pkcs15_fw_data *fw_data, struct pkcs15_cert_object *cert)
 {
+	struct pkcs15_related_index *idx = fw_data->related;
 	struct sc_pkcs15_cert *c1 = cert->cert_data;
 	struct sc_pkcs15_id *id = &cert->cert_info->id;
 	unsigned int i;
 
 	sc_log(context, "Object is a certificate and has id %s", sc_pkcs15_print_id(id));
 
-	/* Loop over all objects to see if we find the certificate of
-	 * the issuer and the associated private key */
-	for (i = 0; i < fw_data->num_objects; i++) {
-		struct pkcs15_any_object *obj = fw_data->objects[i];
-
-		if (is_cert(obj) && obj != (struct pkcs15_any_object *) cert) {
+	/* Look for the certificate of the issuer */
+	if (c1 && c1->issuer_len) {
+		i = idx->subject_buckets[related_index_hash(0, c1->issuer, c1->issuer_len) & (idx->size - 1)];
+		for (; i; i = idx->subject_next[i - 1]) {
+			struct pkcs15_any_object *obj = fw_data->objects[i - 1];
 			struct pkcs15_cert_object *cert2;
 			struct sc_pkcs15_cert *c2;
 
+			if (obj == (struct pkcs15_any_object *) cert)
+				continue;
 			cert2 = (struct pkcs15_cert_object *) obj;
 			c2 = cert2->cert_data;
-
-			if (!c1 || !c2 || !c1->issuer_len || !c2->subject_len)
-				continue;
 			if (c1->issuer_len == c2->subject_len
 			 && !memcmp(c1->issuer, c2->subject, c1->issuer_len)) {
 				sc_log(context, "Associating object %d (id %s) as issuer",
-						i, sc_pkcs15_print_id(&cert2->cert_info->id));
-				cert->cert_issuer = (struct pkcs15_cert_object *) obj;
-				return;
-			}
-		} else
-		if (is_privkey(obj) && !cert->cert_prvkey) {
-			struct pkcs15_prkey_object *pk;
-
-			pk = (struct pkcs15_prkey_object *) obj;
-			if (sc_pkcs15_compare_id(&pk->prv_info->id, id)) {
-				sc_log(context, "Associating object %d as private key", i);
-				cert->cert_prvkey = pk;
+						i - 1, sc_pkcs15_print_id(&cert2->cert_info->id));
+				cert->cert_issuer = cert2;
+				break;
 			}
 		}
 	}
+
+	/* and for the associated private key */
+	for (i = related_index_first_id(idx, SC_PKCS15_TYPE_PRKEY, id); i && !cert->cert_prvkey; i = idx->id_next[i - 1]) {
+		struct pkcs15_any_object *obj = fw_data->objects[i - 1];
+		struct pkcs15_prkey_object *pk;
+
+		if (!is_privkey(obj))
+			continue;
+		pk = (struct pkcs15_prkey_object *) obj;
+		if (sc_pkcs15_compare_id(&pk->prv_info->id, id)) {
+			sc_log(context, "Associating object %d as private key", i - 1);
+			cert->cert_prvkey = pk;
+		}
+	}
 }
 
 static void
@@ -1004,6 +1214,11 @@ pkcs15_bind_related_objects(struct pkcs15_fw_data *fw_data)
 {
 	unsigned int i;
 
+	if (related_index_build(fw_data) != SC_SUCCESS) {
+		sc_log(context, "Cannot index objects, not relating them");
+		return;
+	}
+
 	/* Loop over all private keys and attached related certificate
 	 * and/or public key
 	 */
@@ -1021,6 +1236,51 @@ pkcs15_bind_related_objects(struct pkcs15_fw_data *fw_data)
 	}
 }
 
+/*
+ * Relate a certificate whose data has just been read. Only the data of
+ * this certificate is new, so only its issuer and the certificates it
+ * issued have to be looked up. Everything else is related already, unless
+ * the objects changed since, which needs going over all of them again.
+ */
+static void
+pkcs15_bind_related_cert(struct pkcs15_fw_data *fw_data, struct pkcs15_cert_object *cert)
+{
+	struct pkcs15_related_index *idx = fw_data->related;
+	struct sc_pkcs15_cert *c1 = cert->cert_data;
+	unsigned int pos, i;
+
+	pos = idx ? related_index_position(fw_data, (struct pkcs15_any_object *) cert) : 0;
+	if (pos == 0) {
+		pkcs15_bind_related_objects(fw_data);
+		return;
+	}
+
+	related_index_add_cert(idx, pos, c1);
+	if (cert->base.base.flags & SC_PKCS11_OBJECT_HIDDEN)
+		return;
+	__pkcs15_cert_bind_related(fw_data, cert);
+
+	if (!c1->subject_len)
+		return;
+	i = idx->issuer_buckets[related_index_hash(0, c1->subject, c1->subject_len) & (idx->size - 1)];
+	for (; i; i = idx->issuer_next[i - 1]) {
+		struct pkcs15_cert_object *cert2 = (struct pkcs15_cert_object *) fw_data->objects[i - 1];
+		struct sc_pkcs15_cert *c2 = cert2->cert_data;
+
+		if (cert2 == cert || cert2->base.base.flags & SC_PKCS11_OBJECT_HIDDEN)
+			continue;
+		if (c2->issuer_len != c1->subject_len || memcmp(c2->issuer, c1->subject, c1->subject_len))
+			continue;
+		/* the first issuer in the table order wins */
+		if (cert2->cert_issuer && related_index_position(fw_data,
+					(struct pkcs15_any_object *) cert2->cert_issuer) < pos)
+			continue;
+		sc_log(context, "Associating object %d (id %s) as issuer",
+				pos - 1, sc_pkcs15_print_id(&cert->cert_info->id));
+		cert2->cert_issuer = cert;
+	}
+}
+
 
 /* We deferred reading of the cert until needed, as it may be
  * a private object, so we must wait till login to read  */
@@ -1050,7 +1310,7 @@ check_cert_data_read(struct pkcs15_fw_data *fw_data, struct pkcs15_cert_object *
 	pkcs15_cert_extract_label(cert);
 
 	/* now that we have the cert and pub key, lets see if we can bind anything else */
-	pkcs15_bind_related_objects(fw_data);
+	pkcs15_bind_related_cert(fw_data, cert);
 
 	return rv;
 }
@@ -1077,6 +1337,7 @@ pkcs15_add_object(struct sc_pkcs11_slot *slot, struct pkcs15_any_object *obj,
 		*pHandle = handle;
 
 	list_append(&slot->objects, obj);
+	slot->objects_generation++;
 	sc_log(context, "Slot:%lX Setting object handle of 0x%lx to 0x%lx",
 		   slot->id, obj->base.handle, handle);
 	obj->base.handle = handle;
@@ -1517,10 +1778,11 @@ _add_pin_related_objects(struct sc_pkcs11_slot *slot, struct sc_pkcs15_object *p
 			continue;
 		}
 
-		if (move_to_fw && move_to_fw != fw_data && move_to_fw->num_objects < MAX_OBJECTS)   {
+		if (move_to_fw && move_to_fw != fw_data
+				&& __pkcs15_append_object(move_to_fw, obj) == SC_SUCCESS)   {
 			int tail = fw_data->num_objects - i - 1;
 
-			move_to_fw->objects[move_to_fw->num_objects++] = obj;
+			related_index_drop(fw_data);
 			if (tail)
 				memcpy(&fw_data->objects[i], &fw_data->objects[i + 1], sizeof(fw_data->objects[0]) * tail);
 			i--;
@@ -1649,14 +1911,21 @@ pkcs15_create_tokens(struct sc_pkcs11_card *p11card, struct sc_app_info *app_inf
 	 *  - configuration impose to create slot for all PINs.
 	 */
 	if (!auth_user_pin || cs_flags & SC_PKCS11_SLOT_CREATE_ALL)   {
-		struct sc_pkcs15_object *auths[MAX_OBJECTS];
+		struct sc_pkcs15_object **auths = NULL;
 		int auth_count;
 
-		memset(auths, 0, sizeof(auths));
 		/* Get authentication PKCS#15 objects present in the associated on-card application */
-		rc = sc_pkcs15_get_objects(fw_data->p15_card, SC_PKCS15_TYPE_AUTH_PIN, auths, SC_PKCS15_MAX_PINS);
-		if (rc < 0)
+		rc = sc_pkcs15_get_objects(fw_data->p15_card, SC_PKCS15_TYPE_AUTH_PIN, NULL, 0);
+		if (rc > 0) {
+			auths = calloc(rc, sizeof(*auths));
+			if (!auths)
+				return CKR_HOST_MEMORY;
+			rc = sc_pkcs15_get_objects(fw_data->p15_card, SC_PKCS15_TYPE_AUTH_PIN, auths, rc);
+		}
+		if (rc < 0) {
+			free(auths);
 			return sc_to_cryptoki_error(rc, NULL);
+		}
 		auth_count = rc;
 		sc_log(context, "Found %d authentication objects", auth_count);
 
@@ -1670,8 +1939,10 @@ pkcs15_create_tokens(struct sc_pkcs11_card *p11card, struct sc_app_info *app_inf
 			sc_log(context, "Found authentication object '%.*s'", (int) sizeof auths[i]->label, auths[i]->label);
 
 			rv = pkcs15_create_slot(p11card, fw_data, auths[i], app_info, &islot);
-			if (rv != CKR_OK)
+			if (rv != CKR_OK) {
+				free(auths);
 				return CKR_OK; /* no more slots available for this card */
+			}
 			islot->fw_data_idx = idx;
 			_add_pin_related_objects(islot, auths[i], fw_data, NULL);
 
@@ -1681,6 +1952,7 @@ pkcs15_create_tokens(struct sc_pkcs11_card *p11card, struct sc_app_info *app_inf
 			else if (!slot && auth_user_pin && auth_user_pin == auths[i])
 				slot = islot;
 		}
+		free(auths);
 	}
 	else   {
 		sc_log(context, "User/Sign PINs %p/%p", auth_user_pin, auth_sign_pin);
@@ -1857,7 +2129,7 @@ pkcs15_login(struct sc_pkcs11_slot *slot, CK_USER_TYPE userType,
 		return sc_to_cryptoki_error(rc, "C_Login");
 
 	if (userType == CKU_USER)   {
-		sc_pkcs15_object_t *p15_obj = p15card->obj_list;
+		sc_pkcs15_object_t *p15_obj = p15card->obj_tail;
 		sc_pkcs15_search_key_t sk;
 
 		sc_log(context, "Check if pkcs15 object list can be completed.");
@@ -1866,10 +2138,6 @@ pkcs15_login(struct sc_pkcs11_slot *slot, CK_USER_TYPE userType,
 		if (p15_obj == NULL)
 			return CKR_OK;
 
-		/* Select last object in list */
-		while(p15_obj->next)
-			p15_obj = p15_obj->next;
-
 		/* Trigger enumeration of EF.XXX files */
 		memset(&sk, 0, sizeof(sk));
 		sk.class_mask = SC_PKCS15_SEARCH_CLASS_PRKEY | SC_PKCS15_SEARCH_CLASS_PUBKEY |
@@ -3441,6 +3709,7 @@ pkcs15_skey_destroy(struct sc_pkcs11_session *session, void *object)
 	/* Oppose to pkcs15_add_object */
 	--any_obj->refcount; /* correct refcount */
 	list_delete(&session->slot->objects, any_obj);
+	session->slot->objects_generation++;
 	/* Delete object in pkcs15 */
 	rv = __pkcs15_delete_object(fw_data, any_obj);
 
@@ -3511,6 +3780,7 @@ pkcs15_any_destroy(struct sc_pkcs11_session *session, void *object)
 				 * and was created from certificate. */
 				--ao_pubkey->refcount;
 				list_delete(&session->slot->objects, ao_pubkey);
+				session->slot->objects_generation++;
 				/* Delete public key object in pkcs15 */
 				if (pubkey->pub_data)   {
 					sc_log(context, "Found pub_data %p", pubkey->pub_data);
@@ -3529,6 +3799,7 @@ pkcs15_any_destroy(struct sc_pkcs11_session *session, void *object)
 		/* Oppose to pkcs15_add_object */
 		--any_obj->refcount; /* correct refcount */
 		list_delete(&session->slot->objects, any_obj);
+		session->slot->objects_generation++;
 		/* Delete object in pkcs15 */
 		rv = __pkcs15_delete_object(fw_data, any_obj);
 	}
@@ -3646,6 +3917,7 @@ pkcs15_set_attrib(struct sc_pkcs11_session *session, struct sc_pkcs15_object *p1
 		id.len = attr->ulValueLen;
 		rv = sc_pkcs15init_change_attrib(fw_data->p15_card, profile, p15_object,
 				P15_ATTR_TYPE_ID, &id, sizeof(id));
+		related_index_drop(fw_data);
 		break;
 	case CKA_SUBJECT:
 		rv = SC_SUCCESS;
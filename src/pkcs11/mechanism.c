@@ -22,6 +22,7 @@
 
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
 
 #include "sc-pkcs11.h"
 #include "common/compat_overflow.h"
@@ -41,6 +42,7 @@ struct operation_data {
 	sc_pkcs11_operation_t *md;
 	CK_BYTE			*buffer;
 	CK_ULONG		buffer_len;
+	CK_ULONG		buffer_size;
 };
 
 static struct operation_data *
@@ -55,10 +57,12 @@ operation_data_release(struct operation_data *data)
 	if (!data)
 		return;
 	sc_pkcs11_release_operation(&data->md);
-	sc_mem_secure_clear_free(data->buffer, data->buffer_len);
+	sc_mem_secure_clear_free(data->buffer, data->buffer_size);
 	free(data);
 }
 
+/* The buffer grows geometrically, so that streaming the data in many
+ * small parts takes linear time and few secure allocations */
 static CK_RV
 signature_data_buffer_append(struct operation_data *data,
 		const CK_BYTE *in, CK_ULONG in_len)
@@ -71,16 +75,22 @@ signature_data_buffer_append(struct operation_data *data,
 	CK_ULONG new_len;
 	if (__builtin_uaddl_overflow(data->buffer_len, in_len, &new_len))
 		return CKR_ARGUMENTS_BAD;
-	CK_BYTE *new_buffer = sc_mem_secure_alloc(new_len);
-	if (!new_buffer)
-		return CKR_HOST_MEMORY;
-
-	if (data->buffer_len != 0)
-		memcpy(new_buffer, data->buffer, data->buffer_len);
-	memcpy(new_buffer+data->buffer_len, in, in_len);
-
-	sc_mem_secure_clear_free(data->buffer, data->buffer_len);
-	data->buffer = new_buffer;
+	if (new_len > data->buffer_size) {
+		CK_ULONG new_size = data->buffer_size * 2;
+
+		if (new_size < data->buffer_size || new_size < new_len)
+			new_size = new_len;
+		CK_BYTE *new_buffer = sc_mem_secure_alloc(new_size);
+		if (!new_buffer)
+			return CKR_HOST_MEMORY;
+
+		if (data->buffer_len != 0)
+			memcpy(new_buffer, data->buffer, data->buffer_len);
+		sc_mem_secure_clear_free(data->buffer, data->buffer_size);
+		data->buffer = new_buffer;
+		data->buffer_size = new_size;
+	}
+	memcpy(data->buffer + data->buffer_len, in, in_len);
 	data->buffer_len = new_len;
 	return CKR_OK;
 }
@@ -93,6 +103,60 @@ void _update_mech_info(CK_MECHANISM_INFO_PTR mech_info, CK_MECHANISM_INFO_PTR ne
 	mech_info->flags |= new_mech_info->flags;
 }
 
+/*
+ * Mechanism table: open addressing over the positions + 1 in
+ * p11card->mechanisms, hashed by the mechanism type. Mechanisms are never
+ * removed, so probing for a type visits its registrations in the order
+ * they were made and the first match is the one a scan of the list finds.
+ * Without a table (out of memory), the list is scanned.
+ */
+#define MECH_TABLE_MIN_SIZE	64
+
+static size_t
+mech_table_slot(CK_MECHANISM_TYPE mech, size_t size)
+{
+	/* multiplicative hashing, vendor defined types differ in the high bits */
+	return (size_t)(((uint64_t) mech * 0x9E3779B97F4A7C15ULL) >> 32) & (size - 1);
+}
+
+static void
+mech_table_insert(unsigned int *table, size_t size, CK_MECHANISM_TYPE mech, unsigned int pos)
+{
+	size_t i = mech_table_slot(mech, size);
+
+	while (table[i])
+		i = (i + 1) & (size - 1);
+	table[i] = pos;
+}
+
+/* Add the last registered mechanism to the table, growing it as needed */
+static void
+mech_table_add(struct sc_pkcs11_card *p11card)
+{
+	unsigned int n = p11card->nmechanisms;
+
+	if (p11card->mech_table && (size_t) n * 2 > p11card->mech_table_size) {
+		free(p11card->mech_table);
+		p11card->mech_table = NULL;
+	}
+	if (!p11card->mech_table) {
+		size_t size = MECH_TABLE_MIN_SIZE;
+		unsigned int i;
+
+		while (size < (size_t) n * 2)
+			size <<= 1;
+		p11card->mech_table = calloc(size, sizeof(unsigned int));
+		if (!p11card->mech_table)
+			return;
+		p11card->mech_table_size = size;
+		for (i = 0; i < n; i++)
+			mech_table_insert(p11card->mech_table, size, p11card->mechanisms[i]->mech, i + 1);
+		return;
+	}
+	mech_table_insert(p11card->mech_table, p11card->mech_table_size,
+			p11card->mechanisms[n - 1]->mech, n);
+}
+
 /*
  * Copy a mechanism
  */
@@ -173,6 +237,7 @@ sc_pkcs11_register_mechanism(struct sc_pkcs11_card *p11card,
 	p11card->mechanisms = p;
 	p[p11card->nmechanisms++] = copy_mt;
 	p[p11card->nmechanisms] = NULL;
+	mech_table_add(p11card);
 	/* Return registered mechanism for further use */
 	if (result_mt)
 		*result_mt = copy_mt;
@@ -201,6 +266,20 @@ sc_pkcs11_find_mechanism(struct sc_pkcs11_card *p11card, CK_MECHANISM_TYPE mech,
 	sc_pkcs11_mechanism_type_t *mt;
 	unsigned int n;
 
+	if (p11card->mech_table) {
+		size_t size = p11card->mech_table_size;
+		size_t i = mech_table_slot(mech, size);
+
+		/* the flags may have been extended since the registration,
+		 * so they are checked here rather than hashed */
+		for (; (n = p11card->mech_table[i]) != 0; i = (i + 1) & (size - 1)) {
+			mt = p11card->mechanisms[n - 1];
+			if (mt->mech == mech && ((mt->mech_info.flags & flags) == flags))
+				return mt;
+		}
+		return NULL;
+	}
+
 	for (n = 0; n < p11card->nmechanisms; n++) {
 		mt = p11card->mechanisms[n];
 		if (mt && mt->mech == mech && ((mt->mech_info.flags & flags) == flags))
@@ -51,7 +51,6 @@
 
 sc_context_t *context = NULL;
 struct sc_pkcs11_config sc_pkcs11_conf;
-list_t sessions;
 list_t virtual_slots;
 #if !defined(_WIN32)
 pid_t initialized_pid = (pid_t)-1;
@@ -216,23 +215,6 @@ static sc_thread_context_t sc_thread_ctx = {
 	sc_unlock_mutex, sc_destroy_mutex, NULL
 };
 
-/* simclist helpers to locate interesting objects by ID */
-static int session_list_seeker(const void *el, const void *key) {
-	const struct sc_pkcs11_session *session = (struct sc_pkcs11_session *)el;
-	if ((el == NULL) || (key == NULL))
-		return 0;
-	if (session->handle == *(CK_SESSION_HANDLE*)key)
-		return 1;
-	return 0;
-}
-static int slot_list_seeker(const void *el, const void *key) {
-	const struct sc_pkcs11_slot *slot = (struct sc_pkcs11_slot *)el;
-	if ((el == NULL) || (key == NULL))
-		return 0;
-	if (slot->id == *(CK_SLOT_ID *)key)
-		return 1;
-	return 0;
-}
 
 #ifndef _WIN32
 __attribute__((constructor))
@@ -355,19 +337,11 @@ CK_RV C_Initialize(CK_VOID_PTR pInitArgs)
 	/* Load configuration */
 	load_pkcs11_parameters(&sc_pkcs11_conf, context);
 
-	/* List of sessions */
-	if (0 != list_init(&sessions)) {
-		rv = CKR_HOST_MEMORY;
-		goto out;
-	}
-	list_attributes_seeker(&sessions, session_list_seeker);
-
 	/* List of slots */
 	if (0 != list_init(&virtual_slots)) {
 		rv = CKR_HOST_MEMORY;
 		goto out;
 	}
-	list_attributes_seeker(&virtual_slots, slot_list_seeker);
 
 	card_detect_all();
 
@@ -394,7 +368,6 @@ out:
 CK_RV C_Finalize(CK_VOID_PTR pReserved)
 {
 	int i;
-	void *p;
 	sc_pkcs11_slot_t *slot;
 	CK_RV rv;
 
@@ -421,9 +394,7 @@ CK_RV C_Finalize(CK_VOID_PTR pReserved)
 	for (i=0; i < (int)sc_ctx_get_reader_count(context); i++)
 		card_removed(sc_ctx_get_reader(context, i));
 
-	while ((p = list_fetch(&sessions)))
-		free(p);
-	list_destroy(&sessions);
+	session_table_free();
 
 	while ((slot = list_fetch(&virtual_slots))) {
 		list_destroy(&slot->objects);
@@ -431,6 +402,7 @@ CK_RV C_Finalize(CK_VOID_PTR pReserved)
 		free(slot);
 	}
 	list_destroy(&virtual_slots);
+	slot_index_free();
 
 	sc_release_context(context);
 	context = NULL;
@@ -728,7 +700,7 @@ CK_RV C_InitToken(CK_SLOT_ID slotID,
 	struct sc_pkcs11_session *session;
 	struct sc_pkcs11_slot *slot;
 	CK_RV rv;
-	unsigned int i;
+	unsigned long pos = 0;
 
 	sc_log(context, "C_InitToken(pLabel='%s') called", pLabel);
 	rv = sc_pkcs11_lock();
@@ -749,8 +721,7 @@ CK_RV C_InitToken(CK_SLOT_ID slotID,
 	}
 
 	/* Make sure there's no open session for this token */
-	for (i=0; i<list_size(&sessions); i++) {
-		session = (struct sc_pkcs11_session*)list_get_at(&sessions, i);
+	while ((session = session_table_next(&pos)) != NULL) {
 		if (session->slot == slot) {
 			rv = CKR_SESSION_EXISTS;
 			goto out;
@@ -1040,6 +1011,145 @@ void sc_pkcs11_free_lock(void)
 	global_locking = NULL;
 }
 
+/*
+ * Per-card locks
+ *
+ * The global lock protects the slot and session lists and everything
+ * hanging off them. Long running operations on a token hold the lock of
+ * its card instead, so that tokens in different readers can be used in
+ * parallel. Nobody waits for a card lock holding the global lock: the card
+ * is referenced, the global lock is given up while waiting and taken again
+ * afterwards, so a card lock is always acquired before the global lock.
+ * A card removed meanwhile is freed once its last reference is dropped.
+ */
+CK_RV sc_pkcs11_init_card_lock(struct sc_pkcs11_card *p11card)
+{
+	if (!global_lock || !global_locking)
+		return CKR_OK;
+	return global_locking->CreateMutex(&p11card->mutex);
+}
+
+static void
+__sc_pkcs11_relock(void)
+{
+	if (global_lock && global_locking) {
+		while (global_locking->LockMutex(global_lock) != CKR_OK)
+			;
+	}
+}
+
+/*
+ * Lock the card, called and returning with the global lock held. Fails
+ * with CKR_DEVICE_REMOVED if the card was removed while waiting.
+ * Release with sc_pkcs11_unlock_card().
+ */
+CK_RV sc_pkcs11_lock_card(struct sc_pkcs11_card *p11card)
+{
+	if (!p11card)
+		return CKR_OK;
+	p11card->refs++;
+	if (p11card->mutex && global_locking) {
+		sc_pkcs11_unlock();
+		while (global_locking->LockMutex(p11card->mutex) != CKR_OK)
+			;
+		__sc_pkcs11_relock();
+	}
+	if (p11card->removed) {
+		sc_pkcs11_unlock_card(p11card);
+		return CKR_DEVICE_REMOVED;
+	}
+	return CKR_OK;
+}
+
+/* Called with the global lock held */
+void sc_pkcs11_unlock_card(struct sc_pkcs11_card *p11card)
+{
+	if (!p11card)
+		return;
+	if (p11card->mutex && global_locking)
+		__sc_pkcs11_unlock(p11card->mutex);
+	if (--p11card->refs == 0 && p11card->removed)
+		sc_pkcs11_card_free(p11card);
+}
+
+void sc_pkcs11_free_card_lock(struct sc_pkcs11_card *p11card)
+{
+	if (!p11card->mutex)
+		return;
+	if (global_locking)
+		global_locking->DestroyMutex(p11card->mutex);
+	p11card->mutex = NULL;
+}
+
+/*
+ * Take the lock of the card behind the session in addition to the global
+ * lock, which waits for the operations running on the card. Everything
+ * that changes the session or its objects does so holding both locks.
+ * The session may go away while waiting, so callers look up the session
+ * and its objects only after this succeeded.
+ * Release with sc_pkcs11_unlock_card().
+ */
+CK_RV sc_pkcs11_lock_session_card(CK_SESSION_HANDLE hSession, struct sc_pkcs11_card **p11card)
+{
+	struct sc_pkcs11_session *session;
+	struct sc_pkcs11_card *card;
+	CK_RV rv;
+
+	*p11card = NULL;
+	rv = get_session(hSession, &session);
+	if (rv != CKR_OK)
+		return rv;
+	card = session->slot ? session->slot->p11card : NULL;
+	rv = sc_pkcs11_lock_card(card);
+	if (rv != CKR_OK)
+		return rv;
+
+	/* the session may have been closed or moved to another card meanwhile */
+	rv = get_session(hSession, &session);
+	if (rv == CKR_OK && (session->slot ? session->slot->p11card : NULL) != card)
+		rv = CKR_SESSION_HANDLE_INVALID;
+	if (rv != CKR_OK) {
+		sc_pkcs11_unlock_card(card);
+		return rv;
+	}
+	*p11card = card;
+	return CKR_OK;
+}
+
+/*
+ * Trade the global lock for the lock of the card behind the session.
+ * Sets the card now locked, or NULL if the global lock is kept (failure,
+ * no card or no locking). Release with sc_pkcs11_leave_card() in any case.
+ */
+CK_RV sc_pkcs11_enter_card(CK_SESSION_HANDLE hSession, struct sc_pkcs11_session **session,
+		struct sc_pkcs11_card **p11card)
+{
+	struct sc_pkcs11_card *card;
+	CK_RV rv;
+
+	*p11card = NULL;
+	rv = sc_pkcs11_lock_session_card(hSession, &card);
+	if (rv == CKR_OK)
+		rv = get_session(hSession, session);
+	if (rv != CKR_OK || !card || !card->mutex || !global_locking) {
+		sc_pkcs11_unlock_card(card);
+		return rv;
+	}
+	sc_pkcs11_unlock();
+	*p11card = card;
+	return CKR_OK;
+}
+
+void sc_pkcs11_leave_card(struct sc_pkcs11_card *p11card)
+{
+	if (p11card) {
+		/* the card reference is dropped under the global lock */
+		__sc_pkcs11_relock();
+		sc_pkcs11_unlock_card(p11card);
+	}
+	sc_pkcs11_unlock();
+}
+
 CK_FUNCTION_LIST pkcs11_function_list = {
 	{ 2, 20 }, /* Note: NSS/Firefox ignores this version number and uses C_GetInfo() */
 	C_Initialize,
@@ -20,6 +20,7 @@
 
 #include "config.h"
 
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 
@@ -65,12 +66,211 @@ sc_find_release(sc_pkcs11_operation_t *operation)
 {
 	struct sc_pkcs11_find_operation *fop = (struct sc_pkcs11_find_operation *)operation;
 
-	if (fop->handles) {
-		free(fop->handles);
-		fop->handles = NULL;
+	free(fop->attrs);
+	fop->attrs = NULL;
+	fop->nattrs = 0;
+	free(fop->objects);
+	fop->objects = NULL;
+	fop->num_objects = 0;
+}
+
+/* Order in which the template attributes are compared: cheap and
+ * selective ones first, values that may have to be read from the
+ * card last */
+#define FIND_RANK_MAX	4
+static int
+find_attribute_rank(CK_ATTRIBUTE_TYPE type)
+{
+	switch (type) {
+	case CKA_CLASS:
+		return 0;
+	case CKA_ID:
+		return 1;
+	case CKA_KEY_TYPE:
+	case CKA_CERTIFICATE_TYPE:
+		return 2;
+	case CKA_VALUE:
+		return FIND_RANK_MAX;
+	default:
+		return 3;
 	}
 }
 
+/* Copy the search template into the operation, sorted by rank */
+static CK_RV
+find_plan(struct sc_pkcs11_find_operation *fop, CK_ATTRIBUTE_PTR pTemplate, CK_ULONG ulCount)
+{
+	size_t size = ulCount * sizeof(CK_ATTRIBUTE);
+	unsigned char *value;
+	CK_ULONG i, n = 0;
+	int rank;
+
+	if (ulCount == 0)
+		return CKR_OK;
+	if (ulCount > SIZE_MAX / sizeof(CK_ATTRIBUTE))
+		return CKR_HOST_MEMORY;
+	for (i = 0; i < ulCount; i++) {
+		if (pTemplate[i].pValue == NULL_PTR)
+			continue;
+		if (pTemplate[i].ulValueLen > SIZE_MAX - size)
+			return CKR_HOST_MEMORY;
+		size += pTemplate[i].ulValueLen;
+	}
+
+	fop->attrs = malloc(size);
+	if (fop->attrs == NULL)
+		return CKR_HOST_MEMORY;
+	value = (unsigned char *) (fop->attrs + ulCount);
+	for (rank = 0; rank <= FIND_RANK_MAX; rank++) {
+		for (i = 0; i < ulCount; i++) {
+			if (find_attribute_rank(pTemplate[i].type) != rank)
+				continue;
+			fop->attrs[n] = pTemplate[i];
+			if (pTemplate[i].pValue != NULL_PTR) {
+				memcpy(value, pTemplate[i].pValue, pTemplate[i].ulValueLen);
+				fop->attrs[n].pValue = value;
+				value += pTemplate[i].ulValueLen;
+			}
+			n++;
+		}
+	}
+	fop->nattrs = n;
+	return CKR_OK;
+}
+
+/* Remember the objects of the slot, the search only returns these */
+static CK_RV
+find_snapshot(struct sc_pkcs11_find_operation *fop, struct sc_pkcs11_slot *slot)
+{
+	struct sc_pkcs11_object *object;
+	size_t n = list_size(&slot->objects);
+
+	fop->generation = slot->objects_generation;
+	if (n == 0)
+		return CKR_OK;
+	fop->objects = calloc(n, sizeof(*fop->objects));
+	if (fop->objects == NULL)
+		return CKR_HOST_MEMORY;
+	if (list_iterator_start(&slot->objects) > 0) {
+		while (fop->num_objects < n && (object = list_iterator_next(&slot->objects))) {
+			fop->objects[fop->num_objects].handle = object->handle;
+			fop->objects[fop->num_objects].object = object;
+			fop->num_objects++;
+		}
+		list_iterator_stop(&slot->objects);
+	}
+	return CKR_OK;
+}
+
+static int
+find_object_cmp(const void *a, const void *b)
+{
+	CK_OBJECT_HANDLE ha = (*(struct sc_pkcs11_find_object * const *)a)->handle;
+	CK_OBJECT_HANDLE hb = (*(struct sc_pkcs11_find_object * const *)b)->handle;
+
+	return ha < hb ? -1 : ha > hb;
+}
+
+/* Objects were added to or removed from the slot since the search took
+ * its pointers: look the remaining objects up by handle again, in a
+ * single pass over the slot */
+static CK_RV
+find_refresh(struct sc_pkcs11_find_operation *fop, struct sc_pkcs11_slot *slot)
+{
+	struct sc_pkcs11_find_object **index, **entry, key, *pkey = &key;
+	struct sc_pkcs11_object *object;
+	CK_ULONG i, n = fop->num_objects - fop->next_object;
+
+	if (n > 0) {
+		index = malloc(n * sizeof(*index));
+		if (index == NULL)
+			return CKR_HOST_MEMORY;
+		for (i = 0; i < n; i++) {
+			index[i] = &fop->objects[fop->next_object + i];
+			index[i]->object = NULL;
+		}
+		qsort(index, n, sizeof(*index), find_object_cmp);
+		if (list_iterator_start(&slot->objects) > 0) {
+			while ((object = list_iterator_next(&slot->objects))) {
+				key.handle = object->handle;
+				entry = bsearch(&pkey, index, n, sizeof(*index), find_object_cmp);
+				if (entry != NULL)
+					(*entry)->object = object;
+			}
+			list_iterator_stop(&slot->objects);
+		}
+		free(index);
+	}
+	fop->generation = slot->objects_generation;
+	return CKR_OK;
+}
+
+/* Continue the search through the objects of the slot until
+ * ulMaxObjectCount matches are found or the objects are exhausted */
+static CK_RV
+find_next_objects(struct sc_pkcs11_session *session, struct sc_pkcs11_find_operation *fop,
+		CK_OBJECT_HANDLE_PTR phObject, CK_ULONG ulMaxObjectCount, CK_ULONG_PTR pulFound)
+{
+	struct sc_pkcs11_slot *slot = session->slot;
+	struct sc_pkcs11_object *object;
+	CK_BBOOL is_private = TRUE;
+	CK_ATTRIBUTE private_attribute = { CKA_PRIVATE, &is_private, sizeof(is_private) };
+	CK_ULONG found = 0, j;
+	CK_RV rv = CKR_OK;
+	int match;
+
+	while (found < ulMaxObjectCount && fop->next_object < fop->num_objects) {
+		/* the slot may also change while the attributes are compared */
+		if (fop->generation != slot->objects_generation) {
+			rv = find_refresh(fop, slot);
+			if (rv != CKR_OK)
+				break;
+		}
+		object = fop->objects[fop->next_object++].object;
+		if (object == NULL)
+			continue;
+		sc_log(context, "Object with handle 0x%lx", object->handle);
+
+		/* User not logged in and private object? */
+		if (fop->hide_private) {
+			if (object->ops->get_attribute(session, object, &private_attribute) != CKR_OK)
+			        continue;
+			if (is_private) {
+				sc_log(context,
+				       "Object %lu/%lu: Private object and not logged in.",
+				       slot->id, object->handle);
+				continue;
+			}
+		}
+
+		/* Try to match every attribute */
+		match = 1;
+		for (j = 0; j < fop->nattrs; j++) {
+			if (object->ops->cmp_attribute(session, object, &fop->attrs[j]) == 0) {
+				sc_log(context,
+				       "Object %lu/%lu: Attribute 0x%lx does NOT match.",
+				       slot->id, object->handle, fop->attrs[j].type);
+				match = 0;
+				break;
+			}
+
+			if (context->debug >= 4) {
+				sc_log(context,
+				       "Object %lu/%lu: Attribute 0x%lx matches.",
+				       slot->id, object->handle, fop->attrs[j].type);
+			}
+		}
+		if (!match)
+			continue;
+
+		sc_log(context, "Object %lu/%lu matches\n", slot->id, object->handle);
+		phObject[found++] = object->handle;
+	}
+
+	*pulFound = found;
+	return rv;
+}
+
 
 static CK_RV
 get_object_from_session(CK_SESSION_HANDLE hSession, CK_OBJECT_HANDLE hObject,
@@ -91,8 +291,8 @@ get_object_from_session(CK_SESSION_HANDLE hSession, CK_OBJECT_HANDLE hObject,
 }
 
 /* C_CreateObject can be called from C_DeriveKey
- * which is holding the sc_pkcs11_lock
- * So dont get the lock again. */
+ * which is holding the sc_pkcs11_lock and the card lock
+ * So dont get the locks again. */
 static
 CK_RV sc_create_object_int(CK_SESSION_HANDLE hSession,	/* the session's handle */
 		CK_ATTRIBUTE_PTR pTemplate,		/* the object's template */
@@ -103,6 +303,7 @@ CK_RV sc_create_object_int(CK_SESSION_HANDLE hSession,	/* the session's handle *
 	CK_RV rv = CKR_OK;
 	struct sc_pkcs11_session *session;
 	struct sc_pkcs11_card *card;
+	struct sc_pkcs11_card *p11card = NULL;
 	CK_BBOOL is_token = FALSE;
 
 	LOG_FUNC_CALLED(context);
@@ -117,7 +318,12 @@ CK_RV sc_create_object_int(CK_SESSION_HANDLE hSession,	/* the session's handle *
 
 	dump_template(SC_LOG_DEBUG_NORMAL, "C_CreateObject()", pTemplate, ulCount);
 
-	session = list_seek(&sessions, &hSession);
+	if (use_lock) {
+		rv = sc_pkcs11_lock_session_card(hSession, &p11card);
+		if (rv != CKR_OK)
+			goto out;
+	}
+	session = session_table_get(hSession);
 	if (!session) {
 		rv = CKR_SESSION_HANDLE_INVALID;
 		goto out;
@@ -146,8 +352,10 @@ CK_RV sc_create_object_int(CK_SESSION_HANDLE hSession,	/* the session's handle *
 		rv = card->framework->create_object(session->slot, pTemplate, ulCount, phObject);
 
 out:
-	if (use_lock)
+	if (use_lock) {
+		sc_pkcs11_unlock_card(p11card);
 		sc_pkcs11_unlock();
+	}
 
 	return rv;
 }
@@ -179,6 +387,7 @@ C_DestroyObject(CK_SESSION_HANDLE hSession,	/* the session's handle */
 {
 	CK_RV rv;
 	struct sc_pkcs11_session *session;
+	struct sc_pkcs11_card *p11card = NULL;
 	struct sc_pkcs11_object *object;
 	CK_BBOOL is_token = FALSE;
 	CK_ATTRIBUTE token_attribute = {CKA_TOKEN, &is_token, sizeof(is_token)};
@@ -188,7 +397,9 @@ C_DestroyObject(CK_SESSION_HANDLE hSession,	/* the session's handle */
 		return rv;
 
 	sc_log(context, "C_DestroyObject(hSession=0x%lx, hObject=0x%lx)", hSession, hObject);
-	rv = get_object_from_session(hSession, hObject, &session, &object);
+	rv = sc_pkcs11_lock_session_card(hSession, &p11card);
+	if (rv == CKR_OK)
+		rv = get_object_from_session(hSession, hObject, &session, &object);
 	if (rv != CKR_OK)
 		goto out;
 
@@ -210,6 +421,7 @@ C_DestroyObject(CK_SESSION_HANDLE hSession,	/* the session's handle */
 		rv = object->ops->destroy_object(session, object);
 
 out:
+	sc_pkcs11_unlock_card(p11card);
 	sc_pkcs11_unlock();
 	return rv;
 }
@@ -241,6 +453,7 @@ C_GetAttributeValue(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	CK_RV j;
 	CK_RV rv;
 	struct sc_pkcs11_session *session;
+	struct sc_pkcs11_card *p11card = NULL;
 	struct sc_pkcs11_object *object;
 	CK_RV res;
 	CK_RV res_type;
@@ -254,7 +467,9 @@ C_GetAttributeValue(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	if (rv != CKR_OK)
 		return rv;
 
-	rv = get_object_from_session(hSession, hObject, &session, &object);
+	rv = sc_pkcs11_lock_session_card(hSession, &p11card);
+	if (rv == CKR_OK)
+		rv = get_object_from_session(hSession, hObject, &session, &object);
 	if (rv != CKR_OK)
 		goto out;
 
@@ -297,6 +512,7 @@ out:
 		sc_log(context, "C_GetAttributeValue(hSession=0x%lx, hObject=0x%lx) = 0x%lx",
                         hSession, hObject, rv);
 
+	sc_pkcs11_unlock_card(p11card);
 	sc_pkcs11_unlock();
 	return rv;
 }
@@ -311,6 +527,7 @@ C_SetAttributeValue(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	CK_RV rv;
 	unsigned int i;
 	struct sc_pkcs11_session *session;
+	struct sc_pkcs11_card *p11card = NULL;
 	struct sc_pkcs11_object *object;
 
 	if (pTemplate == NULL_PTR || ulCount == 0)
@@ -322,7 +539,9 @@ C_SetAttributeValue(CK_SESSION_HANDLE hSession,	/* the session's handle */
 
 	dump_template(SC_LOG_DEBUG_NORMAL, "C_SetAttributeValue", pTemplate, ulCount);
 
-	rv = get_object_from_session(hSession, hObject, &session, &object);
+	rv = sc_pkcs11_lock_session_card(hSession, &p11card);
+	if (rv == CKR_OK)
+		rv = get_object_from_session(hSession, hObject, &session, &object);
 	if (rv != CKR_OK)
 		goto out;
 
@@ -342,6 +561,7 @@ C_SetAttributeValue(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	}
 
 out:
+	sc_pkcs11_unlock_card(p11card);
 	sc_pkcs11_unlock();
 	return rv;
 }
@@ -353,12 +573,8 @@ C_FindObjectsInit(CK_SESSION_HANDLE hSession,	/* the session's handle */
 		CK_ULONG ulCount)		/* attributes in search template */
 {
 	CK_RV rv;
-	CK_BBOOL is_private = TRUE;
-	CK_ATTRIBUTE private_attribute = { CKA_PRIVATE, &is_private, sizeof(is_private) };
-	int match, hide_private;
-	unsigned int i, j;
 	struct sc_pkcs11_session *session;
-	struct sc_pkcs11_object *object;
+	struct sc_pkcs11_card *p11card = NULL;
 	struct sc_pkcs11_find_operation *operation;
 	struct sc_pkcs11_slot *slot;
 	struct sc_pkcs11_operation *op = NULL;
@@ -370,7 +586,9 @@ C_FindObjectsInit(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	if (rv != CKR_OK)
 		return rv;
 
-	rv = get_session(hSession, &session);
+	rv = sc_pkcs11_lock_session_card(hSession, &p11card);
+	if (rv == CKR_OK)
+		rv = get_session(hSession, &session);
 	if (rv != CKR_OK)
 		goto out;
 
@@ -383,75 +601,27 @@ C_FindObjectsInit(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	if (rv != CKR_OK)
 		goto out;
 
-	operation->current_handle = 0;
-	operation->num_handles = 0;
-	operation->allocated_handles = 0;
-	operation->handles = NULL;
+	operation->attrs = NULL;
+	operation->nattrs = 0;
+	operation->objects = NULL;
+	operation->num_objects = 0;
+	operation->next_object = 0;
 	slot = session->slot;
 
 	/* Check whether we should hide private objects */
-	hide_private = 0;
+	operation->hide_private = 0;
 	if ((slot->login_user == -1) && (slot->token_info.flags & CKF_LOGIN_REQUIRED))
-		hide_private = 1;
+		operation->hide_private = 1;
 
-	/* For each object in token do */
-	for (i=0; i<list_size(&slot->objects); i++) {
-		object = (struct sc_pkcs11_object *)list_get_at(&slot->objects, i);
-		sc_log(context, "Object with handle 0x%lx", object->handle);
-
-		/* User not logged in and private object? */
-		if (hide_private) {
-			if (object->ops->get_attribute(session, object, &private_attribute) != CKR_OK)
-			        continue;
-			if (is_private) {
-				sc_log(context,
-				       "Object %lu/%lu: Private object and not logged in.",
-				       slot->id, object->handle);
-				continue;
-			}
-		}
-
-		/* Try to match every attribute */
-		match = 1;
-		for (j = 0; j < ulCount; j++) {
-			rv = object->ops->cmp_attribute(session, object, &pTemplate[j]);
-			if (rv == 0) {
-				sc_log(context,
-				       "Object %lu/%lu: Attribute 0x%lx does NOT match.",
-				       slot->id, object->handle, pTemplate[j].type);
-				match = 0;
-				break;
-			}
-
-			if (context->debug >= 4) {
-				sc_log(context,
-				       "Object %lu/%lu: Attribute 0x%lx matches.",
-				       slot->id, object->handle, pTemplate[j].type);
-			}
-		}
-
-		if (match) {
-			sc_log(context, "Object %lu/%lu matches\n", slot->id,
-			       object->handle);
-			/* Realloc handles - remove restriction on only 32 matching objects -dee */
-			if (operation->num_handles >= operation->allocated_handles) {
-				operation->allocated_handles += SC_PKCS11_FIND_INC_HANDLES;
-				sc_log(context, "realloc for %d handles", operation->allocated_handles);
-				operation->handles = realloc(operation->handles,
-					sizeof(CK_OBJECT_HANDLE) * operation->allocated_handles);
-				if (operation->handles == NULL) {
-					rv = CKR_HOST_MEMORY;
-					goto out;
-				}
-			}
-			operation->handles[operation->num_handles++] = object->handle;
-		}
-	}
-	rv = CKR_OK;
-
-	sc_log(context, "%d matching objects\n", operation->num_handles);
+	/* The objects are matched lazily by C_FindObjects() */
+	rv = find_plan(operation, pTemplate, ulCount);
+	if (rv == CKR_OK)
+		rv = find_snapshot(operation, slot);
+	if (rv != CKR_OK)
+		session_stop_operation(session, SC_PKCS11_OPERATION_FIND);
 
 out:
+	sc_pkcs11_unlock_card(p11card);
 	sc_pkcs11_unlock();
 	return rv;
 }
@@ -464,8 +634,8 @@ C_FindObjects(CK_SESSION_HANDLE hSession,	/* the session's handle */
 		CK_ULONG_PTR pulObjectCount)	/* actual number returned */
 {
 	CK_RV rv;
-	CK_ULONG to_return;
 	struct sc_pkcs11_session *session;
+	struct sc_pkcs11_card *p11card = NULL;
 	struct sc_pkcs11_find_operation *operation;
 	struct sc_pkcs11_operation *op = NULL;
 
@@ -476,7 +646,9 @@ C_FindObjects(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	if (rv != CKR_OK)
 		return rv;
 
-	rv = get_session(hSession, &session);
+	rv = sc_pkcs11_lock_session_card(hSession, &p11card);
+	if (rv == CKR_OK)
+		rv = get_session(hSession, &session);
 	if (rv != CKR_OK)
 		goto out;
 
@@ -485,17 +657,12 @@ C_FindObjects(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	if (rv != CKR_OK)
 		goto out;
 
-	to_return = (CK_ULONG) operation->num_handles - operation->current_handle;
-	if (to_return > ulMaxObjectCount)
-		to_return = ulMaxObjectCount;
-
-	*pulObjectCount = to_return;
-
-	memcpy(phObject, &operation->handles[operation->current_handle], to_return * sizeof(CK_OBJECT_HANDLE));
-
-	operation->current_handle += to_return;
+	rv = find_next_objects(session, operation, phObject, ulMaxObjectCount, pulObjectCount);
+	sc_log(context, "%lu matching objects\n", *pulObjectCount);
 
-out:	sc_pkcs11_unlock();
+out:
+	sc_pkcs11_unlock_card(p11card);
+	sc_pkcs11_unlock();
 	return rv;
 }
 
@@ -505,12 +672,15 @@ C_FindObjectsFinal(CK_SESSION_HANDLE hSession)	/* the session's handle */
 {
 	CK_RV rv;
 	struct sc_pkcs11_session *session;
+	struct sc_pkcs11_card *p11card = NULL;
 
 	rv = sc_pkcs11_lock();
 	if (rv != CKR_OK)
 		return rv;
 
-	rv = get_session(hSession, &session);
+	rv = sc_pkcs11_lock_session_card(hSession, &p11card);
+	if (rv == CKR_OK)
+		rv = get_session(hSession, &session);
 	if (rv != CKR_OK)
 		goto out;
 
@@ -518,7 +688,9 @@ C_FindObjectsFinal(CK_SESSION_HANDLE hSession)	/* the session's handle */
 	if (rv == CKR_OK)
 		session_stop_operation(session, SC_PKCS11_OPERATION_FIND);
 
-out:	sc_pkcs11_unlock();
+out:
+	sc_pkcs11_unlock_card(p11card);
+	sc_pkcs11_unlock();
 	return rv;
 }
 
@@ -532,6 +704,7 @@ C_DigestInit(CK_SESSION_HANDLE hSession,	/* the session's handle */
 {
 	CK_RV rv;
 	struct sc_pkcs11_session *session;
+	struct sc_pkcs11_card *p11card = NULL;
 
 	if (pMechanism == NULL_PTR)
 		return CKR_ARGUMENTS_BAD;
@@ -541,11 +714,14 @@ C_DigestInit(CK_SESSION_HANDLE hSession,	/* the session's handle */
 		return rv;
 
 	sc_log(context, "C_DigestInit(hSession=0x%lx)", hSession);
-	rv = get_session(hSession, &session);
+	rv = sc_pkcs11_lock_session_card(hSession, &p11card);
+	if (rv == CKR_OK)
+		rv = get_session(hSession, &session);
 	if (rv == CKR_OK)
 		rv = sc_pkcs11_md_init(session, pMechanism);
 
 	SC_LOG_RV("C_DigestInit() = %s", rv);
+	sc_pkcs11_unlock_card(p11card);
 	sc_pkcs11_unlock();
 	return rv;
 }
@@ -560,6 +736,7 @@ C_Digest(CK_SESSION_HANDLE hSession,		/* the session's handle */
 {
 	CK_RV rv;
 	struct sc_pkcs11_session *session;
+	struct sc_pkcs11_card *p11card = NULL;
 	CK_ULONG  ulBuflen = 0;
 
 	rv = sc_pkcs11_lock();
@@ -567,7 +744,9 @@ C_Digest(CK_SESSION_HANDLE hSession,		/* the session's handle */
 		return rv;
 
 	sc_log(context, "C_Digest(hSession=0x%lx)", hSession);
-	rv = get_session(hSession, &session);
+	rv = sc_pkcs11_lock_session_card(hSession, &p11card);
+	if (rv == CKR_OK)
+		rv = get_session(hSession, &session);
 	if (rv != CKR_OK)
 		goto out;
 
@@ -591,6 +770,7 @@ C_Digest(CK_SESSION_HANDLE hSession,		/* the session's handle */
 
 out:
 	SC_LOG_RV("C_Digest = %s", rv);
+	sc_pkcs11_unlock_card(p11card);
 	sc_pkcs11_unlock();
 	return rv;
 }
@@ -603,16 +783,20 @@ C_DigestUpdate(CK_SESSION_HANDLE hSession,	/* the session's handle */
 {
 	CK_RV rv;
 	struct sc_pkcs11_session *session;
+	struct sc_pkcs11_card *p11card = NULL;
 
 	rv = sc_pkcs11_lock();
 	if (rv != CKR_OK)
 		return rv;
 
-	rv = get_session(hSession, &session);
+	rv = sc_pkcs11_lock_session_card(hSession, &p11card);
+	if (rv == CKR_OK)
+		rv = get_session(hSession, &session);
 	if (rv == CKR_OK)
 		rv = sc_pkcs11_md_update(session, pPart, ulPartLen);
 
 	SC_LOG_RV("C_DigestUpdate() = %s", rv);
+	sc_pkcs11_unlock_card(p11card);
 	sc_pkcs11_unlock();
 	return rv;
 }
@@ -633,16 +817,20 @@ C_DigestFinal(CK_SESSION_HANDLE hSession,	/* the session's handle */
 {
 	CK_RV rv;
 	struct sc_pkcs11_session *session;
+	struct sc_pkcs11_card *p11card = NULL;
 
 	rv = sc_pkcs11_lock();
 	if (rv != CKR_OK)
 		return rv;
 
-	rv = get_session(hSession, &session);
+	rv = sc_pkcs11_lock_session_card(hSession, &p11card);
+	if (rv == CKR_OK)
+		rv = get_session(hSession, &session);
 	if (rv == CKR_OK)
 		rv = sc_pkcs11_md_final(session, pDigest, pulDigestLen);
 
 	SC_LOG_RV("C_DigestFinal() = %s", rv);
+	sc_pkcs11_unlock_card(p11card);
 	sc_pkcs11_unlock();
 	return rv;
 }
@@ -658,6 +846,7 @@ C_SignInit(CK_SESSION_HANDLE hSession,		/* the session's handle */
 	CK_ATTRIBUTE sign_attribute = { CKA_SIGN, &can_sign, sizeof(can_sign) };
 	CK_ATTRIBUTE key_type_attr = { CKA_KEY_TYPE, &key_type, sizeof(key_type) };
 	struct sc_pkcs11_session *session;
+	struct sc_pkcs11_card *p11card = NULL;
 	struct sc_pkcs11_object *object;
 	CK_RV rv;
 
@@ -668,7 +857,9 @@ C_SignInit(CK_SESSION_HANDLE hSession,		/* the session's handle */
 	if (rv != CKR_OK)
 		return rv;
 
-	rv = get_object_from_session(hSession, hKey, &session, &object);
+	rv = sc_pkcs11_lock_session_card(hSession, &p11card);
+	if (rv == CKR_OK)
+		rv = get_object_from_session(hSession, hKey, &session, &object);
 	if (rv != CKR_OK) {
 		if (rv == CKR_OBJECT_HANDLE_INVALID)
 			rv = CKR_KEY_HANDLE_INVALID;
@@ -695,6 +886,7 @@ C_SignInit(CK_SESSION_HANDLE hSession,		/* the session's handle */
 
 out:
 	SC_LOG_RV("C_SignInit() = %s", rv);
+	sc_pkcs11_unlock_card(p11card);
 	sc_pkcs11_unlock();
 	return rv;
 }
@@ -709,13 +901,14 @@ C_Sign(CK_SESSION_HANDLE hSession,		/* the session's handle */
 {
 	CK_RV rv;
 	struct sc_pkcs11_session *session;
+	struct sc_pkcs11_card *p11card = NULL;
 	CK_ULONG length;
 
 	rv = sc_pkcs11_lock();
 	if (rv != CKR_OK)
 		return rv;
 
-	rv = get_session(hSession, &session);
+	rv = sc_pkcs11_enter_card(hSession, &session, &p11card);
 	if (rv != CKR_OK)
 		goto out;
 
@@ -743,7 +936,7 @@ C_Sign(CK_SESSION_HANDLE hSession,		/* the session's handle */
 
 out:
 	SC_LOG_RV("C_Sign() = %s", rv);
-	sc_pkcs11_unlock();
+	sc_pkcs11_leave_card(p11card);
 	return rv;
 }
 
@@ -755,17 +948,18 @@ C_SignUpdate(CK_SESSION_HANDLE hSession,	/* the session's handle */
 {
 	CK_RV rv;
 	struct sc_pkcs11_session *session;
+	struct sc_pkcs11_card *p11card = NULL;
 
 	rv = sc_pkcs11_lock();
 	if (rv != CKR_OK)
 		return rv;
 
-	rv = get_session(hSession, &session);
+	rv = sc_pkcs11_enter_card(hSession, &session, &p11card);
 	if (rv == CKR_OK)
 		rv = sc_pkcs11_sign_update(session, pPart, ulPartLen);
 
 	SC_LOG_RV("C_SignUpdate() = %s", rv);
-	sc_pkcs11_unlock();
+	sc_pkcs11_leave_card(p11card);
 	return rv;
 }
 
@@ -776,6 +970,7 @@ C_SignFinal(CK_SESSION_HANDLE hSession,		/* the session's handle */
 		CK_ULONG_PTR pulSignatureLen)	/* receives byte count of signature */
 {
 	struct sc_pkcs11_session *session;
+	struct sc_pkcs11_card *p11card = NULL;
 	CK_ULONG length;
 	CK_RV rv;
 
@@ -783,7 +978,7 @@ C_SignFinal(CK_SESSION_HANDLE hSession,		/* the session's handle */
 	if (rv != CKR_OK)
 		return rv;
 
-	rv = get_session(hSession, &session);
+	rv = sc_pkcs11_enter_card(hSession, &session, &p11card);
 	if (rv != CKR_OK)
 		goto out;
 
@@ -807,7 +1002,7 @@ C_SignFinal(CK_SESSION_HANDLE hSession,		/* the session's handle */
 
 out:
 	SC_LOG_RV("C_SignFinal() = %s", rv);
-	sc_pkcs11_unlock();
+	sc_pkcs11_leave_card(p11card);
 	return rv;
 }
 
@@ -842,6 +1037,7 @@ C_EncryptInit(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	CK_ATTRIBUTE encrypt_attribute = {CKA_ENCRYPT, &can_encrypt, sizeof(can_encrypt)};
 	CK_ATTRIBUTE key_type_attr = {CKA_KEY_TYPE, &key_type, sizeof(key_type)};
 	struct sc_pkcs11_session *session;
+	struct sc_pkcs11_card *p11card = NULL;
 	struct sc_pkcs11_object *object;
 	CK_RV rv;
 
@@ -852,7 +1048,9 @@ C_EncryptInit(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	if (rv != CKR_OK)
 		return rv;
 
-	rv = get_object_from_session(hSession, hKey, &session, &object);
+	rv = sc_pkcs11_lock_session_card(hSession, &p11card);
+	if (rv == CKR_OK)
+		rv = get_object_from_session(hSession, hKey, &session, &object);
 	if (rv != CKR_OK) {
 		if (rv == CKR_OBJECT_HANDLE_INVALID)
 			rv = CKR_KEY_HANDLE_INVALID;
@@ -877,6 +1075,7 @@ C_EncryptInit(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	rv = sc_pkcs11_encr_init(session, pMechanism, object, key_type);
 out:
 	SC_LOG_RV("C_EncryptInit() = %s", rv);
+	sc_pkcs11_unlock_card(p11card);
 	sc_pkcs11_unlock();
 	return rv;
 }
@@ -890,12 +1089,13 @@ CK_RV C_Encrypt(CK_SESSION_HANDLE hSession,	/* the session's handle */
 {				/* receives encrypted byte count */
 	CK_RV rv;
 	struct sc_pkcs11_session *session;
+	struct sc_pkcs11_card *p11card = NULL;
 
 	rv = sc_pkcs11_lock();
 	if (rv != CKR_OK)
 		return rv;
 
-	rv = get_session(hSession, &session);
+	rv = sc_pkcs11_enter_card(hSession, &session, &p11card);
 	if (rv == CKR_OK) {
 		rv = restore_login_state(session->slot);
 		if (rv == CKR_OK)
@@ -904,7 +1104,7 @@ CK_RV C_Encrypt(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	}
 
 	SC_LOG_RV("C_Encrypt() = %s", rv);
-	sc_pkcs11_unlock();
+	sc_pkcs11_leave_card(p11card);
 	return rv;
 }
 
@@ -916,18 +1116,19 @@ CK_RV C_EncryptUpdate(CK_SESSION_HANDLE hSession,	/* the session's handle */
 {				/* receives encrypted byte count */
 	CK_RV rv;
 	struct sc_pkcs11_session *session;
+	struct sc_pkcs11_card *p11card = NULL;
 
 	rv = sc_pkcs11_lock();
 	if (rv != CKR_OK)
 		return rv;
 
-	rv = get_session(hSession, &session);
+	rv = sc_pkcs11_enter_card(hSession, &session, &p11card);
 	if (rv == CKR_OK)
 		rv = sc_pkcs11_encr_update(session, pPart, ulPartLen,
 				pEncryptedPart, pulEncryptedPartLen);
 
 	SC_LOG_RV("C_EncryptUpdate() = %s", rv);
-	sc_pkcs11_unlock();
+	sc_pkcs11_leave_card(p11card);
 	return rv;
 }
 
@@ -937,12 +1138,13 @@ CK_RV C_EncryptFinal(CK_SESSION_HANDLE hSession,	/* the session's handle */
 {				/* receives byte count */
 	CK_RV rv;
 	struct sc_pkcs11_session *session;
+	struct sc_pkcs11_card *p11card = NULL;
 
 	rv = sc_pkcs11_lock();
 	if (rv != CKR_OK)
 		return rv;
 
-	rv = get_session(hSession, &session);
+	rv = sc_pkcs11_enter_card(hSession, &session, &p11card);
 	if (rv == CKR_OK) {
 		rv = restore_login_state(session->slot);
 		if (rv == CKR_OK)
@@ -951,7 +1153,7 @@ CK_RV C_EncryptFinal(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	}
 
 	SC_LOG_RV("C_EncryptFinal() = %s", rv);
-	sc_pkcs11_unlock();
+	sc_pkcs11_leave_card(p11card);
 	return rv;
 }
 
@@ -965,6 +1167,7 @@ CK_RV C_DecryptInit(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	CK_ATTRIBUTE key_type_attr = { CKA_KEY_TYPE,	&key_type,	sizeof(key_type) };
 	CK_ATTRIBUTE unwrap_attribute = { CKA_UNWRAP,	&can_unwrap,	sizeof(can_unwrap) };
 	struct sc_pkcs11_session *session;
+	struct sc_pkcs11_card *p11card = NULL;
 	struct sc_pkcs11_object *object;
 	CK_RV rv;
 
@@ -975,7 +1178,9 @@ CK_RV C_DecryptInit(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	if (rv != CKR_OK)
 		return rv;
 
-	rv = get_object_from_session(hSession, hKey, &session, &object);
+	rv = sc_pkcs11_lock_session_card(hSession, &p11card);
+	if (rv == CKR_OK)
+		rv = get_object_from_session(hSession, hKey, &session, &object);
 	if (rv != CKR_OK) {
 		if (rv == CKR_OBJECT_HANDLE_INVALID)
 			rv = CKR_KEY_HANDLE_INVALID;
@@ -1006,6 +1211,7 @@ CK_RV C_DecryptInit(CK_SESSION_HANDLE hSession,	/* the session's handle */
 
 out:
 	SC_LOG_RV("C_DecryptInit() = %s", rv);
+	sc_pkcs11_unlock_card(p11card);
 	sc_pkcs11_unlock();
 	return rv;
 }
@@ -1019,12 +1225,13 @@ C_Decrypt(CK_SESSION_HANDLE hSession,	     /* the session's handle */
 {
 	CK_RV rv;
 	struct sc_pkcs11_session *session;
+	struct sc_pkcs11_card *p11card = NULL;
 
 	rv = sc_pkcs11_lock();
 	if (rv != CKR_OK)
 		return rv;
 
-	rv = get_session(hSession, &session);
+	rv = sc_pkcs11_enter_card(hSession, &session, &p11card);
 	if (rv == CKR_OK) {
 		rv = restore_login_state(session->slot);
 		if (rv == CKR_OK) {
@@ -1035,7 +1242,7 @@ C_Decrypt(CK_SESSION_HANDLE hSession,	     /* the session's handle */
 	}
 
 	SC_LOG_RV("C_Decrypt() = %s", rv);
-	sc_pkcs11_unlock();
+	sc_pkcs11_leave_card(p11card);
 	return rv;
 }
 
@@ -1048,18 +1255,19 @@ C_DecryptUpdate(CK_SESSION_HANDLE hSession,  /* the session's handle */
 {
 	CK_RV rv;
 	struct sc_pkcs11_session *session;
+	struct sc_pkcs11_card *p11card = NULL;
 
 	rv = sc_pkcs11_lock();
 	if (rv != CKR_OK)
 		return rv;
 
-	rv = get_session(hSession, &session);
+	rv = sc_pkcs11_enter_card(hSession, &session, &p11card);
 	if (rv == CKR_OK)
 		rv = sc_pkcs11_decr_update(session, pEncryptedPart, ulEncryptedPartLen,
 				pPart, pulPartLen);
 
 	SC_LOG_RV("C_DecryptUpdate() = %s", rv);
-	sc_pkcs11_unlock();
+	sc_pkcs11_leave_card(p11card);
 	return rv;
 }
 
@@ -1070,12 +1278,13 @@ C_DecryptFinal(CK_SESSION_HANDLE hSession,   /* the session's handle */
 {
 	CK_RV rv;
 	struct sc_pkcs11_session *session;
+	struct sc_pkcs11_card *p11card = NULL;
 
 	rv = sc_pkcs11_lock();
 	if (rv != CKR_OK)
 		return rv;
 
-	rv = get_session(hSession, &session);
+	rv = sc_pkcs11_enter_card(hSession, &session, &p11card);
 	if (rv == CKR_OK) {
 		rv = restore_login_state(session->slot);
 		if (rv == CKR_OK) {
@@ -1087,7 +1296,7 @@ C_DecryptFinal(CK_SESSION_HANDLE hSession,   /* the session's handle */
 	}
 
 	SC_LOG_RV("C_DecryptFinal() = %s", rv);
-	sc_pkcs11_unlock();
+	sc_pkcs11_leave_card(p11card);
 	return rv;
 }
 
@@ -1147,6 +1356,7 @@ CK_RV C_GenerateKeyPair(CK_SESSION_HANDLE hSession,	/* the session's handle */
 {				/* gets priv. key handle */
 	CK_RV rv;
 	struct sc_pkcs11_session *session;
+	struct sc_pkcs11_card *p11card = NULL;
 	struct sc_pkcs11_slot *slot;
 
 	if (pMechanism == NULL_PTR
@@ -1161,7 +1371,9 @@ CK_RV C_GenerateKeyPair(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	dump_template(SC_LOG_DEBUG_NORMAL, "C_GenerateKeyPair(), PrivKey attrs", pPrivateKeyTemplate, ulPrivateKeyAttributeCount);
 	dump_template(SC_LOG_DEBUG_NORMAL, "C_GenerateKeyPair(), PubKey attrs", pPublicKeyTemplate, ulPublicKeyAttributeCount);
 
-	rv = get_session(hSession, &session);
+	rv = sc_pkcs11_lock_session_card(hSession, &p11card);
+	if (rv == CKR_OK)
+		rv = get_session(hSession, &session);
 	if (rv != CKR_OK)
 		goto out;
 
@@ -1185,6 +1397,7 @@ CK_RV C_GenerateKeyPair(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	}
 
 out:
+	sc_pkcs11_unlock_card(p11card);
 	sc_pkcs11_unlock();
 	return rv;
 }
@@ -1205,6 +1418,7 @@ CK_RV C_WrapKey(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	CK_ATTRIBUTE extractable_attribute = { CKA_EXTRACTABLE, &can_be_wrapped, sizeof(can_be_wrapped) };
 	CK_ATTRIBUTE key_type_attr = { CKA_KEY_TYPE, &key_type, sizeof(key_type) };
 	struct sc_pkcs11_session *session;
+	struct sc_pkcs11_card *p11card = NULL;
 	struct sc_pkcs11_object *wrapping_object;
 	struct sc_pkcs11_object *key_object;
 
@@ -1216,7 +1430,9 @@ CK_RV C_WrapKey(CK_SESSION_HANDLE hSession,	/* the session's handle */
 		return rv;
 
 	/* Check if the wrapping key is OK to do wrapping */
-	rv = get_object_from_session(hSession, hWrappingKey, &session, &wrapping_object);
+	rv = sc_pkcs11_lock_session_card(hSession, &p11card);
+	if (rv == CKR_OK)
+		rv = get_object_from_session(hSession, hWrappingKey, &session, &wrapping_object);
 	if (rv != CKR_OK) {
 		if (rv == CKR_OBJECT_HANDLE_INVALID)
 			rv = CKR_KEY_HANDLE_INVALID;
@@ -1260,6 +1476,7 @@ CK_RV C_WrapKey(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	rv = reset_login_state(session->slot, rv);
 
 out:
+	sc_pkcs11_unlock_card(p11card);
 	sc_pkcs11_unlock();
 	return rv;
 }
@@ -1279,6 +1496,7 @@ CK_RV C_UnwrapKey(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	CK_ATTRIBUTE unwrap_attribute = { CKA_UNWRAP, &can_unwrap, sizeof(can_unwrap) };
 	CK_ATTRIBUTE key_type_attr = { CKA_KEY_TYPE, &key_type, sizeof(key_type) };
 	struct sc_pkcs11_session *session;
+	struct sc_pkcs11_card *p11card = NULL;
 	struct sc_pkcs11_object *object;
 	struct sc_pkcs11_object *key_object;
 
@@ -1289,7 +1507,9 @@ CK_RV C_UnwrapKey(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	if (rv != CKR_OK)
 		return rv;
 
-	rv = get_object_from_session(hSession, hUnwrappingKey, &session, &object);
+	rv = sc_pkcs11_lock_session_card(hSession, &p11card);
+	if (rv == CKR_OK)
+		rv = get_object_from_session(hSession, hUnwrappingKey, &session, &object);
 	if (rv != CKR_OK) {
 		if (rv == CKR_OBJECT_HANDLE_INVALID)
 			rv = CKR_KEY_HANDLE_INVALID;
@@ -1332,6 +1552,7 @@ CK_RV C_UnwrapKey(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	rv = reset_login_state(session->slot, rv);
 
 out:
+	sc_pkcs11_unlock_card(p11card);
 	sc_pkcs11_unlock();
 	return rv;
 }
@@ -1351,6 +1572,7 @@ CK_RV C_DeriveKey(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	CK_ATTRIBUTE derive_attribute = { CKA_DERIVE, &can_derive, sizeof(can_derive) };
 	CK_ATTRIBUTE key_type_attr = { CKA_KEY_TYPE, &key_type, sizeof(key_type) };
 	struct sc_pkcs11_session *session;
+	struct sc_pkcs11_card *p11card = NULL;
 	struct sc_pkcs11_object *object;
 	struct sc_pkcs11_object *key_object;
 
@@ -1361,7 +1583,9 @@ CK_RV C_DeriveKey(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	if (rv != CKR_OK)
 		return rv;
 
-	rv = get_object_from_session(hSession, hBaseKey, &session, &object);
+	rv = sc_pkcs11_lock_session_card(hSession, &p11card);
+	if (rv == CKR_OK)
+		rv = get_object_from_session(hSession, hBaseKey, &session, &object);
 	if (rv != CKR_OK) {
 		if (rv == CKR_OBJECT_HANDLE_INVALID)
 			rv = CKR_KEY_HANDLE_INVALID;
@@ -1415,6 +1639,7 @@ CK_RV C_DeriveKey(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	}
 
 out:
+	sc_pkcs11_unlock_card(p11card);
 	sc_pkcs11_unlock();
 	return rv;
 }
@@ -1432,13 +1657,14 @@ CK_RV C_GenerateRandom(CK_SESSION_HANDLE hSession,	/* the session's handle */
 {				/* number of bytes to be generated */
 	CK_RV rv;
 	struct sc_pkcs11_session *session;
+	struct sc_pkcs11_card *p11card = NULL;
 	struct sc_pkcs11_slot *slot;
 
 	rv = sc_pkcs11_lock();
 	if (rv != CKR_OK)
 		return rv;
 
-	rv = get_session(hSession, &session);
+	rv = sc_pkcs11_enter_card(hSession, &session, &p11card);
 	if (rv == CKR_OK) {
 		slot = session->slot;
 		if (slot == NULL || slot->p11card == NULL || slot->p11card->framework == NULL
@@ -1449,7 +1675,7 @@ CK_RV C_GenerateRandom(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	}
 
 	SC_LOG_RV("C_GenerateRandom() = %s", rv);
-	sc_pkcs11_unlock();
+	sc_pkcs11_leave_card(p11card);
 	return rv;
 }
 
@@ -1474,6 +1700,7 @@ CK_RV C_VerifyInit(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	CK_ATTRIBUTE key_type_attr = { CKA_KEY_TYPE, &key_type, sizeof(key_type) };
 	CK_RV rv;
 	struct sc_pkcs11_session *session;
+	struct sc_pkcs11_card *p11card = NULL;
 	struct sc_pkcs11_object *object;
 
 	if (pMechanism == NULL_PTR)
@@ -1484,7 +1711,9 @@ CK_RV C_VerifyInit(CK_SESSION_HANDLE hSession,	/* the session's handle */
 		return rv;
 
 
-	rv = get_object_from_session(hSession, hKey, &session, &object);
+	rv = sc_pkcs11_lock_session_card(hSession, &p11card);
+	if (rv == CKR_OK)
+		rv = get_object_from_session(hSession, hKey, &session, &object);
 	if (rv != CKR_OK) {
 		if (rv == CKR_OBJECT_HANDLE_INVALID)
 			rv = CKR_KEY_HANDLE_INVALID;
@@ -1500,6 +1729,7 @@ CK_RV C_VerifyInit(CK_SESSION_HANDLE hSession,	/* the session's handle */
 
 out:
 	SC_LOG_RV("C_VerifyInit() = %s", rv);
+	sc_pkcs11_unlock_card(p11card);
 	sc_pkcs11_unlock();
 	return rv;
 #endif
@@ -1516,12 +1746,13 @@ CK_RV C_Verify(CK_SESSION_HANDLE hSession,	/* the session's handle */
 #else
 	CK_RV rv;
 	struct sc_pkcs11_session *session;
+	struct sc_pkcs11_card *p11card = NULL;
 
 	rv = sc_pkcs11_lock();
 	if (rv != CKR_OK)
 		return rv;
 
-	rv = get_session(hSession, &session);
+	rv = sc_pkcs11_enter_card(hSession, &session, &p11card);
 	if (rv != CKR_OK)
 		goto out;
 
@@ -1535,7 +1766,7 @@ CK_RV C_Verify(CK_SESSION_HANDLE hSession,	/* the session's handle */
 
 out:
 	SC_LOG_RV("C_Verify() = %s", rv);
-	sc_pkcs11_unlock();
+	sc_pkcs11_leave_card(p11card);
 	return rv;
 #endif
 }
@@ -1549,17 +1780,18 @@ CK_RV C_VerifyUpdate(CK_SESSION_HANDLE hSession,	/* the session's handle */
 #else
 	CK_RV rv;
 	struct sc_pkcs11_session *session;
+	struct sc_pkcs11_card *p11card = NULL;
 
 	rv = sc_pkcs11_lock();
 	if (rv != CKR_OK)
 		return rv;
 
-	rv = get_session(hSession, &session);
+	rv = sc_pkcs11_enter_card(hSession, &session, &p11card);
 	if (rv == CKR_OK)
 		rv = sc_pkcs11_verif_update(session, pPart, ulPartLen);
 
 	SC_LOG_RV("C_VerifyUpdate() = %s", rv);
-	sc_pkcs11_unlock();
+	sc_pkcs11_leave_card(p11card);
 	return rv;
 #endif
 }
@@ -1573,12 +1805,13 @@ CK_RV C_VerifyFinal(CK_SESSION_HANDLE hSession,	/* the session's handle */
 #else
 	CK_RV rv;
 	struct sc_pkcs11_session *session;
+	struct sc_pkcs11_card *p11card = NULL;
 
 	rv = sc_pkcs11_lock();
 	if (rv != CKR_OK)
 		return rv;
 
-	rv = get_session(hSession, &session);
+	rv = sc_pkcs11_enter_card(hSession, &session, &p11card);
 	if (rv == CKR_OK) {
 		rv = restore_login_state(session->slot);
 		if (rv == CKR_OK)
@@ -1587,7 +1820,7 @@ CK_RV C_VerifyFinal(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	}
 
 	SC_LOG_RV("C_VerifyFinal() = %s", rv);
-	sc_pkcs11_unlock();
+	sc_pkcs11_leave_card(p11card);
 	return rv;
 #endif
 }
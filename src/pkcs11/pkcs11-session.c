@@ -27,9 +27,129 @@
 
 #include "sc-pkcs11.h"
 
+/*
+ * Open sessions live in a table indexed by their handle. The low bits of
+ * a handle are the index into the table, the high bits a generation
+ * number that is bumped whenever an entry is released, so that a stale
+ * handle is rejected instead of picking up a newer session. An entry whose
+ * generation is used up is retired rather than wrapped around, so a
+ * handle is never handed out twice.
+ */
+#define SESSION_INDEX_BITS	16
+#define SESSION_INDEX_MASK	((1UL << SESSION_INDEX_BITS) - 1)
+#define SESSION_GENERATION_MAX	((CK_SESSION_HANDLE)-1 >> SESSION_INDEX_BITS)
+#define SESSION_TABLE_MIN	16
+
+struct session_entry {
+	struct sc_pkcs11_session *session;
+	unsigned long generation;
+	unsigned long next_free;	/* index + 1 of the next free entry */
+};
+
+static struct {
+	struct session_entry *entries;
+	unsigned long size;
+	unsigned long count;
+	unsigned long free_head;	/* index + 1 of the first free entry */
+} session_table;
+
+struct sc_pkcs11_session *session_table_get(CK_SESSION_HANDLE hSession)
+{
+	unsigned long idx = hSession & SESSION_INDEX_MASK;
+	struct session_entry *entry;
+
+	if (idx >= session_table.size)
+		return NULL;
+	entry = &session_table.entries[idx];
+	if (entry->session == NULL
+			|| entry->generation != (hSession >> SESSION_INDEX_BITS))
+		return NULL;
+	return entry->session;
+}
+
+CK_RV session_table_add(struct sc_pkcs11_session *session)
+{
+	struct session_entry *entry;
+	unsigned long idx;
+
+	if (session_table.free_head == 0) {
+		unsigned long i, size = session_table.size ? 2 * session_table.size : SESSION_TABLE_MIN;
+		struct session_entry *entries;
+
+		if (size > SESSION_INDEX_MASK + 1)
+			size = SESSION_INDEX_MASK + 1;
+		if (size == session_table.size)
+			return CKR_SESSION_COUNT;
+		entries = realloc(session_table.entries, size * sizeof(struct session_entry));
+		if (entries == NULL)
+			return CKR_HOST_MEMORY;
+		/* chain the new entries in front of the (empty) free list */
+		for (i = session_table.size; i < size; i++) {
+			entries[i].session = NULL;
+			entries[i].generation = 1;
+			entries[i].next_free = i + 1 < size ? i + 2 : 0;
+		}
+		session_table.free_head = session_table.size + 1;
+		session_table.entries = entries;
+		session_table.size = size;
+	}
+
+	idx = session_table.free_head - 1;
+	entry = &session_table.entries[idx];
+	session_table.free_head = entry->next_free;
+	entry->session = session;
+	session_table.count++;
+	session->handle = (CK_SESSION_HANDLE)(entry->generation << SESSION_INDEX_BITS | idx);
+	return CKR_OK;
+}
+
+void session_table_remove(struct sc_pkcs11_session *session)
+{
+	unsigned long idx = session->handle & SESSION_INDEX_MASK;
+	struct session_entry *entry;
+
+	if (session_table_get(session->handle) != session)
+		return;
+	entry = &session_table.entries[idx];
+	entry->session = NULL;
+	session_table.count--;
+	if (entry->generation == SESSION_GENERATION_MAX)
+		return;
+	entry->generation++;
+	entry->next_free = session_table.free_head;
+	session_table.free_head = idx + 1;
+}
+
+/* Iterate over the open sessions, start with *pos = 0 */
+struct sc_pkcs11_session *session_table_next(unsigned long *pos)
+{
+	while (*pos < session_table.size) {
+		struct sc_pkcs11_session *session = session_table.entries[(*pos)++].session;
+		if (session != NULL)
+			return session;
+	}
+	return NULL;
+}
+
+unsigned long session_table_count(void)
+{
+	return session_table.count;
+}
+
+/* Free all sessions and the table itself */
+void session_table_free(void)
+{
+	unsigned long i;
+
+	for (i = 0; i < session_table.size; i++)
+		free(session_table.entries[i].session);
+	free(session_table.entries);
+	memset(&session_table, 0, sizeof(session_table));
+}
+
 CK_RV get_session(CK_SESSION_HANDLE hSession, struct sc_pkcs11_session **session)
 {
-	*session = list_seek(&sessions, &hSession);
+	*session = session_table_get(hSession);
 	if (!*session)
 		return CKR_SESSION_HANDLE_INVALID;
 	return CKR_OK;
@@ -73,14 +193,9 @@ CK_RV C_OpenSession(CK_SLOT_ID slotID,	/* the slot's ID */
 		goto out;
 	}
 
-	/* make session handle from pointer and check its uniqueness */
-	session->handle = (CK_SESSION_HANDLE)(uintptr_t)session;
-	if (list_seek(&sessions, &session->handle) != NULL) {
-		sc_log(context, "C_OpenSession handle 0x%lx already exists", session->handle);
-
+	rv = session_table_add(session);
+	if (rv != CKR_OK) {
 		free(session);
-
-		rv = CKR_HOST_MEMORY;
 		goto out;
 	}
 
@@ -89,7 +204,6 @@ CK_RV C_OpenSession(CK_SLOT_ID slotID,	/* the slot's ID */
 	session->notify_data = pApplication;
 	session->flags = flags;
 	slot->nsessions++;
-	list_append(&sessions, session);
 	*phSession = session->handle;
 	sc_log(context, "C_OpenSession handle: 0x%lx", session->handle);
 
@@ -108,7 +222,7 @@ static CK_RV sc_pkcs11_close_session(CK_SESSION_HANDLE hSession)
 
 	sc_log(context, "real C_CloseSession(0x%lx)", hSession);
 
-	session = list_seek(&sessions, &hSession);
+	session = session_table_get(hSession);
 	if (!session)
 		return CKR_SESSION_HANDLE_INVALID;
 
@@ -129,8 +243,7 @@ static CK_RV sc_pkcs11_close_session(CK_SESSION_HANDLE hSession)
 	for (size_t i = 0; i < SC_PKCS11_OPERATION_MAX; i++)
 		sc_pkcs11_release_operation(&session->operation[i]);
 
-	if (list_delete(&sessions, session) != 0)
-		sc_log(context, "Could not delete session from list!");
+	session_table_remove(session);
 	free(session);
 	return CKR_OK;
 }
@@ -141,10 +254,9 @@ CK_RV sc_pkcs11_close_all_sessions(CK_SLOT_ID slotID)
 {
 	CK_RV rv = CKR_OK, error;
 	struct sc_pkcs11_session *session;
-	unsigned int i;
-	sc_log(context, "real C_CloseAllSessions(0x%lx) %d", slotID, list_size(&sessions));
-	for (i = 0; i < list_size(&sessions); i++) {
-		session = list_get_at(&sessions, i);
+	unsigned long pos = 0;
+	sc_log(context, "real C_CloseAllSessions(0x%lx) %lu", slotID, session_table_count());
+	while ((session = session_table_next(&pos)) != NULL) {
 		if (session->slot->id == slotID)
 			if ((error = sc_pkcs11_close_session(session->handle)) != CKR_OK)
 				rv = error;
@@ -155,6 +267,7 @@ CK_RV sc_pkcs11_close_all_sessions(CK_SLOT_ID slotID)
 CK_RV C_CloseSession(CK_SESSION_HANDLE hSession)
 {				/* the session's handle */
 	CK_RV rv;
+	struct sc_pkcs11_card *p11card;
 
 	rv = sc_pkcs11_lock();
 	if (rv != CKR_OK)
@@ -162,7 +275,10 @@ CK_RV C_CloseSession(CK_SESSION_HANDLE hSession)
 
 	sc_log(context, "C_CloseSession(0x%lx)", hSession);
 
-	rv = sc_pkcs11_close_session(hSession);
+	rv = sc_pkcs11_lock_session_card(hSession, &p11card);
+	if (rv == CKR_OK)
+		rv = sc_pkcs11_close_session(hSession);
+	sc_pkcs11_unlock_card(p11card);
 
 	sc_pkcs11_unlock();
 	return rv;
@@ -172,6 +288,7 @@ CK_RV C_CloseAllSessions(CK_SLOT_ID slotID)
 {				/* the token's slot */
 	CK_RV rv;
 	struct sc_pkcs11_slot *slot;
+	struct sc_pkcs11_card *p11card;
 
 	rv = sc_pkcs11_lock();
 	if (rv != CKR_OK)
@@ -183,7 +300,12 @@ CK_RV C_CloseAllSessions(CK_SLOT_ID slotID)
 	if (rv != CKR_OK)
 		goto out;
 
+	p11card = slot->p11card;
+	rv = sc_pkcs11_lock_card(p11card);
+	if (rv != CKR_OK)
+		goto out;
 	rv = sc_pkcs11_close_all_sessions(slotID);
+	sc_pkcs11_unlock_card(p11card);
 
 out:
 	sc_pkcs11_unlock();
@@ -195,13 +317,16 @@ CK_RV C_SessionCancel(CK_SESSION_HANDLE hSession,  /* the session's handle */
 		      CK_FLAGS flags)      /* flags control which sessions are cancelled */
 {
 	struct sc_pkcs11_session *session;
+	struct sc_pkcs11_card *p11card = NULL;
 	CK_RV rv;
 
 	rv = sc_pkcs11_lock();
 	if (rv != CKR_OK)
 		return rv;
 
-	rv = get_session(hSession, &session);
+	rv = sc_pkcs11_lock_session_card(hSession, &p11card);
+	if (rv == CKR_OK)
+		rv = get_session(hSession, &session);
 	if (rv != CKR_OK)
 		goto out;
 
@@ -242,6 +367,7 @@ CK_RV C_SessionCancel(CK_SESSION_HANDLE hSession,  /* the session's handle */
 	}
 
 out:
+	sc_pkcs11_unlock_card(p11card);
 	sc_pkcs11_unlock();
 	return rv;
 }
@@ -251,6 +377,7 @@ CK_RV C_GetSessionInfo(CK_SESSION_HANDLE hSession,	/* the session's handle */
 {				/* receives session information */
 	CK_RV rv;
 	struct sc_pkcs11_session *session;
+	struct sc_pkcs11_card *p11card = NULL;
 	struct sc_pkcs11_slot *slot;
 	const char *name;
 
@@ -263,11 +390,10 @@ CK_RV C_GetSessionInfo(CK_SESSION_HANDLE hSession,	/* the session's handle */
 
 	sc_log(context, "C_GetSessionInfo(hSession:0x%lx)", hSession);
 
-	session = list_seek(&sessions, &hSession);
-	if (!session) {
-		rv = CKR_SESSION_HANDLE_INVALID;
+	rv = sc_pkcs11_lock_session_card(hSession, &p11card);
+	if (rv != CKR_OK)
 		goto out;
-	}
+	session = session_table_get(hSession);
 
 	sc_log(context, "C_GetSessionInfo(slot:0x%lx)", session->slot->id);
 	pInfo->slotID = session->slot->id;
@@ -298,6 +424,7 @@ out:
 		sc_log(context, "C_GetSessionInfo(0x%lx) = %s", hSession, name);
 	else
 		sc_log(context, "C_GetSessionInfo(0x%lx) = 0x%lx", hSession, rv);
+	sc_pkcs11_unlock_card(p11card);
 	sc_pkcs11_unlock();
 	return rv;
 }
@@ -326,6 +453,7 @@ CK_RV C_Login(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	CK_RV rv;
 	struct sc_pkcs11_session *session;
 	struct sc_pkcs11_slot *slot;
+	struct sc_pkcs11_card *p11card = NULL;
 
 	if (pPin == NULL_PTR && ulPinLen > 0)
 		return CKR_ARGUMENTS_BAD;
@@ -338,11 +466,10 @@ CK_RV C_Login(CK_SESSION_HANDLE hSession,	/* the session's handle */
 		rv = CKR_USER_TYPE_INVALID;
 		goto out;
 	}
-	session = list_seek(&sessions, &hSession);
-	if (!session) {
-		rv = CKR_SESSION_HANDLE_INVALID;
+	rv = sc_pkcs11_lock_session_card(hSession, &p11card);
+	if (rv != CKR_OK)
 		goto out;
-	}
+	session = session_table_get(hSession);
 
 	sc_log(context, "C_Login(0x%lx, %lu)", hSession, userType);
 
@@ -392,6 +519,7 @@ CK_RV C_Login(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	}
 
 out:
+	sc_pkcs11_unlock_card(p11card);
 	sc_pkcs11_unlock();
 	return rv;
 }
@@ -412,16 +540,16 @@ CK_RV C_Logout(CK_SESSION_HANDLE hSession)
 	CK_RV rv;
 	struct sc_pkcs11_session *session;
 	struct sc_pkcs11_slot *slot;
+	struct sc_pkcs11_card *p11card;
 
 	rv = sc_pkcs11_lock();
 	if (rv != CKR_OK)
 		return rv;
 
-	session = list_seek(&sessions, &hSession);
-	if (!session) {
-		rv = CKR_SESSION_HANDLE_INVALID;
+	rv = sc_pkcs11_lock_session_card(hSession, &p11card);
+	if (rv != CKR_OK)
 		goto out;
-	}
+	session = session_table_get(hSession);
 
 	sc_log(context, "C_Logout(hSession:0x%lx)", hSession);
 
@@ -438,6 +566,7 @@ CK_RV C_Logout(CK_SESSION_HANDLE hSession)
 		}
 	} else
 		rv = CKR_USER_NOT_LOGGED_IN;
+	sc_pkcs11_unlock_card(p11card);
 
 out:
 	sc_pkcs11_unlock();
@@ -448,6 +577,7 @@ CK_RV C_InitPIN(CK_SESSION_HANDLE hSession, CK_CHAR_PTR pPin, CK_ULONG ulPinLen)
 {
 	CK_RV rv;
 	struct sc_pkcs11_session *session;
+	struct sc_pkcs11_card *p11card = NULL;
 	struct sc_pkcs11_slot *slot;
 
 	sc_log(context, "C_InitPIN() called, pin '%s'", pPin ? (char *) pPin : "<null>");
@@ -458,11 +588,10 @@ CK_RV C_InitPIN(CK_SESSION_HANDLE hSession, CK_CHAR_PTR pPin, CK_ULONG ulPinLen)
 	if (rv != CKR_OK)
 		return rv;
 
-	session = list_seek(&sessions, &hSession);
-	if (!session) {
-		rv = CKR_SESSION_HANDLE_INVALID;
+	rv = sc_pkcs11_lock_session_card(hSession, &p11card);
+	if (rv != CKR_OK)
 		goto out;
-	}
+	session = session_table_get(hSession);
 
 	if (!(session->flags & CKF_RW_SESSION)) {
 		rv = CKR_SESSION_READ_ONLY;
@@ -484,6 +613,7 @@ CK_RV C_InitPIN(CK_SESSION_HANDLE hSession, CK_CHAR_PTR pPin, CK_ULONG ulPinLen)
 	}
 
 out:
+	sc_pkcs11_unlock_card(p11card);
 	sc_pkcs11_unlock();
 	return rv;
 }
@@ -493,6 +623,7 @@ CK_RV C_SetPIN(CK_SESSION_HANDLE hSession,
 {
 	CK_RV rv;
 	struct sc_pkcs11_session *session;
+	struct sc_pkcs11_card *p11card = NULL;
 	struct sc_pkcs11_slot *slot;
 
 	if ((pOldPin == NULL_PTR && ulOldLen > 0) || (pNewPin == NULL_PTR && ulNewLen > 0))
@@ -502,11 +633,10 @@ CK_RV C_SetPIN(CK_SESSION_HANDLE hSession,
 	if (rv != CKR_OK)
 		return rv;
 
-	session = list_seek(&sessions, &hSession);
-	if (!session) {
-		rv = CKR_SESSION_HANDLE_INVALID;
+	rv = sc_pkcs11_lock_session_card(hSession, &p11card);
+	if (rv != CKR_OK)
 		goto out;
-	}
+	session = session_table_get(hSession);
 
 	slot = session->slot;
 	sc_log(context, "Changing PIN (session 0x%lx; login user %d)", hSession, slot->login_user);
@@ -525,6 +655,7 @@ CK_RV C_SetPIN(CK_SESSION_HANDLE hSession,
 	rv = reset_login_state(slot, rv);
 
 out:
+	sc_pkcs11_unlock_card(p11card);
 	sc_pkcs11_unlock();
 	return rv;
 }
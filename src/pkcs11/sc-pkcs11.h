@@ -201,6 +201,16 @@ struct sc_pkcs11_card {
 	/* List of supported mechanisms */
 	struct sc_pkcs11_mechanism_type **mechanisms;
 	unsigned int nmechanisms;
+	/* Hash table over the mechanisms, see sc_pkcs11_find_mechanism() */
+	unsigned int *mech_table;
+	size_t mech_table_size;
+
+	/* Serializes operations on this card, see sc_pkcs11_enter_card() */
+	void *mutex;
+	/* Holders of and waiters for the mutex, under the global lock */
+	unsigned int refs;
+	/* Set by card_removed(), freed with the last reference */
+	int removed;
 };
 
 /* If the slot did already show with `C_GetSlotList`, then we need to keep this
@@ -219,6 +229,7 @@ struct sc_pkcs11_slot {
 	unsigned int events;		/* Card events SC_EVENT_CARD_{INSERTED,REMOVED} */
 	void *fw_data;			/* Framework specific data */  /* TODO: get know how it used */
 	list_t objects;			/* Objects in this slot */
+	unsigned int objects_generation;	/* Changed whenever objects are added or removed */
 	unsigned int nsessions;		/* Number of sessions using this slot */
 	sc_timestamp_t slot_state_expires;
 
@@ -357,11 +368,19 @@ struct sc_pkcs11_operation {
 };
 
 /* Find Operation */
-#define SC_PKCS11_FIND_INC_HANDLES	32
 struct sc_pkcs11_find_operation {
 	struct sc_pkcs11_operation operation;
-	int num_handles, current_handle, allocated_handles;
-	CK_OBJECT_HANDLE *handles;
+	CK_ATTRIBUTE *attrs;		/* search template, most selective attributes first */
+	CK_ULONG nattrs;
+	int hide_private;		/* user not logged in, skip private objects */
+	/* The objects of the slot when the search started, matched lazily */
+	struct sc_pkcs11_find_object {
+		CK_OBJECT_HANDLE handle;
+		struct sc_pkcs11_object *object;	/* NULL once the object is gone */
+	} *objects;
+	CK_ULONG num_objects;
+	CK_ULONG next_object;		/* position in objects to continue from */
+	unsigned int generation;	/* slot->objects_generation the pointers are valid for */
 };
 
 /*
@@ -384,7 +403,6 @@ typedef struct sc_pkcs11_session sc_pkcs11_session_t;
 /* Module variables */
 extern struct sc_context *context;
 extern struct sc_pkcs11_config sc_pkcs11_conf;
-extern list_t sessions;
 extern list_t virtual_slots;
 extern list_t cards;
 
@@ -405,6 +423,7 @@ void sc_pkcs11_card_free(struct sc_pkcs11_card *p11card);
 CK_RV card_removed(sc_reader_t *reader);
 CK_RV card_detect_all(void);
 CK_RV create_slot(sc_reader_t *reader);
+void slot_index_free(void);
 void init_slot_info(CK_SLOT_INFO_PTR pInfo, sc_reader_t *reader);
 CK_RV card_detect(sc_reader_t *reader);
 CK_RV slot_get_slot(CK_SLOT_ID id, struct sc_pkcs11_slot **);
@@ -431,6 +450,12 @@ CK_RV session_get_operation(struct sc_pkcs11_session *, int,
 			struct sc_pkcs11_operation **);
 CK_RV session_stop_operation(struct sc_pkcs11_session *, int);
 CK_RV sc_pkcs11_close_all_sessions(CK_SLOT_ID);
+struct sc_pkcs11_session *session_table_get(CK_SESSION_HANDLE);
+CK_RV session_table_add(struct sc_pkcs11_session *);
+void session_table_remove(struct sc_pkcs11_session *);
+struct sc_pkcs11_session *session_table_next(unsigned long *);
+unsigned long session_table_count(void);
+void session_table_free(void);
 
 /* Generic secret key stuff */
 CK_RV sc_pkcs11_create_secret_key(struct sc_pkcs11_session *,
@@ -521,6 +546,14 @@ CK_RV sc_pkcs11_init_lock(CK_C_INITIALIZE_ARGS_PTR);
 CK_RV sc_pkcs11_lock(void);
 void sc_pkcs11_unlock(void);
 void sc_pkcs11_free_lock(void);
+CK_RV sc_pkcs11_init_card_lock(struct sc_pkcs11_card *);
+CK_RV sc_pkcs11_lock_card(struct sc_pkcs11_card *);
+void sc_pkcs11_unlock_card(struct sc_pkcs11_card *);
+void sc_pkcs11_free_card_lock(struct sc_pkcs11_card *);
+CK_RV sc_pkcs11_lock_session_card(CK_SESSION_HANDLE, struct sc_pkcs11_card **);
+CK_RV sc_pkcs11_enter_card(CK_SESSION_HANDLE, struct sc_pkcs11_session **,
+		struct sc_pkcs11_card **);
+void sc_pkcs11_leave_card(struct sc_pkcs11_card *);
 
 #ifdef __cplusplus
 }
@@ -118,6 +118,15 @@ static int object_list_seeker(const void *el, const void *key)
 	return 0;
 }
 
+/* Slots by ID, the ID of a slot being its position in virtual_slots */
+static struct sc_pkcs11_slot **slot_index = NULL;
+
+void slot_index_free(void)
+{
+	free(slot_index);
+	slot_index = NULL;
+}
+
 CK_RV create_slot(sc_reader_t *reader)
 {
 	/* find unused slots previously allocated for the same reader */
@@ -128,6 +137,11 @@ CK_RV create_slot(sc_reader_t *reader)
 		sc_log(context, "Creating new slot");
 		if (list_size(&virtual_slots) >= sc_pkcs11_conf.max_virtual_slots)
 			return CKR_FUNCTION_FAILED;
+		if (slot_index == NULL) {
+			slot_index = calloc(sc_pkcs11_conf.max_virtual_slots, sizeof(struct sc_pkcs11_slot *));
+			if (!slot_index)
+				return CKR_HOST_MEMORY;
+		}
 
 		slot = (struct sc_pkcs11_slot *)calloc(1, sizeof(struct sc_pkcs11_slot));
 		if (!slot)
@@ -157,6 +171,7 @@ CK_RV create_slot(sc_reader_t *reader)
 
 	slot->login_user = -1;
 	slot->id = (CK_SLOT_ID) list_locate(&virtual_slots, slot);
+	slot_index[slot->id] = slot;
 	init_slot_info(&slot->slot_info, reader);
 	slot->reader = reader;
 
@@ -179,6 +194,8 @@ void sc_pkcs11_card_free(struct sc_pkcs11_card *p11card)
 			free(p11card->mechanisms[i]);
 		}
 		free(p11card->mechanisms);
+		free(p11card->mech_table);
+		sc_pkcs11_free_card_lock(p11card);
 		free(p11card);
 	}
 }
@@ -193,15 +210,26 @@ CK_RV card_removed(sc_reader_t * reader)
 
 	for (i=0; i < list_size(&virtual_slots); i++) {
 		sc_pkcs11_slot_t *slot = (sc_pkcs11_slot_t *) list_get_at(&virtual_slots, i);
-		if (slot->reader == reader) {
+		if (slot->reader == reader && slot->p11card) {
 			/* Save the "card" object */
-			if (slot->p11card)
-				p11card = slot->p11card;
-			slot_token_removed(slot->id);
+			p11card = slot->p11card;
+			break;
 		}
 	}
 
-	sc_pkcs11_card_free(p11card);
+	/* Wait for the operations still running on the card. If somebody
+	 * else removed it meanwhile, the slots are released already. */
+	if (sc_pkcs11_lock_card(p11card) != CKR_OK)
+		return CKR_OK;
+	if (p11card)
+		p11card->removed = 1;
+	for (i=0; i < list_size(&virtual_slots); i++) {
+		sc_pkcs11_slot_t *slot = (sc_pkcs11_slot_t *) list_get_at(&virtual_slots, i);
+		if (slot->reader == reader)
+			slot_token_removed(slot->id);
+	}
+	/* Frees the card, unless operations are still waiting for it */
+	sc_pkcs11_unlock_card(p11card);
 
 	return CKR_OK;
 }
@@ -259,6 +287,9 @@ again:
 			return CKR_HOST_MEMORY;
 		free_p11card = 1;
 		p11card->reader = reader;
+		rv = sc_pkcs11_init_card_lock(p11card);
+		if (rv != CKR_OK)
+			goto fail;
 	}
 
 	if (p11card->card == NULL) {
@@ -459,7 +490,9 @@ CK_RV slot_get_slot(CK_SLOT_ID id, struct sc_pkcs11_slot ** slot)
 	if (context == NULL)
 		return CKR_CRYPTOKI_NOT_INITIALIZED;
 
-	*slot = list_seek(&virtual_slots, &id);	/* FIXME: check for null? */
+	if (slot_index == NULL || id >= list_size(&virtual_slots))
+		return CKR_SLOT_ID_INVALID;
+	*slot = slot_index[id];
 	if (!*slot)
 		return CKR_SLOT_ID_INVALID;
 	return CKR_OK;
@@ -512,6 +545,7 @@ CK_RV slot_token_removed(CK_SLOT_ID id)
 		if (object->ops->release)
 			object->ops->release(object);
 	}
+	slot->objects_generation++;
 
 	/* Release framework stuff */
 	if (slot->p11card != NULL) {
@@ -3451,6 +3451,7 @@ sc_pkcs15init_change_attrib(struct sc_pkcs15_card *p15card, struct sc_profile *p
 		default:
 			LOG_TEST_RET(ctx, SC_ERROR_NOT_SUPPORTED, "Cannot change ID attribute");
 		}
+		sc_pkcs15_reindex_object(p15card, object);
 		break;
 	case P15_ATTR_TYPE_VALUE:
 		switch(df_type) {
@@ -3479,6 +3480,7 @@ sc_pkcs15init_change_attrib(struct sc_pkcs15_card *p15card, struct sc_profile *p
 			info->data.len = new_len;
 			info->data.value = nv;
 			info->path = new_data_path;
+			sc_pkcs15_reindex_object(p15card, object);
 			
 			/* delete old data file from token */
 			r = sc_pkcs15init_delete_by_path(profile, p15card, &old_data_path);
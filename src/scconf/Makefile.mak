@@ -1,7 +1,7 @@
 TOPDIR = ..\..
 
 TARGET = scconf.lib
-OBJECTS = scconf.obj parse.obj write.obj sclex.obj
+OBJECTS = scconf.obj parse.obj write.obj sclex.obj image.obj
 
 .SUFFIXES : .l
 
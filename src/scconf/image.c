@@ -0,0 +1,315 @@
+/*
+ * image.c: Binary images of parsed configurations
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * An image holds the blocks, items and lists of a configuration in their
+ * native layout in one buffer, with offsets into the image instead of
+ * pointers. Loading an image only turns the offsets back into pointers,
+ * so the tree is available without lexing and parsing the file again.
+ *
+ * Nodes are stored in pre-order: every node lies after the node pointing
+ * to it, which the loader checks, so a damaged image cannot make it loop.
+ * The parent and the index of a block are not stored but set while loading.
+ */
+
+#include "config.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "scconf.h"
+#include "internal.h"
+
+#define IMAGE_MAGIC	"SCCONF\x01\x00"
+#define IMAGE_ALIGN	sizeof(void *)
+/* deeper nesting is certainly not a configuration file */
+#define IMAGE_MAX_DEPTH	32
+
+struct image_header {
+	char magic[8];
+	uint32_t layout;
+	uint32_t len;
+};
+
+struct image {
+	unsigned char *buf;
+	size_t len, size;
+	int failed;
+};
+
+#define IMAGE_LAYOUT	((uint32_t)(sizeof(void *) | sizeof(scconf_list) << 8 \
+			| sizeof(scconf_item) << 16 | sizeof(scconf_block) << 24))
+
+#define OFF2PTR(off)	((void *)(uintptr_t)(off))
+#define PTR2OFF(ptr)	((size_t)(uintptr_t)(ptr))
+#define NODE(img, type, off)	((type *)((img)->buf + (off)))
+
+/* Reserve len bytes in the image, returns the offset or 0 */
+static size_t image_alloc(struct image *img, size_t len)
+{
+	size_t off = (img->len + IMAGE_ALIGN - 1) & ~(IMAGE_ALIGN - 1);
+
+	if (img->failed)
+		return 0;
+	if (off + len > img->size) {
+		size_t size = img->size ? img->size : 4096;
+		unsigned char *buf;
+
+		while (size < off + len)
+			size *= 2;
+		buf = realloc(img->buf, size);
+		if (buf == NULL) {
+			img->failed = 1;
+			return 0;
+		}
+		img->buf = buf;
+		img->size = size;
+	}
+	memset(img->buf + off, 0, len);
+	img->len = off + len;
+	return off;
+}
+
+static size_t image_string(struct image *img, const char *str)
+{
+	size_t len, off;
+
+	if (str == NULL)
+		return 0;
+	len = strlen(str) + 1;
+	off = image_alloc(img, len);
+	if (off)
+		memcpy(img->buf + off, str, len);
+	return off;
+}
+
+static size_t image_list(struct image *img, const scconf_list *list)
+{
+	size_t first = 0, prev = 0, off, data;
+
+	for (; list != NULL; list = list->next) {
+		off = image_alloc(img, sizeof(scconf_list));
+		data = image_string(img, list->data);
+		if (img->failed)
+			return 0;
+		NODE(img, scconf_list, off)->data = OFF2PTR(data);
+		if (prev)
+			NODE(img, scconf_list, prev)->next = OFF2PTR(off);
+		else
+			first = off;
+		prev = off;
+	}
+	return first;
+}
+
+static size_t image_block(struct image *img, const scconf_block *block);
+
+static size_t image_items(struct image *img, const scconf_item *item)
+{
+	size_t first = 0, prev = 0, off, key, value = 0;
+
+	for (; item != NULL; item = item->next) {
+		off = image_alloc(img, sizeof(scconf_item));
+		key = image_string(img, item->key);
+		switch (item->type) {
+		case SCCONF_ITEM_TYPE_COMMENT:
+			value = image_string(img, item->value.comment);
+			break;
+		case SCCONF_ITEM_TYPE_BLOCK:
+			value = image_block(img, item->value.block);
+			break;
+		case SCCONF_ITEM_TYPE_VALUE:
+			value = image_list(img, item->value.list);
+			break;
+		default:
+			img->failed = 1;
+		}
+		if (img->failed)
+			return 0;
+		NODE(img, scconf_item, off)->type = item->type;
+		NODE(img, scconf_item, off)->key = OFF2PTR(key);
+		/* all members of the union are pointers */
+		NODE(img, scconf_item, off)->value.list = OFF2PTR(value);
+		if (prev)
+			NODE(img, scconf_item, prev)->next = OFF2PTR(off);
+		else
+			first = off;
+		prev = off;
+	}
+	return first;
+}
+
+static size_t image_block(struct image *img, const scconf_block *block)
+{
+	size_t off, name, items;
+
+	if (block == NULL)
+		return 0;
+	off = image_alloc(img, sizeof(scconf_block));
+	name = image_list(img, block->name);
+	items = image_items(img, block->items);
+	if (img->failed)
+		return 0;
+	NODE(img, scconf_block, off)->name = OFF2PTR(name);
+	NODE(img, scconf_block, off)->items = OFF2PTR(items);
+	return off;
+}
+
+unsigned char *scconf_image_create(const scconf_context * config, size_t *len)
+{
+	struct image img;
+	struct image_header *hdr;
+
+	if (config == NULL || config->root == NULL || len == NULL)
+		return NULL;
+
+	memset(&img, 0, sizeof(img));
+	image_alloc(&img, sizeof(struct image_header));
+	image_block(&img, config->root);
+	if (img.failed || img.len > UINT32_MAX) {
+		free(img.buf);
+		return NULL;
+	}
+	hdr = (struct image_header *)img.buf;
+	memcpy(hdr->magic, IMAGE_MAGIC, sizeof(hdr->magic));
+	hdr->layout = IMAGE_LAYOUT;
+	hdr->len = (uint32_t)img.len;
+	*len = img.len;
+	return img.buf;
+}
+
+/* Turn the offset stored in a pointer field into a pointer to a node of
+ * size bytes after the node at offset min. Sets *ok to 0 if it is not. */
+static void *image_node(const struct image *img, const void *stored,
+		size_t min, size_t size, int *ok)
+{
+	size_t off = PTR2OFF(stored);
+
+	if (off == 0)
+		return NULL;
+	if (off <= min || off % IMAGE_ALIGN != 0
+			|| off > img->len || img->len - off < size) {
+		*ok = 0;
+		return NULL;
+	}
+	return img->buf + off;
+}
+
+static char *image_str(const struct image *img, const char *stored,
+		size_t min, int *ok)
+{
+	size_t off = PTR2OFF(stored);
+
+	if (off == 0)
+		return NULL;
+	if (off <= min || off >= img->len
+			|| memchr(img->buf + off, '\0', img->len - off) == NULL) {
+		*ok = 0;
+		return NULL;
+	}
+	return (char *)img->buf + off;
+}
+
+#define NODE_OFF(img, node)	((size_t)((unsigned char *)(node) - (img)->buf))
+
+static scconf_list *image_load_list(const struct image *img, const scconf_list *stored,
+		size_t min, int *ok)
+{
+	scconf_list *first, *list;
+
+	first = list = image_node(img, stored, min, sizeof(scconf_list), ok);
+	while (list != NULL && *ok) {
+		min = NODE_OFF(img, list);
+		list->data = image_str(img, list->data, min, ok);
+		list->next = image_node(img, list->next, min, sizeof(scconf_list), ok);
+		list = list->next;
+	}
+	return first;
+}
+
+static void image_load_block(const struct image *img, scconf_block *block,
+		scconf_block *parent, int depth, int *ok)
+{
+	size_t min = NODE_OFF(img, block);
+	scconf_item *item;
+
+	if (depth > IMAGE_MAX_DEPTH) {
+		*ok = 0;
+		return;
+	}
+	block->parent = parent;
+	block->index = NULL;
+	block->name = image_load_list(img, block->name, min, ok);
+	item = block->items = image_node(img, block->items, min, sizeof(scconf_item), ok);
+	while (item != NULL && *ok) {
+		min = NODE_OFF(img, item);
+		item->key = image_str(img, item->key, min, ok);
+		switch (item->type) {
+		case SCCONF_ITEM_TYPE_COMMENT:
+			item->value.comment = image_str(img, item->value.comment, min, ok);
+			break;
+		case SCCONF_ITEM_TYPE_BLOCK:
+			item->value.block = image_node(img, item->value.block, min,
+					sizeof(scconf_block), ok);
+			if (item->value.block == NULL)
+				*ok = 0;
+			else
+				image_load_block(img, item->value.block, block, depth + 1, ok);
+			break;
+		case SCCONF_ITEM_TYPE_VALUE:
+			item->value.list = image_load_list(img, item->value.list, min, ok);
+			break;
+		default:
+			*ok = 0;
+		}
+		item->next = image_node(img, item->next, min, sizeof(scconf_item), ok);
+		item = item->next;
+	}
+}
+
+int scconf_image_load(scconf_context * config, unsigned char *image, size_t len)
+{
+	const struct image_header *hdr = (const struct image_header *)image;
+	struct image img;
+	scconf_block *root;
+	int ok = 1;
+
+	if (config == NULL || image == NULL || (uintptr_t)image % IMAGE_ALIGN != 0
+			|| len < sizeof(struct image_header) + sizeof(scconf_block)
+			|| memcmp(hdr->magic, IMAGE_MAGIC, sizeof(hdr->magic)) != 0
+			|| hdr->layout != IMAGE_LAYOUT || hdr->len != len)
+		return 0;
+
+	img.buf = image;
+	img.len = len;
+	img.size = len;
+	img.failed = 0;
+	/* the root block directly follows the header */
+	root = (scconf_block *)(image + ((sizeof(struct image_header)
+			+ IMAGE_ALIGN - 1) & ~(IMAGE_ALIGN - 1)));
+	image_load_block(&img, root, NULL, 0, &ok);
+	if (!ok)
+		return 0;
+
+	scconf_block_destroy(config->root);
+	config->root = root;
+	config->image = image;
+	scconf_index_build(root);
+	return 1;
+}
@@ -60,6 +60,11 @@ extern int scconf_lex_parse_string(scconf_parser * parser,
 extern void scconf_skip_block(scconf_parser * parser);
 extern void scconf_parse_token(scconf_parser * parser, int token_type, const char *token);
 
+/* Index the items of the block and all blocks below it */
+extern void scconf_index_build(scconf_block * block);
+/* Free the index of the block, lookups fall back to scanning the items */
+extern void scconf_index_drop(scconf_block * block);
+
 #ifdef __cplusplus
 }
 #endif
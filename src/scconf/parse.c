@@ -114,6 +114,8 @@ static scconf_item *scconf_item_add_internal(scconf_parser * parser, int type)
 	item->key = parser->key;
 	parser->key = NULL;
 
+	/* the index does not know the new item */
+	scconf_index_drop(parser->block);
 	if (parser->last_item) {
 		parser->last_item->next = item;
 	} else {
@@ -403,6 +405,8 @@ int scconf_parse(scconf_context * config)
 		r = 1;
 	}
 
+	scconf_index_build(config->root);
+
 	if (r <= 0)
 		config->errmsg = buffer;
 	return r;
@@ -433,6 +437,8 @@ int scconf_parse_string(scconf_context * config, const char *string)
 
 	scconf_parse_reset_state(&p);
 
+	scconf_index_build(config->root);
+
 	if (r <= 0)
 		config->errmsg = buffer;
 	return r;
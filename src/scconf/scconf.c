@@ -30,6 +30,165 @@
 #include <ctype.h>
 
 #include "scconf.h"
+#include "internal.h"
+
+/* blocks with fewer keyed items are just scanned */
+#define SCCONF_INDEX_MIN_ITEMS	8
+#define SCCONF_HASH_INIT	2166136261U
+
+typedef struct {
+	const scconf_item *item;
+	/* next entry with the same bucket, 1-based, 0 ends the chain */
+	unsigned int next_key, next_name;
+} scconf_index_entry;
+
+/*
+ * Every keyed item is chained into a bucket by its key. Block items are
+ * also chained by key and first name, which is what scconf_find_blocks()
+ * looks for in blocks holding many card_atr or similar entries. Chains
+ * keep the order of the items, so lookups return the same items as the
+ * linear scans.
+ */
+struct _scconf_index {
+	unsigned int mask;
+	unsigned int *key_buckets;
+	unsigned int *name_buckets;
+	scconf_index_entry *entries;
+};
+
+static unsigned int scconf_hash(unsigned int hash, const char *str)
+{
+	/* FNV-1a over the lower case string, keys match case insensitively */
+	for (; *str; str++) {
+		hash ^= (unsigned char)tolower((unsigned char)*str);
+		hash *= 16777619U;
+	}
+	return hash;
+}
+
+static unsigned int scconf_hash_name(const char *key, const char *name)
+{
+	/* separate key and name, so "ab" "c" and "a" "bc" differ */
+	return scconf_hash(scconf_hash(SCCONF_HASH_INIT, key) * 16777619U, name);
+}
+
+static const char *scconf_block_first_name(const scconf_block * block)
+{
+	if (!block || !block->name)
+		return NULL;
+	return block->name->data;
+}
+
+void scconf_index_drop(scconf_block * block)
+{
+	if (block && block->index) {
+		free(block->index->key_buckets);
+		free(block->index->name_buckets);
+		free(block->index->entries);
+		free(block->index);
+		block->index = NULL;
+	}
+}
+
+static void scconf_index_block(scconf_block * block)
+{
+	scconf_index *index;
+	scconf_item *item;
+	unsigned int count = 0, buckets = 1, i, h;
+	const char *name;
+
+	scconf_index_drop(block);
+	for (item = block->items; item; item = item->next)
+		if (item->key)
+			count++;
+	if (count < SCCONF_INDEX_MIN_ITEMS)
+		return;
+	while (buckets < 2 * count)
+		buckets <<= 1;
+
+	index = calloc(1, sizeof(scconf_index));
+	if (!index)
+		return;
+	index->mask = buckets - 1;
+	index->key_buckets = calloc(buckets, sizeof(unsigned int));
+	index->name_buckets = calloc(buckets, sizeof(unsigned int));
+	index->entries = calloc(count, sizeof(scconf_index_entry));
+	block->index = index;
+	if (!index->key_buckets || !index->name_buckets || !index->entries) {
+		/* not worth failing for, just scan */
+		scconf_index_drop(block);
+		return;
+	}
+
+	i = 0;
+	for (item = block->items; item; item = item->next)
+		if (item->key)
+			index->entries[i++].item = item;
+	/* prepend from the back, so the chains end up in item order */
+	for (i = count; i > 0; i--) {
+		scconf_index_entry *entry = &index->entries[i - 1];
+
+		h = scconf_hash(SCCONF_HASH_INIT, entry->item->key) & index->mask;
+		entry->next_key = index->key_buckets[h];
+		index->key_buckets[h] = i;
+
+		if (entry->item->type != SCCONF_ITEM_TYPE_BLOCK)
+			continue;
+		name = scconf_block_first_name(entry->item->value.block);
+		if (!name)
+			continue;
+		h = scconf_hash_name(entry->item->key, name) & index->mask;
+		entry->next_name = index->name_buckets[h];
+		index->name_buckets[h] = i;
+	}
+}
+
+void scconf_index_build(scconf_block * block)
+{
+	scconf_item *item;
+
+	if (!block)
+		return;
+	scconf_index_block(block);
+	for (item = block->items; item; item = item->next)
+		if (item->type == SCCONF_ITEM_TYPE_BLOCK)
+			scconf_index_build(item->value.block);
+}
+
+/* Free the indexes of a tree whose nodes are not freed one by one */
+static void scconf_index_drop_tree(scconf_block * block)
+{
+	scconf_item *item;
+
+	if (!block)
+		return;
+	scconf_index_drop(block);
+	for (item = block->items; item; item = item->next)
+		if (item->type == SCCONF_ITEM_TYPE_BLOCK)
+			scconf_index_drop_tree(item->value.block);
+}
+
+/* Returns the first item of the type with the key */
+static const scconf_item *scconf_item_lookup(const scconf_block * block, int type, const char *key)
+{
+	const scconf_index *index = block->index;
+	const scconf_item *item;
+	unsigned int i;
+
+	if (!index) {
+		for (item = block->items; item; item = item->next)
+			if (item->type == type && strcasecmp(key, item->key) == 0)
+				return item;
+		return NULL;
+	}
+	i = index->key_buckets[scconf_hash(SCCONF_HASH_INIT, key) & index->mask];
+	for (; i; i = index->entries[i - 1].next_key) {
+		item = index->entries[i - 1].item;
+		if (item->type == type && strcasecmp(key, item->key) == 0)
+			return item;
+	}
+	return NULL;
+}
 
 scconf_context *scconf_new(const char *filename)
 {
@@ -54,7 +213,12 @@ scconf_context *scconf_new(const char *filename)
 void scconf_free(scconf_context * config)
 {
 	if (config) {
-		scconf_block_destroy(config->root);
+		if (config->image) {
+			scconf_index_drop_tree(config->root);
+			free(config->image);
+		} else {
+			scconf_block_destroy(config->root);
+		}
 		if (config->filename) {
 			free(config->filename);
 		}
@@ -64,7 +228,7 @@ void scconf_free(scconf_context * config)
 
 const scconf_block *scconf_find_block(const scconf_context * config, const scconf_block * block, const char *item_name)
 {
-	scconf_item *item;
+	const scconf_item *item;
 
 	if (!block) {
 		block = config->root;
@@ -72,20 +236,46 @@ const scconf_block *scconf_find_block(const scconf_context * config, const sccon
 	if (!item_name) {
 		return NULL;
 	}
-	for (item = block->items; item; item = item->next) {
-		if (item->type == SCCONF_ITEM_TYPE_BLOCK &&
-		    strcasecmp(item_name, item->key) == 0) {
-			return item->value.block;
+	item = scconf_item_lookup(block, SCCONF_ITEM_TYPE_BLOCK, item_name);
+	return item ? item->value.block : NULL;
+}
+
+static int scconf_block_matches(const scconf_item * item, const char *item_name, const char *key)
+{
+	const char *name;
+
+	if (item->type != SCCONF_ITEM_TYPE_BLOCK || !item->value.block ||
+	    strcasecmp(item_name, item->key) != 0)
+		return 0;
+	if (!key)
+		return 1;
+	name = scconf_block_first_name(item->value.block);
+	return name && strcasecmp(key, name) == 0;
+}
+
+static int scconf_blocks_append(scconf_block *** blocks, int *size, int *alloc_size, scconf_block * block)
+{
+	scconf_block **tmp;
+
+	if (*size + 1 >= *alloc_size) {
+		*alloc_size *= 2;
+		tmp = (scconf_block **) realloc(*blocks, sizeof(scconf_block *) * *alloc_size);
+		if (!tmp) {
+			return 0;
 		}
+		*blocks = tmp;
 	}
-	return NULL;
+	(*blocks)[(*size)++] = block;
+	return 1;
 }
 
 scconf_block **scconf_find_blocks(const scconf_context * config, const scconf_block * block, const char *item_name, const char *key)
 {
 	scconf_block **blocks = NULL, **tmp;
 	int alloc_size, size;
-	scconf_item *item;
+	const scconf_index *index;
+	const scconf_item *item;
+	unsigned int i;
 
 	if (!block) {
 		block = config->root;
@@ -102,24 +292,34 @@ scconf_block **scconf_find_blocks(const scconf_context * config, const scconf_bl
 	}
 	blocks = tmp;
 
-	for (item = block->items; item; item = item->next) {
-		if (item->type == SCCONF_ITEM_TYPE_BLOCK &&
-		    strcasecmp(item_name, item->key) == 0) {
-			if (!item->value.block)
-				continue;
-			if (key && strcasecmp(key, item->value.block->name->data)) {
-				continue;
+	index = block->index;
+	if (!index) {
+		for (item = block->items; item; item = item->next) {
+			if (scconf_block_matches(item, item_name, key) &&
+			    !scconf_blocks_append(&blocks, &size, &alloc_size, item->value.block)) {
+				free(blocks);
+				return NULL;
 			}
-			if (size + 1 >= alloc_size) {
-				alloc_size *= 2;
-				tmp = (scconf_block **) realloc(blocks, sizeof(scconf_block *) * alloc_size);
-				if (!tmp) {
-					free(blocks);
-					return NULL;
-				}
-				blocks = tmp;
+		}
+	} else if (key) {
+		i = index->name_buckets[scconf_hash_name(item_name, key) & index->mask];
+		for (; i; i = index->entries[i - 1].next_name) {
+			item = index->entries[i - 1].item;
+			if (scconf_block_matches(item, item_name, key) &&
+			    !scconf_blocks_append(&blocks, &size, &alloc_size, item->value.block)) {
+				free(blocks);
+				return NULL;
+			}
+		}
+	} else {
+		i = index->key_buckets[scconf_hash(SCCONF_HASH_INIT, item_name) & index->mask];
+		for (; i; i = index->entries[i - 1].next_key) {
+			item = index->entries[i - 1].item;
+			if (scconf_block_matches(item, item_name, NULL) &&
+			    !scconf_blocks_append(&blocks, &size, &alloc_size, item->value.block)) {
+				free(blocks);
+				return NULL;
 			}
-			blocks[size++] = item->value.block;
 		}
 	}
 	blocks[size] = NULL;
@@ -128,15 +328,13 @@ scconf_block **scconf_find_blocks(const scconf_context * config, const scconf_bl
 
 const scconf_list *scconf_find_list(const scconf_block * block, const char *option)
 {
-	scconf_item *item;
+	const scconf_item *item;
 
 	if (!block)
 		return NULL;
 
-	for (item = block->items; item; item = item->next)
-		if (item->type == SCCONF_ITEM_TYPE_VALUE && strcasecmp(option, item->key) == 0)
-			return item->value.list;
-	return NULL;
+	item = scconf_item_lookup(block, SCCONF_ITEM_TYPE_VALUE, option);
+	return item ? item->value.list : NULL;
 }
 
 const char *scconf_get_str(const scconf_block * block, const char *option, const char *def)
@@ -299,6 +497,7 @@ scconf_block *scconf_block_copy(const scconf_block * src, scconf_block ** dst)
 void scconf_block_destroy(scconf_block * block)
 {
 	if (block) {
+		scconf_index_drop(block);
 		scconf_list_destroy(block->name);
 		scconf_item_destroy(block->items);
 		free(block);
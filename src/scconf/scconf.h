@@ -24,6 +24,8 @@
 #ifndef _SC_CONF_H
 #define _SC_CONF_H
 
+#include <stddef.h>
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -33,6 +35,7 @@ extern "C" {
 #define SCCONF_STRING		13
 
 typedef struct _scconf_block scconf_block;
+typedef struct _scconf_index scconf_index;
 
 typedef struct _scconf_list {
 	struct _scconf_list *next;
@@ -58,6 +61,8 @@ struct _scconf_block {
 	scconf_block *parent;
 	scconf_list *name;
 	scconf_item *items;
+	/* hash index over the item keys of larger blocks, may be NULL */
+	scconf_index *index;
 };
 
 typedef struct {
@@ -65,6 +70,8 @@ typedef struct {
 	int debug;
 	scconf_block *root;
 	char *errmsg;
+	/* the tree lives in this image, see scconf_image_load() */
+	unsigned char *image;
 } scconf_context;
 
 /* Allocate scconf_context
@@ -86,6 +93,19 @@ extern int scconf_parse(scconf_context * config);
  */
 extern int scconf_parse_string(scconf_context * config, const char *string);
 
+/* Store the parsed configuration in one relocatable buffer
+ * Returns the malloc'ed image and its length, or NULL
+ */
+extern unsigned char *scconf_image_create(const scconf_context * config, size_t *len);
+
+/* Use the tree stored in an image created by scconf_image_create()
+ * The image must be aligned like malloc'ed memory. On success the
+ * context owns the image, frees it in scconf_free() and the tree must
+ * not be modified.
+ * Returns 1 = ok, 0 = invalid image
+ */
+extern int scconf_image_load(scconf_context * config, unsigned char *image, size_t len);
+
 /* Write config to a file
  * If the filename is NULL, use the config->filename
  * Returns 0 = ok, else = errno
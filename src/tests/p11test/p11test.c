@@ -34,6 +34,7 @@
 #include "p11test_case_interface.h"
 #include "p11test_case_wrap.h"
 #include "p11test_case_secret.h"
+#include "p11test_case_sessions.h"
 
 #define DEFAULT_P11LIB	"../../pkcs11/.libs/opensc-pkcs11.so"
 
@@ -70,6 +71,10 @@ int main(int argc, char** argv) {
 		/* Check the PKCS #11 3.0 Interface to access new functions */
 		cmocka_unit_test(interface_test),
 
+		/* Session handle lookup with many open sessions */
+		cmocka_unit_test_setup_teardown(sessions_test,
+			token_setup, token_cleanup),
+
 		/* Complex readonly test of all objects on the card */
 		cmocka_unit_test_setup_teardown(readonly_tests,
 			user_login_setup, after_test_cleanup),
@@ -0,0 +1,89 @@
+/*
+ * p11test_case_sessions.c: Test session handles with many open sessions
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "p11test_case_sessions.h"
+#include <time.h>
+
+#define MAX_SESSIONS	4096
+#define LOOKUPS		100000
+
+/* Average time of a session lookup in nanoseconds */
+static double
+lookup_time(CK_FUNCTION_LIST_PTR fp, CK_SESSION_HANDLE handle)
+{
+	struct timespec start, end;
+	CK_SESSION_INFO session_info;
+	int i;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < LOOKUPS; i++)
+		fp->C_GetSessionInfo(handle, &session_info);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	return ((end.tv_sec - start.tv_sec) * 1e9
+		+ (end.tv_nsec - start.tv_nsec)) / LOOKUPS;
+}
+
+void sessions_test(void **state)
+{
+	token_info_t *info = (token_info_t *) *state;
+	CK_FUNCTION_LIST_PTR fp = info->function_pointer;
+	CK_SESSION_HANDLE *handles, stale;
+	CK_SESSION_INFO session_info;
+	CK_ULONG count = 0, next = 1;
+	CK_RV rv;
+
+	P11TEST_START(info);
+
+	handles = calloc(MAX_SESSIONS, sizeof(CK_SESSION_HANDLE));
+	assert_non_null(handles);
+
+	/* The lookup should not get slower with the number of open sessions */
+	P11TEST_DATA_ROW(info, 2, 's', "SESSIONS", 's', "LOOKUP NS");
+	while (count < MAX_SESSIONS) {
+		rv = fp->C_OpenSession(info->slot_id, CKF_SERIAL_SESSION,
+			NULL_PTR, NULL_PTR, &handles[count]);
+		if (rv == CKR_SESSION_COUNT)
+			break;
+		if (rv != CKR_OK)
+			P11TEST_FAIL(info, "C_OpenSession: rv = 0x%.8lX\n", rv);
+		count++;
+		if (count == next) {
+			double ns = lookup_time(fp, handles[0]);
+
+			debug_print("  %6lu sessions: %8.1f ns per lookup", count, ns);
+			P11TEST_DATA_ROW(info, 2, 'd', (int) count, 'd', (int) ns);
+			next *= 4;
+		}
+	}
+
+	/* A closed session handle must not resolve to a newer session */
+	stale = handles[0];
+	rv = fp->C_CloseSession(stale);
+	assert_int_equal(rv, CKR_OK);
+	rv = fp->C_OpenSession(info->slot_id, CKF_SERIAL_SESSION,
+		NULL_PTR, NULL_PTR, &handles[0]);
+	assert_int_equal(rv, CKR_OK);
+	assert_int_not_equal(handles[0], stale);
+	rv = fp->C_GetSessionInfo(stale, &session_info);
+	assert_int_equal(rv, CKR_SESSION_HANDLE_INVALID);
+
+	while (count > 0)
+		fp->C_CloseSession(handles[--count]);
+	free(handles);
+	P11TEST_PASS(info);
+}
@@ -306,6 +306,28 @@ static void torture_asn1_decode_entry_octet_string_short(void **state)
 	assert_memory_equal(result, octet_string, resultlen);
 }
 
+/* With SC_ASN1_BORROW, the value is not copied but points into the input */
+static void torture_asn1_decode_entry_octet_string_borrow(void **state)
+{
+	sc_context_t *ctx = *state;
+	/* Skipped the Tag and Length (0x04, 0x02) */
+	const u8 octet_string[] = {0xbc, 0xde};
+	struct sc_asn1_entry asn1_struct[2] = {
+		{ "direct",     SC_ASN1_OCTET_STRING, SC_ASN1_CTX | SC_ASN1_CONS,
+			SC_ASN1_ALLOC | SC_ASN1_BORROW, NULL, NULL },
+		{ NULL, 0, 0, 0, NULL, NULL }
+	};
+	u8 *result = NULL;
+	size_t resultlen = 0;
+	int rv;
+
+	sc_format_asn1_entry(asn1_struct, &result, &resultlen, 0);
+	rv = asn1_decode_entry(ctx, asn1_struct, octet_string, sizeof(octet_string), DEPTH);
+	assert_int_equal(rv, SC_SUCCESS);
+	assert_int_equal(resultlen, sizeof(octet_string));
+	assert_ptr_equal(result, octet_string);
+}
+
 /* In case of we expect UNSIGNED value from this, the parser already takes
  * care of removing initial zero byte, which is used to avoid mismatches with
  * negative integers */
@@ -643,6 +665,8 @@ int main(void)
 			setup_sc_context, teardown_sc_context),
 		cmocka_unit_test_setup_teardown(torture_asn1_decode_entry_octet_string_short,
 			setup_sc_context, teardown_sc_context),
+		cmocka_unit_test_setup_teardown(torture_asn1_decode_entry_octet_string_borrow,
+			setup_sc_context, teardown_sc_context),
 		cmocka_unit_test_setup_teardown(torture_asn1_decode_entry_octet_string_unsigned,
 			setup_sc_context, teardown_sc_context),
 		cmocka_unit_test_setup_teardown(torture_asn1_decode_entry_octet_string_pre_allocated,
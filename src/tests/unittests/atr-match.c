@@ -0,0 +1,93 @@
+/*
+ * atr-match.c: Unit tests for matching ATRs against ATR tables
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "torture.h"
+#include "libopensc/opensc.h"
+#include "libopensc/internal.h"
+
+static const struct sc_atr_table test_atrs[] = {
+	/* wrong format, never matches */
+	{ "3B021450", NULL, "no colons", 1, 0, NULL },
+	{ "3b:02:14:50", NULL, "exact", 2, 0, NULL },
+	{ "3b:02:14:51", "ff:ff:ff:f0", "masked", 3, 0, NULL },
+	{ "3B:02:14:5F", "FF:FF:FF:F0", "masked later", 4, 0, NULL },
+	{ "3b:8f:80:01", "ff:ff:ff", "mask length differs", 5, 0, NULL },
+	{ "3b:8f:80:01:80", NULL, "longer", 6, 0, NULL },
+	{ NULL, NULL, NULL, 0, 0, NULL }
+};
+
+static int setup_card(void **state)
+{
+	sc_card_t *card = calloc(1, sizeof(sc_card_t));
+
+	if (card == NULL)
+		return -1;
+	setenv("OPENSC_CONF", "/nonexistent", 1);
+	if (sc_establish_context(&card->ctx, "atrmatch") != SC_SUCCESS)
+		return -1;
+	*state = card;
+	return 0;
+}
+
+static int teardown_card(void **state)
+{
+	sc_card_t *card = *state;
+
+	sc_release_context(card->ctx);
+	free(card);
+	return 0;
+}
+
+static int match(sc_card_t *card, const char *atr, int *type)
+{
+	card->atr.len = sizeof(card->atr.value);
+	assert_int_equal(sc_hex_to_bin(atr, card->atr.value, &card->atr.len), SC_SUCCESS);
+	*type = -1;
+	return _sc_match_atr(card, test_atrs, type);
+}
+
+static void torture_atr_match(void **state)
+{
+	sc_card_t *card = *state;
+	int type, i;
+
+	/* repeat to go through the compiled table */
+	for (i = 0; i < 2; i++) {
+		assert_int_equal(match(card, "3B:02:14:50", &type), 1);
+		assert_int_equal(type, 2);
+		assert_int_equal(match(card, "3B:02:14:5A", &type), 2);
+		assert_int_equal(type, 3);
+		assert_int_equal(match(card, "3B:02:14:60", &type), -1);
+		assert_int_equal(type, -1);
+		assert_int_equal(match(card, "3B:8F:80:01", &type), -1);
+		assert_int_equal(match(card, "3B:8F:80:01:80", &type), 5);
+		assert_int_equal(type, 6);
+		assert_int_equal(match(card, "3B:8F:80:01:80:00", &type), -1);
+	}
+}
+
+int main(void)
+{
+	int rc;
+	struct CMUnitTest tests[] = {
+		cmocka_unit_test_setup_teardown(torture_atr_match,
+			setup_card, teardown_card),
+	};
+
+	rc = cmocka_run_group_tests(tests, NULL, NULL);
+	return rc;
+}
@@ -0,0 +1,245 @@
+/*
+ * config-cache.c: Unit tests for the compiled configuration cache
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <limits.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "torture.h"
+#include "libopensc/opensc.h"
+#include "scconf/scconf.h"
+
+struct cache_state {
+	char dir[PATH_MAX];
+	char conf[PATH_MAX + 16];
+	char cache[PATH_MAX + 32];
+};
+
+static const char config[] =
+	"# comment\n"
+	"app default {\n"
+	"\tenable_config_cache = true;\n"
+	"\tcard_drivers = old, internal;\n"
+	"\tcard_atr 3b:aa:bb {\n"
+	"\t\tname = \"Test card\";\n"
+	"\t}\n"
+	"}\n"
+	"app other {\n"
+	"\tdebug = 0;\n"
+	"}\n";
+
+static void write_config(const char *fname, const char *extra)
+{
+	FILE *f = fopen(fname, "w");
+
+	assert_non_null(f);
+	fputs(config, f);
+	if (extra != NULL)
+		fputs(extra, f);
+	fclose(f);
+}
+
+static int setup_cache(void **state)
+{
+	struct cache_state *cs = calloc(1, sizeof(struct cache_state));
+
+	if (cs == NULL)
+		return -1;
+	strcpy(cs->dir, "/tmp/opensc-config-XXXXXX");
+	if (mkdtemp(cs->dir) == NULL)
+		return -1;
+	snprintf(cs->conf, sizeof(cs->conf), "%s/opensc.conf", cs->dir);
+	snprintf(cs->cache, sizeof(cs->cache), "%s/opensc/config-cache", cs->dir);
+	setenv("OPENSC_CONF", cs->conf, 1);
+	setenv("XDG_CACHE_HOME", cs->dir, 1);
+	*state = cs;
+	return 0;
+}
+
+static int teardown_cache(void **state)
+{
+	struct cache_state *cs = *state;
+	char cmd[PATH_MAX + 16];
+
+	snprintf(cmd, sizeof(cmd), "rm -rf %s", cs->dir);
+	if (system(cmd) != 0)
+		return -1;
+	free(cs);
+	return 0;
+}
+
+/* Checks that the context sees the test configuration */
+static void check_config(sc_context_t *ctx)
+{
+	scconf_block **blocks;
+	const scconf_list *list;
+
+	assert_non_null(ctx->conf_blocks[0]);
+	list = scconf_find_list(ctx->conf_blocks[0], "card_drivers");
+	assert_non_null(list);
+	assert_string_equal(list->data, "old");
+	assert_non_null(list->next);
+	assert_string_equal(list->next->data, "internal");
+
+	blocks = scconf_find_blocks(ctx->conf, ctx->conf_blocks[0], "card_atr", "3b:aa:bb");
+	assert_non_null(blocks);
+	assert_non_null(blocks[0]);
+	assert_ptr_equal(blocks[0]->parent, ctx->conf_blocks[0]);
+	assert_string_equal(scconf_get_str(blocks[0], "name", NULL), "Test card");
+	free(blocks);
+}
+
+static void torture_config_cache(void **state)
+{
+	struct cache_state *cs = *state;
+	sc_context_t *ctx = NULL;
+	struct stat st;
+
+	write_config(cs->conf, NULL);
+
+	/* the first context parses the file and fills the cache */
+	assert_int_equal(sc_establish_context(&ctx, "configcache"), SC_SUCCESS);
+	assert_null(ctx->conf->image);
+	check_config(ctx);
+	sc_release_context(ctx);
+	assert_int_equal(stat(cs->cache, &st), 0);
+
+	/* the second one uses it */
+	assert_int_equal(sc_establish_context(&ctx, "configcache"), SC_SUCCESS);
+	assert_non_null(ctx->conf->image);
+	check_config(ctx);
+	sc_release_context(ctx);
+
+	/* changing the file invalidates the cache */
+	write_config(cs->conf, "# changed\n");
+	assert_int_equal(sc_establish_context(&ctx, "configcache"), SC_SUCCESS);
+	assert_null(ctx->conf->image);
+	check_config(ctx);
+	sc_release_context(ctx);
+}
+
+static void torture_config_cache_damaged(void **state)
+{
+	struct cache_state *cs = *state;
+	sc_context_t *ctx = NULL;
+	long size;
+	FILE *f;
+
+	write_config(cs->conf, NULL);
+	assert_int_equal(sc_establish_context(&ctx, "configcache"), SC_SUCCESS);
+	sc_release_context(ctx);
+
+	/* a cut off cache file is not used */
+	f = fopen(cs->cache, "r+");
+	assert_non_null(f);
+	assert_int_equal(fseek(f, 0, SEEK_END), 0);
+	size = ftell(f);
+	fclose(f);
+	assert_int_equal(truncate(cs->cache, size - 8), 0);
+
+	assert_int_equal(sc_establish_context(&ctx, "configcache"), SC_SUCCESS);
+	assert_null(ctx->conf->image);
+	check_config(ctx);
+	sc_release_context(ctx);
+}
+
+static void torture_config_cache_untrusted(void **state)
+{
+	struct cache_state *cs = *state;
+	char cachedir[PATH_MAX + 16];
+	sc_context_t *ctx = NULL;
+
+	write_config(cs->conf, NULL);
+	assert_int_equal(sc_establish_context(&ctx, "configcache"), SC_SUCCESS);
+	sc_release_context(ctx);
+
+	/* a cache file others may write is not used */
+	assert_int_equal(chmod(cs->cache, 0666), 0);
+	assert_int_equal(sc_establish_context(&ctx, "configcache"), SC_SUCCESS);
+	assert_null(ctx->conf->image);
+	check_config(ctx);
+	sc_release_context(ctx);
+
+	/* neither is one in a directory others may write */
+	assert_int_equal(chmod(cs->cache, 0600), 0);
+	snprintf(cachedir, sizeof(cachedir), "%s/opensc", cs->dir);
+	assert_int_equal(chmod(cachedir, 0777), 0);
+	assert_int_equal(sc_establish_context(&ctx, "configcache"), SC_SUCCESS);
+	assert_null(ctx->conf->image);
+	sc_release_context(ctx);
+
+	assert_int_equal(chmod(cachedir, 0700), 0);
+	assert_int_equal(sc_establish_context(&ctx, "configcache"), SC_SUCCESS);
+	assert_non_null(ctx->conf->image);
+	check_config(ctx);
+	sc_release_context(ctx);
+}
+
+static void torture_config_image_roundtrip(void **state)
+{
+	struct cache_state *cs = *state;
+	scconf_context *conf, *copy;
+	unsigned char *image;
+	char written[PATH_MAX + 16];
+	char a[sizeof(config) + 64], b[sizeof(config) + 64];
+	size_t len, alen, blen;
+	FILE *f;
+
+	write_config(cs->conf, NULL);
+	conf = scconf_new(cs->conf);
+	assert_int_equal(scconf_parse(conf), 1);
+	image = scconf_image_create(conf, &len);
+	assert_non_null(image);
+
+	copy = scconf_new(NULL);
+	assert_int_equal(scconf_image_load(copy, image, len), 1);
+
+	/* both trees are written out the same, comments included */
+	snprintf(written, sizeof(written), "%s/a.conf", cs->dir);
+	assert_int_equal(scconf_write(conf, written), 0);
+	f = fopen(written, "r");
+	alen = fread(a, 1, sizeof(a), f);
+	fclose(f);
+	snprintf(written, sizeof(written), "%s/b.conf", cs->dir);
+	assert_int_equal(scconf_write(copy, written), 0);
+	f = fopen(written, "r");
+	blen = fread(b, 1, sizeof(b), f);
+	fclose(f);
+	assert_int_equal(alen, blen);
+	assert_memory_equal(a, b, alen);
+
+	scconf_free(copy);
+	scconf_free(conf);
+}
+
+int main(void)
+{
+	int rc;
+	struct CMUnitTest tests[] = {
+		cmocka_unit_test_setup_teardown(torture_config_cache,
+			setup_cache, teardown_cache),
+		cmocka_unit_test_setup_teardown(torture_config_cache_damaged,
+			setup_cache, teardown_cache),
+		cmocka_unit_test_setup_teardown(torture_config_cache_untrusted,
+			setup_cache, teardown_cache),
+		cmocka_unit_test_setup_teardown(torture_config_image_roundtrip,
+			setup_cache, teardown_cache),
+	};
+
+	rc = cmocka_run_group_tests(tests, NULL, NULL);
+	return rc;
+}
@@ -0,0 +1,98 @@
+/*
+ * crc32.c: Unit tests for sc_crc32()
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <time.h>
+
+#include "torture.h"
+#include "libopensc/opensc.h"
+
+#define DATA_LEN	1024
+#define BENCH_LEN	(1024 * 1024)
+
+/* The bitwise reference, as the table driven version used to compute it */
+static unsigned crc32_reference(const unsigned char *value, size_t len)
+{
+	unsigned long crc = 0xffffffffL;
+	size_t i;
+	int bit;
+
+	for (i = 0; i < len; i++) {
+		crc ^= value[i];
+		for (bit = 0; bit < 8; bit++)
+			crc = (crc & 1) ? (crc >> 1) ^ 0xEDB88320L : crc >> 1;
+	}
+	crc ^= 0xffffffffL;
+	return crc % 0xffff;
+}
+
+static void torture_crc32_check_value(void **state)
+{
+	/* the standard check value 0xCBF43926, reduced */
+	assert_int_equal(sc_crc32((const unsigned char *)"123456789", 9),
+			0xCBF43926UL % 0xffff);
+	assert_int_equal(sc_crc32(NULL, 0), 0);
+}
+
+static void torture_crc32_bit_exact(void **state)
+{
+	unsigned char data[DATA_LEN + 8];
+	size_t i, len, offset;
+
+	srand(0x5c);
+	for (i = 0; i < sizeof(data); i++)
+		data[i] = rand() & 0xff;
+
+	/* all tail lengths and alignments of the eight byte steps */
+	for (offset = 0; offset < 8; offset++)
+		for (len = 0; len <= DATA_LEN; len++)
+			assert_int_equal(sc_crc32(data + offset, len),
+					crc32_reference(data + offset, len));
+}
+
+static void torture_crc32_benchmark(void **state)
+{
+	unsigned char *data = malloc(BENCH_LEN);
+	unsigned expected, crc = 0;
+	clock_t start;
+	int i;
+
+	assert_non_null(data);
+	for (i = 0; i < BENCH_LEN; i++)
+		data[i] = (unsigned char)(i * 7);
+	expected = crc32_reference(data, BENCH_LEN);
+
+	start = clock();
+	for (i = 0; i < 16; i++)
+		crc = sc_crc32(data, BENCH_LEN);
+	print_message("sc_crc32: %.1f MB/s\n", 16.0 * BENCH_LEN / (1024 * 1024)
+			/ ((double)(clock() - start + 1) / CLOCKS_PER_SEC));
+	assert_int_equal(crc, expected);
+	free(data);
+}
+
+int main(void)
+{
+	int rc;
+	struct CMUnitTest tests[] = {
+		cmocka_unit_test(torture_crc32_check_value),
+		cmocka_unit_test(torture_crc32_bit_exact),
+		cmocka_unit_test(torture_crc32_benchmark),
+	};
+
+	rc = cmocka_run_group_tests(tests, NULL, NULL);
+	return rc;
+}
@@ -0,0 +1,102 @@
+/*
+ * hex-dump.c: Unit tests for sc_bin_to_hex(), sc_hex_dump() and sc_dump_hex()
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "torture.h"
+#include "libopensc/opensc.h"
+#include "libopensc/log.h"
+
+static const u8 data[] = {
+	0x00, 0x01, 0x41, 0x42, 0x7f, 0x80, 0xfe, 0xff,
+	0x30, 0x31, 0x32, 0x33, 0x34, 0x35, 0x36, 0x37,
+	0x61, 0x0a
+};
+
+static void torture_bin_to_hex(void **state)
+{
+	char out[64];
+
+	assert_int_equal(sc_bin_to_hex(data, 8, out, sizeof(out), 0), SC_SUCCESS);
+	assert_string_equal(out, "00014142" "7f80feff");
+	assert_int_equal(sc_bin_to_hex(data, 4, out, sizeof(out), ':'), SC_SUCCESS);
+	assert_string_equal(out, "00:01:41:42");
+	assert_int_equal(sc_bin_to_hex(data, 0, out, sizeof(out), ':'), SC_SUCCESS);
+	assert_string_equal(out, "");
+
+	/* the terminating zero has to fit as well */
+	assert_int_equal(sc_bin_to_hex(data, 4, out, 8, 0), SC_ERROR_BUFFER_TOO_SMALL);
+	assert_int_equal(sc_bin_to_hex(data, 4, out, 9, 0), SC_SUCCESS);
+	assert_int_equal(sc_bin_to_hex(data, 4, out, 11, ' '), SC_ERROR_BUFFER_TOO_SMALL);
+	assert_int_equal(sc_bin_to_hex(data, 4, out, 12, ' '), SC_SUCCESS);
+	assert_string_equal(out, "00 01 41 42");
+}
+
+static void torture_hex_dump(void **state)
+{
+	char out[2 * 65 + 1];
+
+	sc_hex_dump(data, sizeof(data), out, sizeof(out));
+	assert_string_equal(out,
+		"00 01 41 42 7F 80 FE FF 30 31 32 33 34 35 36 37 ..AB....01234567\n"
+		"61 0A                                           a.\n");
+
+	/* a single line is not padded */
+	sc_hex_dump(data + 2, 2, out, sizeof(out));
+	assert_string_equal(out, "41 42 AB\n");
+
+	/* the padding of the last line has to fit, too */
+	sc_hex_dump(data, sizeof(data), out, sizeof(out) - 1);
+	assert_string_equal(out, "");
+}
+
+static void torture_dump_hex(void **state)
+{
+	u8 big[4096];
+	const char *dump;
+	size_t i;
+
+	assert_string_equal(sc_dump_hex(data, sizeof(data)),
+		"000141427F80FEFF3031323334353637 610A");
+	assert_string_equal(sc_dump_hex(NULL, 4), "");
+
+	/* groups of 16 bytes, three on a line */
+	memset(big, 0xA5, sizeof(big));
+	dump = sc_dump_hex(big, 49);
+	assert_int_equal(strlen(dump), 49 * 2 + 3);
+	assert_int_equal(dump[32], ' ');
+	assert_int_equal(dump[65], ' ');
+	assert_int_equal(dump[98], '\n');
+
+	/* long input is cut off visibly */
+	dump = sc_dump_hex(big, sizeof(big));
+	i = strlen(dump);
+	assert_true(i < 0x1000);
+	assert_string_equal(dump + i - 5, "....\n");
+	assert_int_equal(dump[i - 6], '5');
+}
+
+int main(void)
+{
+	int rc;
+	struct CMUnitTest tests[] = {
+		cmocka_unit_test(torture_bin_to_hex),
+		cmocka_unit_test(torture_hex_dump),
+		cmocka_unit_test(torture_dump_hex),
+	};
+
+	rc = cmocka_run_group_tests(tests, NULL, NULL);
+	return rc;
+}
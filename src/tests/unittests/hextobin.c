@@ -88,6 +88,9 @@ int main()
 		{C_ERROR, "G", ""},
 		{C_ERROR, " z", ""},
 		{C_ERROR, ":a1:1", ""},
+		{C_ERROR, "\t01", ""},	/* only space and colon separate */
+		{C_ERROR, "01-02", ""},
+		{C_ERROR, "0\xb0", ""},
 		{C_END, "", ""}
 	};
 	uint8_t res[LEN];
@@ -0,0 +1,189 @@
+/*
+ * log-async.c: Unit tests for the asynchronous debug log writer
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <limits.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include "torture.h"
+#include "libopensc/opensc.h"
+#include "libopensc/log.h"
+
+#define THREADS		4
+#define MESSAGES	500
+
+struct log_state {
+	char dir[PATH_MAX];
+	char conf[PATH_MAX + 16];
+	char log[PATH_MAX + 16];
+};
+
+static int setup_log(void **state)
+{
+	struct log_state *ls = calloc(1, sizeof(struct log_state));
+	FILE *f;
+
+	if (ls == NULL)
+		return -1;
+	strcpy(ls->dir, "/tmp/opensc-log-XXXXXX");
+	if (mkdtemp(ls->dir) == NULL)
+		return -1;
+	snprintf(ls->conf, sizeof(ls->conf), "%s/opensc.conf", ls->dir);
+	snprintf(ls->log, sizeof(ls->log), "%s/debug.log", ls->dir);
+
+	f = fopen(ls->conf, "w");
+	if (f == NULL)
+		return -1;
+	fprintf(f, "app default {\n\tdebug = 3;\n\tdebug_file = \"%s\";\n\tdebug_async = true;\n}\n", ls->log);
+	fclose(f);
+	setenv("OPENSC_CONF", ls->conf, 1);
+	unsetenv("OPENSC_DEBUG");
+	*state = ls;
+	return 0;
+}
+
+static int teardown_log(void **state)
+{
+	struct log_state *ls = *state;
+	char cmd[PATH_MAX + 16];
+
+	snprintf(cmd, sizeof(cmd), "rm -rf %s", ls->dir);
+	if (system(cmd) != 0)
+		return -1;
+	free(ls);
+	return 0;
+}
+
+/* Count the test messages and the reported drops in a log file */
+static void count_messages(const char *fname, const char *marker,
+		unsigned long *messages, unsigned long *dropped)
+{
+	char line[4096];
+	unsigned long n;
+	FILE *f;
+
+	*messages = 0;
+	*dropped = 0;
+	f = fopen(fname, "r");
+	assert_non_null(f);
+	while (fgets(line, sizeof(line), f) != NULL) {
+		if (sscanf(line, "[%lu log messages dropped]", &n) == 1)
+			*dropped += n;
+		else if (strstr(line, marker) != NULL)
+			(*messages)++;
+	}
+	fclose(f);
+}
+
+static void *log_thread(void *arg)
+{
+	sc_context_t *ctx = arg;
+	int i;
+
+	for (i = 0; i < MESSAGES; i++)
+		sc_log(ctx, "async test message %d", i);
+	return NULL;
+}
+
+static void torture_log_threads(void **state)
+{
+	struct log_state *ls = *state;
+	pthread_t threads[THREADS];
+	unsigned long messages, dropped;
+	sc_context_t *ctx = NULL;
+	int i;
+
+	assert_int_equal(sc_establish_context(&ctx, "logasync"), SC_SUCCESS);
+	for (i = 0; i < THREADS; i++)
+		assert_int_equal(pthread_create(&threads[i], NULL, log_thread, ctx), 0);
+	for (i = 0; i < THREADS; i++)
+		pthread_join(threads[i], NULL);
+	/* releasing the context writes all queued messages */
+	sc_release_context(ctx);
+
+	/* the drop count also covers messages of the library itself */
+	count_messages(ls->log, "async test message", &messages, &dropped);
+	assert_true(messages > 0);
+	assert_true(messages <= THREADS * MESSAGES);
+	assert_true(messages + dropped >= THREADS * MESSAGES);
+}
+
+static void torture_log_switch_file(void **state)
+{
+	struct log_state *ls = *state;
+	unsigned long messages, dropped;
+	sc_context_t *ctx = NULL;
+	char other[PATH_MAX + 16];
+
+	snprintf(other, sizeof(other), "%s/other.log", ls->dir);
+	assert_int_equal(sc_establish_context(&ctx, "logasync"), SC_SUCCESS);
+	sc_log(ctx, "first file");
+	/* queued messages go to the file which was current */
+	assert_int_equal(sc_ctx_log_to_file(ctx, other), SC_SUCCESS);
+	sc_log(ctx, "second file");
+	sc_release_context(ctx);
+
+	count_messages(ls->log, "first file", &messages, &dropped);
+	assert_int_equal(messages, 1);
+	count_messages(ls->log, "second file", &messages, &dropped);
+	assert_int_equal(messages, 0);
+	count_messages(other, "second file", &messages, &dropped);
+	assert_int_equal(messages, 1);
+}
+
+static void torture_log_switch_file_threads(void **state)
+{
+	struct log_state *ls = *state;
+	pthread_t threads[THREADS];
+	unsigned long messages, total = 0, dropped;
+	sc_context_t *ctx = NULL;
+	char other[PATH_MAX + 16];
+	int i;
+
+	snprintf(other, sizeof(other), "%s/other.log", ls->dir);
+	assert_int_equal(sc_establish_context(&ctx, "logasync"), SC_SUCCESS);
+	for (i = 0; i < THREADS; i++)
+		assert_int_equal(pthread_create(&threads[i], NULL, log_thread, ctx), 0);
+	/* the writer must not use a file that was closed meanwhile */
+	for (i = 0; i < 50; i++)
+		assert_int_equal(sc_ctx_log_to_file(ctx, i % 2 ? ls->log : other), SC_SUCCESS);
+	for (i = 0; i < THREADS; i++)
+		pthread_join(threads[i], NULL);
+	sc_release_context(ctx);
+
+	count_messages(ls->log, "async test message", &messages, &dropped);
+	total += messages;
+	count_messages(other, "async test message", &messages, &dropped);
+	total += messages;
+	assert_true(total <= THREADS * MESSAGES);
+}
+
+int main(void)
+{
+	int rc;
+	struct CMUnitTest tests[] = {
+		cmocka_unit_test_setup_teardown(torture_log_threads,
+			setup_log, teardown_log),
+		cmocka_unit_test_setup_teardown(torture_log_switch_file,
+			setup_log, teardown_log),
+		cmocka_unit_test_setup_teardown(torture_log_switch_file_threads,
+			setup_log, teardown_log),
+	};
+
+	rc = cmocka_run_group_tests(tests, NULL, NULL);
+	return rc;
+}
@@ -0,0 +1,195 @@
+/*
+ * openpgp-decipher.c: Unit tests for PSO:DECIPHER with key slot 3 of the
+ * OpenPGP driver
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "torture.h"
+#include "libopensc/card-openpgp.c"
+
+#define PLAIN_LEN	16
+
+/* A card answering MSE and PSO:DECIPHER with scripted status words,
+ * recording the key slot of every MSE */
+struct fake_card {
+	sc_card_t card;
+	sc_reader_t reader;
+	struct sc_reader_operations reader_ops;
+	struct sc_card_operations card_ops;
+	struct pgp_priv_data priv;
+	u8 mse_sw1, mse_sw2;
+	u8 dec_sw1, dec_sw2;
+	int mse_fail;		/* number of MSE back to slot 2 failing to transmit */
+	u8 slots[8];
+	size_t nslots;
+	int deciphers;
+};
+
+static int fake_transmit(sc_reader_t *reader, sc_apdu_t *apdu)
+{
+	struct fake_card *fc = reader->drv_data;
+
+	switch (apdu->ins) {
+	case 0x22:
+		if (apdu->data[2] == 2 && fc->mse_fail > 0) {
+			fc->mse_fail--;
+			return SC_ERROR_TRANSMIT_FAILED;
+		}
+		if (fc->nslots < sizeof(fc->slots))
+			fc->slots[fc->nslots++] = apdu->data[2];
+		apdu->sw1 = fc->mse_sw1;
+		apdu->sw2 = fc->mse_sw2;
+		break;
+	case 0x2A:
+		fc->deciphers++;
+		apdu->sw1 = fc->dec_sw1;
+		apdu->sw2 = fc->dec_sw2;
+		if (apdu->sw1 == 0x90) {
+			memset(apdu->resp, 0x5a, PLAIN_LEN);
+			apdu->resplen = PLAIN_LEN;
+		} else {
+			apdu->resplen = 0;
+		}
+		break;
+	default:
+		apdu->sw1 = 0x6D;
+		apdu->sw2 = 0x00;
+	}
+	return SC_SUCCESS;
+}
+
+static int setup_card(void **state)
+{
+	struct fake_card *fc = calloc(1, sizeof(struct fake_card));
+
+	if (fc == NULL)
+		return -1;
+	setenv("OPENSC_CONF", "/nonexistent", 1);
+	if (sc_establish_context(&fc->card.ctx, "openpgpdecipher") != SC_SUCCESS)
+		return -1;
+
+	fc->reader_ops.transmit = fake_transmit;
+	fc->reader.ctx = fc->card.ctx;
+	fc->reader.ops = &fc->reader_ops;
+	fc->reader.drv_data = fc;
+	fc->card_ops = *sc_get_iso7816_driver()->ops;
+	fc->card.reader = &fc->reader;
+	fc->card.ops = &fc->card_ops;
+	fc->card.type = SC_CARD_TYPE_OPENPGP_V3;
+	fc->card.max_recv_size = 256;
+	fc->card.max_send_size = 255;
+	fc->card.drv_data = &fc->priv;
+	fc->priv.bcd_version = OPENPGP_CARD_3_3;
+	fc->priv.ext_caps = EXT_CAP_MSE;
+	fc->priv.sec_env.operation = SC_SEC_OPERATION_DECIPHER;
+	fc->priv.sec_env.algorithm = SC_ALGORITHM_RSA;
+	fc->priv.sec_env.key_ref[0] = 0x02;
+	fc->priv.sec_env.key_ref_len = 1;
+	fc->mse_sw1 = fc->dec_sw1 = 0x90;
+	*state = fc;
+	return 0;
+}
+
+static int teardown_card(void **state)
+{
+	struct fake_card *fc = *state;
+
+	fc->card.drv_data = NULL;
+	sc_release_context(fc->card.ctx);
+	free(fc);
+	return 0;
+}
+
+static int decipher(struct fake_card *fc)
+{
+	u8 in[64], out[128];
+
+	memset(in, 0x11, sizeof(in));
+	return pgp_decipher(&fc->card, in, sizeof(in), out, sizeof(out));
+}
+
+static void torture_decipher_success(void **state)
+{
+	struct fake_card *fc = *state;
+
+	assert_int_equal(decipher(fc), PLAIN_LEN);
+	assert_int_equal(fc->deciphers, 1);
+	assert_int_equal(fc->nslots, 2);
+	assert_int_equal(fc->slots[0], 3);
+	assert_int_equal(fc->slots[1], 2);
+}
+
+static void torture_decipher_error_sw(void **state)
+{
+	struct fake_card *fc = *state;
+
+	/* security status not satisfied, e.g. the PIN was not verified */
+	fc->dec_sw1 = 0x69;
+	fc->dec_sw2 = 0x82;
+	assert_int_equal(decipher(fc), SC_ERROR_SECURITY_STATUS_NOT_SATISFIED);
+	assert_int_equal(fc->deciphers, 1);
+	/* key slot 2 is selected again */
+	assert_int_equal(fc->nslots, 2);
+	assert_int_equal(fc->slots[1], 2);
+}
+
+static void torture_decipher_mse_error(void **state)
+{
+	struct fake_card *fc = *state;
+
+	/* the card refuses the first MSE: nothing is deciphered and
+	 * key slot 2 is still selected */
+	fc->mse_sw1 = 0x6A;
+	fc->mse_sw2 = 0x80;
+	assert_true(decipher(fc) < 0);
+	assert_int_equal(fc->deciphers, 0);
+	assert_int_equal(fc->nslots, 1);
+}
+
+static void torture_decipher_restore_failure(void **state)
+{
+	struct fake_card *fc = *state;
+
+	/* the MSE back to slot 2 is lost once: deciphered data is still
+	 * returned and the MSE is sent again */
+	fc->mse_fail = 1;
+	assert_int_equal(decipher(fc), PLAIN_LEN);
+	assert_int_equal(fc->nslots, 2);
+	assert_int_equal(fc->slots[1], 2);
+
+	/* lost twice: still a result */
+	fc->nslots = 0;
+	fc->mse_fail = 2;
+	assert_int_equal(decipher(fc), PLAIN_LEN);
+	assert_int_equal(fc->nslots, 1);
+}
+
+int main(void)
+{
+	int rc;
+	struct CMUnitTest tests[] = {
+		cmocka_unit_test_setup_teardown(torture_decipher_success,
+			setup_card, teardown_card),
+		cmocka_unit_test_setup_teardown(torture_decipher_error_sw,
+			setup_card, teardown_card),
+		cmocka_unit_test_setup_teardown(torture_decipher_mse_error,
+			setup_card, teardown_card),
+		cmocka_unit_test_setup_teardown(torture_decipher_restore_failure,
+			setup_card, teardown_card),
+	};
+
+	rc = cmocka_run_group_tests(tests, NULL, NULL);
+	return rc;
+}
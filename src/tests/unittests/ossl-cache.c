@@ -0,0 +1,129 @@
+/*
+ * ossl-cache.c: Unit tests for the cache of fetched OpenSSL algorithms
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "torture.h"
+#include "libopensc/opensc.h"
+#include "libopensc/sc-ossl-compat.h"
+
+static int setup_sc_context(void **state)
+{
+	sc_context_t *ctx = NULL;
+
+	setenv("OPENSC_CONF", "/nonexistent", 1);
+	if (sc_establish_context(&ctx, "osslcache") != SC_SUCCESS)
+		return -1;
+	*state = ctx;
+	return 0;
+}
+
+static int teardown_sc_context(void **state)
+{
+	sc_release_context(*state);
+	return 0;
+}
+
+#ifdef USE_OPENSSL3_LIBCTX
+static void torture_ossl_cache_md(void **state)
+{
+	sc_context_t *ctx = *state;
+	EVP_MD *md1, *md2, *md3;
+
+	md1 = sc_evp_md(ctx, "sha256");
+	assert_non_null(md1);
+	md2 = sc_evp_md(ctx, "sha256");
+	/* the same algorithm object is handed out again */
+	assert_ptr_equal(md1, md2);
+	md3 = sc_evp_md(ctx, "sha1");
+	assert_non_null(md3);
+	assert_ptr_not_equal(md1, md3);
+	sc_evp_md_free(md1);
+	sc_evp_md_free(md2);
+	sc_evp_md_free(md3);
+
+	/* still usable after the callers released their references */
+	md1 = sc_evp_md(ctx, "sha256");
+	assert_ptr_equal(md1, md2);
+	assert_int_equal(EVP_MD_get_size(md1), 32);
+	sc_evp_md_free(md1);
+
+	assert_null(sc_evp_md(ctx, "no-such-digest"));
+}
+
+static void torture_ossl_cache_cipher_mac(void **state)
+{
+	sc_context_t *ctx = *state;
+	EVP_CIPHER *c1, *c2;
+	EVP_MAC *m1, *m2;
+
+	c1 = sc_evp_cipher(ctx, "AES-128-CBC");
+	c2 = sc_evp_cipher(ctx, "AES-128-CBC");
+	assert_non_null(c1);
+	assert_ptr_equal(c1, c2);
+	sc_evp_cipher_free(c1);
+	sc_evp_cipher_free(c2);
+
+	m1 = sc_evp_mac(ctx, "cmac");
+	m2 = sc_evp_mac(ctx, "cmac");
+	assert_non_null(m1);
+	assert_ptr_equal(m1, m2);
+	sc_evp_mac_free(m1);
+	sc_evp_mac_free(m2);
+}
+
+static void torture_ossl_cache_full(void **state)
+{
+	sc_context_t *ctx = *state;
+	const char *names[] = {
+		"sha1", "sha224", "sha256", "sha384", "sha512", "sha512-224",
+		"sha512-256", "sha3-224", "sha3-256", "sha3-384", "sha3-512",
+		"shake128", "shake256", "md5", "sm3", "blake2s256", "blake2b512",
+		"SHA2-256", "SHA2-512",
+	};
+	EVP_MD *md;
+	size_t i;
+
+	/* more names than the cache holds are still fetched */
+	for (i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+		md = sc_evp_md(ctx, names[i]);
+		assert_non_null(md);
+		sc_evp_md_free(md);
+	}
+}
+#else
+static void torture_ossl_cache_md(void **state)
+{
+	skip();
+}
+#endif
+
+int main(void)
+{
+	int rc;
+	struct CMUnitTest tests[] = {
+		cmocka_unit_test_setup_teardown(torture_ossl_cache_md,
+			setup_sc_context, teardown_sc_context),
+#ifdef USE_OPENSSL3_LIBCTX
+		cmocka_unit_test_setup_teardown(torture_ossl_cache_cipher_mac,
+			setup_sc_context, teardown_sc_context),
+		cmocka_unit_test_setup_teardown(torture_ossl_cache_full,
+			setup_sc_context, teardown_sc_context),
+#endif
+	};
+
+	rc = cmocka_run_group_tests(tests, NULL, NULL);
+	return rc;
+}
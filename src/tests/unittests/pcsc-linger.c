@@ -0,0 +1,241 @@
+/*
+ * pcsc-linger.c: Unit tests for lingering PC/SC transactions
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <sys/wait.h>
+
+#include "torture.h"
+#include "libopensc/reader-pcsc.c"
+
+#ifdef PCSC_LINGER
+/* SCardEndTransaction() is replaced to count the ended transactions */
+static int end_calls;
+
+static LONG PCSC_API fake_end_transaction(SCARDHANDLE card, DWORD disposition)
+{
+	end_calls++;
+	return SCARD_S_SUCCESS;
+}
+
+struct linger_state {
+	sc_context_t *ctx;
+	sc_reader_t reader;
+	struct pcsc_global_private_data gpriv;
+	struct pcsc_private_data priv;
+};
+
+static int setup_linger(void **state)
+{
+	struct linger_state *ls = calloc(1, sizeof(struct linger_state));
+
+	if (ls == NULL)
+		return -1;
+	setenv("OPENSC_CONF", "/nonexistent", 1);
+	if (sc_establish_context(&ls->ctx, "pcsclinger") != SC_SUCCESS)
+		return -1;
+	ls->gpriv.transaction_linger = 50;
+	ls->gpriv.SCardEndTransaction = fake_end_transaction;
+	if (linger_init(&ls->gpriv) != 0)
+		return -1;
+	ls->priv.gpriv = &ls->gpriv;
+	ls->reader.ctx = ls->ctx;
+	ls->reader.drv_data = &ls->priv;
+	end_calls = 0;
+	*state = ls;
+	return 0;
+}
+
+static int teardown_linger(void **state)
+{
+	struct linger_state *ls = *state;
+
+	linger_stop(&ls->gpriv, 1);
+	sc_release_context(ls->ctx);
+	free(ls);
+	return 0;
+}
+
+static int ended(struct linger_state *ls)
+{
+	int calls;
+
+	pthread_mutex_lock(&ls->gpriv.linger_lock);
+	calls = end_calls;
+	pthread_mutex_unlock(&ls->gpriv.linger_lock);
+	return calls;
+}
+
+static void torture_linger_resume(void **state)
+{
+	struct linger_state *ls = *state;
+
+	assert_int_equal(linger_start(&ls->reader), 1);
+	assert_int_equal(linger_resume(&ls->priv), 1);
+	/* only once */
+	assert_int_equal(linger_resume(&ls->priv), 0);
+	usleep(150000);
+	assert_int_equal(ended(ls), 0);
+
+	/* without the option */
+	ls->gpriv.transaction_linger = 0;
+	assert_int_equal(linger_start(&ls->reader), 0);
+}
+
+static void torture_linger_timeout(void **state)
+{
+	struct linger_state *ls = *state;
+
+	assert_int_equal(linger_start(&ls->reader), 1);
+	usleep(200000);
+	/* the linger thread ended the transaction */
+	assert_int_equal(ended(ls), 1);
+	assert_int_equal(linger_resume(&ls->priv), 0);
+
+	/* and keeps doing so */
+	assert_int_equal(linger_start(&ls->reader), 1);
+	usleep(200000);
+	assert_int_equal(ended(ls), 2);
+}
+
+static void torture_linger_release(void **state)
+{
+	struct linger_state *ls = *state;
+
+	ls->gpriv.transaction_linger = 10000;
+	assert_int_equal(linger_start(&ls->reader), 1);
+	/* pcsc_release() ends the transaction */
+	linger_cancel(&ls->priv, 1);
+	assert_int_equal(end_calls, 1);
+	assert_int_equal(linger_resume(&ls->priv), 0);
+
+	/* pcsc_disconnect() forgets it */
+	assert_int_equal(linger_start(&ls->reader), 1);
+	linger_cancel(&ls->priv, 0);
+	assert_int_equal(end_calls, 1);
+
+	/* pcsc_finish() ends the lingering ones and stops the thread */
+	assert_int_equal(linger_start(&ls->reader), 1);
+	linger_stop(&ls->gpriv, 1);
+	assert_int_equal(end_calls, 2);
+	assert_int_equal(ls->gpriv.linger_started, 0);
+	assert_null(ls->gpriv.lingering);
+}
+
+#define CONCURRENT_READERS	8
+
+struct linger_reader {
+	sc_reader_t reader;
+	struct pcsc_private_data priv;
+	pthread_barrier_t *barrier;
+};
+
+static void *unlock_thread(void *arg)
+{
+	struct linger_reader *lr = arg;
+
+	pthread_barrier_wait(lr->barrier);
+	return linger_start(&lr->reader) == 1 ? NULL : arg;
+}
+
+static void torture_linger_concurrent(void **state)
+{
+	struct linger_state *ls = *state;
+	struct linger_reader readers[CONCURRENT_READERS];
+	pthread_t threads[CONCURRENT_READERS];
+	pthread_barrier_t barrier;
+	void *result;
+	int i;
+
+	/* readers unlocked at the same time share one linger thread */
+	ls->gpriv.transaction_linger = 10000;
+	memset(readers, 0, sizeof(readers));
+	assert_int_equal(pthread_barrier_init(&barrier, NULL, CONCURRENT_READERS), 0);
+	for (i = 0; i < CONCURRENT_READERS; i++) {
+		readers[i].priv.gpriv = &ls->gpriv;
+		readers[i].reader.ctx = ls->ctx;
+		readers[i].reader.drv_data = &readers[i].priv;
+		readers[i].barrier = &barrier;
+		assert_int_equal(pthread_create(&threads[i], NULL, unlock_thread, &readers[i]), 0);
+	}
+	for (i = 0; i < CONCURRENT_READERS; i++) {
+		assert_int_equal(pthread_join(threads[i], &result), 0);
+		assert_null(result);
+	}
+	pthread_barrier_destroy(&barrier);
+
+	for (i = 0; i < CONCURRENT_READERS; i++)
+		assert_int_equal(linger_resume(&readers[i].priv), 1);
+	assert_null(ls->gpriv.lingering);
+	linger_stop(&ls->gpriv, 1);
+	assert_int_equal(end_calls, 0);
+}
+
+static void torture_linger_fork(void **state)
+{
+	struct linger_state *ls = *state;
+	int status;
+	pid_t pid;
+
+	ls->gpriv.transaction_linger = 10000;
+	assert_int_equal(linger_start(&ls->reader), 1);
+
+	pid = fork();
+	assert_true(pid >= 0);
+	if (pid == 0) {
+		/* the transaction is the parent's */
+		if (linger_resume(&ls->priv) != 0)
+			_exit(1);
+		/* the child starts its own linger thread */
+		ls->gpriv.transaction_linger = 50;
+		if (linger_start(&ls->reader) != 1)
+			_exit(2);
+		usleep(200000);
+		if (ended(ls) != 1)
+			_exit(3);
+		linger_stop(&ls->gpriv, 1);
+		_exit(end_calls == 1 ? 0 : 4);
+	}
+	assert_int_equal(waitpid(pid, &status, 0), pid);
+	assert_true(WIFEXITED(status));
+	assert_int_equal(WEXITSTATUS(status), 0);
+
+	/* still lingering in the parent */
+	assert_int_equal(end_calls, 0);
+	assert_int_equal(linger_resume(&ls->priv), 1);
+}
+#endif
+
+int main(void)
+{
+	int rc = 0;
+#ifdef PCSC_LINGER
+	struct CMUnitTest tests[] = {
+		cmocka_unit_test_setup_teardown(torture_linger_resume,
+			setup_linger, teardown_linger),
+		cmocka_unit_test_setup_teardown(torture_linger_timeout,
+			setup_linger, teardown_linger),
+		cmocka_unit_test_setup_teardown(torture_linger_release,
+			setup_linger, teardown_linger),
+		cmocka_unit_test_setup_teardown(torture_linger_concurrent,
+			setup_linger, teardown_linger),
+		cmocka_unit_test_setup_teardown(torture_linger_fork,
+			setup_linger, teardown_linger),
+	};
+
+	rc = cmocka_run_group_tests(tests, NULL, NULL);
+#endif
+	return rc;
+}
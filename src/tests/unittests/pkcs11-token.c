@@ -0,0 +1,473 @@
+/*
+ * pkcs11-token.c: Unit tests for the PKCS#11 module on a token without card
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <pthread.h>
+#include <unistd.h>
+
+#include "torture.h"
+#include "pkcs11/sc-pkcs11.h"
+
+#define OBJECT_MAGIC	0x6f626a21
+
+/* An object of the test token, the attributes are kept in the object */
+struct test_object {
+	struct sc_pkcs11_object base;
+	unsigned int magic;
+	CK_OBJECT_CLASS class;
+	CK_BBOOL is_private;
+	CK_ULONG id;
+};
+
+struct test_token {
+	struct sc_pkcs11_slot *slot;
+	struct sc_pkcs11_card *p11card;
+	CK_SESSION_HANDLE session;
+	CK_SESSION_HANDLE other;
+};
+
+/* Progress of the signature started by sign_thread() */
+static volatile int signing, sign_done, destroyed_while_signing;
+/* Attribute comparisons on private objects */
+static int private_compared;
+
+static void test_object_release(void *obj)
+{
+	struct test_object *object = obj;
+
+	object->magic = 0;
+	free(object);
+}
+
+static CK_RV test_object_get_attribute(struct sc_pkcs11_session *session, void *obj,
+		CK_ATTRIBUTE_PTR attr)
+{
+	struct test_object *object = obj;
+	CK_BBOOL yes = TRUE, no = FALSE;
+	CK_KEY_TYPE key_type = CKK_RSA;
+	CK_ULONG bits = 1024;
+	const void *value;
+	CK_ULONG len;
+
+	if (object->magic != OBJECT_MAGIC)
+		return CKR_OBJECT_HANDLE_INVALID;
+	switch (attr->type) {
+	case CKA_CLASS:
+		value = &object->class;
+		len = sizeof(object->class);
+		break;
+	case CKA_PRIVATE:
+		value = &object->is_private;
+		len = sizeof(object->is_private);
+		break;
+	case CKA_TOKEN:
+		value = &no;
+		len = sizeof(no);
+		break;
+	case CKA_SIGN:
+		value = object->class == CKO_PRIVATE_KEY ? &yes : &no;
+		len = sizeof(yes);
+		break;
+	case CKA_KEY_TYPE:
+		value = &key_type;
+		len = sizeof(key_type);
+		break;
+	case CKA_MODULUS_BITS:
+		value = &bits;
+		len = sizeof(bits);
+		break;
+	case CKA_ID:
+		value = &object->id;
+		len = sizeof(object->id);
+		break;
+	default:
+		return CKR_ATTRIBUTE_TYPE_INVALID;
+	}
+	if (attr->pValue == NULL_PTR) {
+		attr->ulValueLen = len;
+		return CKR_OK;
+	}
+	if (attr->ulValueLen < len)
+		return CKR_BUFFER_TOO_SMALL;
+	memcpy(attr->pValue, value, len);
+	attr->ulValueLen = len;
+	return CKR_OK;
+}
+
+static CK_RV test_object_cmp_attribute(struct sc_pkcs11_session *session, void *obj,
+		CK_ATTRIBUTE_PTR attr)
+{
+	unsigned char value[sizeof(CK_ULONG)];
+	CK_ATTRIBUTE temp = { attr->type, value, sizeof(value) };
+
+	if (((struct test_object *)obj)->is_private)
+		private_compared++;
+	if (test_object_get_attribute(session, obj, &temp) != CKR_OK)
+		return 0;
+	return temp.ulValueLen == attr->ulValueLen
+		&& memcmp(value, attr->pValue, temp.ulValueLen) == 0;
+}
+
+static CK_RV test_object_destroy(struct sc_pkcs11_session *session, void *obj)
+{
+	struct test_object *object = obj;
+
+	if (signing && !sign_done)
+		destroyed_while_signing = 1;
+	list_delete(&session->slot->objects, object);
+	session->slot->objects_generation++;
+	test_object_release(object);
+	return CKR_OK;
+}
+
+static CK_RV test_object_sign(struct sc_pkcs11_session *session, void *obj,
+		CK_MECHANISM_PTR mechanism, CK_BYTE_PTR pData, CK_ULONG ulDataLen,
+		CK_BYTE_PTR pSignature, CK_ULONG_PTR pulDataLen)
+{
+	struct test_object *object = obj;
+
+	signing = 1;
+	/* a slow card, the key must stay alive meanwhile */
+	usleep(200000);
+	if (object->magic != OBJECT_MAGIC)
+		return CKR_KEY_HANDLE_INVALID;
+	memset(pSignature, 0x5a, 128);
+	*pulDataLen = 128;
+	sign_done = 1;
+	return CKR_OK;
+}
+
+static struct sc_pkcs11_object_ops test_object_ops = {
+	.release = test_object_release,
+	.get_attribute = test_object_get_attribute,
+	.cmp_attribute = test_object_cmp_attribute,
+	.destroy_object = test_object_destroy,
+	.sign = test_object_sign,
+};
+
+static struct test_object *add_object(struct test_token *token, CK_OBJECT_CLASS class,
+		CK_BBOOL is_private, CK_ULONG id)
+{
+	struct test_object *object = calloc(1, sizeof(struct test_object));
+
+	assert_non_null(object);
+	object->base.ops = &test_object_ops;
+	object->base.handle = (CK_OBJECT_HANDLE)(uintptr_t)object;
+	object->magic = OBJECT_MAGIC;
+	object->class = class;
+	object->is_private = is_private;
+	object->id = id;
+	sc_pkcs11_lock();
+	list_append(&token->slot->objects, object);
+	token->slot->objects_generation++;
+	sc_pkcs11_unlock();
+	return object;
+}
+
+static int setup_token(void **state)
+{
+	CK_C_INITIALIZE_ARGS args = { .flags = CKF_OS_LOCKING_OK };
+	CK_MECHANISM_INFO info = { 1024, 4096, CKF_HW | CKF_SIGN };
+	sc_pkcs11_mechanism_type_t *mt;
+	struct test_token *token;
+	CK_RV rv;
+
+	setenv("OPENSC_CONF", "/nonexistent", 1);
+	token = calloc(1, sizeof(struct test_token));
+	if (token == NULL || C_Initialize(&args) != CKR_OK)
+		return -1;
+
+	/* A slot with a token, but without reader and card */
+	sc_pkcs11_lock();
+	rv = create_slot(NULL);
+	if (rv == CKR_OK) {
+		token->slot = list_get_at(&virtual_slots, list_size(&virtual_slots) - 1);
+		token->p11card = calloc(1, sizeof(struct sc_pkcs11_card));
+		if (token->p11card == NULL)
+			rv = CKR_HOST_MEMORY;
+	}
+	if (rv == CKR_OK)
+		rv = sc_pkcs11_init_card_lock(token->p11card);
+	if (rv == CKR_OK) {
+		token->slot->p11card = token->p11card;
+		token->slot->slot_info.flags |= CKF_TOKEN_PRESENT;
+		mt = sc_pkcs11_new_fw_mechanism(CKM_RSA_PKCS, &info, CKK_RSA, NULL, NULL, NULL);
+		rv = sc_pkcs11_register_mechanism(token->p11card, mt, NULL);
+		sc_pkcs11_free_mechanism(&mt);
+	}
+	sc_pkcs11_unlock();
+	if (rv != CKR_OK)
+		return -1;
+
+	if (C_OpenSession(token->slot->id, CKF_SERIAL_SESSION | CKF_RW_SESSION,
+				NULL, NULL, &token->session) != CKR_OK
+			|| C_OpenSession(token->slot->id, CKF_SERIAL_SESSION | CKF_RW_SESSION,
+				NULL, NULL, &token->other) != CKR_OK)
+		return -1;
+	*state = token;
+	return 0;
+}
+
+static int teardown_token(void **state)
+{
+	struct test_token *token = *state;
+
+	sc_pkcs11_lock();
+	slot_token_removed(token->slot->id);
+	sc_pkcs11_card_free(token->p11card);
+	sc_pkcs11_unlock();
+	free(token);
+	return C_Finalize(NULL_PTR) == CKR_OK ? 0 : -1;
+}
+
+static void *sign_thread(void *arg)
+{
+	struct test_token *token = arg;
+	CK_BYTE data[20] = { 0 }, signature[256];
+	CK_ULONG len = sizeof(signature);
+
+	if (C_Sign(token->session, data, sizeof(data), signature, &len) != CKR_OK)
+		return arg;
+	return NULL;
+}
+
+static void torture_destroy_while_signing(void **state)
+{
+	struct test_token *token = *state;
+	CK_MECHANISM mech = { CKM_RSA_PKCS, NULL_PTR, 0 };
+	struct test_object *key;
+	pthread_t thread;
+	void *result;
+
+	key = add_object(token, CKO_PRIVATE_KEY, FALSE, 1);
+	assert_int_equal(C_SignInit(token->session, &mech, key->base.handle), CKR_OK);
+
+	signing = sign_done = destroyed_while_signing = 0;
+	assert_int_equal(pthread_create(&thread, NULL, sign_thread, token), 0);
+	while (!signing)
+		usleep(1000);
+	/* the key is only released after the signature is done */
+	assert_int_equal(C_DestroyObject(token->other, key->base.handle), CKR_OK);
+	assert_int_equal(pthread_join(thread, &result), 0);
+	assert_null(result);
+	assert_int_equal(destroyed_while_signing, 0);
+}
+
+static void torture_close_while_signing(void **state)
+{
+	struct test_token *token = *state;
+	CK_MECHANISM mech = { CKM_RSA_PKCS, NULL_PTR, 0 };
+	struct test_object *key;
+	pthread_t thread;
+	void *result;
+
+	key = add_object(token, CKO_PRIVATE_KEY, FALSE, 1);
+	assert_int_equal(C_SignInit(token->session, &mech, key->base.handle), CKR_OK);
+
+	signing = sign_done = 0;
+	assert_int_equal(pthread_create(&thread, NULL, sign_thread, token), 0);
+	while (!signing)
+		usleep(1000);
+	assert_int_equal(C_CloseAllSessions(token->slot->id), CKR_OK);
+	assert_int_equal(sign_done, 1);
+	assert_int_equal(pthread_join(thread, &result), 0);
+	assert_null(result);
+}
+
+static CK_OBJECT_HANDLE destroy_handle;
+
+static void *destroy_thread(void *arg)
+{
+	struct test_token *token = arg;
+
+	if (C_DestroyObject(token->other, destroy_handle) != CKR_OK)
+		return arg;
+	return NULL;
+}
+
+static void torture_wait_without_global_lock(void **state)
+{
+	struct test_token *token = *state;
+	CK_MECHANISM mech = { CKM_RSA_PKCS, NULL_PTR, 0 };
+	CK_SESSION_HANDLE session;
+	struct test_object *key;
+	pthread_t signer, destroyer;
+	void *result;
+
+	key = add_object(token, CKO_PRIVATE_KEY, FALSE, 1);
+	destroy_handle = add_object(token, CKO_DATA, FALSE, 2)->base.handle;
+	assert_int_equal(C_SignInit(token->session, &mech, key->base.handle), CKR_OK);
+
+	signing = sign_done = destroyed_while_signing = 0;
+	assert_int_equal(pthread_create(&signer, NULL, sign_thread, token), 0);
+	while (!signing)
+		usleep(1000);
+	assert_int_equal(pthread_create(&destroyer, NULL, destroy_thread, token), 0);
+	usleep(20000);
+	/* the destroyer waits for the card, but not with the global lock */
+	assert_int_equal(C_OpenSession(token->slot->id, CKF_SERIAL_SESSION,
+				NULL, NULL, &session), CKR_OK);
+	assert_int_equal(sign_done, 0);
+
+	assert_int_equal(pthread_join(signer, &result), 0);
+	assert_null(result);
+	assert_int_equal(pthread_join(destroyer, &result), 0);
+	assert_null(result);
+	assert_int_equal(destroyed_while_signing, 0);
+	assert_int_equal(C_CloseSession(session), CKR_OK);
+}
+
+static void torture_session_handle_reuse(void **state)
+{
+	struct test_token *token = *state;
+	CK_SESSION_HANDLE first, session;
+	CK_SESSION_INFO info;
+	int i;
+
+	/* a closed handle stays invalid however often its entry is reused */
+	assert_int_equal(C_OpenSession(token->slot->id, CKF_SERIAL_SESSION,
+				NULL, NULL, &first), CKR_OK);
+	assert_int_equal(C_CloseSession(first), CKR_OK);
+	for (i = 0; i < 10000; i++) {
+		assert_int_equal(C_OpenSession(token->slot->id, CKF_SERIAL_SESSION,
+					NULL, NULL, &session), CKR_OK);
+		assert_int_not_equal(session, first);
+		assert_int_equal(C_GetSessionInfo(first, &info), CKR_SESSION_HANDLE_INVALID);
+		assert_int_equal(C_CloseSession(session), CKR_OK);
+	}
+}
+
+/* Read the IDs of the next found objects */
+static CK_ULONG find_ids(struct test_token *token, CK_ULONG *ids, CK_ULONG max)
+{
+	CK_OBJECT_HANDLE handles[16];
+	CK_ATTRIBUTE attr = { CKA_ID, NULL_PTR, sizeof(CK_ULONG) };
+	CK_ULONG i, count = 0;
+
+	assert_true(max <= 16);
+	assert_int_equal(C_FindObjects(token->session, handles, max, &count), CKR_OK);
+	for (i = 0; i < count; i++) {
+		attr.pValue = &ids[i];
+		assert_int_equal(C_GetAttributeValue(token->session, handles[i], &attr, 1), CKR_OK);
+	}
+	return count;
+}
+
+static void torture_find_lazy(void **state)
+{
+	struct test_token *token = *state;
+	CK_OBJECT_CLASS class = CKO_PRIVATE_KEY;
+	CK_ATTRIBUTE template[] = { { CKA_CLASS, &class, sizeof(class) } };
+	CK_ULONG i, ids[16];
+
+	for (i = 0; i < 10; i++)
+		add_object(token, i % 2 ? CKO_CERTIFICATE : CKO_PRIVATE_KEY, FALSE, i);
+
+	assert_int_equal(C_FindObjectsInit(token->session, template, 1), CKR_OK);
+	/* the matches come one by one in the order of the slot */
+	for (i = 0; i < 5; i++) {
+		assert_int_equal(find_ids(token, ids, 1), 1);
+		assert_int_equal(ids[0], 2 * i);
+	}
+	assert_int_equal(find_ids(token, ids, 1), 0);
+	assert_int_equal(C_FindObjectsFinal(token->session), CKR_OK);
+
+	/* an empty template matches everything */
+	assert_int_equal(C_FindObjectsInit(token->session, NULL_PTR, 0), CKR_OK);
+	assert_int_equal(find_ids(token, ids, 16), 10);
+	for (i = 0; i < 10; i++)
+		assert_int_equal(ids[i], i);
+	assert_int_equal(C_FindObjectsFinal(token->session), CKR_OK);
+}
+
+static void torture_find_changed_slot(void **state)
+{
+	struct test_token *token = *state;
+	struct test_object *objects[6];
+	CK_ULONG i, ids[16];
+
+	for (i = 0; i < 6; i++)
+		objects[i] = add_object(token, CKO_DATA, FALSE, i);
+
+	assert_int_equal(C_FindObjectsInit(token->session, NULL_PTR, 0), CKR_OK);
+	assert_int_equal(find_ids(token, ids, 2), 2);
+	assert_int_equal(ids[0], 0);
+	assert_int_equal(ids[1], 1);
+
+	/* objects removed or added during the search neither shift the
+	 * search nor show up in it */
+	add_object(token, CKO_DATA, FALSE, 6);
+	assert_int_equal(C_DestroyObject(token->other, objects[0]->base.handle), CKR_OK);
+	assert_int_equal(C_DestroyObject(token->other, objects[3]->base.handle), CKR_OK);
+
+	assert_int_equal(find_ids(token, ids, 16), 3);
+	assert_int_equal(ids[0], 2);
+	assert_int_equal(ids[1], 4);
+	assert_int_equal(ids[2], 5);
+	assert_int_equal(find_ids(token, ids, 16), 0);
+	assert_int_equal(C_FindObjectsFinal(token->session), CKR_OK);
+}
+
+static void torture_find_private(void **state)
+{
+	struct test_token *token = *state;
+	CK_OBJECT_CLASS class = CKO_DATA;
+	CK_ATTRIBUTE template[] = { { CKA_CLASS, &class, sizeof(class) } };
+	CK_ULONG i, ids[16];
+
+	for (i = 0; i < 6; i++)
+		add_object(token, CKO_DATA, i < 3, i);
+
+	/* not logged in to a token that requires it */
+	token->slot->token_info.flags |= CKF_LOGIN_REQUIRED;
+	private_compared = 0;
+	assert_int_equal(C_FindObjectsInit(token->session, template, 1), CKR_OK);
+	assert_int_equal(find_ids(token, ids, 16), 3);
+	for (i = 0; i < 3; i++)
+		assert_int_equal(ids[i], i + 3);
+	assert_int_equal(C_FindObjectsFinal(token->session), CKR_OK);
+	/* hidden objects are skipped before their attributes are compared */
+	assert_int_equal(private_compared, 0);
+
+	token->slot->token_info.flags &= ~CKF_LOGIN_REQUIRED;
+	assert_int_equal(C_FindObjectsInit(token->session, template, 1), CKR_OK);
+	assert_int_equal(find_ids(token, ids, 16), 6);
+	assert_int_equal(C_FindObjectsFinal(token->session), CKR_OK);
+}
+
+int main(void)
+{
+	int rc;
+	struct CMUnitTest tests[] = {
+		cmocka_unit_test_setup_teardown(torture_destroy_while_signing,
+			setup_token, teardown_token),
+		cmocka_unit_test_setup_teardown(torture_close_while_signing,
+			setup_token, teardown_token),
+		cmocka_unit_test_setup_teardown(torture_wait_without_global_lock,
+			setup_token, teardown_token),
+		cmocka_unit_test_setup_teardown(torture_session_handle_reuse,
+			setup_token, teardown_token),
+		cmocka_unit_test_setup_teardown(torture_find_lazy,
+			setup_token, teardown_token),
+		cmocka_unit_test_setup_teardown(torture_find_changed_slot,
+			setup_token, teardown_token),
+		cmocka_unit_test_setup_teardown(torture_find_private,
+			setup_token, teardown_token),
+	};
+
+	rc = cmocka_run_group_tests(tests, NULL, NULL);
+	return rc;
+}
@@ -0,0 +1,430 @@
+/*
+ * pkcs15-cache.c: Unit tests for the PKCS#15 file cache
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <limits.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include "torture.h"
+#include "libopensc/opensc.h"
+#include "libopensc/pkcs15.h"
+
+struct cache_state {
+	sc_context_t *ctx;
+	sc_card_t card;
+	struct sc_pkcs15_card *p15card;
+	char dir[PATH_MAX];
+};
+
+static int setup_cache(void **state)
+{
+	struct cache_state *cs = calloc(1, sizeof(struct cache_state));
+
+	if (cs == NULL)
+		return -1;
+	strcpy(cs->dir, "/tmp/opensc-cache-XXXXXX");
+	if (mkdtemp(cs->dir) == NULL)
+		return -1;
+	setenv("OPENSC_CONF", "/nonexistent", 1);
+	setenv("XDG_CACHE_HOME", cs->dir, 1);
+	if (sc_establish_context(&cs->ctx, "pkcs15cache") != SC_SUCCESS)
+		return -1;
+
+	cs->card.ctx = cs->ctx;
+	cs->p15card = sc_pkcs15_card_new();
+	if (cs->p15card == NULL)
+		return -1;
+	cs->p15card->card = &cs->card;
+	cs->p15card->tokeninfo->serial_number = strdup("0123456789");
+	*state = cs;
+	return 0;
+}
+
+static int teardown_cache(void **state)
+{
+	struct cache_state *cs = *state;
+	char cmd[PATH_MAX + 16];
+
+	sc_pkcs15_card_free(cs->p15card);
+	sc_release_context(cs->ctx);
+	snprintf(cmd, sizeof(cmd), "rm -rf %s", cs->dir);
+	if (system(cmd) != 0)
+		return -1;
+	free(cs);
+	return 0;
+}
+
+static void torture_cache_roundtrip(void **state)
+{
+	struct cache_state *cs = *state;
+	const u8 odf[] = { 0xA0, 0x06, 0x30, 0x04, 0x04, 0x02, 0x44, 0x01 };
+	const u8 cdf[] = { 0x30, 0x00 };
+	const u8 cdf2[] = { 0x30, 0x03, 0x01, 0x02, 0x03 };
+	sc_path_t odf_path, cdf_path;
+	u8 *buf = NULL;
+	u8 small[4];
+	size_t len = 0;
+	int rv;
+
+	sc_format_path("3F0050155031", &odf_path);
+	sc_format_path("3F0050154404", &cdf_path);
+
+	rv = sc_pkcs15_read_cached_file(cs->p15card, &odf_path, &buf, &len);
+	assert_int_equal(rv, SC_ERROR_FILE_NOT_FOUND);
+
+	rv = sc_pkcs15_cache_file(cs->p15card, &odf_path, odf, sizeof(odf));
+	assert_int_equal(rv, SC_SUCCESS);
+	rv = sc_pkcs15_cache_file(cs->p15card, &cdf_path, cdf, sizeof(cdf));
+	assert_int_equal(rv, SC_SUCCESS);
+
+	rv = sc_pkcs15_read_cached_file(cs->p15card, &odf_path, &buf, &len);
+	assert_int_equal(rv, SC_SUCCESS);
+	assert_int_equal(len, sizeof(odf));
+	assert_memory_equal(buf, odf, sizeof(odf));
+	free(buf);
+
+	/* replace an entry */
+	rv = sc_pkcs15_cache_file(cs->p15card, &cdf_path, cdf2, sizeof(cdf2));
+	assert_int_equal(rv, SC_SUCCESS);
+	buf = NULL;
+	rv = sc_pkcs15_read_cached_file(cs->p15card, &cdf_path, &buf, &len);
+	assert_int_equal(rv, SC_SUCCESS);
+	assert_int_equal(len, sizeof(cdf2));
+	assert_memory_equal(buf, cdf2, sizeof(cdf2));
+	free(buf);
+
+	/* read a part into the caller's buffer */
+	cdf_path.index = 2;
+	cdf_path.count = 3;
+	buf = small;
+	len = sizeof(small);
+	rv = sc_pkcs15_read_cached_file(cs->p15card, &cdf_path, &buf, &len);
+	assert_int_equal(rv, SC_SUCCESS);
+	assert_int_equal(len, 3);
+	assert_memory_equal(small, cdf2 + 2, 3);
+
+	cdf_path.count = 4;
+	rv = sc_pkcs15_read_cached_file(cs->p15card, &cdf_path, &buf, &len);
+	assert_int_equal(rv, SC_ERROR_FILE_NOT_FOUND);
+
+	/* the first entry survived the updates */
+	buf = NULL;
+	rv = sc_pkcs15_read_cached_file(cs->p15card, &odf_path, &buf, &len);
+	assert_int_equal(rv, SC_SUCCESS);
+	assert_memory_equal(buf, odf, sizeof(odf));
+	free(buf);
+}
+
+static void cache_fname(struct cache_state *cs, char *fname, size_t size)
+{
+	assert_int_equal(sc_get_cache_dir(cs->ctx, fname, size), SC_SUCCESS);
+	strncat(fname, "/0123456789_NODATE", size - strlen(fname) - 1);
+}
+
+static struct sc_pkcs15_card *new_p15card(struct cache_state *cs)
+{
+	struct sc_pkcs15_card *p15card = sc_pkcs15_card_new();
+
+	assert_non_null(p15card);
+	p15card->card = &cs->card;
+	p15card->tokeninfo->serial_number = strdup("0123456789");
+	return p15card;
+}
+
+static void torture_cache_flush(void **state)
+{
+	struct cache_state *cs = *state;
+	const u8 data[] = { 0x30, 0x01, 0x00 };
+	char fname[PATH_MAX], pathstr[16];
+	struct sc_pkcs15_card *p15card;
+	struct stat st, st2;
+	sc_path_t path;
+	u8 *buf = NULL;
+	size_t len = 0;
+	mode_t mask;
+	int i, rv;
+
+	cache_fname(cs, fname, sizeof(fname));
+	for (i = 0; i < 20; i++) {
+		snprintf(pathstr, sizeof(pathstr), "3F005015%04X", 0x4400 + i);
+		sc_format_path(pathstr, &path);
+		rv = sc_pkcs15_cache_file(cs->p15card, &path, data, sizeof(data));
+		assert_int_equal(rv, SC_SUCCESS);
+	}
+	/* nothing is written before the flush */
+	assert_int_not_equal(stat(fname, &st), 0);
+
+	mask = umask(022);
+	rv = sc_pkcs15_cache_flush(cs->p15card);
+	umask(mask);
+	assert_int_equal(rv, SC_SUCCESS);
+	assert_int_equal(stat(fname, &st), 0);
+	/* the mode follows the umask */
+	assert_int_equal(st.st_mode & 0777, 0644);
+
+	/* flushing without new entries does not rewrite the file */
+	rv = sc_pkcs15_cache_flush(cs->p15card);
+	assert_int_equal(rv, SC_SUCCESS);
+	assert_int_equal(stat(fname, &st2), 0);
+	assert_int_equal(st.st_ino, st2.st_ino);
+
+	p15card = new_p15card(cs);
+	sc_format_path("3F0050154413", &path);
+	rv = sc_pkcs15_read_cached_file(p15card, &path, &buf, &len);
+	assert_int_equal(rv, SC_SUCCESS);
+	assert_int_equal(len, sizeof(data));
+	free(buf);
+	sc_pkcs15_card_free(p15card);
+}
+
+static void torture_cache_concurrent(void **state)
+{
+	struct cache_state *cs = *state;
+	const u8 data[] = { 0x30, 0x00 };
+	struct sc_pkcs15_card *p15card;
+	char pathstr[16];
+	sc_path_t path;
+	u8 *buf = NULL;
+	size_t len = 0;
+	pid_t pids[8];
+	int i, j, status, rv;
+
+	/* concurrent updates of the cache file keep all entries */
+	for (i = 0; i < 8; i++) {
+		pids[i] = fork();
+		assert_true(pids[i] >= 0);
+		if (pids[i] == 0) {
+			p15card = new_p15card(cs);
+			for (j = 0; j < 10; j++) {
+				snprintf(pathstr, sizeof(pathstr), "3F00%02X%02X", i, j);
+				sc_format_path(pathstr, &path);
+				if (sc_pkcs15_cache_file(p15card, &path, data, sizeof(data)) != SC_SUCCESS
+						|| sc_pkcs15_cache_flush(p15card) != SC_SUCCESS)
+					_exit(1);
+			}
+			_exit(0);
+		}
+	}
+	for (i = 0; i < 8; i++) {
+		assert_int_equal(waitpid(pids[i], &status, 0), pids[i]);
+		assert_true(WIFEXITED(status));
+		assert_int_equal(WEXITSTATUS(status), 0);
+	}
+
+	for (i = 0; i < 8; i++) {
+		for (j = 0; j < 10; j++) {
+			snprintf(pathstr, sizeof(pathstr), "3F00%02X%02X", i, j);
+			sc_format_path(pathstr, &path);
+			rv = sc_pkcs15_read_cached_file(cs->p15card, &path, &buf, &len);
+			assert_int_equal(rv, SC_SUCCESS);
+			free(buf);
+			buf = NULL;
+		}
+	}
+}
+
+struct cache_thread {
+	struct cache_state *cs;
+	int id;
+	int rv;
+};
+
+static void *cache_thread_run(void *arg)
+{
+	struct cache_thread *ct = arg;
+	const u8 data[] = { 0x30, 0x00 };
+	struct sc_pkcs15_card *p15card;
+	char pathstr[16];
+	sc_path_t path;
+	int j;
+
+	p15card = new_p15card(ct->cs);
+	for (j = 0; j < 10 && ct->rv == SC_SUCCESS; j++) {
+		snprintf(pathstr, sizeof(pathstr), "3F00%02X%02X", ct->id, j);
+		sc_format_path(pathstr, &path);
+		ct->rv = sc_pkcs15_cache_file(p15card, &path, data, sizeof(data));
+		if (ct->rv == SC_SUCCESS)
+			ct->rv = sc_pkcs15_cache_flush(p15card);
+	}
+	sc_pkcs15_card_free(p15card);
+	return NULL;
+}
+
+static void torture_cache_threads(void **state)
+{
+	struct cache_state *cs = *state;
+	struct cache_thread ct[8];
+	pthread_t threads[8];
+	char pathstr[16];
+	sc_path_t path;
+	u8 *buf = NULL;
+	size_t len = 0;
+	int i, j, rv;
+
+	/* the threads of one process sharing a context exclude each other
+	 * as well */
+	for (i = 0; i < 8; i++) {
+		ct[i].cs = cs;
+		ct[i].id = i;
+		ct[i].rv = SC_SUCCESS;
+		assert_int_equal(pthread_create(&threads[i], NULL, cache_thread_run, &ct[i]), 0);
+	}
+	for (i = 0; i < 8; i++) {
+		assert_int_equal(pthread_join(threads[i], NULL), 0);
+		assert_int_equal(ct[i].rv, SC_SUCCESS);
+	}
+
+	for (i = 0; i < 8; i++) {
+		for (j = 0; j < 10; j++) {
+			snprintf(pathstr, sizeof(pathstr), "3F00%02X%02X", i, j);
+			sc_format_path(pathstr, &path);
+			rv = sc_pkcs15_read_cached_file(cs->p15card, &path, &buf, &len);
+			assert_int_equal(rv, SC_SUCCESS);
+			free(buf);
+			buf = NULL;
+		}
+	}
+}
+
+static void torture_cache_migrate(void **state)
+{
+	struct cache_state *cs = *state;
+	const u8 odf[] = { 0xA0, 0x06, 0x30, 0x04, 0x04, 0x02, 0x44, 0x01 };
+	const u8 cdf[] = { 0x30, 0x00 };
+	char fname[PATH_MAX], old1[PATH_MAX + 32], old2[PATH_MAX + 32], other[PATH_MAX + 32];
+	sc_path_t odf_path, cdf_path;
+	struct stat st;
+	u8 *buf = NULL;
+	size_t len = 0;
+	FILE *f;
+	int rv;
+
+	/* files written by older versions, one per cached file */
+	cache_fname(cs, fname, sizeof(fname));
+	assert_int_equal(sc_make_cache_dir(cs->ctx), SC_SUCCESS);
+	snprintf(old1, sizeof(old1), "%s_50155031", fname);
+	snprintf(old2, sizeof(old2), "%s_A000000063_4404", fname);
+	snprintf(other, sizeof(other), "%s_notes", fname);
+	f = fopen(old1, "wb");
+	assert_non_null(f);
+	assert_int_equal(fwrite(odf, 1, sizeof(odf), f), sizeof(odf));
+	fclose(f);
+	f = fopen(old2, "wb");
+	assert_non_null(f);
+	assert_int_equal(fwrite(cdf, 1, sizeof(cdf), f), sizeof(cdf));
+	fclose(f);
+	f = fopen(other, "wb");
+	assert_non_null(f);
+	fclose(f);
+
+	sc_format_path("3F0050155031", &odf_path);
+	rv = sc_pkcs15_read_cached_file(cs->p15card, &odf_path, &buf, &len);
+	assert_int_equal(rv, SC_SUCCESS);
+	assert_int_equal(len, sizeof(odf));
+	assert_memory_equal(buf, odf, sizeof(odf));
+	free(buf);
+
+	rv = sc_pkcs15_cache_flush(cs->p15card);
+	assert_int_equal(rv, SC_SUCCESS);
+	assert_int_equal(stat(fname, &st), 0);
+	assert_int_not_equal(stat(old1, &st), 0);
+	assert_int_not_equal(stat(old2, &st), 0);
+	/* not a cached file */
+	assert_int_equal(stat(other, &st), 0);
+
+	sc_format_path("4404", &cdf_path);
+	cdf_path.type = SC_PATH_TYPE_FILE_ID;
+	cdf_path.aid.len = sizeof(cdf_path.aid.value);
+	assert_int_equal(sc_hex_to_bin("A000000063", cdf_path.aid.value, &cdf_path.aid.len), SC_SUCCESS);
+	buf = NULL;
+	rv = sc_pkcs15_read_cached_file(cs->p15card, &cdf_path, &buf, &len);
+	assert_int_equal(rv, SC_SUCCESS);
+	assert_int_equal(len, sizeof(cdf));
+	free(buf);
+}
+
+static void torture_cache_parse_df(void **state)
+{
+	struct cache_state *cs = *state;
+	struct sc_pkcs15_object cert_obj, *obj = NULL;
+	struct sc_pkcs15_cert_info cert_info;
+	struct sc_pkcs15_cert_info *info;
+	const u8 value[] = { 0x30, 0x03, 0x02, 0x01, 0x05 };
+	sc_path_t cdf_path;
+	u8 *buf = NULL;
+	size_t len = 0;
+	int rv;
+
+	memset(&cert_obj, 0, sizeof(cert_obj));
+	memset(&cert_info, 0, sizeof(cert_info));
+	strcpy(cert_obj.label, "Direct");
+	cert_obj.type = SC_PKCS15_TYPE_CERT_X509;
+	cert_obj.data = &cert_info;
+	cert_info.id.value[0] = 0x45;
+	cert_info.id.len = 1;
+	cert_info.value.value = (u8 *)value;
+	cert_info.value.len = sizeof(value);
+	rv = sc_pkcs15_encode_cdf_entry(cs->ctx, &cert_obj, &buf, &len);
+	assert_int_equal(rv, SC_SUCCESS);
+
+	sc_format_path("3F0050154404", &cdf_path);
+	rv = sc_pkcs15_cache_file(cs->p15card, &cdf_path, buf, len);
+	assert_int_equal(rv, SC_SUCCESS);
+	free(buf);
+
+	cs->p15card->opts.use_file_cache = 1;
+	cs->p15card->file_app = sc_file_new();
+	assert_non_null(cs->p15card->file_app);
+	sc_format_path("3F005015", &cs->p15card->file_app->path);
+	rv = sc_pkcs15_add_df(cs->p15card, SC_PKCS15_CDF, &cdf_path);
+	assert_int_equal(rv, SC_SUCCESS);
+	rv = sc_pkcs15_parse_df(cs->p15card, cs->p15card->df_list);
+	assert_int_equal(rv, SC_SUCCESS);
+
+	rv = sc_pkcs15_find_cert_by_id(cs->p15card, &cert_info.id, &obj);
+	assert_int_equal(rv, SC_SUCCESS);
+	info = obj->data;
+	assert_int_equal(info->value.len, sizeof(value));
+	assert_memory_equal(info->value.value, value, sizeof(value));
+	/* the value was decoded in place and keeps the DF contents */
+	assert_non_null(obj->df_buffer);
+	assert_null(cs->p15card->df_buffer);
+}
+
+int main(void)
+{
+	int rc;
+	struct CMUnitTest tests[] = {
+		cmocka_unit_test_setup_teardown(torture_cache_roundtrip,
+			setup_cache, teardown_cache),
+		cmocka_unit_test_setup_teardown(torture_cache_flush,
+			setup_cache, teardown_cache),
+		cmocka_unit_test_setup_teardown(torture_cache_concurrent,
+			setup_cache, teardown_cache),
+		cmocka_unit_test_setup_teardown(torture_cache_threads,
+			setup_cache, teardown_cache),
+		cmocka_unit_test_setup_teardown(torture_cache_migrate,
+			setup_cache, teardown_cache),
+		cmocka_unit_test_setup_teardown(torture_cache_parse_df,
+			setup_cache, teardown_cache),
+	};
+
+	rc = cmocka_run_group_tests(tests, NULL, NULL);
+	return rc;
+}
@@ -0,0 +1,176 @@
+/*
+ * pkcs15-objects.c: Unit tests for the PKCS#15 object list and its index
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "torture.h"
+#include "libopensc/pkcs15.h"
+
+static struct sc_pkcs15_object *
+new_cert(struct sc_pkcs15_card *p15card, unsigned char id, unsigned char auth_id)
+{
+	struct sc_pkcs15_object *obj = calloc(1, sizeof(struct sc_pkcs15_object));
+	struct sc_pkcs15_cert_info *info = calloc(1, sizeof(struct sc_pkcs15_cert_info));
+
+	assert_non_null(obj);
+	assert_non_null(info);
+	obj->type = SC_PKCS15_TYPE_CERT_X509;
+	obj->data = info;
+	info->id.value[0] = id;
+	info->id.len = 1;
+	info->path.value[0] = 0x3F;
+	info->path.value[1] = id;
+	info->path.len = 2;
+	if (auth_id) {
+		obj->auth_id.value[0] = auth_id;
+		obj->auth_id.len = 1;
+	}
+	assert_int_equal(sc_pkcs15_add_object(p15card, obj), SC_SUCCESS);
+	return obj;
+}
+
+static int setup_p15card(void **state)
+{
+	struct sc_pkcs15_card *p15card = sc_pkcs15_card_new();
+
+	if (p15card == NULL)
+		return -1;
+	*state = p15card;
+	return 0;
+}
+
+static int teardown_p15card(void **state)
+{
+	sc_pkcs15_card_free(*state);
+	return 0;
+}
+
+static void torture_find_by_id(void **state)
+{
+	struct sc_pkcs15_card *p15card = *state;
+	struct sc_pkcs15_object *objs[300], *found = NULL;
+	struct sc_pkcs15_id id;
+	int i, rv;
+
+	/* more objects than the initial number of buckets */
+	for (i = 0; i < 300; i++)
+		objs[i] = new_cert(p15card, (unsigned char) i, 0);
+	assert_ptr_equal(p15card->obj_tail, objs[299]);
+
+	id.len = 1;
+	for (i = 0; i < 256; i++) {
+		id.value[0] = (unsigned char) i;
+		rv = sc_pkcs15_find_cert_by_id(p15card, &id, &found);
+		assert_int_equal(rv, SC_SUCCESS);
+		/* the first object in the list order wins */
+		assert_ptr_equal(found, objs[i]);
+	}
+
+	id.len = 2;
+	rv = sc_pkcs15_find_cert_by_id(p15card, &id, &found);
+	assert_int_equal(rv, SC_ERROR_OBJECT_NOT_FOUND);
+	id.len = 1;
+	rv = sc_pkcs15_find_prkey_by_id(p15card, &id, &found);
+	assert_int_equal(rv, SC_ERROR_OBJECT_NOT_FOUND);
+}
+
+static void torture_remove_and_reindex(void **state)
+{
+	struct sc_pkcs15_card *p15card = *state;
+	struct sc_pkcs15_object *a, *b, *c, *found = NULL;
+	struct sc_pkcs15_search_key sk;
+	struct sc_pkcs15_id id;
+	int rv;
+
+	a = new_cert(p15card, 1, 0);
+	b = new_cert(p15card, 1, 0);
+	c = new_cert(p15card, 2, 0);
+
+	id.len = 1;
+	id.value[0] = 1;
+	memset(&sk, 0, sizeof(sk));
+	sk.class_mask = SC_PKCS15_SEARCH_CLASS_CERT;
+	sk.id = &id;
+	rv = sc_pkcs15_search_objects(p15card, &sk, NULL, 0);
+	assert_int_equal(rv, 2);
+
+	sc_pkcs15_remove_object(p15card, a);
+	sc_pkcs15_free_object(a);
+	rv = sc_pkcs15_find_cert_by_id(p15card, &id, &found);
+	assert_int_equal(rv, SC_SUCCESS);
+	assert_ptr_equal(found, b);
+
+	sc_pkcs15_remove_object(p15card, c);
+	assert_ptr_equal(p15card->obj_tail, b);
+	sc_pkcs15_free_object(c);
+
+	/* change the ID in place */
+	((struct sc_pkcs15_cert_info *) b->data)->id.value[0] = 3;
+	sc_pkcs15_reindex_object(p15card, b);
+	rv = sc_pkcs15_find_cert_by_id(p15card, &id, &found);
+	assert_int_equal(rv, SC_ERROR_OBJECT_NOT_FOUND);
+	id.value[0] = 3;
+	rv = sc_pkcs15_find_cert_by_id(p15card, &id, &found);
+	assert_int_equal(rv, SC_SUCCESS);
+	assert_ptr_equal(found, b);
+}
+
+static void torture_find_by_auth_id_and_path(void **state)
+{
+	struct sc_pkcs15_card *p15card = *state;
+	struct sc_pkcs15_object *ret[4];
+	struct sc_pkcs15_search_key sk;
+	struct sc_pkcs15_id auth_id;
+	struct sc_path path;
+	int rv;
+
+	new_cert(p15card, 1, 0x10);
+	new_cert(p15card, 2, 0x20);
+	new_cert(p15card, 3, 0x10);
+
+	auth_id.value[0] = 0x10;
+	auth_id.len = 1;
+	memset(&sk, 0, sizeof(sk));
+	sk.class_mask = SC_PKCS15_SEARCH_CLASS_CERT;
+	sk.auth_id = &auth_id;
+	rv = sc_pkcs15_search_objects(p15card, &sk, ret, 4);
+	assert_int_equal(rv, 2);
+	assert_int_equal(((struct sc_pkcs15_cert_info *) ret[0]->data)->id.value[0], 1);
+	assert_int_equal(((struct sc_pkcs15_cert_info *) ret[1]->data)->id.value[0], 3);
+
+	sc_format_path("3F02", &path);
+	memset(&sk, 0, sizeof(sk));
+	sk.class_mask = SC_PKCS15_SEARCH_CLASS_CERT;
+	sk.path = &path;
+	rv = sc_pkcs15_search_objects(p15card, &sk, ret, 4);
+	assert_int_equal(rv, 1);
+	assert_int_equal(ret[0]->auth_id.value[0], 0x20);
+}
+
+int main(void)
+{
+	int rc;
+	struct CMUnitTest tests[] = {
+		cmocka_unit_test_setup_teardown(torture_find_by_id,
+			setup_p15card, teardown_p15card),
+		cmocka_unit_test_setup_teardown(torture_remove_and_reindex,
+			setup_p15card, teardown_p15card),
+		cmocka_unit_test_setup_teardown(torture_find_by_auth_id_and_path,
+			setup_p15card, teardown_p15card),
+	};
+
+	rc = cmocka_run_group_tests(tests, NULL, NULL);
+	return rc;
+}
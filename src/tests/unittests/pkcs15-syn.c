@@ -0,0 +1,213 @@
+/*
+ * pkcs15-syn.c: Unit tests for the selection of PKCS#15 emulators
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "torture.h"
+#include "libopensc/pkcs15-syn.c"
+#include "libopensc/pkcs15-emulator-filter.c"
+
+/*
+ * The emulators are replaced by stubs counting the calls. Every call of a
+ * real emulator costs at least one APDU to select its application.
+ */
+static int (*first_handler)(sc_pkcs15_card_t *, struct sc_aid *);
+static int handler_calls;
+static int handler_result;
+
+static int stub_called(int (*handler)(sc_pkcs15_card_t *, struct sc_aid *))
+{
+	if (handler_calls++ == 0)
+		first_handler = handler;
+	return handler_result;
+}
+
+#define EMULATOR_STUB(name) \
+	int sc_pkcs15emu_##name##_init_ex(sc_pkcs15_card_t *p15card, struct sc_aid *aid) \
+	{ \
+		return stub_called(sc_pkcs15emu_##name##_init_ex); \
+	}
+
+EMULATOR_STUB(westcos)
+EMULATOR_STUB(openpgp)
+EMULATOR_STUB(starcert)
+EMULATOR_STUB(tcos)
+EMULATOR_STUB(esteid)
+EMULATOR_STUB(esteid2018)
+EMULATOR_STUB(piv)
+EMULATOR_STUB(cac)
+EMULATOR_STUB(gemsafeGPK)
+EMULATOR_STUB(gemsafeV1)
+EMULATOR_STUB(actalis)
+EMULATOR_STUB(atrust_acos)
+EMULATOR_STUB(tccardos)
+EMULATOR_STUB(entersafe)
+EMULATOR_STUB(pteid)
+EMULATOR_STUB(oberthur)
+EMULATOR_STUB(itacns)
+EMULATOR_STUB(sc_hsm)
+EMULATOR_STUB(dnie)
+EMULATOR_STUB(gids)
+EMULATOR_STUB(iasecc)
+EMULATOR_STUB(jpki)
+EMULATOR_STUB(coolkey)
+EMULATOR_STUB(din_66291)
+EMULATOR_STUB(idprime)
+EMULATOR_STUB(cardos)
+EMULATOR_STUB(nqapplet)
+EMULATOR_STUB(starcos_esign)
+EMULATOR_STUB(skeid)
+EMULATOR_STUB(eoi)
+
+struct syn_state {
+	sc_context_t *ctx;
+	sc_card_t card;
+};
+
+static int setup_syn(void **state)
+{
+	struct syn_state *ss = calloc(1, sizeof(struct syn_state));
+
+	if (ss == NULL)
+		return -1;
+	setenv("OPENSC_CONF", "/nonexistent", 1);
+	if (sc_establish_context(&ss->ctx, "pkcs15syn") != SC_SUCCESS)
+		return -1;
+	ss->card.ctx = ss->ctx;
+	*state = ss;
+	return 0;
+}
+
+static int teardown_syn(void **state)
+{
+	struct syn_state *ss = *state;
+
+	sc_release_context(ss->ctx);
+	free(ss);
+	return 0;
+}
+
+static int bind_type(struct syn_state *ss, int type, int result)
+{
+	struct sc_pkcs15_card *p15card;
+	int r;
+
+	ss->card.type = type;
+	p15card = sc_pkcs15_card_new();
+	assert_non_null(p15card);
+	p15card->card = &ss->card;
+
+	first_handler = NULL;
+	handler_calls = 0;
+	handler_result = result;
+	r = sc_pkcs15_bind_synthetic(p15card, NULL);
+	sc_pkcs15_card_free(p15card);
+	return r;
+}
+
+static int (*handler_by_name(const char *name))(sc_pkcs15_card_t *, struct sc_aid *)
+{
+	int i;
+
+	for (i = 0; builtin_emulators[i].name; i++)
+		if (strcmp(builtin_emulators[i].name, name) == 0)
+			return builtin_emulators[i].handler;
+	fail_msg("no emulator %s", name);
+	return NULL;
+}
+
+static void torture_emulator_for_type(void **state)
+{
+	struct syn_state *ss = *state;
+	static const struct {
+		int type;
+		const char *name;	/* NULL: no emulator for this type */
+	} cases[] = {
+		{ SC_CARD_TYPE_OPENPGP_V3,		"openpgp" },
+		{ SC_CARD_TYPE_TCOS_V3,			"tcos" },
+		{ SC_CARD_TYPE_MCRD_ESTEID_V30,		"esteid" },
+		{ SC_CARD_TYPE_ITACNS_CNS,		"itacns" },
+		{ SC_CARD_TYPE_CARDOS_CIE_V1,		"itacns" },
+		{ SC_CARD_TYPE_PIV_II_SWISSBIT,		"PIV-II" },
+		{ SC_CARD_TYPE_CAC_ALT_HID,		"cac" },
+		{ SC_CARD_TYPE_IDPRIME_GENERIC,		"idprime" },
+		{ SC_CARD_TYPE_GEMSAFEV1_PTEID,		"pteid" },
+		{ SC_CARD_TYPE_OBERTHUR_64K,		"oberthur" },
+		{ SC_CARD_TYPE_SC_HSM_GOID,		"sc-hsm" },
+		{ SC_CARD_TYPE_DNIE_USER,		"dnie" },
+		{ SC_CARD_TYPE_GIDS_V2,			"gids" },
+		{ SC_CARD_TYPE_IASECC_CPXCL,		"iasecc" },
+		{ SC_CARD_TYPE_JPKI_BASE,		"jpki" },
+		{ SC_CARD_TYPE_COOLKEY_GENERIC,		"coolkey" },
+		{ SC_CARD_TYPE_ESTEID_2018,		"esteid2018" },
+		{ SC_CARD_TYPE_SKEID_V3,		"skeid" },
+		{ SC_CARD_TYPE_CARDOS_V5_3,		"cardos" },
+		{ SC_CARD_TYPE_NQ_APPLET,		"nqapplet" },
+		{ SC_CARD_TYPE_STARCOS_V3_5_ESIGN,	"esign" },
+		{ SC_CARD_TYPE_EOI_CONTACTLESS,		"eOI" },
+		/* the first types after the families */
+		{ SC_CARD_TYPE_MUSCLE_BASE,		NULL },
+		{ SC_CARD_TYPE_CAC_BASE,		NULL },
+		{ SC_CARD_TYPE_NPA,			NULL },
+		{ SC_CARD_TYPE_EDO,			NULL },
+		{ SC_CARD_TYPE_GENERIC_BASE,		NULL },
+		{ SC_CARD_TYPE_STARCOS_V3_4,		NULL },
+	};
+	size_t i;
+
+	for (i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+		assert_int_equal(bind_type(ss, cases[i].type, SC_SUCCESS), SC_SUCCESS);
+		/* a single emulator is probed */
+		assert_int_equal(handler_calls, 1);
+		if (cases[i].name)
+			assert_ptr_equal(first_handler, handler_by_name(cases[i].name));
+		else
+			assert_ptr_equal(first_handler, builtin_emulators[0].handler);
+	}
+}
+
+static void torture_emulator_fallback(void **state)
+{
+	struct syn_state *ss = *state;
+	int count;
+
+	for (count = 0; builtin_emulators[count].name; count++)
+		;
+
+	/* all emulators are probed once if the one for the type fails */
+	assert_int_equal(bind_type(ss, SC_CARD_TYPE_CAC_GENERIC, SC_ERROR_WRONG_CARD),
+			SC_ERROR_WRONG_CARD);
+	assert_ptr_equal(first_handler, handler_by_name("cac"));
+	assert_int_equal(handler_calls, count);
+
+	assert_int_equal(bind_type(ss, SC_CARD_TYPE_NPA, SC_ERROR_WRONG_CARD),
+			SC_ERROR_WRONG_CARD);
+	assert_ptr_equal(first_handler, builtin_emulators[0].handler);
+	assert_int_equal(handler_calls, count);
+}
+
+int main(void)
+{
+	int rc;
+	struct CMUnitTest tests[] = {
+		cmocka_unit_test_setup_teardown(torture_emulator_for_type,
+			setup_syn, teardown_syn),
+		cmocka_unit_test_setup_teardown(torture_emulator_fallback,
+			setup_syn, teardown_syn),
+	};
+
+	rc = cmocka_run_group_tests(tests, NULL, NULL);
+	return rc;
+}
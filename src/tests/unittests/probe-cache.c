@@ -0,0 +1,278 @@
+/*
+ * probe-cache.c: Unit tests for the cache of card driver probes
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <limits.h>
+
+#include "torture.h"
+#include "libopensc/opensc.h"
+#include "libopensc/internal.h"
+
+static const u8 atr_a[] = { 0x3B, 0x02, 0x14, 0x50 };
+static const u8 atr_b[] = { 0x3B, 0x02, 0x14, 0x51 };
+
+/* Drivers counting the calls of match_card(), accepting one ATR each */
+struct fake_driver {
+	struct sc_card_driver drv;
+	struct sc_card_operations ops;
+	const u8 *atr;
+	int type;
+	int accept;
+	int calls;
+};
+
+static struct fake_driver drivers[3];
+
+static struct fake_driver *fake_driver_of(sc_card_t *card)
+{
+	size_t i;
+
+	for (i = 0; i < sizeof(drivers) / sizeof(drivers[0]); i++)
+		if (card->ops->match_card == drivers[i].ops.match_card)
+			return &drivers[i];
+	return NULL;
+}
+
+#define FAKE_DRIVER_OPS(n) \
+	static int fake_match_##n(sc_card_t *card) \
+	{ \
+		struct fake_driver *d = &drivers[n]; \
+		d->calls++; \
+		return d->accept && card->atr.len == sizeof(atr_a) \
+			&& memcmp(card->atr.value, d->atr, card->atr.len) == 0; \
+	} \
+	static int fake_init_##n(sc_card_t *card) \
+	{ \
+		card->type = drivers[n].type; \
+		return SC_SUCCESS; \
+	}
+
+FAKE_DRIVER_OPS(0)
+FAKE_DRIVER_OPS(1)
+FAKE_DRIVER_OPS(2)
+
+struct probe_state {
+	sc_context_t *ctx;
+	sc_reader_t reader;
+	struct sc_reader_operations reader_ops;
+	struct sc_card_driver *saved[SC_MAX_CARD_DRIVERS];
+	char dir[PATH_MAX];
+};
+
+static int fake_connect(sc_reader_t *reader)
+{
+	return SC_SUCCESS;
+}
+
+static int fake_disconnect(sc_reader_t *reader)
+{
+	return SC_SUCCESS;
+}
+
+static int setup_probe(void **state)
+{
+	struct probe_state *ps = calloc(1, sizeof(struct probe_state));
+	const char *names[] = { "alpha", "beta", "gamma" };
+	size_t i;
+
+	if (ps == NULL)
+		return -1;
+	strcpy(ps->dir, "/tmp/opensc-probe-XXXXXX");
+	if (mkdtemp(ps->dir) == NULL)
+		return -1;
+	setenv("OPENSC_CONF", "/nonexistent", 1);
+	setenv("XDG_CACHE_HOME", ps->dir, 1);
+	if (sc_establish_context(&ps->ctx, "probecache") != SC_SUCCESS)
+		return -1;
+	ps->ctx->flags |= SC_CTX_FLAG_ENABLE_PROBE_CACHE;
+
+	memset(drivers, 0, sizeof(drivers));
+	drivers[0].ops.match_card = fake_match_0;
+	drivers[0].ops.init = fake_init_0;
+	drivers[1].ops.match_card = fake_match_1;
+	drivers[1].ops.init = fake_init_1;
+	drivers[2].ops.match_card = fake_match_2;
+	drivers[2].ops.init = fake_init_2;
+	drivers[0].atr = atr_a;
+	drivers[1].atr = atr_b;
+	drivers[2].atr = atr_b;
+	/* replace the built-in drivers */
+	memcpy(ps->saved, ps->ctx->card_drivers, sizeof(ps->saved));
+	memset(ps->ctx->card_drivers, 0, sizeof(ps->ctx->card_drivers));
+	for (i = 0; i < 3; i++) {
+		drivers[i].drv.name = names[i];
+		drivers[i].drv.short_name = names[i];
+		drivers[i].drv.ops = &drivers[i].ops;
+		drivers[i].type = 100 + (int)i;
+		drivers[i].accept = 1;
+		ps->ctx->card_drivers[i] = &drivers[i].drv;
+	}
+
+	ps->reader_ops.connect = fake_connect;
+	ps->reader_ops.disconnect = fake_disconnect;
+	ps->reader.ctx = ps->ctx;
+	ps->reader.ops = &ps->reader_ops;
+	*state = ps;
+	return 0;
+}
+
+static int teardown_probe(void **state)
+{
+	struct probe_state *ps = *state;
+	char cmd[PATH_MAX + 16];
+
+	memcpy(ps->ctx->card_drivers, ps->saved, sizeof(ps->saved));
+	sc_release_context(ps->ctx);
+	snprintf(cmd, sizeof(cmd), "rm -rf %s", ps->dir);
+	if (system(cmd) != 0)
+		return -1;
+	free(ps);
+	return 0;
+}
+
+/* Connects a card with the ATR in the reader, returns the driver used */
+static struct fake_driver *connect_card(struct probe_state *ps, const char *reader, const u8 *atr)
+{
+	struct fake_driver *d;
+	sc_card_t *card = NULL;
+	size_t i;
+
+	for (i = 0; i < 3; i++)
+		drivers[i].calls = 0;
+	ps->reader.name = (char *)reader;
+	memcpy(ps->reader.atr.value, atr, sizeof(atr_a));
+	ps->reader.atr.len = sizeof(atr_a);
+
+	assert_int_equal(sc_connect_card(&ps->reader, &card), SC_SUCCESS);
+	d = fake_driver_of(card);
+	assert_non_null(d);
+	assert_int_equal(card->type, d->type);
+	sc_disconnect_card(card);
+	return d;
+}
+
+static void torture_probe_cache_hit(void **state)
+{
+	struct probe_state *ps = *state;
+
+	/* the first connect probes the drivers in order */
+	assert_ptr_equal(connect_card(ps, "Reader 1", atr_b), &drivers[1]);
+	assert_int_equal(drivers[0].calls, 1);
+	assert_int_equal(drivers[1].calls, 1);
+
+	/* then the driver found is tried first */
+	assert_ptr_equal(connect_card(ps, "Reader 1", atr_b), &drivers[1]);
+	assert_int_equal(drivers[0].calls, 0);
+	assert_int_equal(drivers[1].calls, 1);
+	assert_int_equal(drivers[2].calls, 0);
+
+	/* without the option, all are probed */
+	ps->ctx->flags &= ~SC_CTX_FLAG_ENABLE_PROBE_CACHE;
+	assert_ptr_equal(connect_card(ps, "Reader 1", atr_b), &drivers[1]);
+	assert_int_equal(drivers[0].calls, 1);
+}
+
+static void torture_probe_cache_miss(void **state)
+{
+	struct probe_state *ps = *state;
+
+	assert_ptr_equal(connect_card(ps, "Reader 1", atr_b), &drivers[1]);
+
+	/* another ATR in the same reader */
+	assert_ptr_equal(connect_card(ps, "Reader 1", atr_a), &drivers[0]);
+	assert_int_equal(drivers[0].calls, 1);
+	assert_int_equal(drivers[1].calls, 0);
+
+	/* the same ATR in another reader */
+	assert_ptr_equal(connect_card(ps, "Reader 2", atr_b), &drivers[1]);
+	assert_int_equal(drivers[0].calls, 1);
+	assert_int_equal(drivers[1].calls, 1);
+
+	/* both entries are kept */
+	assert_ptr_equal(connect_card(ps, "Reader 1", atr_a), &drivers[0]);
+	assert_int_equal(drivers[1].calls, 0);
+	assert_ptr_equal(connect_card(ps, "Reader 1", atr_b), &drivers[1]);
+	assert_int_equal(drivers[0].calls, 0);
+}
+
+static void torture_probe_cache_stale(void **state)
+{
+	struct probe_state *ps = *state;
+
+	assert_ptr_equal(connect_card(ps, "Reader 1", atr_b), &drivers[1]);
+
+	/* the cached driver rejects the card now: the others are probed */
+	drivers[1].accept = 0;
+	assert_ptr_equal(connect_card(ps, "Reader 1", atr_b), &drivers[2]);
+	assert_int_equal(drivers[0].calls, 1);
+	assert_int_equal(drivers[1].calls, 1);
+	assert_int_equal(drivers[2].calls, 1);
+
+	/* and the new result replaces the entry */
+	drivers[1].accept = 1;
+	assert_ptr_equal(connect_card(ps, "Reader 1", atr_b), &drivers[2]);
+	assert_int_equal(drivers[0].calls, 0);
+	assert_int_equal(drivers[1].calls, 0);
+	assert_int_equal(drivers[2].calls, 1);
+
+	/* a driver no longer configured is ignored */
+	ps->ctx->card_drivers[2] = NULL;
+	assert_ptr_equal(connect_card(ps, "Reader 1", atr_b), &drivers[1]);
+	assert_int_equal(drivers[0].calls, 1);
+}
+
+static void torture_probe_cache_evict(void **state)
+{
+	struct probe_state *ps = *state;
+	char name[32];
+	int i;
+
+	/* an entry followed by a full cache of newer ones */
+	assert_ptr_equal(connect_card(ps, "Reader 0", atr_b), &drivers[1]);
+	for (i = 1; i < 32; i++) {
+		snprintf(name, sizeof(name), "Reader %d", i);
+		assert_ptr_equal(connect_card(ps, name, atr_b), &drivers[1]);
+	}
+
+	/* a hit makes it the most recently used one */
+	assert_ptr_equal(connect_card(ps, "Reader 0", atr_b), &drivers[1]);
+	assert_int_equal(drivers[0].calls, 0);
+
+	/* so a new entry evicts the least recently used one instead */
+	assert_ptr_equal(connect_card(ps, "Reader 32", atr_b), &drivers[1]);
+	assert_ptr_equal(connect_card(ps, "Reader 0", atr_b), &drivers[1]);
+	assert_int_equal(drivers[0].calls, 0);
+	assert_ptr_equal(connect_card(ps, "Reader 1", atr_b), &drivers[1]);
+	assert_int_equal(drivers[0].calls, 1);
+}
+
+int main(void)
+{
+	int rc;
+	struct CMUnitTest tests[] = {
+		cmocka_unit_test_setup_teardown(torture_probe_cache_hit,
+			setup_probe, teardown_probe),
+		cmocka_unit_test_setup_teardown(torture_probe_cache_miss,
+			setup_probe, teardown_probe),
+		cmocka_unit_test_setup_teardown(torture_probe_cache_stale,
+			setup_probe, teardown_probe),
+		cmocka_unit_test_setup_teardown(torture_probe_cache_evict,
+			setup_probe, teardown_probe),
+	};
+
+	rc = cmocka_run_group_tests(tests, NULL, NULL);
+	return rc;
+}
@@ -0,0 +1,269 @@
+/*
+ * read-cache.c: Unit tests for the EF cache of sc_read_binary()
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "torture.h"
+#include "libopensc/opensc.h"
+#include "libopensc/internal.h"
+
+#define EF_SIZE		(300 * 1024)
+
+/* A card with EFs of EF_SIZE bytes, counting the READ BINARY commands */
+struct fake_card {
+	sc_card_t card;
+	sc_reader_t reader;
+	struct sc_reader_operations reader_ops;
+	struct sc_card_operations card_ops;
+	u8 ef[EF_SIZE];
+	int reads;
+	size_t last_idx, last_count;
+};
+
+static int fake_select_file(sc_card_t *card, const sc_path_t *path, sc_file_t **file)
+{
+	return SC_SUCCESS;
+}
+
+static int fake_read_binary(sc_card_t *card, unsigned int idx, u8 *buf, size_t count,
+		unsigned long flags)
+{
+	struct fake_card *fc = (struct fake_card *)card;
+
+	if (idx >= EF_SIZE)
+		return SC_ERROR_FILE_END_REACHED;
+	count = MIN(count, EF_SIZE - idx);
+	fc->reads++;
+	fc->last_idx = idx;
+	fc->last_count = count;
+	memcpy(buf, fc->ef + idx, count);
+	return (int)count;
+}
+
+static int fake_update_binary(sc_card_t *card, unsigned int idx, const u8 *buf, size_t count,
+		unsigned long flags)
+{
+	struct fake_card *fc = (struct fake_card *)card;
+
+	memcpy(fc->ef + idx, buf, count);
+	return (int)count;
+}
+
+static int fake_transmit(sc_reader_t *reader, sc_apdu_t *apdu)
+{
+	apdu->sw1 = 0x90;
+	apdu->sw2 = 0x00;
+	return SC_SUCCESS;
+}
+
+static int fake_reset(sc_reader_t *reader, int cold)
+{
+	return SC_SUCCESS;
+}
+
+static int setup_card(void **state)
+{
+	struct fake_card *fc = calloc(1, sizeof(struct fake_card));
+	size_t i;
+
+	if (fc == NULL)
+		return -1;
+	setenv("OPENSC_CONF", "/nonexistent", 1);
+	if (sc_establish_context(&fc->card.ctx, "readcache") != SC_SUCCESS)
+		return -1;
+	for (i = 0; i < EF_SIZE; i++)
+		fc->ef[i] = (u8)(i * 7);
+
+	fc->reader_ops.transmit = fake_transmit;
+	fc->reader_ops.reset = fake_reset;
+	fc->reader.ctx = fc->card.ctx;
+	fc->reader.ops = &fc->reader_ops;
+	fc->card_ops.select_file = fake_select_file;
+	fc->card_ops.read_binary = fake_read_binary;
+	fc->card_ops.update_binary = fake_update_binary;
+	fc->card.reader = &fc->reader;
+	fc->card.ops = &fc->card_ops;
+	fc->card.flags = SC_CARD_FLAG_READ_CACHE;
+	fc->card.max_recv_size = 256;
+	*state = fc;
+	return 0;
+}
+
+static int teardown_card(void **state)
+{
+	struct fake_card *fc = *state;
+
+	/* drops the cache */
+	sc_reset(&fc->card, 0);
+	sc_release_context(fc->card.ctx);
+	free(fc);
+	return 0;
+}
+
+static void select_path(struct fake_card *fc, const char *str)
+{
+	sc_path_t path;
+
+	sc_format_path(str, &path);
+	assert_int_equal(sc_select_file(&fc->card, &path, NULL), SC_SUCCESS);
+}
+
+/* Reads and checks the contents, returns the number of READ BINARY commands */
+static int read_ef(struct fake_card *fc, unsigned int idx, size_t count, unsigned long flags)
+{
+	u8 *buf = malloc(count);
+	int reads = fc->reads;
+
+	assert_non_null(buf);
+	assert_int_equal(sc_read_binary(&fc->card, idx, buf, count, flags), (int)count);
+	assert_memory_equal(buf, fc->ef + idx, count);
+	free(buf);
+	return fc->reads - reads;
+}
+
+static void torture_read_cache_hit(void **state)
+{
+	struct fake_card *fc = *state;
+
+	select_path(fc, "3F0050154401");
+	assert_int_equal(read_ef(fc, 0, 600, 0), 3);
+	assert_int_equal(read_ef(fc, 0, 600, 0), 0);
+	assert_int_equal(read_ef(fc, 100, 50, 0), 0);
+
+	/* another EF, and back */
+	select_path(fc, "3F0050154402");
+	assert_int_equal(read_ef(fc, 0, 10, 0), 1);
+	select_path(fc, "3F0050154401");
+	assert_int_equal(read_ef(fc, 0, 600, 0), 0);
+
+	/* a cache miss for reads with flags */
+	assert_int_equal(read_ef(fc, 0, 10, SC_RECORD_BY_REC_NR), 1);
+}
+
+static void torture_read_cache_miss(void **state)
+{
+	struct fake_card *fc = *state;
+	sc_path_t path;
+
+	/* without a selected path */
+	assert_int_equal(read_ef(fc, 0, 10, 0), 1);
+	assert_int_equal(read_ef(fc, 0, 10, 0), 1);
+
+	/* a file ID is not unique without the DF */
+	sc_format_path("4401", &path);
+	path.type = SC_PATH_TYPE_FILE_ID;
+	assert_int_equal(sc_select_file(&fc->card, &path, NULL), SC_SUCCESS);
+	assert_int_equal(read_ef(fc, 0, 10, 0), 1);
+	assert_int_equal(read_ef(fc, 0, 10, 0), 1);
+
+	/* only with the flag of the card */
+	fc->card.flags = 0;
+	select_path(fc, "3F0050154401");
+	assert_int_equal(read_ef(fc, 0, 10, 0), 1);
+	assert_int_equal(read_ef(fc, 0, 10, 0), 1);
+}
+
+static void torture_read_cache_partial(void **state)
+{
+	struct fake_card *fc = *state;
+
+	select_path(fc, "3F0050154401");
+	assert_int_equal(read_ef(fc, 0, 50, 0), 1);
+
+	/* overlapping: only the part after the cached contents is read */
+	assert_int_equal(read_ef(fc, 30, 70, 0), 1);
+	assert_int_equal(fc->last_idx, 50);
+	assert_int_equal(fc->last_count, 50);
+	assert_int_equal(read_ef(fc, 0, 100, 0), 0);
+
+	/* contents after a gap are not cached */
+	assert_int_equal(read_ef(fc, 200, 10, 0), 1);
+	assert_int_equal(read_ef(fc, 200, 10, 0), 1);
+	assert_int_equal(read_ef(fc, 0, 100, 0), 0);
+
+	/* the end of the EF */
+	assert_int_equal(read_ef(fc, EF_SIZE - 10, 10, 0), 1);
+}
+
+static void torture_read_cache_invalidate(void **state)
+{
+	struct fake_card *fc = *state;
+	const u8 data[] = { 0x01, 0x02, 0x03 };
+	sc_apdu_t apdu;
+
+	select_path(fc, "3F0050154401");
+	assert_int_equal(read_ef(fc, 0, 10, 0), 1);
+	assert_int_equal(sc_update_binary(&fc->card, 2, data, sizeof(data), 0), (int)sizeof(data));
+	assert_int_equal(read_ef(fc, 0, 10, 0), 1);
+	assert_int_equal(read_ef(fc, 0, 10, 0), 0);
+
+	/* a SELECT outside of sc_select_file() makes the selected EF unknown */
+	sc_format_apdu(&fc->card, &apdu, SC_APDU_CASE_1, 0xA4, 0x00, 0x00);
+	assert_int_equal(sc_transmit_apdu(&fc->card, &apdu), SC_SUCCESS);
+	assert_int_equal(read_ef(fc, 0, 10, 0), 1);
+	select_path(fc, "3F0050154401");
+	assert_int_equal(read_ef(fc, 0, 10, 0), 0);
+
+	/* APDUs modifying files drop the cache */
+	sc_format_apdu(&fc->card, &apdu, SC_APDU_CASE_1, 0xE4, 0x00, 0x00);
+	assert_int_equal(sc_transmit_apdu(&fc->card, &apdu), SC_SUCCESS);
+	assert_int_equal(read_ef(fc, 0, 10, 0), 1);
+
+	/* and the card reset */
+	assert_int_equal(sc_reset(&fc->card, 0), SC_SUCCESS);
+	assert_null(fc->card.cache.ef_list);
+	assert_int_equal(read_ef(fc, 0, 10, 0), 1);
+}
+
+static void torture_read_cache_limits(void **state)
+{
+	struct fake_card *fc = *state;
+
+	/* no more than 256 KiB of one EF */
+	select_path(fc, "3F0050154401");
+	assert_int_equal(read_ef(fc, 0, 200 * 1024, 0), 800);
+	assert_int_equal(read_ef(fc, 200 * 1024, 100 * 1024, 0), 400);
+	assert_int_equal(fc->card.cache.ef_size, 200 * 1024);
+	assert_int_equal(read_ef(fc, 0, 200 * 1024, 0), 0);
+	assert_int_equal(read_ef(fc, 200 * 1024, 10, 0), 1);
+
+	/* nor of all EFs, the least recently used ones are dropped */
+	select_path(fc, "3F0050154402");
+	assert_int_equal(read_ef(fc, 0, 100 * 1024, 0), 400);
+	assert_true(fc->card.cache.ef_size <= 256 * 1024);
+	assert_int_equal(read_ef(fc, 0, 100 * 1024, 0), 0);
+	select_path(fc, "3F0050154401");
+	assert_int_equal(read_ef(fc, 0, 10, 0), 1);
+}
+
+int main(void)
+{
+	int rc;
+	struct CMUnitTest tests[] = {
+		cmocka_unit_test_setup_teardown(torture_read_cache_hit,
+			setup_card, teardown_card),
+		cmocka_unit_test_setup_teardown(torture_read_cache_miss,
+			setup_card, teardown_card),
+		cmocka_unit_test_setup_teardown(torture_read_cache_partial,
+			setup_card, teardown_card),
+		cmocka_unit_test_setup_teardown(torture_read_cache_invalidate,
+			setup_card, teardown_card),
+		cmocka_unit_test_setup_teardown(torture_read_cache_limits,
+			setup_card, teardown_card),
+	};
+
+	rc = cmocka_run_group_tests(tests, NULL, NULL);
+	return rc;
+}
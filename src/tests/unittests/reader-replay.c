@@ -0,0 +1,228 @@
+/*
+ * reader-replay.c: Unit tests for the APDU replay reader driver
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <limits.h>
+#include <unistd.h>
+
+#include "torture.h"
+#include "libopensc/opensc.h"
+
+static const char recording[] =
+	"# OpenSC APDU recording\n"
+	"reader Replay Test Reader\n"
+	"protocol 2\n"
+	"atr 3B8F800180\n"
+	"apdu 120 00A4000C023F00 9000\n"
+	"apdu 80 00B0000004 010203049000\n"
+	"apdu 90 00B0000004 050607089000\n"
+	"apdu 50 00A4000C02DEAD 6A82\n";
+
+/* two readers used at the same time */
+static const char recording_readers[] =
+	"reader Reader A\n"
+	"protocol 2\n"
+	"atr 3B8F800180\n"
+	"reader Reader B\n"
+	"protocol 2\n"
+	"atr 3B8F800180\n"
+	"apdu 80 00B0000004 0A0A0A0A9000 Reader A\n"
+	"apdu 80 00B0000004 0B0B0B0B9000 Reader B\n"
+	"apdu 80 00B0000004 0A0A0A0A9000 Reader A\n";
+
+struct replay_state {
+	char fname[PATH_MAX];
+	sc_context_t *ctx;
+	sc_card_t *card;
+};
+
+static struct replay_state *replay_open(const char *data, size_t len,
+		unsigned int readers)
+{
+	struct replay_state *rs = calloc(1, sizeof(struct replay_state));
+	sc_reader_t *reader;
+	int fd;
+
+	if (rs == NULL)
+		return NULL;
+	strcpy(rs->fname, "/tmp/opensc-replay-XXXXXX");
+	fd = mkstemp(rs->fname);
+	if (fd < 0)
+		return NULL;
+	if (write(fd, data, len) != (ssize_t)len) {
+		close(fd);
+		return NULL;
+	}
+	close(fd);
+
+	setenv("OPENSC_CONF", "/nonexistent", 1);
+	setenv("OPENSC_REPLAY", rs->fname, 1);
+	if (sc_establish_context(&rs->ctx, "readerreplay") != SC_SUCCESS)
+		return NULL;
+	if (sc_ctx_get_reader_count(rs->ctx) != readers
+			|| sc_set_card_driver(rs->ctx, "default") != SC_SUCCESS)
+		return NULL;
+	reader = sc_ctx_get_reader(rs->ctx, 0);
+	if (reader == NULL || sc_connect_card(reader, &rs->card) != SC_SUCCESS)
+		return NULL;
+	return rs;
+}
+
+static int setup_replay(void **state)
+{
+	*state = replay_open(recording, sizeof(recording) - 1, 1);
+	return *state != NULL ? 0 : -1;
+}
+
+static int setup_replay_readers(void **state)
+{
+	*state = replay_open(recording_readers, sizeof(recording_readers) - 1, 2);
+	return *state != NULL ? 0 : -1;
+}
+
+static int teardown_replay(void **state)
+{
+	struct replay_state *rs = *state;
+
+	sc_disconnect_card(rs->card);
+	sc_release_context(rs->ctx);
+	unlink(rs->fname);
+	unsetenv("OPENSC_REPLAY");
+	free(rs);
+	return 0;
+}
+
+static int read_binary(sc_card_t *card, u8 *buf)
+{
+	sc_apdu_t apdu;
+	int r;
+
+	sc_format_apdu(card, &apdu, SC_APDU_CASE_2_SHORT, 0xB0, 0, 0);
+	apdu.le = 4;
+	apdu.resplen = 4;
+	apdu.resp = buf;
+	r = sc_transmit_apdu(card, &apdu);
+	if (r != SC_SUCCESS)
+		return r;
+	assert_int_equal(apdu.resplen, 4);
+	return sc_check_sw(card, apdu.sw1, apdu.sw2);
+}
+
+static void torture_replay_session(void **state)
+{
+	struct replay_state *rs = *state;
+	const u8 atr[] = { 0x3B, 0x8F, 0x80, 0x01, 0x80 };
+	const u8 first[] = { 0x01, 0x02, 0x03, 0x04 };
+	const u8 second[] = { 0x05, 0x06, 0x07, 0x08 };
+	u8 buf[4];
+
+	assert_string_equal(rs->card->reader->name, "Replay Test Reader");
+	assert_int_equal(rs->card->atr.len, sizeof(atr));
+	assert_memory_equal(rs->card->atr.value, atr, sizeof(atr));
+
+	/* equal commands are answered in the recorded order */
+	assert_int_equal(read_binary(rs->card, buf), SC_SUCCESS);
+	assert_memory_equal(buf, first, sizeof(first));
+	assert_int_equal(read_binary(rs->card, buf), SC_SUCCESS);
+	assert_memory_equal(buf, second, sizeof(second));
+	/* and the recording starts over at the end */
+	assert_int_equal(read_binary(rs->card, buf), SC_SUCCESS);
+	assert_memory_equal(buf, first, sizeof(first));
+}
+
+static void torture_replay_unknown_command(void **state)
+{
+	struct replay_state *rs = *state;
+	sc_apdu_t apdu;
+
+	sc_format_apdu(rs->card, &apdu, SC_APDU_CASE_1, 0x44, 0, 0);
+	assert_int_equal(sc_transmit_apdu(rs->card, &apdu), SC_ERROR_TRANSMIT_FAILED);
+}
+
+static void torture_replay_batch(void **state)
+{
+	struct replay_state *rs = *state;
+	const u8 mf[] = { 0x3F, 0x00 };
+	const u8 missing[] = { 0xDE, 0xAD };
+	u8 buf[2][4];
+	sc_apdu_t apdus[3];
+	size_t done;
+
+	sc_format_apdu(rs->card, &apdus[0], SC_APDU_CASE_3_SHORT, 0xA4, 0x00, 0x0C);
+	apdus[0].lc = apdus[0].datalen = sizeof(mf);
+	apdus[0].data = mf;
+	sc_format_apdu(rs->card, &apdus[1], SC_APDU_CASE_2_SHORT, 0xB0, 0, 0);
+	apdus[1].le = apdus[1].resplen = 4;
+	apdus[1].resp = buf[0];
+	apdus[2] = apdus[1];
+	apdus[2].resp = buf[1];
+
+	assert_int_equal(sc_transmit_apdu_batch(rs->card, apdus, 3, &done), SC_SUCCESS);
+	assert_int_equal(done, 3);
+	assert_int_equal(apdus[2].sw1, 0x90);
+	assert_memory_equal(buf[0], "\x01\x02\x03\x04", 4);
+	assert_memory_equal(buf[1], "\x05\x06\x07\x08", 4);
+
+	/* the sequence stops at the first error status */
+	apdus[0].data = missing;
+	assert_int_equal(sc_transmit_apdu_batch(rs->card, apdus, 2, &done),
+			SC_ERROR_FILE_NOT_FOUND);
+	assert_int_equal(done, 1);
+	assert_int_equal(apdus[0].sw1, 0x6A);
+	assert_int_equal(apdus[0].sw2, 0x82);
+}
+
+static void torture_replay_readers(void **state)
+{
+	struct replay_state *rs = *state;
+	const u8 a[] = { 0x0A, 0x0A, 0x0A, 0x0A };
+	const u8 b[] = { 0x0B, 0x0B, 0x0B, 0x0B };
+	sc_card_t *card_b;
+	u8 buf[4];
+
+	/* the interleaved APDUs are answered in the reader they were sent to */
+	assert_string_equal(rs->card->reader->name, "Reader A");
+	assert_int_equal(sc_connect_card(sc_ctx_get_reader(rs->ctx, 1), &card_b), SC_SUCCESS);
+	assert_string_equal(card_b->reader->name, "Reader B");
+
+	assert_int_equal(read_binary(rs->card, buf), SC_SUCCESS);
+	assert_memory_equal(buf, a, sizeof(a));
+	assert_int_equal(read_binary(card_b, buf), SC_SUCCESS);
+	assert_memory_equal(buf, b, sizeof(b));
+	assert_int_equal(read_binary(rs->card, buf), SC_SUCCESS);
+	assert_memory_equal(buf, a, sizeof(a));
+	assert_int_equal(read_binary(card_b, buf), SC_SUCCESS);
+	assert_memory_equal(buf, b, sizeof(b));
+	sc_disconnect_card(card_b);
+}
+
+int main(void)
+{
+	int rc;
+	struct CMUnitTest tests[] = {
+		cmocka_unit_test_setup_teardown(torture_replay_session,
+			setup_replay, teardown_replay),
+		cmocka_unit_test_setup_teardown(torture_replay_unknown_command,
+			setup_replay, teardown_replay),
+		cmocka_unit_test_setup_teardown(torture_replay_batch,
+			setup_replay, teardown_replay),
+		cmocka_unit_test_setup_teardown(torture_replay_readers,
+			setup_replay_readers, teardown_replay),
+	};
+
+	rc = cmocka_run_group_tests(tests, NULL, NULL);
+	return rc;
+}
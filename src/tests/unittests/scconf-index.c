@@ -0,0 +1,175 @@
+/*
+ * scconf-index.c: Unit tests for the indexed configuration lookups
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "torture.h"
+#include "scconf/scconf.h"
+
+#define ATR_BLOCKS	40
+
+static int setup_conf(void **state)
+{
+	scconf_context *conf;
+	char *str, *p;
+	size_t len = 256 + ATR_BLOCKS * 64;
+	int i;
+
+	str = p = malloc(len);
+	if (str == NULL)
+		return -1;
+	p += sprintf(p, "app default {\n\tdebug = 1;\n\tDebug = 2;\n");
+	for (i = 0; i < ATR_BLOCKS; i++)
+		p += sprintf(p, "\tcard_atr 3b:%02x { name = \"card %d\"; }\n", i, i);
+	/* a second block with an equal name follows the first one */
+	p += sprintf(p, "\tCARD_ATR 3B:05 { name = \"again\"; }\n");
+	p += sprintf(p, "\treader_driver pcsc { }\n}\napp other { debug = 3; }\n");
+
+	conf = scconf_new(NULL);
+	if (conf == NULL || scconf_parse_string(conf, str) != 1) {
+		scconf_free(conf);
+		free(str);
+		return -1;
+	}
+	free(str);
+	*state = conf;
+	return 0;
+}
+
+static int teardown_conf(void **state)
+{
+	scconf_free(*state);
+	return 0;
+}
+
+static scconf_block *app_block(scconf_context *conf, const char *name)
+{
+	scconf_block **blocks, *block;
+
+	blocks = scconf_find_blocks(conf, NULL, "app", name);
+	assert_non_null(blocks);
+	block = blocks[0];
+	assert_non_null(block);
+	assert_null(blocks[1]);
+	free(blocks);
+	return block;
+}
+
+static void torture_index_lookups(void **state)
+{
+	scconf_context *conf = *state;
+	scconf_block *app = app_block(conf, "default");
+	scconf_block **blocks;
+	char atr[16];
+	int i;
+
+	/* only the large block is indexed */
+	assert_non_null(app->index);
+	assert_null(app_block(conf, "other")->index);
+
+	/* the first value with a key matching in any case wins */
+	assert_int_equal(scconf_get_int(app, "DEBUG", 0), 1);
+	assert_null(scconf_find_list(app, "card_atr"));
+	assert_non_null(scconf_find_block(conf, app, "Reader_Driver"));
+	assert_null(scconf_find_block(conf, app, "debug"));
+
+	for (i = 0; i < ATR_BLOCKS; i++) {
+		char name[16];
+
+		snprintf(atr, sizeof(atr), "3B:%02X", i);
+		snprintf(name, sizeof(name), "card %d", i);
+		blocks = scconf_find_blocks(conf, app, "card_atr", atr);
+		assert_non_null(blocks);
+		assert_non_null(blocks[0]);
+		assert_ptr_equal(blocks[0]->parent, app);
+		assert_string_equal(scconf_get_str(blocks[0], "name", NULL), name);
+		if (i == 5) {
+			assert_non_null(blocks[1]);
+			assert_string_equal(scconf_get_str(blocks[1], "name", NULL), "again");
+			assert_null(blocks[2]);
+		} else {
+			assert_null(blocks[1]);
+		}
+		free(blocks);
+	}
+	blocks = scconf_find_blocks(conf, app, "card_atr", "3b:ff");
+	assert_non_null(blocks);
+	assert_null(blocks[0]);
+	free(blocks);
+
+	/* without a name all blocks are returned in order */
+	blocks = scconf_find_blocks(conf, app, "card_atr", NULL);
+	assert_non_null(blocks);
+	for (i = 0; blocks[i] != NULL; i++)
+		if (i < ATR_BLOCKS) {
+			snprintf(atr, sizeof(atr), "3b:%02x", i);
+			assert_string_equal(blocks[i]->name->data, atr);
+		}
+	assert_int_equal(i, ATR_BLOCKS + 1);
+	free(blocks);
+}
+
+static void torture_index_modified(void **state)
+{
+	scconf_context *conf = *state;
+	scconf_block *app = app_block(conf, "default");
+
+	/* changing an existing value keeps the index */
+	scconf_put_int(app, "debug", 7);
+	assert_non_null(app->index);
+	assert_int_equal(scconf_get_int(app, "debug", 0), 1);
+
+	/* new items are found, even though the index is gone */
+	scconf_put_str(app, "new_option", "value");
+	assert_string_equal(scconf_get_str(app, "new_option", NULL), "value");
+	assert_int_equal(scconf_get_int(app, "debug", 0), 1);
+}
+
+static void torture_index_image(void **state)
+{
+	scconf_context *conf = *state, *copy;
+	scconf_block **blocks;
+	unsigned char *image;
+	size_t len;
+
+	image = scconf_image_create(conf, &len);
+	assert_non_null(image);
+	copy = scconf_new(NULL);
+	assert_int_equal(scconf_image_load(copy, image, len), 1);
+
+	assert_non_null(app_block(copy, "default")->index);
+	blocks = scconf_find_blocks(copy, app_block(copy, "default"), "card_atr", "3b:21");
+	assert_non_null(blocks);
+	assert_non_null(blocks[0]);
+	assert_string_equal(scconf_get_str(blocks[0], "name", NULL), "card 33");
+	free(blocks);
+	scconf_free(copy);
+}
+
+int main(void)
+{
+	int rc;
+	struct CMUnitTest tests[] = {
+		cmocka_unit_test_setup_teardown(torture_index_lookups,
+			setup_conf, teardown_conf),
+		cmocka_unit_test_setup_teardown(torture_index_modified,
+			setup_conf, teardown_conf),
+		cmocka_unit_test_setup_teardown(torture_index_image,
+			setup_conf, teardown_conf),
+	};
+
+	rc = cmocka_run_group_tests(tests, NULL, NULL);
+	return rc;
+}
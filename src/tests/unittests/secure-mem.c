@@ -0,0 +1,116 @@
+/*
+ * secure-mem.c: Unit tests for the locked memory pool
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "torture.h"
+#include "libopensc/opensc.h"
+
+#define MANY_PINS	600
+
+static int is_zero(const unsigned char *p, size_t len)
+{
+	size_t i;
+
+	for (i = 0; i < len; i++)
+		if (p[i] != 0)
+			return 0;
+	return 1;
+}
+
+static void torture_secure_alloc_zeroed(void **state)
+{
+	struct sc_mem_secure_stats before, stats;
+	unsigned char *pin, *key, *big;
+
+	sc_mem_secure_get_stats(&before);
+	pin = sc_mem_secure_alloc(8);
+	key = sc_mem_secure_alloc(256);
+	big = sc_mem_secure_alloc(65536);
+	assert_non_null(pin);
+	assert_non_null(key);
+	assert_non_null(big);
+	assert_true(is_zero(pin, 8));
+	assert_true(is_zero(key, 256));
+	assert_true(is_zero(big, 65536));
+
+	sc_mem_secure_get_stats(&stats);
+#if defined(HAVE_PTHREAD) && !defined(_WIN32)
+	/* only the small buffers come from the pool */
+	assert_int_equal(stats.in_use, before.in_use + 2);
+	assert_int_equal(stats.allocations, before.allocations + 2);
+	assert_true(stats.slabs >= 2);
+#endif
+
+	/* a freed chunk comes back zeroized */
+	memset(pin, 0x55, 8);
+	memset(key, 0xAA, 256);
+	sc_mem_secure_free(pin, 8);
+	sc_mem_secure_free(key, 256);
+	sc_mem_secure_free(big, 65536);
+	pin = sc_mem_secure_alloc(16);
+	key = sc_mem_secure_alloc(200);
+	assert_true(is_zero(pin, 16));
+	assert_true(is_zero(key, 200));
+	sc_mem_secure_free(pin, 16);
+	sc_mem_secure_free(key, 200);
+
+	sc_mem_secure_get_stats(&stats);
+	assert_int_equal(stats.in_use, before.in_use);
+}
+
+static void torture_secure_alloc_many(void **state)
+{
+	struct sc_mem_secure_stats before, stats;
+	unsigned char *pins[MANY_PINS];
+	int i;
+
+	sc_mem_secure_get_stats(&before);
+	for (i = 0; i < MANY_PINS; i++) {
+		pins[i] = sc_mem_secure_alloc(32);
+		assert_non_null(pins[i]);
+		memset(pins[i], i, 32);
+	}
+	/* no buffer overlaps another one */
+	for (i = 0; i < MANY_PINS; i++) {
+		assert_int_equal(pins[i][0], (unsigned char)i);
+		assert_int_equal(pins[i][31], (unsigned char)i);
+	}
+	sc_mem_secure_get_stats(&stats);
+#if defined(HAVE_PTHREAD) && !defined(_WIN32)
+	/* they share a few slabs instead of using a page each */
+	assert_true(stats.slabs > before.slabs);
+	assert_true(stats.slabs - before.slabs < MANY_PINS / 64);
+#endif
+
+	for (i = 0; i < MANY_PINS; i++)
+		sc_mem_secure_free(pins[i], 32);
+	/* empty slabs are returned, except for one per size */
+	sc_mem_secure_get_stats(&stats);
+	assert_int_equal(stats.in_use, before.in_use);
+	assert_true(stats.slabs <= before.slabs + 1);
+}
+
+int main(void)
+{
+	int rc;
+	struct CMUnitTest tests[] = {
+		cmocka_unit_test(torture_secure_alloc_zeroed),
+		cmocka_unit_test(torture_secure_alloc_many),
+	};
+
+	rc = cmocka_run_group_tests(tests, NULL, NULL);
+	return rc;
+}
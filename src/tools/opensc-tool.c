@@ -190,6 +190,7 @@ cleanup:
 
 static int opensc_set_conf_entry(const char *config)
 {
+	scconf_context *conf = NULL;
 	scconf_block *conf_block = NULL, **blocks;
 	char *buffer = NULL;
 	char *section = NULL;
@@ -203,6 +204,19 @@ static int opensc_set_conf_entry(const char *config)
 		goto cleanup;
 	}
 
+	/* The configuration of the context may come from the read-only
+	 * configuration cache, so edit a freshly parsed copy of the file */
+	conf = scconf_new(ctx->conf->filename);
+	if (conf == NULL) {
+		r = ENOMEM;
+		goto cleanup;
+	}
+	if (scconf_parse(conf) < 1) {
+		fprintf(stderr, "scconf_parse(): %s\n", conf->errmsg ? conf->errmsg : "failed");
+		r = EINVAL;
+		goto cleanup;
+	}
+
 	if ((buffer = strdup(config)) == NULL) {
 		r = ENOMEM;
 		goto cleanup;
@@ -223,7 +237,7 @@ static int opensc_set_conf_entry(const char *config)
 	*value = '\0';
 	value++;
 
-	blocks = scconf_find_blocks(ctx->conf, NULL, section, name);
+	blocks = scconf_find_blocks(conf, NULL, section, name);
 	if (blocks && blocks[0])
 		conf_block = blocks[0];
 	free(blocks);
@@ -248,7 +262,7 @@ static int opensc_set_conf_entry(const char *config)
 	}
 
 	/* Write */
-	if ((r = scconf_write(ctx->conf, ctx->conf->filename)) != 0) {
+	if ((r = scconf_write(conf, conf->filename)) != 0) {
 		fprintf(stderr, "scconf_write(): %s\n", strerror(r));
 		goto cleanup;
 	}
@@ -259,6 +273,7 @@ cleanup:
 
 	if (buffer != NULL)
 		free(buffer);
+	scconf_free(conf);
 
 	return r;
 }